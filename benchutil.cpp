@@ -0,0 +1,57 @@
+#include "stdinc.hpp"
+#include "benchutil.hpp"
+
+namespace
+{
+const char* evictionNames[] = { "fifo", "lru", "clock", "sieve", "s3-fifo" };
+const size_t noOfEvictions = sizeof( evictionNames ) / sizeof( evictionNames[0] );
+}
+
+std::string GetParameter( const BenchParameters& parameters, const std::string& name, const std::string& value )
+{
+  BenchParameters::const_iterator it( parameters.find( name ) );
+  return it != parameters.end() ? it->second : value;
+}
+
+uint64_t GetParameter( const BenchParameters& parameters, const std::string& name, uint64_t value )
+{
+  BenchParameters::const_iterator it( parameters.find( name ) );
+  if ( it != parameters.end() ) {
+    std::istringstream ss( it->second );
+    if ( !( ss >> value ) ) {
+      throw std::runtime_error( "Not a number: " + name + "=" + it->second );
+    }
+  }
+  return value;
+}
+
+CacheOptions::Eviction GetEviction( const BenchParameters& parameters, CacheOptions::Eviction value )
+{
+  BenchParameters::const_iterator it( parameters.find( "eviction" ) );
+  if ( it == parameters.end() ) {
+    return value;
+  }
+  const char** found = std::find( evictionNames, evictionNames + noOfEvictions, it->second );
+  if ( found == evictionNames + noOfEvictions ) {
+    throw std::runtime_error( "Unknown eviction: " + it->second );
+  }
+  return static_cast< CacheOptions::Eviction >( found - evictionNames );
+}
+
+const char* EvictionName( CacheOptions::Eviction eviction )
+{
+  return static_cast< size_t >( eviction ) < noOfEvictions ? evictionNames[ eviction ] : "unknown";
+}
+
+void PrintLatencies( std::ostream& out, const std::vector< double >& latencies )
+{
+  std::vector< double > sorted( latencies );
+  std::sort( sorted.begin(), sorted.end() );
+  const double percentiles[] = { 50, 90, 99, 99.9 };
+  const char* names[] = { "p50", "p90", "p99", "p999" };
+  out << "{ \"count\": " << sorted.size() << std::fixed << std::setprecision( 1 );
+  for ( size_t i = 0; i < sizeof( percentiles ) / sizeof( percentiles[0] ); ++i ) {
+    out << ", \"" << names[i] << "\": " << sorted[ std::min( sorted.size() - 1, static_cast< size_t >( sorted.size() * percentiles[i] / 100 ) ) ];
+  }
+  out << ", \"max\": " << sorted.back() << " }";
+}
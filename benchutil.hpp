@@ -0,0 +1,25 @@
+#ifndef __BENCHUTIL_HPP__
+#define __BENCHUTIL_HPP__
+
+#include "cache.hpp"
+
+// What cachebench and cachereplay share: the name=value parameters given
+// on their command lines, and how they print latencies as JSON.
+
+typedef std::map< std::string, std::string > BenchParameters;
+
+// The value of parameter name, or value if it isn't given. Throws
+// std::runtime_error if a number isn't one.
+std::string GetParameter( const BenchParameters& parameters, const std::string& name, const std::string& value );
+uint64_t GetParameter( const BenchParameters& parameters, const std::string& name, uint64_t value );
+
+// The eviction parameter: fifo, lru, clock, sieve or s3-fifo. Throws
+// std::runtime_error for any other name.
+CacheOptions::Eviction GetEviction( const BenchParameters& parameters, CacheOptions::Eviction value );
+const char* EvictionName( CacheOptions::Eviction eviction );
+
+// Prints { "count": ..., "p50": ..., "p90": ..., "p99": ..., "p999": ...,
+// "max": ... } of latencies, which mustn't be empty
+void PrintLatencies( std::ostream& out, const std::vector< double >& latencies );
+
+#endif // __BENCHUTIL_HPP__
@@ -1,23 +1,334 @@
 #ifndef __CACHE_HPP__
 #define __CACHE_HPP__
 
+// What a partition holds, and what has happened to it since the cache
+// was created
+struct PartitionStats
+{
+  PartitionStats() : maxSize( 0 ), currentSize( 0 ), objects( 0 ), hits( 0 ), writes( 0 ), prunes( 0 ) {}
+  uint64_t maxSize; // The budget of the partition
+  uint64_t currentSize;
+  uint64_t objects;
+  uint64_t hits;
+  uint64_t writes;
+  uint64_t prunes;
+};
+
+// What the in-memory tier holds, and how often it was read from
+struct MemoryTierStats
+{
+  MemoryTierStats() : maxSize( 0 ), currentSize( 0 ), objects( 0 ), hits( 0 ), misses( 0 ) {}
+  uint64_t maxSize;
+  uint64_t currentSize;
+  uint64_t objects;
+  uint64_t hits; // Reads that needed no file I/O and no decryption
+  uint64_t misses;
+};
+
+// How long something took, counted in buckets by powers of two of
+// nanoseconds: bucket 0 counts what took less than 2 ns, bucket i what
+// took from 2^i up to 2^(i+1) ns, and the last one all that took longer
+struct LatencyHistogram
+{
+  static const size_t noOfBuckets = 40;
+  LatencyHistogram() : count( 0 ), nanoseconds( 0 ) { std::fill( buckets, buckets + noOfBuckets, 0 ); }
+  uint64_t count;
+  uint64_t nanoseconds; // Taken by all of them together
+  uint64_t buckets[ noOfBuckets ];
+};
+
+// What the cache as a whole has done since it was created
+struct CacheStats
+{
+  // The public calls. A batch counts once, and an asynchronous call takes
+  // from the call until done is called. hasObject takes about as long as
+  // reading the clock, so only one call in 16 is timed and counted here.
+  enum Operation
+  {
+    HasOperation,
+    ReadOperation,
+    WriteOperation, // All overloads
+    EraseOperation,
+    HasBatchOperation,
+    ReadBatchOperation,
+    WriteBatchOperation,
+    EraseBatchOperation,
+    ReadStreamOperation,
+    ReadRangeOperation,
+    ReadAsyncOperation,
+    WriteAsyncOperation,
+    CommitOperation, // Of a Writer
+    SetMaxSizeOperation,
+    noOfOperations
+  };
+
+  // Parts of the work the calls do. They don't overlap, so the time of a
+  // call is theirs plus that of the index and the locks.
+  enum Stage
+  {
+    FileReadStage,  // Reading a whole record, not by chunks or asynchronously
+    FileWriteStage, // Writing a whole record, not through a Writer
+    DeleteStage,    // Erasing a record from the store
+    EncryptStage,   // With AEAD, or with RC4 in the format of older versions
+    DecryptStage,   // Also checks the tags of AEAD records
+    HashStage,      // SHA1 of records in the older format, and deduplication digests
+    CompressStage,
+    DecompressStage,
+    noOfStages
+  };
+
+  CacheStats()
+      : hits( 0 ), misses( 0 ), integrityFailures( 0 ), bytesRead( 0 ), bytesWritten( 0 ), prunes( 0 ), deleteFailures( 0 ) {}
+  uint64_t hits; // Objects read, also by the batch, stream, range and asynchronous calls
+  uint64_t misses;
+  uint64_t integrityFailures; // Records that didn't decrypt or verify, and were dropped
+  uint64_t bytesRead; // Of the objects read
+  uint64_t bytesWritten; // Of the objects written, before compression
+  uint64_t prunes; // Objects pruned to make room
+  uint64_t deleteFailures; // Records of pruned objects that couldn't be deleted
+  LatencyHistogram operations[ noOfOperations ];
+  LatencyHistogram stages[ noOfStages ];
+};
+
 class Cache
 {
  public:
   typedef std::vector< uint8_t > ObjectId;
+
+  // When the cache is full, objects of a lower priority are pruned
+  // before any object of a higher one
+  enum Priority
+  {
+    LowPriority,
+    NormalPriority, // What writeObject without a priority uses
+    HighPriority
+  };
+  static const size_t noOfPriorities = HighPriority + 1;
+
+  // Called when an asynchronous operation has completed, on one of the
+  // cache's worker threads or on the caller's own
+  typedef boost::function< void ( bool ok, const std::vector< uint8_t >& value ) > ReadCallback;
+  typedef boost::function< void ( bool ok ) > WriteCallback;
+  // Takes an object a chunk at a time
+  typedef boost::function< void ( const uint8_t* data, size_t size ) > ReadSink;
+
+  // Writes an object that arrives a piece at a time, e.g. while it is
+  // still being downloaded. Nothing of it can be read before commit
+  // returns true; after that, or a failed call, the writer is finished.
+  // Deleting a writer that wasn't committed aborts it. Writers must be
+  // deleted before their cache.
+  class Writer
+  {
+   public:
+    virtual ~Writer() {}
+    virtual bool append( const uint8_t* data, size_t size ) = 0;
+    // Publishes the object, replacing any earlier version
+    virtual bool commit() = 0;
+    virtual void abort() = 0;
+  };
+
   virtual ~Cache() {}
   virtual bool hasObject( const ObjectId& obj_id ) = 0;
   virtual bool readObject( const ObjectId& obj_id, std::vector< uint8_t >& result ) = 0;
   virtual bool writeObject( const ObjectId& obj_id, const std::vector< uint8_t >& value ) = 0;
+  // Writes an object that expires at expiry, in seconds since the epoch
+  // as returned by std::time, or never if expiry is 0. An expired object
+  // can't be read. It is erased by the next write or erase after it
+  // expired, and hasObject may still report it until then.
+  virtual bool writeObject( const ObjectId& obj_id, const std::vector< uint8_t >& value, std::time_t expiry,
+                            Priority priority = NormalPriority ) = 0;
+  // Writes an object to one of the partitions named in CacheOptions. The
+  // overloads without a partition write to the first one. An object is
+  // only ever in one partition; writing it again may move it.
+  virtual bool writeObject( const ObjectId& obj_id, const std::vector< uint8_t >& value, const std::string& partition,
+                            std::time_t expiry = 0, Priority priority = NormalPriority ) = 0;
+  // Starts writing an object to the first partition, or to a named one.
+  // The space it takes is reserved up front for expectedSize bytes, and
+  // grown as more arrives, pruning other objects to make room, so the
+  // cache stays within its maximum size while the write goes on. The
+  // caller deletes the writer. Returns 0 on failure.
+  virtual Writer* beginWrite( const ObjectId& obj_id, uint64_t expectedSize = 0 ) = 0;
+  virtual Writer* beginWrite( const ObjectId& obj_id, uint64_t expectedSize, const std::string& partition,
+                              std::time_t expiry = 0, Priority priority = NormalPriority ) = 0;
+  // Reads an object without ever holding all of it in memory. It is
+  // read, decrypted and verified in one pass over a small buffer, and
+  // every chunk is handed to sink as soon as it is decrypted. Objects
+  // written by older versions can only be verified after their last
+  // chunk, so if this returns false whatever sink was given must be
+  // thrown away.
+  virtual bool readObjectStream( const ObjectId& obj_id, const ReadSink& sink ) = 0;
+  // Reads length bytes of an object from offset on, fewer if the object
+  // ends first, and none if offset is its size. Fails if offset is
+  // beyond the end. Objects are kept in chunks with a tag each, so only
+  // the chunks that hold the range are read and verified; objects written
+  // by older versions are still read in full.
+  virtual bool readObjectRange( const ObjectId& obj_id, uint64_t offset, uint64_t length, std::vector< uint8_t >& result ) = 0;
+  // Like readObject and writeObject, but return at once and call done
+  // when finished. At most CacheOptions::asyncQueueDepth operations are
+  // in flight; beyond that these block until one completes. done must
+  // not start further asynchronous operations itself.
+  virtual void readObjectAsync( const ObjectId& obj_id, const ReadCallback& done ) = 0;
+  virtual void writeObjectAsync( const ObjectId& obj_id, const std::vector< uint8_t >& value, const WriteCallback& done ) = 0;
   virtual bool eraseObject( const ObjectId &obj_id ) = 0;
+  // Batch versions of hasObject, readObject, writeObject and eraseObject.
+  // The flags say which objects were found, read, written or erased, and
+  // the number of them is returned. A batch looks its objects up with one
+  // pass over the index, starts all its reads at once and decrypts them
+  // on the asynchronous workers, and makes room for the objects it writes
+  // with one pruning pass. writeObjects writes to the first partition,
+  // with no expiry and NormalPriority. Like the asynchronous operations,
+  // readObjects must not be called from their callbacks.
+  virtual size_t hasObjects( const std::vector< ObjectId >& obj_ids, std::vector< bool >& found ) = 0;
+  virtual size_t readObjects( const std::vector< ObjectId >& obj_ids, std::vector< std::vector< uint8_t > >& results,
+                              std::vector< bool >& found ) = 0;
+  virtual size_t writeObjects( const std::vector< ObjectId >& obj_ids, const std::vector< std::vector< uint8_t > >& values,
+                               std::vector< bool >& written ) = 0;
+  virtual size_t eraseObjects( const std::vector< ObjectId >& obj_ids, std::vector< bool >& erased ) = 0;
   virtual void setMaxSize( uint64_t max_size ) = 0;
   virtual uint64_t getCurrentSize() = 0;
+  // Returns false if there is no such partition
+  virtual bool getPartitionStats( const std::string& partition, PartitionStats& stats ) = 0;
+  // Returns false if the cache has no in-memory tier
+  virtual bool getMemoryTierStats( MemoryTierStats& stats ) = 0;
+  // Counts kept without locks, cheap enough to always be on. The snapshot
+  // isn't taken atomically, so counts may be off by the calls in flight.
+  virtual void getStats( CacheStats& stats ) = 0;
+  // With CacheOptions::writeBack, waits until every object written
+  // before the call has been persisted, or replaced by a later write.
+  // Otherwise every write is persisted before it returns anyway.
+  virtual void flush() = 0;
 
   static Cache* createCache( const std::string&path, const std::vector< uint8_t >& encryption_key );
 
 };
 
+// Settings for createCache. The defaults give the same cache as the
+// createCache overload without options.
+struct CacheOptions
+{
+  enum Storage
+  {
+    FileStorage,   // One .CDF file per object
+    SegmentStorage // Objects appended to large segment files
+  };
+
+  enum Eviction
+  {
+    FifoEviction,  // Oldest written first
+    LruEviction,   // Least recently read or written first
+    ClockEviction, // Oldest first, but objects read since get another round
+    SieveEviction, // Like CLOCK, without moving objects around
+    S3FifoEviction // New objects that aren't read soon go first
+  };
+
+  enum Encryption
+  {
+    AutoEncryption,     // AES-GCM if the CPU accelerates it, else ChaCha20-Poly1305
+    AesGcmEncryption,   // AES-256-GCM
+    ChaChaEncryption,   // ChaCha20-Poly1305
+    Rc4Sha1Encryption   // RC4 with a SHA1 hash, the format of older versions
+  };
+
+  enum Compression
+  {
+    NoCompression,
+    FastCompression, // zlib at level 1
+    BestCompression  // zlib at level 9
+  };
+
+  // A part of the cache with a budget of its own, e.g. for one type of
+  // object. Objects written to it are compressed before they are
+  // encrypted, unless they don't compress well, and count towards the
+  // size of the cache with their compressed size.
+  struct Partition
+  {
+    Partition( const std::string& name_ = std::string(), uint64_t maxSize_ = std::numeric_limits< uint64_t >::max(),
+               Compression compression_ = NoCompression )
+        : name( name_ ), maxSize( maxSize_ ), compression( compression_ ) {}
+    std::string name;
+    uint64_t maxSize;
+    Compression compression;
+  };
+
+  CacheOptions()
+      : storage( FileStorage ), segmentSize( 16 * 1024 * 1024 ), shards( 1 ), checkpointRecords( 65536 ),
+        eviction( FifoEviction ), asyncQueueDepth( 64 ), asyncThreads( 2 ),
+        writeBack( false ), writeBackBytes( 32 * 1024 * 1024 ), memoryTierSize( 0 ), memoryTierEviction( LruEviction ),
+        encryption( AutoEncryption ), deduplicate( false ) {}
+
+  Storage storage;
+  // Size at which a segment is sealed and a new one started. Pruning
+  // retires whole segments, so this is also the eviction granularity.
+  uint64_t segmentSize;
+  // The cache is always safe to share between threads. The index is
+  // split into this many independently locked shards; use more than one
+  // when several threads call the cache at the same time.
+  size_t shards;
+  // Changes to the index are appended to a journal as they happen. The
+  // whole index is written as a checkpoint once the journal holds more
+  // records than this, and more than there are objects.
+  uint64_t checkpointRecords;
+  // Which objects are pruned first when the cache is full. Only FIFO
+  // retires whole segments with segment storage; with the others the
+  // compactor reclaims the space.
+  Eviction eviction;
+  // The partitions of the cache, with a single unnamed one if empty. A
+  // partition may grow beyond its maxSize while the cache as a whole
+  // has room. When the cache is full, objects are pruned from the
+  // partitions that are over budget first, and only when none is from
+  // all of them. Objects are kept by the position of their partition
+  // here, so only add partitions at the end. At most 42.
+  std::vector< Partition > partitions;
+  // readObjectAsync and writeObjectAsync keep at most this many
+  // operations in flight. Reads go to the kernel through io_uring where
+  // there is one; checking and decrypting what was read, and all writes,
+  // run on asyncThreads worker threads.
+  size_t asyncQueueDepth;
+  size_t asyncThreads;
+  // With writeBack, writeObject only stages a copy of the object in
+  // memory, where hasObject and readObject find it at once, and a
+  // background thread encrypts and stores it later. Up to writeBackBytes
+  // are staged; beyond that writeObject waits for the flusher, and larger
+  // objects are written straight away. Staged objects count towards
+  // getCurrentSize, but are only pruned once stored. Destroying the
+  // cache stores everything still staged first.
+  bool writeBack;
+  uint64_t writeBackBytes;
+  // Keeps up to memoryTierSize bytes of objects that have been read in
+  // memory, decrypted and verified, and reads them from there again.
+  // memoryTierEviction picks what goes when it is full. 0 for none.
+  uint64_t memoryTierSize;
+  Eviction memoryTierEviction;
+  // How objects are encrypted when written. Objects are read whatever
+  // they were written with, so a cache of an older version can be
+  // opened as it is, and its objects are replaced as they are written.
+  Encryption encryption;
+  // Objects written with identical contents share one record, which
+  // takes up room on disk and in the cache's size once. writeObject keeps
+  // objects as blobs named by a digest of their contents, keyed with the
+  // encryption key; the object ids point to the blobs, and a blob goes
+  // when the last object that points to it is erased or pruned. Objects
+  // written with beginWrite still get a record of their own. Costs a
+  // digest per write, and some memory per object.
+  bool deduplicate;
+  // Records every call of hasObject, readObject, writeObject,
+  // eraseObject, their batch versions and setMaxSize in this file, with
+  // its time, duration and outcome, the size of the object and a hash of
+  // its id, to replay later with cachereplay. Empty for none.
+  std::string traceFile;
+};
+
 Cache* createCache( const std::string& path, const std::vector< uint8_t >& encryption_key );
+Cache* createCache( const std::string& path, const std::vector< uint8_t >& encryption_key, const CacheOptions& options );
+
+// Spans of where the time of the calls of every cache goes: file I/O,
+// encryption, hashing, compression, pruning and the journal, nested in
+// the calls themselves. While enabled, every thread keeps its last few
+// thousand spans. writeSpans writes them as Chrome trace-event JSON, to
+// open in Perfetto or chrome://tracing. Builds without CLIENTCACHE_SPANS
+// have none: enableSpans( true ) and writeSpans return false there.
+bool enableSpans( bool enable );
+bool writeSpans( const std::string& filename );
 
 
 #endif // __CACHE_HPP__
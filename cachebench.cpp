@@ -0,0 +1,1431 @@
+#include "stdinc.hpp"
+#include "crypt.hpp"
+#include "os.hpp"
+#include "cache.hpp"
+#include "objectindex.hpp"
+#include "presenceindex.hpp"
+#include "journal.hpp"
+#include "filestore.hpp"
+#include "benchutil.hpp"
+
+#include <cmath>
+#include <boost/chrono.hpp>
+#include <boost/random/mersenne_twister.hpp>
+#include <boost/random/uniform_real_distribution.hpp>
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+
+// Benchmarks for the cache. Run with an optional scratch directory,
+// optionally followed by the names of the benchmarks to run: reads,
+// storage, concurrency, lookups, index, eviction, startup, async, tier,
+// stream, crypto, range, batch, compression, dedup and workloads, and by
+// name=value parameters of the workloads.
+
+namespace
+{
+typedef std::vector< uint8_t > BinaryBuffer;
+typedef boost::chrono::steady_clock Clock;
+
+#ifdef _WIN32
+const std::string defaultBenchPath( "c:\\temp\\bench" );
+#else
+const std::string defaultBenchPath( "/tmp/clientcache/bench" );
+#endif
+
+// Size of the header in front of the payload: SHA1 hash + object id
+const size_t benchHeaderSize = sizeof( Crypt::Sha1HashValue ) + 16;
+
+BinaryBuffer GetBenchKey()
+{
+  const std::string benchkey( "benchkey" );
+  return BinaryBuffer( benchkey.begin(), benchkey.end() );
+}
+
+// The read path before mapping: copy the whole file into a buffer,
+// decrypt it in place and copy the payload out of it.
+void ReadCopy( const std::string& filename, const BinaryBuffer& key, BinaryBuffer& result )
+{
+  BinaryBuffer rawBuffer;
+  OsReadFile( filename, rawBuffer );
+  Crypt::Rc4EncryptDecrypt( key, rawBuffer );
+  result.resize( rawBuffer.size() - benchHeaderSize );
+  std::copy( rawBuffer.begin() + benchHeaderSize, rawBuffer.end(), result.begin() );
+}
+
+// The mapped read path: decrypt from the mapping straight into the result.
+void ReadMapped( const std::string& filename, const BinaryBuffer& key, BinaryBuffer& result )
+{
+  OsMappedFile file( filename );
+  Crypt::Rc4Cipher cipher( key );
+  uint8_t header[ benchHeaderSize ];
+  cipher.Process( file.data(), header, benchHeaderSize );
+  result.resize( file.size() - benchHeaderSize );
+  cipher.Process( file.data() + benchHeaderSize, &result[0], result.size() );
+}
+
+typedef void ( *ReadFunction )( const std::string&, const BinaryBuffer&, BinaryBuffer& );
+
+// Returns the throughput in MB/s of reading the file iterations times
+double TimeReads( ReadFunction read, const std::string& filename, const BinaryBuffer& key, size_t iterations )
+{
+  BinaryBuffer result;
+  read( filename, key, result ); // Warm up the page cache
+
+  Clock::time_point start( Clock::now() );
+  for ( size_t i = 0; i < iterations; ++i ) {
+    read( filename, key, result );
+  }
+  boost::chrono::duration< double > elapsed( Clock::now() - start );
+
+  double megabytes = static_cast< double >( result.size() ) * iterations / ( 1024.0 * 1024.0 );
+  return megabytes / elapsed.count();
+}
+
+void BenchReadPaths( const std::string& path )
+{
+  const size_t objectSizes[] = { 1024, 16 * 1024, 256 * 1024, 1024 * 1024, 8 * 1024 * 1024, 50 * 1024 * 1024 };
+  const size_t noOfSizes = sizeof( objectSizes ) / sizeof( objectSizes[0] );
+  const BinaryBuffer key( GetBenchKey() );
+
+  std::cout << "Read path benchmark (MB/s of decrypted payload)" << std::endl;
+  std::cout << std::setw( 12 ) << "size" << std::setw( 12 ) << "copy" << std::setw( 12 ) << "mmap" << std::endl;
+
+  for ( size_t i = 0; i < noOfSizes; ++i ) {
+    BinaryBuffer buffer( benchHeaderSize + objectSizes[i] );
+    for ( size_t j = 0; j < buffer.size(); ++j ) {
+      buffer[j] = static_cast< uint8_t >( rand() % 0x100 );
+    }
+    Crypt::Rc4EncryptDecrypt( key, buffer );
+
+    std::string filename( OsConcatPath( path, "readpath.CDF" ) );
+    OsWriteFile( filename, buffer );
+
+    // Read roughly 256 MB per path, but at least a few times
+    size_t iterations = std::max< size_t >( 3, ( 256 * 1024 * 1024 ) / objectSizes[i] );
+    iterations = std::min< size_t >( iterations, 20000 );
+
+    double copyRate = TimeReads( ReadCopy, filename, key, iterations );
+    double mappedRate = TimeReads( ReadMapped, filename, key, iterations );
+
+    std::cout << std::setw( 12 ) << objectSizes[i]
+              << std::setw( 12 ) << std::fixed << std::setprecision( 1 ) << copyRate
+              << std::setw( 12 ) << mappedRate << std::endl;
+
+    OsDeleteFile( filename );
+  }
+}
+
+// Writes small objects through each storage engine, then prunes them all
+void BenchStorage( const std::string& path )
+{
+  const size_t noOfObjects = 5000;
+  const size_t objectSize = 4096;
+  const BinaryBuffer key( GetBenchKey() );
+  BinaryBuffer value( objectSize );
+  for ( size_t j = 0; j < value.size(); ++j ) {
+    value[j] = static_cast< uint8_t >( rand() % 0x100 );
+  }
+
+  std::cout << "Storage benchmark (" << noOfObjects << " objects of " << objectSize << " bytes)" << std::endl;
+  std::cout << std::setw( 12 ) << "storage" << std::setw( 12 ) << "writes/s" << std::setw( 12 ) << "prune ms" << std::endl;
+
+  const CacheOptions::Storage storages[] = { CacheOptions::FileStorage, CacheOptions::SegmentStorage };
+  const char* names[] = { "files", "segments" };
+  for ( size_t i = 0; i < 2; ++i ) {
+    CacheOptions options;
+    options.storage = storages[i];
+    std::string cachePath( OsConcatPath( path, names[i] ) );
+    boost::scoped_ptr< Cache > cache( createCache( cachePath, key, options ) );
+
+    Clock::time_point start( Clock::now() );
+    for ( size_t n = 0; n < noOfObjects; ++n ) {
+      Cache::ObjectId objId( 16 );
+      for ( size_t j = 0; j < objId.size(); ++j ) {
+        objId[j] = static_cast< uint8_t >( ( n >> ( 8 * ( j % 4 ) ) ) + j );
+      }
+      cache->writeObject( objId, value );
+    }
+    boost::chrono::duration< double > writeTime( Clock::now() - start );
+
+    start = Clock::now();
+    cache->setMaxSize( 0 );
+    boost::chrono::duration< double, boost::milli > pruneTime( Clock::now() - start );
+
+    std::cout << std::setw( 12 ) << names[i]
+              << std::setw( 12 ) << std::fixed << std::setprecision( 0 ) << noOfObjects / writeTime.count()
+              << std::setw( 12 ) << std::setprecision( 1 ) << pruneTime.count() << std::endl;
+  }
+}
+
+// Body of a thread in BenchConcurrency: reads, with every tenth operation
+// being a write, over the objects in [first, first + count)
+void ConcurrentClient( Cache* cache, size_t first, size_t count, size_t operations, const BinaryBuffer* value )
+{
+  BinaryBuffer result;
+  for ( size_t i = 0; i < operations; ++i ) {
+    Cache::ObjectId objId( 16, 0 );
+    size_t n = first + ( i * 7919 ) % count;
+    std::memcpy( &objId[0], &n, sizeof( n ) );
+    if ( i % 10 == 0 ) {
+      cache->writeObject( objId, *value );
+    } else {
+      cache->readObject( objId, result );
+    }
+  }
+}
+
+// Runs a read mostly workload from a growing number of threads, with the
+// index in one shard and in many
+void BenchConcurrency( const std::string& path )
+{
+  const size_t noOfObjects = 2000;
+  const size_t objectSize = 1024;
+  const size_t operationsPerThread = 20000;
+  const BinaryBuffer key( GetBenchKey() );
+  const BinaryBuffer value( objectSize, 0x5a );
+
+  std::cout << "Concurrency benchmark (operations/s, 90% reads of " << objectSize << " byte objects)" << std::endl;
+  std::cout << std::setw( 12 ) << "threads" << std::setw( 12 ) << "1 shard" << std::setw( 12 ) << "16 shards" << std::endl;
+
+  for ( size_t noOfThreads = 1; noOfThreads <= 8; noOfThreads *= 2 ) {
+    std::cout << std::setw( 12 ) << noOfThreads;
+    const size_t shards[] = { 1, 16 };
+    for ( size_t i = 0; i < 2; ++i ) {
+      CacheOptions options;
+      options.storage = CacheOptions::SegmentStorage;
+      options.shards = shards[i];
+      std::ostringstream name;
+      name << "concurrency" << shards[i];
+      boost::scoped_ptr< Cache > cache( createCache( OsConcatPath( path, name.str() ), key, options ) );
+      for ( size_t n = 0; n < noOfObjects; ++n ) {
+        Cache::ObjectId objId( 16, 0 );
+        std::memcpy( &objId[0], &n, sizeof( n ) );
+        cache->writeObject( objId, value );
+      }
+
+      Clock::time_point start( Clock::now() );
+      boost::thread_group threads;
+      for ( size_t t = 0; t < noOfThreads; ++t ) {
+        // Threads share the objects, half of each slice with their neighbour
+        size_t first = t * noOfObjects / noOfThreads / 2;
+        threads.create_thread( boost::bind( ConcurrentClient, cache.get(), first, noOfObjects / 2, operationsPerThread, &value ) );
+      }
+      threads.join_all();
+      boost::chrono::duration< double > elapsed( Clock::now() - start );
+
+      std::cout << std::setw( 12 ) << std::fixed << std::setprecision( 0 ) << noOfThreads * operationsPerThread / elapsed.count();
+      cache->setMaxSize( 0 );
+    }
+    std::cout << std::endl;
+  }
+}
+
+// Body of a reader thread in BenchLookups. Times every hasObject call.
+void LookupClient( Cache* cache, size_t noOfObjects, size_t lookups, std::vector< double >* latencies )
+{
+  latencies->reserve( lookups );
+  Cache::ObjectId objId( 16, 0 );
+  for ( size_t i = 0; i < lookups; ++i ) {
+    size_t n = ( i * 7919 ) % noOfObjects;
+    std::memcpy( &objId[0], &n, sizeof( n ) );
+    Clock::time_point start( Clock::now() );
+    cache->hasObject( objId );
+    latencies->push_back( boost::chrono::duration< double, boost::nano >( Clock::now() - start ).count() );
+  }
+}
+
+// Body of the writer thread in BenchLookups. Keeps writing new objects,
+// and shrinks the cache now and then to force a large prune.
+void LookupWriter( Cache* cache, size_t noOfObjects, const boost::atomic< bool >* stop, const BinaryBuffer* value )
+{
+  Cache::ObjectId objId( 16, 0 );
+  for ( size_t n = noOfObjects; !*stop; ++n ) {
+    std::memcpy( &objId[0], &n, sizeof( n ) );
+    cache->writeObject( objId, *value );
+    if ( n % 1000 == 0 ) {
+      cache->setMaxSize( noOfObjects * value->size() / 2 );
+      cache->setMaxSize( noOfObjects * value->size() * 2 );
+    }
+  }
+}
+
+// Measures hasObject latency from 16 threads, with the cache otherwise
+// idle and with another thread writing and pruning at the same time
+void BenchLookups( const std::string& path )
+{
+  const size_t noOfObjects = 10000;
+  const size_t noOfReaders = 16;
+  const size_t lookupsPerThread = 50000;
+  const BinaryBuffer key( GetBenchKey() );
+  const BinaryBuffer value( 256, 0x5a );
+
+  std::cout << "Lookup benchmark (hasObject latency in ns, " << noOfReaders << " reader threads)" << std::endl;
+  std::cout << std::setw( 12 ) << "writer" << std::setw( 12 ) << "p50" << std::setw( 12 ) << "p99" << std::setw( 12 ) << "max" << std::endl;
+
+  const char* names[] = { "idle", "busy" };
+  for ( size_t i = 0; i < 2; ++i ) {
+    CacheOptions options;
+    options.storage = CacheOptions::SegmentStorage;
+    options.shards = 16;
+    boost::scoped_ptr< Cache > cache( createCache( OsConcatPath( path, "lookups" ), key, options ) );
+    cache->setMaxSize( noOfObjects * value.size() * 2 );
+    for ( size_t n = 0; n < noOfObjects; ++n ) {
+      Cache::ObjectId objId( 16, 0 );
+      std::memcpy( &objId[0], &n, sizeof( n ) );
+      cache->writeObject( objId, value );
+    }
+
+    boost::atomic< bool > stop( false );
+    boost::scoped_ptr< boost::thread > writer;
+    if ( i == 1 ) {
+      writer.reset( new boost::thread( boost::bind( LookupWriter, cache.get(), noOfObjects, &stop, &value ) ) );
+    }
+    std::vector< std::vector< double > > latencies( noOfReaders );
+    boost::thread_group readers;
+    for ( size_t t = 0; t < noOfReaders; ++t ) {
+      readers.create_thread( boost::bind( LookupClient, cache.get(), noOfObjects, lookupsPerThread, &latencies[t] ) );
+    }
+    readers.join_all();
+    stop = true;
+    if ( writer ) {
+      writer->join();
+    }
+
+    std::vector< double > all;
+    for ( size_t t = 0; t < noOfReaders; ++t ) {
+      all.insert( all.end(), latencies[t].begin(), latencies[t].end() );
+    }
+    std::sort( all.begin(), all.end() );
+    std::cout << std::setw( 12 ) << names[i]
+              << std::setw( 12 ) << std::fixed << std::setprecision( 0 ) << all[ all.size() / 2 ]
+              << std::setw( 12 ) << all[ all.size() * 99 / 100 ]
+              << std::setw( 12 ) << all.back() << std::endl;
+    cache->setMaxSize( 0 );
+  }
+}
+
+// Bytes currently allocated from the heap, or 0 where that is unknown
+size_t HeapInUse()
+{
+#if defined( __GLIBC__ ) && ( __GLIBC__ > 2 || __GLIBC_MINOR__ >= 33 )
+  struct mallinfo2 info( mallinfo2() );
+  return info.uordblks + info.hblkhd;
+#else
+  return 0;
+#endif
+}
+
+// The index as it was before ObjectIndex: a node based map with the
+// prune list threaded through the values
+namespace intrusive = boost::intrusive;
+struct NodeIndexObject : public intrusive::list_base_hook< intrusive::link_mode< intrusive::auto_unlink > >
+{
+  boost::unordered_map< Cache::ObjectId, NodeIndexObject >::pointer mapElement_;
+  uint32_t size_;
+  uint64_t sequence_;
+  StoreLocation location_;
+};
+typedef boost::unordered_map< Cache::ObjectId, NodeIndexObject > NodeIndex;
+typedef intrusive::list< NodeIndexObject, intrusive::constant_time_size< false > > NodePruneList;
+
+Cache::ObjectId IndexBenchId( size_t n )
+{
+  Cache::ObjectId objId( 16, 0 );
+  std::memcpy( &objId[0], &n, sizeof( n ) );
+  objId[15] = 0xa5;
+  return objId;
+}
+
+// Compares the memory use and lookup speed of the node based index and
+// ObjectIndex with a million 16 byte object ids
+void BenchIndex()
+{
+  const size_t noOfObjects = 1000000;
+  const size_t noOfLookups = 2000000;
+  std::vector< Cache::ObjectId > objIds;
+  objIds.reserve( noOfObjects );
+  for ( size_t n = 0; n < noOfObjects; ++n ) {
+    objIds.push_back( IndexBenchId( n ) );
+  }
+
+  std::cout << "Index benchmark (" << noOfObjects << " objects)" << std::endl;
+  std::cout << std::setw( 12 ) << "index" << std::setw( 12 ) << "bytes/obj" << std::setw( 12 ) << "insert ns" << std::setw( 12 ) << "find ns" << std::endl;
+
+  {
+    size_t heapBefore = HeapInUse();
+    Clock::time_point start( Clock::now() );
+    NodeIndex index;
+    NodePruneList pruneList;
+    for ( size_t n = 0; n < noOfObjects; ++n ) {
+      NodeIndex::value_type& elem( *index.insert( NodeIndex::value_type( objIds[n], NodeIndexObject() ) ).first );
+      elem.second.mapElement_ = &elem;
+      pruneList.push_back( elem.second );
+    }
+    boost::chrono::duration< double, boost::nano > insertTime( Clock::now() - start );
+    size_t heapUsed = HeapInUse() - heapBefore;
+
+    start = Clock::now();
+    size_t found = 0;
+    for ( size_t i = 0; i < noOfLookups; ++i ) {
+      found += index.count( objIds[ ( i * 7919 ) % noOfObjects ] );
+    }
+    boost::chrono::duration< double, boost::nano > findTime( Clock::now() - start );
+
+    std::cout << std::setw( 12 ) << "node" << std::setw( 12 ) << std::fixed << std::setprecision( 1 ) << static_cast< double >( heapUsed ) / noOfObjects
+              << std::setw( 12 ) << insertTime.count() / noOfObjects << std::setw( 12 ) << findTime.count() / noOfLookups << std::endl;
+    if ( found != noOfLookups ) {
+      throw std::runtime_error( "Node index lost objects" );
+    }
+  }
+
+  {
+    size_t heapBefore = HeapInUse();
+    Clock::time_point start( Clock::now() );
+    ObjectIndex index;
+    for ( size_t n = 0; n < noOfObjects; ++n ) {
+      index.Insert( objIds[n], Fingerprint( objIds[n] ) );
+    }
+    boost::chrono::duration< double, boost::nano > insertTime( Clock::now() - start );
+    size_t heapUsed = HeapInUse() - heapBefore;
+
+    start = Clock::now();
+    size_t found = 0;
+    for ( size_t i = 0; i < noOfLookups; ++i ) {
+      const Cache::ObjectId& objId( objIds[ ( i * 7919 ) % noOfObjects ] );
+      found += index.Find( objId, Fingerprint( objId ) ) != 0;
+    }
+    boost::chrono::duration< double, boost::nano > findTime( Clock::now() - start );
+
+    std::cout << std::setw( 12 ) << "flat" << std::setw( 12 ) << std::fixed << std::setprecision( 1 ) << static_cast< double >( heapUsed ) / noOfObjects
+              << std::setw( 12 ) << insertTime.count() / noOfObjects << std::setw( 12 ) << findTime.count() / noOfLookups << std::endl;
+    if ( found != noOfLookups ) {
+      throw std::runtime_error( "Flat index lost objects" );
+    }
+  }
+}
+
+
+// Draws numbers from 0 to n - 1, where k comes up with a probability
+// proportional to 1 / ( k + 1 )^alpha
+class ZipfGenerator
+{
+ public:
+  ZipfGenerator( size_t n, double alpha, uint32_t seed ) : random_( seed ), uniform_( 0.0, 1.0 ), cdf_( n ) {
+    double sum = 0;
+    for ( size_t k = 0; k < n; ++k ) {
+      sum += 1.0 / std::pow( static_cast< double >( k + 1 ), alpha );
+      cdf_[k] = sum;
+    }
+    for ( size_t k = 0; k < n; ++k ) {
+      cdf_[k] /= sum;
+    }
+  }
+
+  size_t operator()() {
+    size_t k = std::lower_bound( cdf_.begin(), cdf_.end(), uniform_( random_ ) ) - cdf_.begin();
+    return std::min( k, cdf_.size() - 1 );
+  }
+
+ private:
+  boost::random::mt19937 random_;
+  boost::random::uniform_real_distribution< double > uniform_;
+  std::vector< double > cdf_;
+};
+
+// Runs a Zipfian read workload through every eviction policy. A read that
+// misses writes the object, as a client fetching it from the network
+// would. The cache holds a tenth of the objects.
+void BenchEviction( const std::string& path )
+{
+  const size_t noOfObjects = 10000;
+  const size_t noOfRequests = 100000;
+  const double alpha = 0.9;
+  const BinaryBuffer key( GetBenchKey() );
+  const BinaryBuffer value( 256, 0x5a );
+
+  std::cout << "Eviction benchmark (" << noOfRequests << " Zipfian requests over " << noOfObjects << " objects, alpha " << alpha << ")" << std::endl;
+  std::cout << std::setw( 12 ) << "policy" << std::setw( 12 ) << "hit ratio" << std::setw( 12 ) << "ops/s" << std::endl;
+
+  const CacheOptions::Eviction evictions[] = { CacheOptions::FifoEviction, CacheOptions::LruEviction, CacheOptions::ClockEviction,
+                                               CacheOptions::SieveEviction, CacheOptions::S3FifoEviction };
+  const char* names[] = { "fifo", "lru", "clock", "sieve", "s3-fifo" };
+  for ( size_t i = 0; i < sizeof( evictions ) / sizeof( evictions[0] ); ++i ) {
+    CacheOptions options;
+    options.eviction = evictions[i];
+    boost::scoped_ptr< Cache > cache( createCache( OsConcatPath( path, "eviction" ), key, options ) );
+    cache->setMaxSize( noOfObjects / 10 * value.size() );
+
+    // The same requests for every policy
+    ZipfGenerator zipf( noOfObjects, alpha, 4711 );
+    size_t hits = 0;
+    BinaryBuffer result;
+    Clock::time_point start( Clock::now() );
+    for ( size_t r = 0; r < noOfRequests; ++r ) {
+      Cache::ObjectId objId( 16, 0 );
+      // Spread the popular objects over the id space
+      size_t n = ( zipf() * 7919 ) % noOfObjects;
+      std::memcpy( &objId[0], &n, sizeof( n ) );
+      if ( cache->readObject( objId, result ) ) {
+        ++ hits;
+      } else {
+        cache->writeObject( objId, value );
+      }
+    }
+    boost::chrono::duration< double > elapsed( Clock::now() - start );
+
+    std::cout << std::setw( 12 ) << names[i]
+              << std::setw( 12 ) << std::fixed << std::setprecision( 3 ) << static_cast< double >( hits ) / noOfRequests
+              << std::setw( 12 ) << std::setprecision( 0 ) << noOfRequests / elapsed.count() << std::endl;
+    cache->setMaxSize( 0 );
+  }
+}
+
+// Measures how long createCache takes to get ready with an index of
+// noOfObjects objects, loaded from a checkpoint. Every object has a file,
+// empty to save space, so that whatever the file store does with its
+// files when it opens is timed too. noOfFiles counts the files already
+// written to path.
+double TimeStartup( const std::string& path, size_t noOfObjects, size_t& noOfFiles )
+{
+  const BinaryBuffer key( GetBenchKey() );
+  const std::string metaDataFiles[] = { checkpointFilename, journalFilenames[0], journalFilenames[1] };
+  for ( size_t i = 0; i < sizeof( metaDataFiles ) / sizeof( metaDataFiles[0] ); ++i ) {
+    const std::string filename( OsConcatPath( path, metaDataFiles[i] ) );
+    if ( OsFileExists( filename ) ) {
+      OsDeleteFile( filename );
+    }
+  }
+
+  {
+    FileStore store( path );
+    for ( ; noOfFiles < noOfObjects; ++noOfFiles ) {
+      StoreLocation location;
+      store.Write( IndexBenchId( noOfFiles ), BinaryBuffer(), location );
+      store.Commit( IndexBenchId( noOfFiles ), location );
+    }
+  }
+  {
+    MetaJournal journal( path, key );
+    JournalCheckpoint checkpoint;
+    std::vector< JournalRecord > records;
+    journal.Open( checkpoint, records );
+    journal.StartCheckpoint();
+    for ( size_t n = 0; n < noOfObjects; ++n ) {
+      StoreLocation location;
+      location.length_ = 100;
+      checkpoint.Add( IndexBenchId( n ), 100, location );
+    }
+    journal.CommitCheckpoint( checkpoint );
+  }
+
+  Clock::time_point start( Clock::now() );
+  boost::scoped_ptr< Cache > cache( createCache( path, key ) );
+  boost::chrono::duration< double, boost::milli > elapsed( Clock::now() - start );
+  if ( !cache->hasObject( IndexBenchId( noOfObjects - 1 ) ) ) {
+    throw std::runtime_error( "Startup lost objects" );
+  }
+  return elapsed.count();
+}
+
+void BenchStartup( const std::string& path )
+{
+  const size_t objectCounts[] = { 50000, 100000, 250000, 500000 };
+  const size_t noOfCounts = sizeof( objectCounts ) / sizeof( objectCounts[0] );
+  const std::string startupPath( OsConcatPath( path, "startup" ) );
+  OsEnsureDirectory( startupPath );
+  size_t noOfFiles = 0;
+
+  std::cout << "Startup benchmark (time to ready)" << std::endl;
+  std::cout << std::setw( 12 ) << "objects" << std::setw( 12 ) << "ms" << std::endl;
+  for ( size_t i = 0; i < noOfCounts; ++i ) {
+    std::cout << std::setw( 12 ) << objectCounts[i] << std::setw( 12 ) << std::fixed << std::setprecision( 1 )
+              << TimeStartup( startupPath, objectCounts[i], noOfFiles ) << std::endl;
+  }
+}
+
+
+// Counts the completions of asynchronous reads in BenchAsync
+struct AsyncCounter
+{
+  AsyncCounter() : completed_( 0 ), failed_( 0 ) {}
+  void Read( bool ok, const BinaryBuffer& /* value */ ) {
+    boost::mutex::scoped_lock lock( mutex_ );
+    ++ completed_;
+    if ( !ok ) {
+      ++ failed_;
+    }
+    done_.notify_all();
+  }
+  void Wait( size_t expected ) {
+    boost::mutex::scoped_lock lock( mutex_ );
+    while ( completed_ < expected ) {
+      done_.wait( lock );
+    }
+  }
+  boost::mutex mutex_;
+  boost::condition_variable done_;
+  size_t completed_;
+  size_t failed_;
+};
+
+// Reads objects with readObjectAsync from a single thread, with a growing
+// queue depth, against readObject from the same thread
+void BenchAsync( const std::string& path )
+{
+  const size_t noOfObjects = 2000;
+  const size_t objectSize = 16 * 1024;
+  const size_t reads = 20000;
+  const BinaryBuffer key( GetBenchKey() );
+  const BinaryBuffer value( objectSize, 0x5a );
+
+  std::cout << "Async benchmark (reads/s of " << objectSize << " byte objects from one thread)" << std::endl;
+  std::cout << std::setw( 12 ) << "depth" << std::setw( 12 ) << "reads/s" << std::setw( 12 ) << "MB/s" << std::endl;
+
+  const size_t depths[] = { 0, 1, 4, 16, 64 };
+  for ( size_t i = 0; i < sizeof( depths ) / sizeof( depths[0] ); ++i ) {
+    CacheOptions options;
+    options.storage = CacheOptions::SegmentStorage;
+    options.shards = 16;
+    options.asyncQueueDepth = std::max< size_t >( 1, depths[i] );
+    boost::scoped_ptr< Cache > cache( createCache( OsConcatPath( path, "async" ), key, options ) );
+    for ( size_t n = 0; n < noOfObjects; ++n ) {
+      Cache::ObjectId objId( 16, 0 );
+      std::memcpy( &objId[0], &n, sizeof( n ) );
+      cache->writeObject( objId, value );
+    }
+
+    AsyncCounter counter;
+    BinaryBuffer result;
+    Clock::time_point start( Clock::now() );
+    for ( size_t r = 0; r < reads; ++r ) {
+      Cache::ObjectId objId( 16, 0 );
+      size_t n = ( r * 7919 ) % noOfObjects;
+      std::memcpy( &objId[0], &n, sizeof( n ) );
+      if ( depths[i] == 0 ) {
+        counter.Read( cache->readObject( objId, result ), result );
+      } else {
+        cache->readObjectAsync( objId, boost::bind( &AsyncCounter::Read, &counter, _1, _2 ) );
+      }
+    }
+    counter.Wait( reads );
+    boost::chrono::duration< double > elapsed( Clock::now() - start );
+    if ( counter.failed_ ) {
+      throw std::runtime_error( "Async reads failed" );
+    }
+
+    if ( depths[i] == 0 ) {
+      std::cout << std::setw( 12 ) << "sync";
+    } else {
+      std::cout << std::setw( 12 ) << depths[i];
+    }
+    std::cout << std::setw( 12 ) << std::fixed << std::setprecision( 0 ) << reads / elapsed.count()
+              << std::setw( 12 ) << std::setprecision( 1 ) << reads * objectSize / elapsed.count() / ( 1024 * 1024 ) << std::endl;
+    cache->setMaxSize( 0 );
+  }
+}
+
+
+// Rereads the same objects with in-memory tiers of a growing share of
+// their size
+void BenchMemoryTier( const std::string& path )
+{
+  const size_t noOfObjects = 200;
+  const size_t objectSize = 64 * 1024;
+  const size_t reads = 20000;
+  const BinaryBuffer key( GetBenchKey() );
+  const BinaryBuffer value( objectSize, 0x5a );
+
+  std::cout << "Memory tier benchmark (rereads/s of " << noOfObjects << " objects of " << objectSize << " bytes)" << std::endl;
+  std::cout << std::setw( 12 ) << "tier" << std::setw( 12 ) << "reads/s" << std::setw( 12 ) << "hit ratio" << std::endl;
+
+  const size_t shares[] = { 0, 25, 50, 100 };
+  for ( size_t i = 0; i < sizeof( shares ) / sizeof( shares[0] ); ++i ) {
+    CacheOptions options;
+    options.memoryTierSize = noOfObjects * objectSize * shares[i] / 100;
+    boost::scoped_ptr< Cache > cache( createCache( OsConcatPath( path, "tier" ), key, options ) );
+    for ( size_t n = 0; n < noOfObjects; ++n ) {
+      Cache::ObjectId objId( 16, 0 );
+      std::memcpy( &objId[0], &n, sizeof( n ) );
+      cache->writeObject( objId, value );
+    }
+
+    BinaryBuffer result;
+    Clock::time_point start( Clock::now() );
+    for ( size_t r = 0; r < reads; ++r ) {
+      // Mostly the first objects, like scrolling back and forth
+      Cache::ObjectId objId( 16, 0 );
+      size_t n = ( r * 7919 ) % noOfObjects;
+      n = n * n / noOfObjects;
+      std::memcpy( &objId[0], &n, sizeof( n ) );
+      if ( !cache->readObject( objId, result ) ) {
+        throw std::runtime_error( "Memory tier read failed" );
+      }
+    }
+    boost::chrono::duration< double > elapsed( Clock::now() - start );
+
+    MemoryTierStats stats;
+    std::ostringstream tier;
+    tier << shares[i] << "%";
+    std::cout << std::setw( 12 ) << tier.str() << std::setw( 12 ) << std::fixed << std::setprecision( 0 ) << reads / elapsed.count()
+              << std::setw( 12 ) << std::setprecision( 2 )
+              << ( cache->getMemoryTierStats( stats ) ? static_cast< double >( stats.hits ) / reads : 0.0 ) << std::endl;
+    cache->setMaxSize( 0 );
+  }
+}
+
+
+// A ReadSink for BenchStream that keeps track of the heap while the
+// object streams through
+struct StreamCounter
+{
+  StreamCounter( size_t heapBefore ) : heapBefore_( heapBefore ), peak_( 0 ), bytes_( 0 ) {}
+  void Chunk( const uint8_t* /* data */, size_t size ) {
+    bytes_ += size;
+    const size_t heap = HeapInUse();
+    peak_ = std::max( peak_, heap > heapBefore_ ? heap - heapBefore_ : 0 );
+  }
+  size_t heapBefore_;
+  size_t peak_;
+  size_t bytes_;
+};
+
+// Reads large objects whole with readObject, and a chunk at a time with
+// readObjectStream, and how much the heap grows while doing so
+void BenchStream( const std::string& path )
+{
+  const size_t objectSizes[] = { 1024 * 1024, 8 * 1024 * 1024, 40 * 1024 * 1024 };
+  const BinaryBuffer key( GetBenchKey() );
+
+  std::cout << "Stream benchmark (MB/s, and heap growth in KB)" << std::endl;
+  std::cout << std::setw( 12 ) << "size" << std::setw( 12 ) << "whole" << std::setw( 12 ) << "heap"
+            << std::setw( 12 ) << "stream" << std::setw( 12 ) << "heap" << std::endl;
+
+  boost::scoped_ptr< Cache > cache( createCache( OsConcatPath( path, "stream" ), key ) );
+  cache->setMaxSize( 64 * 1024 * 1024 );
+  for ( size_t i = 0; i < sizeof( objectSizes ) / sizeof( objectSizes[0] ); ++i ) {
+    const Cache::ObjectId objId( 16, static_cast< uint8_t >( i ) );
+    {
+      BinaryBuffer value( objectSizes[i], 0x5a );
+      cache->writeObject( objId, value );
+    }
+    const size_t iterations = std::max< size_t >( 3, 256 * 1024 * 1024 / objectSizes[i] );
+
+    size_t wholeHeap = 0;
+    Clock::time_point start( Clock::now() );
+    for ( size_t n = 0; n < iterations; ++n ) {
+      const size_t before = HeapInUse();
+      BinaryBuffer result;
+      if ( !cache->readObject( objId, result ) ) {
+        throw std::runtime_error( "Stream benchmark read failed" );
+      }
+      const size_t after = HeapInUse();
+      wholeHeap = std::max( wholeHeap, after > before ? after - before : 0 );
+    }
+    boost::chrono::duration< double > whole( Clock::now() - start );
+
+    size_t streamHeap = 0;
+    start = Clock::now();
+    for ( size_t n = 0; n < iterations; ++n ) {
+      StreamCounter counter( HeapInUse() );
+      if ( !cache->readObjectStream( objId, boost::bind( &StreamCounter::Chunk, &counter, _1, _2 ) ) ||
+           counter.bytes_ != objectSizes[i] ) {
+        throw std::runtime_error( "Stream benchmark stream failed" );
+      }
+      streamHeap = std::max( streamHeap, counter.peak_ );
+    }
+    boost::chrono::duration< double > stream( Clock::now() - start );
+
+    const double megabytes = static_cast< double >( objectSizes[i] ) * iterations / ( 1024 * 1024 );
+    std::cout << std::setw( 12 ) << objectSizes[i] << std::fixed << std::setprecision( 1 )
+              << std::setw( 12 ) << megabytes / whole.count() << std::setw( 12 ) << wholeHeap / 1024
+              << std::setw( 12 ) << megabytes / stream.count() << std::setw( 12 ) << streamHeap / 1024 << std::endl;
+    cache->eraseObject( objId );
+  }
+}
+
+
+// Encrypts and decrypts an object the way legacy records are: a SHA1
+// hash, and a new RC4 key schedule for every pass
+void RoundTripRc4Sha1( const BinaryBuffer& key, const BinaryBuffer& value, BinaryBuffer& buffer, BinaryBuffer& result )
+{
+  Crypt::Sha1HashValue hash( Crypt::Sha1Hash( value ) );
+  buffer.resize( hash.size() + value.size() );
+  std::copy( value.begin(), value.end(), std::copy( hash.begin(), hash.end(), buffer.begin() ) );
+  Crypt::Rc4EncryptDecrypt( key, buffer );
+
+  Crypt::Rc4Cipher cipher( key );
+  cipher.Process( &buffer[0], hash.data(), hash.size() );
+  result.resize( value.size() );
+  cipher.Process( &buffer[ hash.size() ], &result[0], result.size() );
+  if ( Crypt::Sha1Hash( result ) != hash ) {
+    throw std::runtime_error( "Crypto benchmark hash mismatch" );
+  }
+}
+
+// The same with one AEAD pass each way, with a new nonce every time
+void RoundTripAead( Crypt::Aead& aead, const BinaryBuffer& value, BinaryBuffer& buffer, BinaryBuffer& result )
+{
+  uint8_t nonce[ Crypt::Aead::nonceSize ];
+  Crypt::RandomBytes( nonce, sizeof( nonce ) );
+  buffer.resize( value.size() + Crypt::Aead::tagSize );
+  {
+    Crypt::Aead::Operation operation( aead, true, nonce );
+    operation.Process( &value[0], &buffer[0], value.size() );
+    operation.Seal( &buffer[ value.size() ] );
+  }
+  result.resize( value.size() );
+  Crypt::Aead::Operation operation( aead, false, nonce );
+  operation.Process( &buffer[0], &result[0], result.size() );
+  if ( !operation.Open( &buffer[ value.size() ] ) ) {
+    throw std::runtime_error( "Crypto benchmark tag mismatch" );
+  }
+}
+
+// Compares the MB/s of encrypting and decrypting objects with RC4 and
+// SHA1 against AES-GCM and ChaCha20-Poly1305, and of readObject on
+// caches written with each
+void BenchCrypto( const std::string& path )
+{
+  const size_t objectSizes[] = { 1024, 16 * 1024, 256 * 1024, 4 * 1024 * 1024 };
+  const BinaryBuffer key( GetBenchKey() );
+  const Crypt::Aead::Algorithm algorithms[] = { Crypt::Aead::AesGcm, Crypt::Aead::ChaCha20Poly1305 };
+  boost::scoped_ptr< Crypt::Aead > aeads[2];
+  for ( size_t a = 0; a < 2; ++a ) {
+    if ( Crypt::Aead::Supported( algorithms[a] ) ) {
+      aeads[a].reset( new Crypt::Aead( algorithms[a], key ) );
+    }
+  }
+
+  std::cout << "Crypto benchmark (MB/s of objects encrypted and decrypted; "
+            << ( Crypt::Aead::Fastest() == Crypt::Aead::AesGcm ? "aes-gcm" : "chacha20" ) << " is picked here)" << std::endl;
+  std::cout << std::setw( 12 ) << "size" << std::setw( 12 ) << "rc4+sha1" << std::setw( 12 ) << "aes-gcm"
+            << std::setw( 12 ) << "chacha20" << std::endl;
+  for ( size_t i = 0; i < sizeof( objectSizes ) / sizeof( objectSizes[0] ); ++i ) {
+    BinaryBuffer value( objectSizes[i] );
+    for ( size_t j = 0; j < value.size(); ++j ) {
+      value[j] = static_cast< uint8_t >( rand() % 0x100 );
+    }
+    const size_t iterations = std::max< size_t >( 3, 256 * 1024 * 1024 / objectSizes[i] );
+    const double megabytes = static_cast< double >( objectSizes[i] ) * iterations / ( 1024 * 1024 );
+    BinaryBuffer buffer, result;
+
+    std::cout << std::setw( 12 ) << objectSizes[i] << std::fixed << std::setprecision( 1 );
+    Clock::time_point start( Clock::now() );
+    for ( size_t n = 0; n < iterations; ++n ) {
+      RoundTripRc4Sha1( key, value, buffer, result );
+    }
+    std::cout << std::setw( 12 ) << megabytes / boost::chrono::duration< double >( Clock::now() - start ).count();
+    for ( size_t a = 0; a < 2; ++a ) {
+      if ( !aeads[a] ) {
+        std::cout << std::setw( 12 ) << "-";
+        continue;
+      }
+      start = Clock::now();
+      for ( size_t n = 0; n < iterations; ++n ) {
+        RoundTripAead( *aeads[a], value, buffer, result );
+      }
+      std::cout << std::setw( 12 ) << megabytes / boost::chrono::duration< double >( Clock::now() - start ).count();
+    }
+    std::cout << std::endl;
+  }
+
+  std::cout << "readObject of 256 KB objects (MB/s)" << std::endl;
+  const CacheOptions::Encryption encryptions[] = { CacheOptions::Rc4Sha1Encryption, CacheOptions::AesGcmEncryption,
+                                                   CacheOptions::ChaChaEncryption };
+  const char* names[] = { "rc4+sha1", "aes-gcm", "chacha20" };
+  const size_t objectSize = 256 * 1024;
+  const size_t noOfObjects = 64;
+  for ( size_t e = 0; e < sizeof( encryptions ) / sizeof( encryptions[0] ); ++e ) {
+    if ( e > 0 && !aeads[ e - 1 ] ) {
+      continue;
+    }
+    CacheOptions options;
+    options.encryption = encryptions[e];
+    const std::string cachePath( OsConcatPath( path, std::string( "crypto-" ) + names[e] ) );
+    boost::scoped_ptr< Cache > cache( createCache( cachePath, key, options ) );
+    cache->setMaxSize( 2 * noOfObjects * objectSize );
+    const BinaryBuffer value( objectSize, 0x5a );
+    for ( size_t n = 0; n < noOfObjects; ++n ) {
+      cache->writeObject( Cache::ObjectId( 16, static_cast< uint8_t >( n ) ), value );
+    }
+    const size_t rounds = 16;
+    Clock::time_point start( Clock::now() );
+    BinaryBuffer result;
+    for ( size_t round = 0; round < rounds; ++round ) {
+      for ( size_t n = 0; n < noOfObjects; ++n ) {
+        if ( !cache->readObject( Cache::ObjectId( 16, static_cast< uint8_t >( n ) ), result ) ) {
+          throw std::runtime_error( "Crypto benchmark read failed" );
+        }
+      }
+    }
+    const double megabytes = static_cast< double >( objectSize ) * noOfObjects * rounds / ( 1024 * 1024 );
+    std::cout << std::setw( 12 ) << names[e] << std::setw( 12 ) << std::fixed << std::setprecision( 1 )
+              << megabytes / boost::chrono::duration< double >( Clock::now() - start ).count() << std::endl;
+    for ( size_t n = 0; n < noOfObjects; ++n ) {
+      cache->eraseObject( Cache::ObjectId( 16, static_cast< uint8_t >( n ) ) );
+    }
+  }
+}
+
+}
+
+// Reads of 64 KB at random offsets with readObjectRange, against reading
+// the whole object with readObject for every one
+void BenchRange( const std::string& path )
+{
+  const size_t objectSizes[] = { 1024 * 1024, 8 * 1024 * 1024, 40 * 1024 * 1024 };
+  const size_t rangeSize = 64 * 1024;
+  const BinaryBuffer key( GetBenchKey() );
+
+  std::cout << "Range benchmark (64 KB reads per second)" << std::endl;
+  std::cout << std::setw( 12 ) << "size" << std::setw( 12 ) << "whole" << std::setw( 12 ) << "range" << std::endl;
+
+  boost::scoped_ptr< Cache > cache( createCache( OsConcatPath( path, "range" ), key ) );
+  cache->setMaxSize( 64 * 1024 * 1024 );
+  boost::random::mt19937 random;
+  for ( size_t i = 0; i < sizeof( objectSizes ) / sizeof( objectSizes[0] ); ++i ) {
+    const Cache::ObjectId objId( 16, static_cast< uint8_t >( i ) );
+    {
+      BinaryBuffer value( objectSizes[i], 0x5a );
+      cache->writeObject( objId, value );
+    }
+    const size_t wholeIterations = std::max< size_t >( 3, 128 * 1024 * 1024 / objectSizes[i] );
+    const size_t rangeIterations = 4000;
+
+    Clock::time_point start( Clock::now() );
+    for ( size_t n = 0; n < wholeIterations; ++n ) {
+      BinaryBuffer result;
+      if ( !cache->readObject( objId, result ) ) {
+        throw std::runtime_error( "Range benchmark read failed" );
+      }
+    }
+    boost::chrono::duration< double > whole( Clock::now() - start );
+
+    start = Clock::now();
+    for ( size_t n = 0; n < rangeIterations; ++n ) {
+      BinaryBuffer result;
+      const uint64_t offset = random() % ( objectSizes[i] - rangeSize );
+      if ( !cache->readObjectRange( objId, offset, rangeSize, result ) || result.size() != rangeSize ) {
+        throw std::runtime_error( "Range benchmark range read failed" );
+      }
+    }
+    boost::chrono::duration< double > range( Clock::now() - start );
+
+    std::cout << std::setw( 12 ) << objectSizes[i] << std::fixed << std::setprecision( 1 )
+              << std::setw( 12 ) << wholeIterations / whole.count()
+              << std::setw( 12 ) << rangeIterations / range.count() << std::endl;
+    cache->eraseObject( objId );
+  }
+}
+
+// Microseconds per object of a grid of 200 album covers, found, read,
+// written and erased one call at a time and in batches of growing size
+void BenchBatch( const std::string& path )
+{
+  const size_t objects = 200;
+  const size_t objectSize = 16 * 1024;
+  const size_t batchSizes[] = { 1, 8, 32, 200 };
+  const size_t rounds = 10;
+  const BinaryBuffer key( GetBenchKey() );
+
+  std::cout << "Batch benchmark (microseconds per object)" << std::endl;
+  std::cout << std::setw( 12 ) << "batch" << std::setw( 12 ) << "has" << std::setw( 12 ) << "read"
+            << std::setw( 12 ) << "write" << std::setw( 12 ) << "erase" << std::endl;
+
+  // Segments, so that creating and deleting files doesn't drown out the rest
+  CacheOptions options;
+  options.storage = CacheOptions::SegmentStorage;
+  boost::scoped_ptr< Cache > cache( createCache( OsConcatPath( path, "batch" ), key, options ) );
+  cache->setMaxSize( 64 * 1024 * 1024 );
+  std::vector< Cache::ObjectId > objIds;
+  std::vector< BinaryBuffer > values;
+  for ( size_t i = 0; i < objects; ++i ) {
+    objIds.push_back( Cache::ObjectId( 16, 0 ) );
+    objIds.back()[0] = static_cast< uint8_t >( i );
+    objIds.back()[1] = static_cast< uint8_t >( i >> 8 );
+    values.push_back( BinaryBuffer( objectSize, static_cast< uint8_t >( i ) ) );
+  }
+
+  // Batch size 0 is a call per object
+  for ( size_t b = 0; b <= sizeof( batchSizes ) / sizeof( batchSizes[0] ); ++b ) {
+    const size_t batchSize = b ? batchSizes[ b - 1 ] : 1;
+    std::vector< std::vector< Cache::ObjectId > > idBatches;
+    std::vector< std::vector< BinaryBuffer > > valueBatches;
+    for ( size_t first = 0; first < objects; first += batchSize ) {
+      const size_t last = std::min( objects, first + batchSize );
+      idBatches.push_back( std::vector< Cache::ObjectId >( objIds.begin() + first, objIds.begin() + last ) );
+      valueBatches.push_back( std::vector< BinaryBuffer >( values.begin() + first, values.begin() + last ) );
+    }
+    double seconds[4] = { 0, 0, 0, 0 };
+    for ( size_t round = 0; round < rounds; ++round ) {
+      for ( size_t op = 0; op < 4; ++op ) {
+        // Write first and erase last, so that every round starts empty
+        const size_t order[4] = { 2, 0, 1, 3 };
+        const Clock::time_point start( Clock::now() );
+        size_t done = 0;
+        for ( size_t n = 0; n < idBatches.size(); ++n ) {
+          const std::vector< Cache::ObjectId >& batch( idBatches[n] );
+          if ( !b ) {
+            BinaryBuffer result;
+            switch ( order[ op ] ) {
+              case 0: done += cache->hasObject( batch[0] ) ? 1 : 0; break;
+              case 1: done += cache->readObject( batch[0], result ) ? 1 : 0; break;
+              case 2: done += cache->writeObject( batch[0], valueBatches[n][0] ) ? 1 : 0; break;
+              case 3: done += cache->eraseObject( batch[0] ) ? 1 : 0; break;
+            }
+            continue;
+          }
+          std::vector< bool > ok;
+          std::vector< BinaryBuffer > results;
+          switch ( order[ op ] ) {
+            case 0: done += cache->hasObjects( batch, ok ); break;
+            case 1: done += cache->readObjects( batch, results, ok ); break;
+            case 2: done += cache->writeObjects( batch, valueBatches[n], ok ); break;
+            case 3: done += cache->eraseObjects( batch, ok ); break;
+          }
+        }
+        seconds[ order[ op ] ] += boost::chrono::duration< double >( Clock::now() - start ).count();
+        if ( done != objects ) {
+          throw std::runtime_error( "Batch benchmark operation failed" );
+        }
+      }
+    }
+
+    std::ostringstream label;
+    if ( b ) {
+      label << batchSize;
+    } else {
+      label << "single";
+    }
+    std::cout << std::setw( 12 ) << label.str() << std::fixed << std::setprecision( 1 );
+    for ( size_t op = 0; op < 4; ++op ) {
+      std::cout << std::setw( 12 ) << seconds[ op ] * 1e6 / ( objects * rounds );
+    }
+    std::cout << std::endl;
+  }
+}
+
+// How many more objects fit in the same cache with compression, and what
+// it costs to write and read them, for text and for random data
+void BenchCompression( const std::string& path )
+{
+  const size_t objects = 500;
+  const size_t objectSize = 8 * 1024;
+  const char* compressionNames[] = { "none", "fast", "best" };
+  const BinaryBuffer key( GetBenchKey() );
+
+  std::cout << "Compression benchmark (stored bytes per object, and MB/s)" << std::endl;
+  std::cout << std::setw( 12 ) << "data" << std::setw( 12 ) << "codec" << std::setw( 12 ) << "stored"
+            << std::setw( 12 ) << "write" << std::setw( 12 ) << "read" << std::endl;
+
+  // Text made of words, like a biography, and bytes that don't compress
+  const std::string words[] = { "The ", "band ", "was ", "formed ", "in ", "1994 ", "and ", "released ", "their ",
+                                "first ", "album, ", "which ", "toured ", "Europe ", "with ", "critics. " };
+  std::vector< Cache::ObjectId > objIds;
+  std::vector< BinaryBuffer > texts( objects );
+  std::vector< BinaryBuffer > randoms( objects );
+  boost::random::mt19937 random;
+  for ( size_t i = 0; i < objects; ++i ) {
+    while ( texts[i].size() < objectSize ) {
+      const std::string& word( words[ random() % ( sizeof( words ) / sizeof( words[0] ) ) ] );
+      texts[i].insert( texts[i].end(), word.begin(), word.end() );
+    }
+    texts[i].resize( objectSize );
+    objIds.push_back( Cache::ObjectId( 16, 0 ) );
+    objIds.back()[0] = static_cast< uint8_t >( i );
+    objIds.back()[1] = static_cast< uint8_t >( i >> 8 );
+    for ( size_t j = 0; j < objectSize; ++j ) {
+      randoms[i].push_back( static_cast< uint8_t >( random() ) );
+    }
+  }
+
+  for ( size_t data = 0; data < 2; ++data ) {
+    const std::vector< BinaryBuffer >& values( data ? randoms : texts );
+    for ( size_t compression = CacheOptions::NoCompression; compression <= CacheOptions::BestCompression; ++compression ) {
+      CacheOptions options;
+      options.partitions.push_back( CacheOptions::Partition( "", std::numeric_limits< uint64_t >::max(),
+                                                             static_cast< CacheOptions::Compression >( compression ) ) );
+      boost::scoped_ptr< Cache > cache( createCache( OsConcatPath( path, "compression" ), key, options ) );
+      cache->setMaxSize( 64 * 1024 * 1024 );
+      Clock::time_point start( Clock::now() );
+      for ( size_t i = 0; i < objects; ++i ) {
+        cache->writeObject( objIds[i], values[i] );
+      }
+      boost::chrono::duration< double > written( Clock::now() - start );
+      const uint64_t stored = cache->getCurrentSize();
+      start = Clock::now();
+      for ( size_t i = 0; i < objects; ++i ) {
+        BinaryBuffer result;
+        if ( !cache->readObject( objIds[i], result ) || result != values[i] ) {
+          throw std::runtime_error( "Compression benchmark read failed" );
+        }
+      }
+      boost::chrono::duration< double > read( Clock::now() - start );
+
+      const double megabytes = static_cast< double >( objectSize ) * objects / ( 1024 * 1024 );
+      std::cout << std::setw( 12 ) << ( data ? "random" : "text" ) << std::setw( 12 ) << compressionNames[ compression ]
+                << std::setw( 12 ) << stored / objects << std::fixed << std::setprecision( 1 )
+                << std::setw( 12 ) << megabytes / written.count() << std::setw( 12 ) << megabytes / read.count() << std::endl;
+      for ( size_t i = 0; i < objects; ++i ) {
+        cache->eraseObject( objIds[i] );
+      }
+    }
+  }
+}
+
+// What the cache stores, and how fast it writes and reads, when every
+// cover is written under three ids, with and without deduplication
+void BenchDedup( const std::string& path )
+{
+  const size_t covers = 200;
+  const size_t copies = 3;
+  const size_t coverSize = 32 * 1024;
+  const BinaryBuffer key( GetBenchKey() );
+
+  std::cout << "Deduplication benchmark (" << covers << " covers under " << copies << " ids each, stored KB and MB/s)" << std::endl;
+  std::cout << std::setw( 12 ) << "dedup" << std::setw( 12 ) << "stored" << std::setw( 12 ) << "write"
+            << std::setw( 12 ) << "read" << std::endl;
+
+  boost::random::mt19937 random;
+  std::vector< BinaryBuffer > values( covers );
+  for ( size_t i = 0; i < covers; ++i ) {
+    for ( size_t j = 0; j < coverSize; ++j ) {
+      values[i].push_back( static_cast< uint8_t >( random() ) );
+    }
+  }
+  std::vector< Cache::ObjectId > objIds;
+  for ( size_t i = 0; i < covers * copies; ++i ) {
+    objIds.push_back( Cache::ObjectId( 16, 0 ) );
+    objIds.back()[0] = static_cast< uint8_t >( i );
+    objIds.back()[1] = static_cast< uint8_t >( i >> 8 );
+  }
+
+  for ( int dedup = 0; dedup < 2; ++dedup ) {
+    CacheOptions options;
+    options.deduplicate = dedup != 0;
+    boost::scoped_ptr< Cache > cache( createCache( OsConcatPath( path, "dedup" ), key, options ) );
+    cache->setMaxSize( 64 * 1024 * 1024 );
+    Clock::time_point start( Clock::now() );
+    for ( size_t i = 0; i < objIds.size(); ++i ) {
+      cache->writeObject( objIds[i], values[ i % covers ] );
+    }
+    boost::chrono::duration< double > written( Clock::now() - start );
+    const uint64_t stored = cache->getCurrentSize();
+    start = Clock::now();
+    for ( size_t i = 0; i < objIds.size(); ++i ) {
+      BinaryBuffer result;
+      if ( !cache->readObject( objIds[i], result ) || result != values[ i % covers ] ) {
+        throw std::runtime_error( "Deduplication benchmark read failed" );
+      }
+    }
+    boost::chrono::duration< double > read( Clock::now() - start );
+
+    const double megabytes = static_cast< double >( coverSize ) * objIds.size() / ( 1024 * 1024 );
+    std::cout << std::setw( 12 ) << ( dedup ? "on" : "off" ) << std::setw( 12 ) << stored / 1024
+              << std::fixed << std::setprecision( 1 )
+              << std::setw( 12 ) << megabytes / written.count() << std::setw( 12 ) << megabytes / read.count() << std::endl;
+    for ( size_t i = 0; i < objIds.size(); ++i ) {
+      cache->eraseObject( objIds[i] );
+    }
+  }
+}
+
+// The kinds of object a client caches, with sizes spread evenly on a
+// log scale between minSize and maxSize. Tracks are cached in pieces.
+struct ObjectKind
+{
+  const char* name;
+  size_t minSize;
+  size_t maxSize;
+  unsigned share; // Percent of the objects of a mix
+};
+
+const ObjectKind imageKinds[] = { { "images", 4 * 1024, 96 * 1024, 100 } };
+const ObjectKind trackKinds[] = { { "tracks", 64 * 1024, 384 * 1024, 100 } };
+const ObjectKind bioKinds[] = { { "bios", 512, 8 * 1024, 100 } };
+const ObjectKind mixedKinds[] = { { "images", 4 * 1024, 96 * 1024, 60 }, { "bios", 512, 8 * 1024, 30 },
+                                  { "tracks", 64 * 1024, 384 * 1024, 10 } };
+
+// A client workload. Every request reads an object, and writes it if it
+// wasn't there, as a client that then fetches it from the network would.
+// Objects are picked with a Zipfian distribution of alpha, or uniformly
+// if alpha is 0.
+struct Workload
+{
+  const char* name;
+  const ObjectKind* kinds;
+  size_t noOfKinds;
+  double alpha;
+  size_t objects;
+  uint64_t maxSize;
+};
+
+#define BENCH_KINDS( kinds ) kinds, sizeof( kinds ) / sizeof( kinds[0] )
+const Workload workloads[] = {
+  { "zipf-images", BENCH_KINDS( imageKinds ), 0.9, 50000, 128 * 1024 * 1024 },
+  { "uniform-images", BENCH_KINDS( imageKinds ), 0.0, 50000, 128 * 1024 * 1024 },
+  { "zipf-tracks", BENCH_KINDS( trackKinds ), 0.9, 50000, 256 * 1024 * 1024 },
+  { "zipf-bios", BENCH_KINDS( bioKinds ), 0.9, 1000000, 64 * 1024 * 1024 },
+  { "uniform-bios", BENCH_KINDS( bioKinds ), 0.0, 1000000, 64 * 1024 * 1024 },
+  { "zipf-mixed", BENCH_KINDS( mixedKinds ), 0.9, 200000, 128 * 1024 * 1024 }
+};
+#undef BENCH_KINDS
+
+// Latencies in microseconds of the calls of a phase, by call
+typedef std::map< std::string, std::vector< double > > LatencyMap;
+
+// What a phase of a workload did
+struct PhaseResult
+{
+  PhaseResult() : requests( 0 ), hits( 0 ), bytesRead( 0 ), bytesWritten( 0 ), seconds( 0 ) {}
+  size_t requests;
+  size_t hits;
+  uint64_t bytesRead;
+  uint64_t bytesWritten;
+  double seconds;
+  LatencyMap latencies;
+};
+
+class WorkloadClient
+{
+ public:
+  WorkloadClient( const Workload& workload, size_t objects, uint32_t seed )
+      : workload_( workload ), objects_( objects ), zipf_( workload.alpha > 0 ? objects : 1, workload.alpha, seed ),
+        random_( seed ), payload_( workload.kinds[0].maxSize ) {
+    for ( size_t i = 0; i < workload.noOfKinds; ++i ) {
+      payload_.resize( std::max( payload_.size(), workload.kinds[i].maxSize ) );
+    }
+    for ( size_t i = 0; i < payload_.size(); ++i ) {
+      payload_[i] = static_cast< uint8_t >( random_() );
+    }
+  }
+
+  // Sends requests to cache, adding what happened to result
+  void Run( Cache* cache, size_t requests, PhaseResult& result ) {
+    Cache::ObjectId objId( 16, 0 );
+    BinaryBuffer buffer;
+    const Clock::time_point begin( Clock::now() );
+    for ( size_t r = 0; r < requests; ++r ) {
+      // Spread the popular objects over the id space
+      const size_t n = ( ( workload_.alpha > 0 ? zipf_() : random_() % objects_ ) * 7919 ) % objects_;
+      std::memcpy( &objId[0], &n, sizeof( n ) );
+      Clock::time_point start( Clock::now() );
+      const bool hit = cache->readObject( objId, buffer );
+      Clock::time_point end( Clock::now() );
+      result.latencies[ hit ? "read_hit" : "read_miss" ].push_back( Microseconds( start, end ) );
+      if ( hit ) {
+        ++ result.hits;
+        result.bytesRead += buffer.size();
+        continue;
+      }
+      buffer.assign( payload_.begin(), payload_.begin() + ObjectSize( n ) );
+      start = Clock::now();
+      cache->writeObject( objId, buffer );
+      end = Clock::now();
+      result.latencies[ "write" ].push_back( Microseconds( start, end ) );
+      result.bytesWritten += buffer.size();
+    }
+    result.requests += requests;
+    result.seconds += boost::chrono::duration< double >( Clock::now() - begin ).count();
+  }
+
+  static double Microseconds( Clock::time_point start, Clock::time_point end ) {
+    return boost::chrono::duration< double, boost::micro >( end - start ).count();
+  }
+
+ private:
+  // The size of object n, the same every time it is written
+  size_t ObjectSize( size_t n ) const {
+    const uint32_t hash = static_cast< uint32_t >( n * 2654435761u );
+    unsigned percent = hash % 100;
+    const ObjectKind* kind = workload_.kinds;
+    while ( percent >= kind->share && kind + 1 != workload_.kinds + workload_.noOfKinds ) {
+      percent -= kind->share;
+      ++ kind;
+    }
+    const double position = ( hash >> 8 ) / static_cast< double >( 1 << 24 );
+    return static_cast< size_t >( kind->minSize * std::pow( static_cast< double >( kind->maxSize ) / kind->minSize, position ) );
+  }
+
+  const Workload& workload_;
+  size_t objects_;
+  ZipfGenerator zipf_;
+  boost::random::mt19937 random_;
+  BinaryBuffer payload_;
+};
+
+void PrintPhase( const std::string& name, const PhaseResult& result, bool last )
+{
+  std::cout << "        { \"phase\": \"" << name << "\", \"requests\": " << result.requests
+            << ", \"seconds\": " << std::fixed << std::setprecision( 3 ) << result.seconds
+            << ", \"ops_per_sec\": " << std::setprecision( 0 ) << ( result.seconds > 0 ? result.requests / result.seconds : 0.0 )
+            << ", \"hit_ratio\": " << std::setprecision( 4 ) << ( result.requests ? static_cast< double >( result.hits ) / result.requests : 0.0 )
+            << ", \"bytes_read\": " << result.bytesRead << ", \"bytes_written\": " << result.bytesWritten
+            << ", \"latency_us\": {";
+  for ( LatencyMap::const_iterator it = result.latencies.begin(); it != result.latencies.end(); ++it ) {
+    std::cout << ( it == result.latencies.begin() ? " " : ", " ) << "\"" << it->first << "\": ";
+    PrintLatencies( std::cout, it->second );
+  }
+  std::cout << " } }" << ( last ? "" : "," ) << std::endl;
+}
+
+// Runs client workloads against createCache and prints what happened as
+// JSON, to be kept and compared between versions. Every workload is
+// warmed up until the cache is full, then measured in steady state,
+// through a storm of prunes from setMaxSize shrinking the cache to a
+// quarter and back, and after reopening the cache from its meta data.
+void BenchWorkloads( const std::string& path, const BenchParameters& parameters )
+{
+  const size_t requests = GetParameter( parameters, "requests", 20000 );
+  const size_t storms = 4;
+  const BinaryBuffer key( GetBenchKey() );
+  CacheOptions options;
+  BenchParameters::const_iterator it( parameters.find( "storage" ) );
+  const bool segments = it != parameters.end() && it->second == "segments";
+  options.storage = segments ? CacheOptions::SegmentStorage : CacheOptions::FileStorage;
+  options.eviction = GetEviction( parameters, options.eviction );
+  options.shards = GetParameter( parameters, "shards", options.shards );
+  it = parameters.find( "workload" );
+  const std::string only( it != parameters.end() ? it->second : std::string() );
+
+  std::cout << "{ \"benchmark\": \"workloads\", \"storage\": \"" << ( segments ? "segments" : "files" )
+            << "\", \"eviction\": \"" << EvictionName( options.eviction ) << "\", \"shards\": " << options.shards
+            << ", \"requests\": " << requests << "," << std::endl;
+  std::cout << "  \"workloads\": [" << std::endl;
+  bool first = true;
+  for ( size_t w = 0; w < sizeof( workloads ) / sizeof( workloads[0] ); ++w ) {
+    const Workload& workload( workloads[w] );
+    if ( !only.empty() && only != workload.name ) {
+      continue;
+    }
+    const size_t objects = GetParameter( parameters, "objects", workload.objects );
+    const uint64_t maxSize = GetParameter( parameters, "maxsize", workload.maxSize );
+    const std::string workloadPath( OsConcatPath( path, "workloads" ) );
+    WorkloadClient client( workload, objects, 4711 );
+    boost::scoped_ptr< Cache > cache( createCache( workloadPath, key, options ) );
+    cache->setMaxSize( 0 );
+    cache->setMaxSize( maxSize );
+
+    PhaseResult warmup;
+    for ( size_t round = 0; round < 100 && cache->getCurrentSize() < maxSize * 9 / 10; ++round ) {
+      client.Run( cache.get(), requests / 4, warmup );
+    }
+    const uint64_t warmSize = cache->getCurrentSize();
+
+    PhaseResult steady;
+    client.Run( cache.get(), requests, steady );
+
+    PhaseResult storm;
+    for ( size_t i = 0; i < storms; ++i ) {
+      Clock::time_point start( Clock::now() );
+      cache->setMaxSize( maxSize / 4 );
+      storm.latencies[ "set_max_size" ].push_back( WorkloadClient::Microseconds( start, Clock::now() ) );
+      client.Run( cache.get(), requests / storms / 2, storm );
+      cache->setMaxSize( maxSize );
+      client.Run( cache.get(), requests / storms / 2, storm );
+    }
+
+    PhaseResult cold;
+    cache.reset();
+    Clock::time_point start( Clock::now() );
+    cache.reset( createCache( workloadPath, key, options ) );
+    cache->setMaxSize( maxSize );
+    cold.latencies[ "open" ].push_back( WorkloadClient::Microseconds( start, Clock::now() ) );
+    client.Run( cache.get(), requests, cold );
+
+    if ( !first ) {
+      std::cout << "," << std::endl;
+    }
+    first = false;
+    std::cout << "    { \"name\": \"" << workload.name << "\", \"objects\": " << objects
+              << ", \"distribution\": \"" << ( workload.alpha > 0 ? "zipf" : "uniform" ) << "\", \"alpha\": "
+              << std::fixed << std::setprecision( 2 ) << workload.alpha << ", \"max_size\": " << maxSize
+              << ", \"size_after_warmup\": " << warmSize << ", \"phases\": [" << std::endl;
+    PrintPhase( "warmup", warmup, false );
+    PrintPhase( "steady", steady, false );
+    PrintPhase( "prune_storm", storm, false );
+    PrintPhase( "cold_start", cold, true );
+    std::cout << "      ] }";
+    cache->setMaxSize( 0 );
+  }
+  std::cout << std::endl << "  ] }" << std::endl;
+}
+
+int main( int argc, char* argv[] )
+{
+  try {
+    const std::string path( argc > 1 ? argv[1] : defaultBenchPath );
+    OsEnsureDirectory( path );
+
+    // Any further arguments pick the benchmarks to run, or set parameters
+    // of the workloads
+    std::set< std::string > selected;
+    BenchParameters parameters;
+    for ( int i = 2; i < argc; ++i ) {
+      const std::string argument( argv[i] );
+      const size_t equals = argument.find( '=' );
+      if ( equals == std::string::npos ) {
+        selected.insert( argument );
+      } else {
+        parameters[ argument.substr( 0, equals ) ] = argument.substr( equals + 1 );
+      }
+    }
+    if ( selected.empty() || selected.count( "reads" ) ) {
+      BenchReadPaths( path );
+    }
+    if ( selected.empty() || selected.count( "storage" ) ) {
+      BenchStorage( path );
+    }
+    if ( selected.empty() || selected.count( "concurrency" ) ) {
+      BenchConcurrency( path );
+    }
+    if ( selected.empty() || selected.count( "lookups" ) ) {
+      BenchLookups( path );
+    }
+    if ( selected.empty() || selected.count( "index" ) ) {
+      BenchIndex();
+    }
+    if ( selected.empty() || selected.count( "eviction" ) ) {
+      BenchEviction( path );
+    }
+    if ( selected.empty() || selected.count( "startup" ) ) {
+      BenchStartup( path );
+    }
+    if ( selected.empty() || selected.count( "async" ) ) {
+      BenchAsync( path );
+    }
+    if ( selected.empty() || selected.count( "tier" ) ) {
+      BenchMemoryTier( path );
+    }
+    if ( selected.empty() || selected.count( "stream" ) ) {
+      BenchStream( path );
+    }
+    if ( selected.empty() || selected.count( "crypto" ) ) {
+      BenchCrypto( path );
+    }
+    if ( selected.empty() || selected.count( "range" ) ) {
+      BenchRange( path );
+    }
+    if ( selected.empty() || selected.count( "batch" ) ) {
+      BenchBatch( path );
+    }
+    if ( selected.empty() || selected.count( "compression" ) ) {
+      BenchCompression( path );
+    }
+    if ( selected.empty() || selected.count( "dedup" ) ) {
+      BenchDedup( path );
+    }
+    // Only on request, since it prints JSON rather than a table
+    if ( selected.count( "workloads" ) ) {
+      BenchWorkloads( path, parameters );
+    }
+  } catch( boost::exception& ex ) {
+    std::cerr << diagnostic_information( ex ) << std::endl;
+    return 1;
+  } catch( std::exception& ex ) {
+    std::cerr << ex.what() << std::endl;
+    return 1;
+  }
+  return 0;
+}
@@ -2,6 +2,10 @@
 #include "os.hpp"
 #include "cacheimpl.hpp"
 #include "crypt.hpp"
+#include "compress.hpp"
+#include "filestore.hpp"
+#include "segmentstore.hpp"
+#include "span.hpp"
 
 #define CATCH_RETURN()                                                  \
   catch( boost::exception& ex ) {                                       \
@@ -20,299 +24,2960 @@
     std::clog << "std::exception caught in " << __FILE__ << " line " << __LINE__ << "\n" <<  ex.what() << std::endl; \
   }
 
-CacheImpl::CacheImpl( const std::string& path, const std::vector< uint8_t >& encryption_key )
-    : path_( path ), encryptionKey_( encryption_key ), maxSize_( 500000000 ), currSize_( 0 )
+namespace
 {
+// The current time as kept in the index, in seconds since the epoch
+uint32_t Now()
+{
+  return static_cast< uint32_t >( std::time( 0 ) );
+}
+
+// The expiry of an object as kept in the index. Times beyond 2106 are
+// cut short, times before 1970 have already passed.
+uint32_t IndexExpiry( std::time_t expiry )
+{
+  if ( expiry < 0 ) {
+    return 1;
+  }
+  return static_cast< uint32_t >( std::min< uint64_t >( expiry, std::numeric_limits< uint32_t >::max() ) );
+}
+
+bool HasExpired( const ObjectIndex::Entry& entry )
+{
+  return entry.expiry_ != 0 && entry.expiry_ <= Now();
+}
+
+// Every priority of every partition has a policy, and every policy has
+// index queues of its own
+size_t PolicyOf( size_t partition, size_t priority )
+{
+  return partition * Cache::noOfPriorities + priority;
+}
+
+uint8_t PriorityOf( const ObjectIndex::Entry& entry )
+{
+  return static_cast< uint8_t >( entry.Queue() / policyQueues % Cache::noOfPriorities );
+}
+
+uint8_t PartitionOf( const ObjectIndex::Entry& entry )
+{
+  return static_cast< uint8_t >( entry.Queue() / policyQueues / Cache::noOfPriorities );
+}
+
+// Records are written in a chunked AEAD format, unless
+// CacheOptions::encryption asks for the legacy one. An AEAD record is a
+// header of a magic number, the format version and the algorithm, then
+// a nonce and the encrypted object id, then the object:
+//
+// Version 2 seals the whole object as one message, followed by its tag,
+// with the header and the object id as associated data.
+//
+// Version 3 splits the object into chunks of recordChunkSize, the last
+// one shorter, and seals each on its own, followed by its tag. A chunk's
+// nonce is the record's with its index added, and its associated data is
+// the header, the object id, the index and whether it is the last chunk,
+// so chunks can't be swapped, moved between records, or cut off at the
+// end. The object id is encrypted with the record's own nonce.
+//
+// Version 4 is version 3 with the object compressed. What is stored
+// starts with the codec and the size of the original object, in 8 bytes
+// big-endian, so the codec is authenticated along with the rest.
+//
+// Anything else is a legacy record: the SHA1 hash of the object, the
+// object id and the object, all RC4 encrypted.
+const uint8_t recordMagic[] = { 'C', 'C', 'A', 'E', 'A', 'D' };
+const uint8_t aeadRecordVersion = 2;
+const uint8_t chunkedRecordVersion = 3;
+const uint8_t compressedRecordVersion = 4;
+const uint8_t zlibCodec = 1;
+const size_t compressedHeaderSize = 1 + 8;
+const size_t recordHeaderSize = sizeof( recordMagic ) + 2;
+
+// The version of an AEAD record, or 0 for a legacy one
+uint8_t RecordVersion( const uint8_t* data, size_t size )
+{
+  if ( size < recordHeaderSize || !std::equal( recordMagic, recordMagic + sizeof( recordMagic ), data ) ) {
+    return 0;
+  }
+  const uint8_t version = data[ sizeof( recordMagic ) ];
+  return version >= aeadRecordVersion && version <= compressedRecordVersion ? version : 0;
+}
+
+bool IsAeadRecord( const uint8_t* data, size_t size )
+{
+  return RecordVersion( data, size ) != 0;
+}
+
+// The bytes before the object, in either format. Both happen to be the
+// same, which lets compaction find the object id without knowing the
+// format first.
+size_t AeadPrefixSize( size_t idSize )
+{
+  return recordHeaderSize + Crypt::Aead::nonceSize + idSize;
+}
+
+size_t LegacyPrefixSize( size_t idSize )
+{
+  return sizeof( Crypt::Sha1HashValue ) + idSize;
+}
+
+size_t RecordPrefixSize( size_t idSize )
+{
+  return std::max( AeadPrefixSize( idSize ), LegacyPrefixSize( idSize ) );
+}
+
+// Where the chunks of the object of a chunked record are
+struct ChunkLayout
+{
+  ChunkLayout( size_t prefixSize, uint64_t objectSize )
+      : prefixSize_( prefixSize ), objectSize_( objectSize ),
+        chunks_( std::max< uint64_t >( 1, ( objectSize + recordChunkSize - 1 ) / recordChunkSize ) ) {}
+
+  // The layout of a record of length bytes. False if there is none.
+  static bool FromRecord( size_t prefixSize, uint64_t length, ChunkLayout& layout )
+  {
+    if ( length < prefixSize + Crypt::Aead::tagSize ) {
+      return false;
+    }
+    const uint64_t sealedChunkSize = recordChunkSize + Crypt::Aead::tagSize;
+    const uint64_t full = ( length - prefixSize ) / sealedChunkSize;
+    const uint64_t rest = ( length - prefixSize ) % sealedChunkSize;
+    if ( rest != 0 && rest < Crypt::Aead::tagSize ) {
+      return false;
+    }
+    layout = ChunkLayout( prefixSize, full * recordChunkSize + ( rest ? rest - Crypt::Aead::tagSize : 0 ) );
+    return true;
+  }
+
+  uint64_t RecordSize() const { return prefixSize_ + objectSize_ + chunks_ * Crypt::Aead::tagSize; }
+  uint64_t Offset( uint64_t chunk ) const { return prefixSize_ + chunk * ( recordChunkSize + Crypt::Aead::tagSize ); }
+  size_t Size( uint64_t chunk ) const
+  {
+    return static_cast< size_t >( chunk + 1 < chunks_ ? recordChunkSize : objectSize_ - chunk * recordChunkSize );
+  }
+
+  size_t prefixSize_;
+  uint64_t objectSize_;
+  uint64_t chunks_;
+};
+
+// Starts sealing or opening a chunk of the chunked record whose header
+// and nonce begin prefix
+void StartChunk( Crypt::Aead& aead, bool encrypt, const uint8_t* prefix, const Cache::ObjectId& obj_id,
+                 uint64_t chunk, bool last, boost::scoped_ptr< Crypt::Aead::Operation >& operation )
+{
+  uint8_t nonce[ Crypt::Aead::nonceSize ];
+  std::copy( prefix + recordHeaderSize, prefix + recordHeaderSize + sizeof( nonce ), nonce );
+  // The record's own nonce encrypts the object id
+  uint64_t carry = chunk + 1;
+  for ( size_t i = sizeof( nonce ); i-- > 0 && carry; ) {
+    carry += nonce[i];
+    nonce[i] = static_cast< uint8_t >( carry );
+    carry >>= 8;
+  }
+  uint8_t position[ 9 ];
+  for ( size_t i = 0; i < 8; ++i ) {
+    position[i] = static_cast< uint8_t >( chunk >> ( 56 - 8 * i ) );
+  }
+  position[8] = last ? 1 : 0;
+
+  operation.reset( new Crypt::Aead::Operation( aead, encrypt, nonce ) );
+  operation->Authenticate( prefix, recordHeaderSize );
+  operation->Authenticate( obj_id.empty() ? 0 : &obj_id[0], obj_id.size() );
+  operation->Authenticate( position, sizeof( position ) );
+}
+
+// Encrypts size bytes of chunk into sealed, followed by the tag
+void SealChunk( Crypt::Aead& aead, const uint8_t* prefix, const Cache::ObjectId& obj_id, uint64_t chunk, bool last,
+                const uint8_t* in, size_t size, uint8_t* sealed )
+{
+  boost::scoped_ptr< Crypt::Aead::Operation > operation;
+  StartChunk( aead, true, prefix, obj_id, chunk, last, operation );
+  operation->Process( in, sealed, size );
+  operation->Seal( sealed + size );
+}
+
+// Decrypts a chunk of size bytes, followed by its tag, into out. False if
+// it doesn't match the tag.
+bool OpenChunk( Crypt::Aead& aead, const uint8_t* prefix, const Cache::ObjectId& obj_id, uint64_t chunk, bool last,
+                const uint8_t* sealed, size_t size, uint8_t* out )
+{
+  boost::scoped_ptr< Crypt::Aead::Operation > operation;
+  StartChunk( aead, false, prefix, obj_id, chunk, last, operation );
+  operation->Process( sealed, out, size );
+  return operation->Open( sealed + size );
+}
+
+// A ReadSink that appends to buffer
+void AppendChunk( std::vector< uint8_t >* buffer, const uint8_t* data, size_t size )
+{
+  buffer->insert( buffer->end(), data, data + size );
+}
+
+// Collects the results of the reads of a batch as they complete, on
+// whatever thread
+class BatchRead
+{
+ public:
+  BatchRead( std::vector< std::vector< uint8_t > >& results, std::vector< bool >& found )
+      : results_( results ), found_( found ), pending_( 0 ) {}
+
+  // Before every read is started
+  void Add()
+  {
+    boost::mutex::scoped_lock lock( mutex_ );
+    ++ pending_;
+  }
+
+  void Done( size_t index, bool ok, const std::vector< uint8_t >& value )
+  {
+    boost::mutex::scoped_lock lock( mutex_ );
+    if ( ok ) {
+      results_[ index ] = value;
+      found_[ index ] = true;
+    }
+    if ( -- pending_ == 0 ) {
+      finished_.notify_all();
+    }
+  }
+
+  void Wait()
+  {
+    boost::mutex::scoped_lock lock( mutex_ );
+    while ( pending_ ) {
+      finished_.wait( lock );
+    }
+  }
+
+ private:
+  std::vector< std::vector< uint8_t > >& results_;
+  std::vector< bool >& found_;
+  boost::mutex mutex_;
+  boost::condition_variable finished_;
+  size_t pending_;
+};
+
+// The data of a buffer, which may be empty
+const uint8_t* Begin( const std::vector< uint8_t >& buffer )
+{
+  return buffer.empty() ? 0 : &buffer[0];
+}
+
+uint8_t* Begin( std::vector< uint8_t >& buffer )
+{
+  return buffer.empty() ? 0 : &buffer[0];
+}
+
+// Compresses value for a version 4 record into compressed. False if it
+// isn't worth it: data that looks random isn't even tried, and the
+// result must save at least an eighth. Objects larger than a chunk
+// aren't compressed either, since reading one inflates all of it, so a
+// compressed record is never more than one chunk.
+bool CompressObject( const std::vector< uint8_t >& value, CacheOptions::Compression compression,
+                     std::vector< uint8_t >& compressed )
+{
+  if ( compression == CacheOptions::NoCompression || value.size() <= compressedHeaderSize ||
+       value.size() > recordChunkSize || Compress::SampledEntropy( &value[0], value.size() ) > 7.5 ) {
+    return false;
+  }
+  compressed.resize( compressedHeaderSize );
+  compressed[0] = zlibCodec;
+  for ( size_t i = 0; i < 8; ++i ) {
+    compressed[ 1 + i ] = static_cast< uint8_t >( static_cast< uint64_t >( value.size() ) >> ( 56 - 8 * i ) );
+  }
+  Compress::Deflate( &value[0], value.size(), compression == CacheOptions::FastCompression ? 1 : 9, compressed );
+  return compressed.size() <= value.size() - value.size() / 8;
+}
+
+// The object of what CompressObject made of it
+bool DecompressObject( const uint8_t* data, size_t size, std::vector< uint8_t >& result )
+{
+  if ( size < compressedHeaderSize || data[0] != zlibCodec ) {
+    return false;
+  }
+  uint64_t original = 0;
+  for ( size_t i = 0; i < 8; ++i ) {
+    original = ( original << 8 ) | data[ 1 + i ];
+  }
+  if ( original > std::numeric_limits< uint32_t >::max() ) {
+    return false;
+  }
+  result.resize( static_cast< size_t >( original ) );
+  return Compress::Inflate( data + compressedHeaderSize, size - compressedHeaderSize, Begin( result ), result.size() );
+}
+
+// Objects are pruned by priority first, then in the order their policy
+// put them in
+std::pair< size_t, uint64_t > PruneOrder( const ObjectIndex::Entry& entry )
+{
+  return std::make_pair( PriorityOf( entry ), entry.sequence_ );
+}
+
+// Hands a chunk of a streamed object to sink, adding its size to size
+void CountChunk( const Cache::ReadSink& sink, uint64_t& size, const uint8_t* data, size_t chunk )
+{
+  size += chunk;
+  sink( data, chunk );
+}
+
+// What a call is recorded as in a trace. False for the calls that
+// aren't traced.
+bool TraceOperation( CacheStats::Operation operation, TraceRecord::Operation& traced )
+{
+  switch ( operation ) {
+  case CacheStats::HasOperation:
+  case CacheStats::HasBatchOperation:
+    traced = TraceRecord::Has;
+    return true;
+  case CacheStats::ReadOperation:
+  case CacheStats::ReadBatchOperation:
+    traced = TraceRecord::Read;
+    return true;
+  case CacheStats::WriteOperation:
+  case CacheStats::WriteBatchOperation:
+    traced = TraceRecord::Write;
+    return true;
+  case CacheStats::EraseOperation:
+  case CacheStats::EraseBatchOperation:
+    traced = TraceRecord::Erase;
+    return true;
+  case CacheStats::SetMaxSizeOperation:
+    traced = TraceRecord::SetMaxSize;
+    return true;
+  default:
+    return false;
+  }
+}
+}
+
+CacheImpl::CacheImpl( const std::string& path, const std::vector< uint8_t >& encryption_key, const CacheOptions& options )
+    : path_( path ), encryptionKey_( encryption_key ), options_( options ), writeAead_( 0 ), segmentStore_( 0 ),
+      lookups_( 0 ), misses_( 0 ), integrityFailures_( 0 ), bytesRead_( 0 ), bytesWritten_( 0 ), deleteFailures_( 0 ),
+      shards_( new Shard[ std::max< size_t >( 1, options.shards ) ] ), noOfShards_( std::max< size_t >( 1, options.shards ) ),
+      partitions_( new Partition[ std::max< size_t >( 1, options.partitions.size() ) ] ),
+      noOfPartitions_( std::max< size_t >( 1, options.partitions.size() ) ),
+      expiryTimers_( Now() ), asyncInFlight_( 0 ), stagedBytes_( 0 ), stagingSequence_( 0 ), stopFlusher_( false ),
+      sequence_( 0 ), maxSize_( 500000000 ), currSize_( 0 ), reservedSize_( 0 ), nextWriter_( 0 ), objectCount_( 0 )
+{
+  if ( noOfPartitions_ * noOfPriorities * policyQueues > ObjectIndex::maxQueues ) {
+    throw std::invalid_argument( "Too many partitions" );
+  }
+  for ( size_t i = 0; i < options_.partitions.size(); ++i ) {
+    partitions_[i].name_ = options_.partitions[i].name;
+    partitions_[i].maxSize_ = options_.partitions[i].maxSize;
+    partitions_[i].compression_ = options_.partitions[i].compression;
+  }
+  if ( options_.partitions.empty() ) {
+    partitions_[0].maxSize_ = std::numeric_limits< uint64_t >::max();
+  }
+
+  // Records of any algorithm can be read, whatever new ones are written with
+  const Crypt::Aead::Algorithm algorithms[] = { Crypt::Aead::AesGcm, Crypt::Aead::ChaCha20Poly1305 };
+  for ( size_t i = 0; i < sizeof( algorithms ) / sizeof( algorithms[0] ); ++i ) {
+    if ( Crypt::Aead::Supported( algorithms[i] ) ) {
+      aeads_[ algorithms[i] ].reset( new Crypt::Aead( algorithms[i], encryptionKey_ ) );
+    }
+  }
+  switch ( options_.encryption ) {
+  case CacheOptions::AutoEncryption:
+    writeAead_ = aeads_[ Crypt::Aead::Fastest() ].get();
+    break;
+  case CacheOptions::AesGcmEncryption:
+    writeAead_ = aeads_[ Crypt::Aead::AesGcm ].get();
+    break;
+  case CacheOptions::ChaChaEncryption:
+    writeAead_ = aeads_[ Crypt::Aead::ChaCha20Poly1305 ].get();
+    break;
+  default:
+    break;
+  }
+  if ( !writeAead_ && options_.encryption != CacheOptions::Rc4Sha1Encryption ) {
+    throw std::invalid_argument( "Unsupported encryption" );
+  }
+
   // Create the cache directory
   OsEnsureDirectory( path );
+  RemoveTemporaries();
+
+  if ( options_.storage == CacheOptions::SegmentStorage ) {
+    segmentStore_ = new SegmentStore( path_, options_.segmentSize );
+    store_.reset( segmentStore_ );
+  } else {
+    store_.reset( new FileStore( path_ ) );
+  }
+
+  for ( size_t i = 0; i < noOfShards_; ++i ) {
+    for ( size_t policy = 0; policy < noOfPartitions_ * noOfPriorities; ++policy ) {
+      shards_[i].policies_.push_back( boost::shared_ptr< EvictionPolicy >(
+        CreateEvictionPolicy( options_.eviction, sequence_, policy * policyQueues ) ) );
+    }
+  }
+
+  if ( options_.memoryTierSize ) {
+    memoryTier_.reset( new MemoryTier( options_.memoryTierSize, options_.memoryTierEviction ) );
+  }
+  if ( !options_.traceFile.empty() ) {
+    trace_.reset( new TraceWriter( options_.traceFile ) );
+  }
+
+  journal_.reset( new MetaJournal( path_, encryptionKey_ ) );
   LoadMetaData();
+
+  if ( options_.writeBack ) {
+    flusher_.reset( new boost::thread( boost::bind( &CacheImpl::FlushStaged, this ) ) );
+  }
+  if ( segmentStore_ ) {
+    compactor_.reset( new boost::thread( boost::bind( &CacheImpl::CompactSegments, this ) ) );
+  }
+}
+
+
+void CacheImpl::RemoveTemporaries()
+{
+  OsDirectory temporary( OsConcatPath( path_, temporaryDirectory ) );
+  std::vector< std::string > names;
+  temporary.List( names );
+  for ( std::vector< std::string >::const_iterator it = names.begin(); it != names.end(); ++it ) {
+    try {
+      temporary.Delete( *it );
+    } catch ( OsDeleteFileException& ) {
+    }
+  }
+}
+
+
+CacheImpl::~CacheImpl()
+{
+  try {
+    {
+      boost::mutex::scoped_lock lock( asyncMutex_ );
+      while ( asyncInFlight_ ) {
+        asyncFinished_.wait( lock );
+      }
+    }
+    if ( readCollector_ ) {
+      readQueue_->Wake();
+      readCollector_->join();
+    }
+    workers_.reset();
+    if ( flusher_ ) {
+      // Everything staged is stored before the flusher stops
+      {
+        boost::mutex::scoped_lock lock( stagingMutex_ );
+        stopFlusher_ = true;
+      }
+      objectStaged_.notify_all();
+      flusher_->join();
+    }
+    if ( compactor_ ) {
+      segmentStore_->StopCompaction();
+      compactor_->join();
+    }
+    // The journal is up to date, apart from what is still buffered
+    journal_->Flush();
+  } CATCH();
+}
+
+size_t CacheImpl::ShardIndex( uint64_t fingerprint ) const
+{
+  // The shard's own tables use the low bits of the fingerprint, so pick
+  // the shard from the high bits.
+  return static_cast< size_t >( ( fingerprint >> 32 ) % noOfShards_ );
+}
+
+CacheImpl::Shard& CacheImpl::GetShard( uint64_t fingerprint )
+{
+  return shards_[ ShardIndex( fingerprint ) ];
+}
+
+void CacheImpl::GroupByShard( const std::vector< ObjectId >& obj_ids, const std::vector< size_t >& indices,
+                              std::vector< uint64_t >& fingerprints, std::vector< std::vector< size_t > >& groups )
+{
+  fingerprints.resize( obj_ids.size() );
+  groups.assign( noOfShards_, std::vector< size_t >() );
+  for ( std::vector< size_t >::const_iterator it = indices.begin(); it != indices.end(); ++ it ) {
+    fingerprints[ *it ] = Fingerprint( obj_ids[ *it ] );
+    groups[ ShardIndex( fingerprints[ *it ] ) ].push_back( *it );
+  }
+}
+
+uint64_t CacheImpl::StartCall() const
+{
+  return OsNanoseconds();
+}
+
+bool CacheImpl::EndCall( CacheStats::Operation operation, uint64_t start, const ObjectId& obj_id, uint64_t size, bool ok )
+{
+  if ( start == 0 ) {
+    // Not timed
+    CountObject( operation, size, ok );
+    return ok;
+  }
+  operations_[ operation ].Add( OsNanoseconds() - start );
+  CountObject( operation, size, ok );
+  TraceRecord::Operation traced;
+  if ( trace_ && TraceOperation( operation, traced ) ) {
+    try {
+      trace_->Add( traced, start / 1000, Fingerprint( obj_id ), ok ? size : 0, ok );
+    } CATCH();
+  }
+  return ok;
+}
+
+void CacheImpl::EndBatch( CacheStats::Operation operation, uint64_t start, const std::vector< ObjectId >& obj_ids,
+                          const std::vector< std::vector< uint8_t > >* values, const std::vector< bool >& ok )
+{
+  operations_[ operation ].Add( OsNanoseconds() - start );
+  TraceRecord::Operation traced;
+  const bool trace = trace_ && TraceOperation( operation, traced );
+  for ( size_t i = 0; i < obj_ids.size() && i < ok.size(); ++i ) {
+    const uint64_t size = values && i < values->size() ? ( *values )[i].size() : 0;
+    CountObject( operation, size, ok[i] );
+    if ( trace ) {
+      try {
+        trace_->Add( traced, start / 1000, Fingerprint( obj_ids[i] ), ok[i] ? size : 0, ok[i] );
+      } CATCH();
+    }
+  }
+}
+
+void CacheImpl::CountObject( CacheStats::Operation operation, uint64_t size, bool ok )
+{
+  switch ( operation ) {
+  case CacheStats::ReadOperation:
+  case CacheStats::ReadBatchOperation:
+  case CacheStats::ReadStreamOperation:
+  case CacheStats::ReadRangeOperation:
+  case CacheStats::ReadAsyncOperation:
+    // Hits are counted by partition, where they are found
+    if ( ok ) {
+      bytesRead_.fetch_add( size, boost::memory_order_relaxed );
+    } else {
+      misses_.fetch_add( 1, boost::memory_order_relaxed );
+    }
+    break;
+  case CacheStats::WriteOperation:
+  case CacheStats::WriteBatchOperation:
+  case CacheStats::WriteAsyncOperation:
+  case CacheStats::CommitOperation:
+    if ( ok ) {
+      bytesWritten_.fetch_add( size, boost::memory_order_relaxed );
+    }
+    break;
+  default:
+    break;
+  }
+}
+
+bool CacheImpl::hasObject( const ObjectId& obj_id )
+{
+  SPAN( "hasObject" );
+  // A lookup takes about as long as reading the clock twice, so only
+  // some are timed, unless every call is traced
+  const bool timed = trace_ || lookups_.fetch_add( 1, boost::memory_order_relaxed ) % timedLookups == 0;
+  const uint64_t start = timed ? StartCall() : 0;
+  return EndCall( CacheStats::HasOperation, start, obj_id, 0, HasObject( obj_id ) );
+}
+
+bool CacheImpl::readObject( const ObjectId& obj_id, std::vector< uint8_t >& result )
+{
+  SPAN( "readObject" );
+  const uint64_t start = StartCall();
+  const bool read = ReadObject( obj_id, result );
+  return EndCall( CacheStats::ReadOperation, start, obj_id, result.size(), read );
+}
+
+size_t CacheImpl::hasObjects( const std::vector< ObjectId >& obj_ids, std::vector< bool >& found )
+{
+  SPAN( "hasObjects" );
+  const uint64_t start = StartCall();
+  const size_t count = HasObjects( obj_ids, found );
+  EndBatch( CacheStats::HasBatchOperation, start, obj_ids, 0, found );
+  return count;
+}
+
+size_t CacheImpl::readObjects( const std::vector< ObjectId >& obj_ids, std::vector< std::vector< uint8_t > >& results,
+                               std::vector< bool >& found )
+{
+  SPAN( "readObjects" );
+  const uint64_t start = StartCall();
+  const size_t count = ReadObjects( obj_ids, results, found );
+  EndBatch( CacheStats::ReadBatchOperation, start, obj_ids, &results, found );
+  return count;
+}
+
+size_t CacheImpl::writeObjects( const std::vector< ObjectId >& obj_ids, const std::vector< std::vector< uint8_t > >& values,
+                                std::vector< bool >& written )
+{
+  SPAN( "writeObjects" );
+  const uint64_t start = StartCall();
+  const size_t count = WriteObjects( obj_ids, values, written );
+  EndBatch( CacheStats::WriteBatchOperation, start, obj_ids, &values, written );
+  return count;
+}
+
+size_t CacheImpl::eraseObjects( const std::vector< ObjectId >& obj_ids, std::vector< bool >& erased )
+{
+  SPAN( "eraseObjects" );
+  const uint64_t start = StartCall();
+  const size_t count = EraseObjects( obj_ids, erased );
+  EndBatch( CacheStats::EraseBatchOperation, start, obj_ids, 0, erased );
+  return count;
+}
+
+bool CacheImpl::HasObject( const ObjectId& obj_id )
+{
+  try {
+    const uint64_t fingerprint = Fingerprint( obj_id );
+    if ( GetShard( fingerprint ).presence_.Contains( fingerprint ) ) {
+      return true;
+    }
+    // A staged object is only in the index once it has been stored
+    boost::shared_ptr< const std::vector< uint8_t > > value;
+    size_t partition;
+    return options_.writeBack && FindStaged( obj_id, value, partition ) && value.get() != 0;
+  } CATCH_RETURN();
+}
+
+
+bool CacheImpl::FindObject( const ObjectId& obj_id, uint64_t fingerprint, StoreLocation& location, ObjectId& blobId,
+                            size_t& partition )
+{
+  Shard& shard( GetShard( fingerprint ) );
+  boost::mutex::scoped_lock lock( shard.mutex_ );
+  ObjectIndex::Entry* found( shard.objects_.Find( obj_id, fingerprint ) );
+  if ( !found ) {
+    return false;
+  }
+  if ( HasExpired( *found ) ) {
+    // Its timer just hasn't been handled yet
+    RemoveFromObjects( shard, obj_id, fingerprint, &location );
+    journal_->Append( JournalRecord( JournalRecord::Erase, obj_id ) );
+    EraseRecord( obj_id, location );
+    lock.unlock();
+    FlushJournal();
+    return false;
+  }
+  FindRecord( obj_id, *found, location, blobId );
+  partition = PartitionOf( *found );
+  shard.Policy( *found ).Accessed( shard.objects_, *found );
+  return true;
+}
+
+void CacheImpl::FindRecord( const ObjectId& obj_id, const ObjectIndex::Entry& entry, StoreLocation& location, ObjectId& blobId )
+{
+  location = entry.Location();
+  blobId.clear();
+  if ( location.length_ != 0 ) {
+    return;
+  }
+  // Deduplicated. A blob is only erased along with the last object
+  // pointing to it, which can't happen while its shard is locked.
+  boost::mutex::scoped_lock lock( blobMutex_ );
+  boost::unordered_map< ObjectId, ObjectId >::const_iterator link = links_.find( obj_id );
+  if ( link != links_.end() ) {
+    BlobMap::const_iterator blob = blobs_.find( link->second );
+    if ( blob != blobs_.end() ) {
+      location = blob->second.location_;
+      blobId = link->second;
+    }
+  }
+}
+
+bool CacheImpl::ReadObject( const ObjectId& obj_id, std::vector< uint8_t >& result )
+{
+  try {
+    if ( options_.writeBack ) {
+      boost::shared_ptr< const std::vector< uint8_t > > value;
+      size_t partition;
+      if ( FindStaged( obj_id, value, partition ) ) {
+        if ( !value ) {
+          return false;
+        }
+        result = *value;
+        ++ partitions_[ partition ].hits_;
+        return true;
+      }
+    }
+    const uint64_t fingerprint = Fingerprint( obj_id );
+    StoreLocation location;
+    ObjectId blobId;
+    size_t partition;
+    return FindObject( obj_id, fingerprint, location, blobId, partition ) &&
+           ReadFound( obj_id, fingerprint, location, blobId, partition, result );
+  } CATCH_RETURN();
+}
+
+size_t CacheImpl::HasObjects( const std::vector< ObjectId >& obj_ids, std::vector< bool >& found )
+{
+  found.assign( obj_ids.size(), false );
+  size_t count = 0;
+  try {
+    for ( size_t i = 0; i < obj_ids.size(); ++i ) {
+      const uint64_t fingerprint = Fingerprint( obj_ids[i] );
+      boost::shared_ptr< const std::vector< uint8_t > > value;
+      size_t partition;
+      if ( GetShard( fingerprint ).presence_.Contains( fingerprint ) ||
+           ( options_.writeBack && FindStaged( obj_ids[i], value, partition ) && value.get() != 0 ) ) {
+        found[i] = true;
+        ++ count;
+      }
+    }
+  } CATCH();
+  return count;
+}
+
+void CacheImpl::FindObjects( const std::vector< ObjectId >& obj_ids, const std::vector< size_t >& indices,
+                             std::vector< FoundObject >& found )
+{
+  std::vector< uint64_t > fingerprints;
+  std::vector< std::vector< size_t > > groups;
+  GroupByShard( obj_ids, indices, fingerprints, groups );
+  bool expired = false;
+  for ( size_t i = 0; i < noOfShards_; ++i ) {
+    if ( groups[i].empty() ) {
+      continue;
+    }
+    Shard& shard( shards_[i] );
+    boost::mutex::scoped_lock lock( shard.mutex_ );
+    for ( std::vector< size_t >::const_iterator it = groups[i].begin(); it != groups[i].end(); ++ it ) {
+      const ObjectId& objId( obj_ids[ *it ] );
+      ObjectIndex::Entry* entry( shard.objects_.Find( objId, fingerprints[ *it ] ) );
+      if ( !entry ) {
+        continue;
+      }
+      if ( HasExpired( *entry ) ) {
+        StoreLocation location;
+        RemoveFromObjects( shard, objId, fingerprints[ *it ], &location );
+        journal_->Append( JournalRecord( JournalRecord::Erase, objId ) );
+        EraseRecord( objId, location );
+        expired = true;
+        continue;
+      }
+      found.push_back( FoundObject() );
+      FoundObject& object( found.back() );
+      object.index_ = *it;
+      object.fingerprint_ = fingerprints[ *it ];
+      FindRecord( objId, *entry, object.location_, object.blobId_ );
+      object.partition_ = PartitionOf( *entry );
+      shard.Policy( *entry ).Accessed( shard.objects_, *entry );
+    }
+  }
+  if ( expired ) {
+    FlushJournal();
+  }
 }
 
+size_t CacheImpl::ReadObjects( const std::vector< ObjectId >& obj_ids, std::vector< std::vector< uint8_t > >& results,
+                               std::vector< bool >& found )
+{
+  results.clear();
+  results.resize( obj_ids.size() );
+  found.assign( obj_ids.size(), false );
+  try {
+    std::vector< size_t > stored;
+    for ( size_t i = 0; i < obj_ids.size(); ++i ) {
+      boost::shared_ptr< const std::vector< uint8_t > > value;
+      size_t partition;
+      if ( options_.writeBack && FindStaged( obj_ids[i], value, partition ) ) {
+        if ( value ) {
+          results[i] = *value;
+          found[i] = true;
+          ++ partitions_[ partition ].hits_;
+        }
+      } else {
+        stored.push_back( i );
+      }
+    }
+    std::vector< FoundObject > objects;
+    FindObjects( obj_ids, stored, objects );
+
+    // With a single core, handing the reads over to other threads costs
+    // more than overlapping them gains
+    const bool overlap = objects.size() > 1 && boost::thread::hardware_concurrency() > 1;
+    if ( overlap ) {
+      StartWorkers();
+    }
+    if ( !overlap || !readCollector_ ) {
+      for ( std::vector< FoundObject >::const_iterator it = objects.begin(); it != objects.end(); ++ it ) {
+        try {
+          found[ it->index_ ] = ReadFound( obj_ids[ it->index_ ], it->fingerprint_, it->location_, it->blobId_,
+                                           it->partition_, results[ it->index_ ] );
+        } CATCH();
+      }
+    } else {
+      // All reads go to the ring at once, as far as the queue depth
+      // allows, and are decrypted on the workers
+      BatchRead batch( results, found );
+      try {
+        for ( std::vector< FoundObject >::const_iterator it = objects.begin(); it != objects.end(); ++ it ) {
+          StartAsync();
+          batch.Add();
+          SubmitRead( obj_ids[ it->index_ ], it->fingerprint_, it->location_, it->blobId_, it->partition_,
+                      boost::bind( &BatchRead::Done, &batch, it->index_, _1, _2 ) );
+        }
+      } CATCH();
+      batch.Wait();
+    }
+  } CATCH();
+  return static_cast< size_t >( std::count( found.begin(), found.end(), true ) );
+}
+
+bool CacheImpl::ReadFound( const ObjectId& obj_id, uint64_t fingerprint, StoreLocation location, ObjectId blobId,
+                           size_t partition, std::vector< uint8_t >& result )
+{
+  if ( memoryTier_ && memoryTier_->Get( obj_id, fingerprint, location, result ) ) {
+    ++ partitions_[ partition ].hits_;
+    return true;
+  }
+
+  Shard& shard( GetShard( fingerprint ) );
+  for ( ;; ) {
+    // Read and decrypt without holding the lock
+    bool valid = false;
+    bool gone = false;
+    try {
+      const ObjectId& recordId( blobId.empty() ? obj_id : blobId );
+      StoredRecord record;
+      {
+        StageTimer timer( stages_[ CacheStats::FileReadStage ] );
+        store_->Read( recordId, location, record );
+      }
+      valid = DecodeObject( recordId, record.data(), record.size(), result );
+    } catch ( OsReadFileException& ) {
+      // The record is gone, e.g. the file was deleted behind our back
+      gone = true;
+    }
+    if ( valid ) {
+      ++ partitions_[ partition ].hits_;
+      if ( memoryTier_ ) {
+        memoryTier_->Put( obj_id, fingerprint, location, result );
+      }
+      return true;
+    }
+
+    boost::mutex::scoped_lock lock( shard.mutex_ );
+    const ObjectIndex::Entry* found( shard.objects_.Find( obj_id, fingerprint ) );
+    if ( !found ) {
+      return false;
+    }
+    StoreLocation current;
+    ObjectId currentBlob;
+    FindRecord( obj_id, *found, current, currentBlob );
+    if ( !( current == location ) || currentBlob != blobId ) {
+      // Written again or moved by the compactor while we were reading
+      location = current;
+      blobId.swap( currentBlob );
+      continue;
+    }
+
+    // Drop the object
+    if ( !gone ) {
+      ++ integrityFailures_;
+    }
+    RemoveFromObjects( shard, obj_id, fingerprint );
+    journal_->Append( JournalRecord( JournalRecord::Erase, obj_id ) );
+    break;
+  }
+  FlushJournal();
+  return false;
+}
+
+bool CacheImpl::readObjectStream( const ObjectId& obj_id, const ReadSink& sink )
+{
+  SPAN( "readObjectStream" );
+  const uint64_t start = StartCall();
+  uint64_t size = 0;
+  const bool read = ReadObjectStream( obj_id, boost::bind( &CountChunk, boost::cref( sink ), boost::ref( size ), _1, _2 ) );
+  return EndCall( CacheStats::ReadStreamOperation, start, obj_id, size, read );
+}
+
+bool CacheImpl::ReadObjectStream( const ObjectId& obj_id, const ReadSink& sink )
+{
+  try {
+    if ( options_.writeBack ) {
+      boost::shared_ptr< const std::vector< uint8_t > > value;
+      size_t partition;
+      if ( FindStaged( obj_id, value, partition ) ) {
+        if ( !value ) {
+          return false;
+        }
+        for ( size_t done = 0; done < value->size(); done += streamChunkSize ) {
+          sink( &( *value )[ done ], std::min( streamChunkSize, value->size() - done ) );
+        }
+        ++ partitions_[ partition ].hits_;
+        return true;
+      }
+    }
+
+    return ReadStored( obj_id, boost::bind( &CacheImpl::StreamObject, this, _1, _2, boost::cref( sink ), _3 ) );
+  } CATCH_RETURN();
+}
+
+bool CacheImpl::readObjectRange( const ObjectId& obj_id, uint64_t offset, uint64_t length, std::vector< uint8_t >& result )
+{
+  SPAN( "readObjectRange" );
+  const uint64_t start = StartCall();
+  const bool read = ReadObjectRange( obj_id, offset, length, result );
+  return EndCall( CacheStats::ReadRangeOperation, start, obj_id, result.size(), read );
+}
+
+bool CacheImpl::ReadObjectRange( const ObjectId& obj_id, uint64_t offset, uint64_t length, std::vector< uint8_t >& result )
+{
+  try {
+    if ( options_.writeBack ) {
+      boost::shared_ptr< const std::vector< uint8_t > > value;
+      size_t partition;
+      if ( FindStaged( obj_id, value, partition ) ) {
+        if ( !value || offset > value->size() ) {
+          return false;
+        }
+        const size_t begin = static_cast< size_t >( offset );
+        const size_t end = begin + static_cast< size_t >( std::min< uint64_t >( length, value->size() - begin ) );
+        result.assign( value->begin() + begin, value->begin() + end );
+        ++ partitions_[ partition ].hits_;
+        return true;
+      }
+    }
+
+    bool inRange = true;
+    return ReadStored( obj_id, boost::bind( &CacheImpl::RangeObject, this, _1, _2, offset, length, boost::ref( result ),
+                                            boost::ref( inRange ), _3 ) ) && inRange;
+  } CATCH_RETURN();
+}
+
+bool CacheImpl::ReadStored( const ObjectId& obj_id, const StoredRead& read )
+{
+  const uint64_t fingerprint = Fingerprint( obj_id );
+  Shard& shard( GetShard( fingerprint ) );
+  StoreLocation location;
+  ObjectId blobId;
+  size_t partition;
+  if ( !FindObject( obj_id, fingerprint, location, blobId, partition ) ) {
+    return false;
+  }
+
+  for ( ;; ) {
+    bool valid = false;
+    bool delivered = false;
+    bool gone = false;
+    try {
+      valid = read( blobId.empty() ? obj_id : blobId, location, delivered );
+    } catch ( OsReadFileException& ) {
+      // The record is gone, or shorter than it should be
+      gone = true;
+    }
+    if ( valid ) {
+      ++ partitions_[ partition ].hits_;
+      return true;
+    }
+
+    boost::mutex::scoped_lock lock( shard.mutex_ );
+    const ObjectIndex::Entry* found( shard.objects_.Find( obj_id, fingerprint ) );
+    if ( !found ) {
+      return false;
+    }
+    StoreLocation current;
+    ObjectId currentBlob;
+    FindRecord( obj_id, *found, current, currentBlob );
+    if ( !( current == location ) || currentBlob != blobId ) {
+      // Written again or moved while we were reading. Start over,
+      // unless part of the old version has been handed over.
+      if ( delivered ) {
+        return false;
+      }
+      location = current;
+      blobId.swap( currentBlob );
+      continue;
+    }
+
+    // Drop the object
+    if ( !gone ) {
+      ++ integrityFailures_;
+    }
+    RemoveFromObjects( shard, obj_id, fingerprint );
+    journal_->Append( JournalRecord( JournalRecord::Erase, obj_id ) );
+    break;
+  }
+  FlushJournal();
+  return false;
+}
+
+bool CacheImpl::StreamObject( const ObjectId& obj_id, const StoreLocation& location, const ReadSink& sink, bool& delivered )
+{
+  if ( location.length_ < recordHeaderSize ) {
+    return false;
+  }
+  std::string filename;
+  uint64_t offset;
+  store_->Locate( obj_id, location, filename, offset );
+  OsFile file( filename, false );
+
+  uint8_t header[ recordHeaderSize ];
+  file.ReadAt( offset, header, recordHeaderSize );
+  const uint8_t version = RecordVersion( header, recordHeaderSize );
+  if ( !version ) {
+    return StreamLegacyObject( obj_id, file, offset, location.length_, sink, delivered );
+  }
+  const size_t prefixSize( AeadPrefixSize( obj_id.size() ) );
+  if ( location.length_ < prefixSize + Crypt::Aead::tagSize ) {
+    return false;
+  }
+
+  if ( version >= chunkedRecordVersion ) {
+    // Every chunk is verified before it is handed over. A compressed
+    // object is at most a chunk, so it is inflated in one go.
+    std::vector< uint8_t > compressed;
+    std::vector< uint8_t > prefix( prefixSize );
+    file.ReadAt( offset, &prefix[0], prefixSize );
+    Crypt::Aead* aead = RecordAead( &prefix[0] );
+    ChunkLayout layout( 0, 0 );
+    if ( !aead || !ChunkLayout::FromRecord( prefixSize, location.length_, layout ) ) {
+      return false;
+    }
+    std::vector< uint8_t > buffer( std::min< uint64_t >( layout.objectSize_, recordChunkSize ) + Crypt::Aead::tagSize );
+    for ( uint64_t chunk = 0; chunk < layout.chunks_; ++chunk ) {
+      const size_t size = layout.Size( chunk );
+      file.ReadAt( offset + layout.Offset( chunk ), &buffer[0], size + Crypt::Aead::tagSize );
+      if ( !OpenChunk( *aead, &prefix[0], obj_id, chunk, chunk + 1 == layout.chunks_, &buffer[0], size, &buffer[0] ) ) {
+        return false;
+      }
+      if ( version == compressedRecordVersion ) {
+        compressed.insert( compressed.end(), buffer.begin(), buffer.begin() + size );
+      } else if ( size ) {
+        sink( &buffer[0], size );
+        delivered = true;
+      }
+    }
+    if ( version == compressedRecordVersion ) {
+      if ( !DecompressObject( Begin( compressed ), compressed.size(), buffer ) ) {
+        return false;
+      }
+      for ( size_t offset = 0; offset < buffer.size(); offset += streamChunkSize ) {
+        sink( &buffer[ offset ], std::min( streamChunkSize, buffer.size() - offset ) );
+        delivered = true;
+      }
+    }
+    return true;
+  }
+
+  std::vector< uint8_t > buffer( std::max( prefixSize, std::min< size_t >( streamChunkSize, location.length_ ) ) );
+  file.ReadAt( offset, &buffer[0], prefixSize );
+  boost::scoped_ptr< Crypt::Aead::Operation > operation;
+  if ( !OpenRecord( obj_id, &buffer[0], operation ) ) {
+    return false;
+  }
+
+  // Then the object, in one pass over the buffer, and the tag
+  const uint64_t end = location.length_ - Crypt::Aead::tagSize;
+  for ( uint64_t done = prefixSize; done < end; ) {
+    const size_t size = static_cast< size_t >( std::min< uint64_t >( buffer.size(), end - done ) );
+    file.ReadAt( offset + done, &buffer[0], size );
+    operation->Process( &buffer[0], &buffer[0], size );
+    sink( &buffer[0], size );
+    delivered = true;
+    done += size;
+  }
+  uint8_t tag[ Crypt::Aead::tagSize ];
+  file.ReadAt( offset + end, tag, sizeof( tag ) );
+  return operation->Open( tag );
+}
+
+bool CacheImpl::RangeObject( const ObjectId& obj_id, const StoreLocation& location, uint64_t offset, uint64_t length,
+                             std::vector< uint8_t >& result, bool& inRange, bool& delivered )
+{
+  const size_t prefixSize( AeadPrefixSize( obj_id.size() ) );
+  std::vector< uint8_t > prefix;
+  ChunkLayout layout( 0, 0 );
+  std::string filename;
+  uint64_t fileOffset;
+  store_->Locate( obj_id, location, filename, fileOffset );
+  OsFile file( filename, false );
+  if ( location.length_ >= prefixSize ) {
+    prefix.resize( prefixSize );
+    file.ReadAt( fileOffset, &prefix[0], prefixSize );
+  }
+  if ( RecordVersion( Begin( prefix ), prefix.size() ) != chunkedRecordVersion ) {
+    // The whole record has to be read to check it, but only the range is kept
+    std::vector< uint8_t > object;
+    if ( !StreamObject( obj_id, location, boost::bind( &AppendChunk, &object, _1, _2 ), delivered ) ) {
+      return false;
+    }
+    if ( offset > object.size() ) {
+      inRange = false;
+      return true;
+    }
+    const size_t begin = static_cast< size_t >( offset );
+    const size_t end = begin + static_cast< size_t >( std::min< uint64_t >( length, object.size() - begin ) );
+    result.assign( object.begin() + begin, object.begin() + end );
+    return true;
+  }
+  Crypt::Aead* aead = RecordAead( &prefix[0] );
+  if ( !aead || !ChunkLayout::FromRecord( prefixSize, location.length_, layout ) ) {
+    return false;
+  }
+  if ( offset > layout.objectSize_ ) {
+    inRange = false;
+    return true;
+  }
+
+  // Read and verify the chunks the range overlaps, at least one
+  length = std::min( length, layout.objectSize_ - offset );
+  const uint64_t first = std::min( offset / recordChunkSize, layout.chunks_ - 1 );
+  const uint64_t last = length ? ( offset + length - 1 ) / recordChunkSize : first;
+  result.resize( static_cast< size_t >( length ) );
+  std::vector< uint8_t > buffer( std::min< uint64_t >( layout.objectSize_, recordChunkSize ) + Crypt::Aead::tagSize );
+  for ( uint64_t chunk = first; chunk <= last; ++chunk ) {
+    const size_t size = layout.Size( chunk );
+    file.ReadAt( fileOffset + layout.Offset( chunk ), &buffer[0], size + Crypt::Aead::tagSize );
+    if ( !OpenChunk( *aead, &prefix[0], obj_id, chunk, chunk + 1 == layout.chunks_, &buffer[0], size, &buffer[0] ) ) {
+      return false;
+    }
+    // The part of the chunk that is in the range
+    const uint64_t chunkBegin = chunk * recordChunkSize;
+    const uint64_t begin = std::max( offset, chunkBegin );
+    const uint64_t end = std::min( offset + length, chunkBegin + size );
+    if ( begin < end ) {
+      std::copy( buffer.begin() + static_cast< size_t >( begin - chunkBegin ), buffer.begin() + static_cast< size_t >( end - chunkBegin ),
+                 result.begin() + static_cast< size_t >( begin - offset ) );
+    }
+  }
+  return true;
+}
+
+bool CacheImpl::StreamLegacyObject( const ObjectId& obj_id, OsFile& file, uint64_t offset, uint64_t length,
+                                    const ReadSink& sink, bool& delivered )
+{
+  const size_t headerSize( LegacyPrefixSize( obj_id.size() ) );
+  if ( length <= headerSize ) {
+    return false;
+  }
+
+  // The header holds the hash and the object id, like in DecodeObject
+  Crypt::Rc4Cipher cipher( encryptionKey_ );
+  std::vector< uint8_t > buffer( std::max( headerSize, static_cast< size_t >( std::min< uint64_t >( streamChunkSize, length ) ) ) );
+  file.ReadAt( offset, &buffer[0], headerSize );
+  cipher.Process( &buffer[0], &buffer[0], headerSize );
+  Crypt::Sha1HashValue hash;
+  std::copy( buffer.begin(), buffer.begin() + hash.size(), hash.begin() );
+  if ( !std::equal( obj_id.begin(), obj_id.end(), buffer.begin() + hash.size() ) ) {
+    return false;
+  }
+
+  // Then the payload, in one pass over the buffer
+  Crypt::Sha1Hasher hasher;
+  for ( uint64_t done = headerSize; done < length; ) {
+    const size_t size = static_cast< size_t >( std::min< uint64_t >( buffer.size(), length - done ) );
+    file.ReadAt( offset + done, &buffer[0], size );
+    cipher.Process( &buffer[0], &buffer[0], size );
+    hasher.Update( &buffer[0], size );
+    sink( &buffer[0], size );
+    delivered = true;
+    done += size;
+  }
+  return hasher.Final() == hash;
+}
+
+void CacheImpl::StartWorkers()
+{
+  const size_t depth = std::max< size_t >( 1, options_.asyncQueueDepth );
+  boost::mutex::scoped_lock lock( asyncMutex_ );
+  if ( !workers_ ) {
+    workers_.reset( new WorkerPool( options_.asyncThreads, depth ) );
+    readQueue_.reset( new OsReadQueue( depth ) );
+    if ( readQueue_->Available() ) {
+      readCollector_.reset( new boost::thread( boost::bind( &CacheImpl::CollectReads, this ) ) );
+    }
+  }
+}
+
+void CacheImpl::StartAsync()
+{
+  StartWorkers();
+  const size_t depth = std::max< size_t >( 1, options_.asyncQueueDepth );
+  boost::mutex::scoped_lock lock( asyncMutex_ );
+  while ( asyncInFlight_ >= depth ) {
+    asyncFinished_.wait( lock );
+  }
+  ++ asyncInFlight_;
+}
+
+void CacheImpl::FinishAsync()
+{
+  boost::mutex::scoped_lock lock( asyncMutex_ );
+  -- asyncInFlight_;
+  asyncFinished_.notify_all();
+}
+
+void CacheImpl::readObjectAsync( const ObjectId& obj_id, const ReadCallback& callback )
+{
+  const ReadCallback done( boost::bind( &CacheImpl::EndAsyncRead, this, StartCall(), obj_id, callback, _1, _2 ) );
+  StartAsync();
+  if ( !readCollector_ ) {
+    // No io_uring, so a worker reads the way readObject does
+    workers_->Submit( boost::bind( &CacheImpl::RunRead, this, obj_id, done ) );
+    return;
+  }
+
+  try {
+    boost::shared_ptr< const std::vector< uint8_t > > value;
+    size_t partition;
+    if ( options_.writeBack && FindStaged( obj_id, value, partition ) ) {
+      // Nothing to wait for
+      if ( value ) {
+        ++ partitions_[ partition ].hits_;
+      }
+      try {
+        done( value.get() != 0, value ? *value : std::vector< uint8_t >() );
+      } CATCH();
+      FinishAsync();
+      return;
+    }
+
+    const uint64_t fingerprint = Fingerprint( obj_id );
+    StoreLocation location;
+    ObjectId blobId;
+    if ( FindObject( obj_id, fingerprint, location, blobId, partition ) ) {
+      SubmitRead( obj_id, fingerprint, location, blobId, partition, done );
+      return;
+    }
+  } CATCH();
+
+  try {
+    done( false, std::vector< uint8_t >() );
+  } CATCH();
+  FinishAsync();
+}
+
+void CacheImpl::EndAsyncRead( uint64_t start, const ObjectId& obj_id, const ReadCallback& done, bool ok,
+                              const std::vector< uint8_t >& value )
+{
+  EndCall( CacheStats::ReadAsyncOperation, start, obj_id, value.size(), ok );
+  done( ok, value );
+}
+
+void CacheImpl::SubmitRead( const ObjectId& obj_id, uint64_t fingerprint, const StoreLocation& location, const ObjectId& blobId,
+                            size_t partition, const ReadCallback& done )
+{
+  AsyncRead* read = 0;
+  try {
+    std::vector< uint8_t > result;
+    if ( memoryTier_ && memoryTier_->Get( obj_id, fingerprint, location, result ) ) {
+      ++ partitions_[ partition ].hits_;
+      try {
+        done( true, result );
+      } CATCH();
+      FinishAsync();
+      return;
+    }
+
+    read = new AsyncRead;
+    read->objId_ = obj_id;
+    read->fingerprint_ = fingerprint;
+    read->location_ = location;
+    read->blobId_ = blobId;
+    read->partition_ = partition;
+    read->buffer_.resize( location.length_ );
+    read->done_ = done;
+    std::string filename;
+    uint64_t offset;
+    store_->Locate( blobId.empty() ? obj_id : blobId, location, filename, offset );
+    if ( readQueue_->Read( filename, offset, read->buffer_.empty() ? 0 : &read->buffer_[0], read->buffer_.size(), read ) ) {
+      return;
+    }
+    // Not there any more, or the ring is busy. The synchronous path
+    // knows how to deal with either.
+    delete read;
+    read = 0;
+    workers_->Submit( boost::bind( &CacheImpl::RunRead, this, obj_id, done ) );
+    return;
+  } CATCH();
+  delete read;
+
+  try {
+    done( false, std::vector< uint8_t >() );
+  } CATCH();
+  FinishAsync();
+}
+
+void CacheImpl::CollectReads()
+{
+  for ( ;; ) {
+    bool ok = false;
+    AsyncRead* read = static_cast< AsyncRead* >( readQueue_->Wait( ok ) );
+    if ( !read ) {
+      // Woken up by the destructor
+      return;
+    }
+    workers_->Submit( boost::bind( &CacheImpl::CompleteRead, this, read, ok ) );
+  }
+}
+
+void CacheImpl::CompleteRead( AsyncRead* read, bool ok )
+{
+  SPAN( "CompleteRead" );
+  std::vector< uint8_t > result;
+  bool valid = false;
+  try {
+    valid = ok && DecodeObject( read->blobId_.empty() ? read->objId_ : read->blobId_, &read->buffer_[0], read->buffer_.size(),
+                                result );
+    if ( valid ) {
+      ++ partitions_[ read->partition_ ].hits_;
+      if ( memoryTier_ ) {
+        memoryTier_->Put( read->objId_, read->fingerprint_, read->location_, result );
+      }
+    } else {
+      // Written again, moved by the compactor, or damaged. ReadObject
+      // retries or drops the object as needed.
+      valid = ReadObject( read->objId_, result );
+    }
+  } CATCH();
+  try {
+    read->done_( valid, result );
+  } CATCH();
+  delete read;
+  FinishAsync();
+}
+
+void CacheImpl::RunRead( const ObjectId& obj_id, const ReadCallback& done )
+{
+  SPAN( "RunRead" );
+  std::vector< uint8_t > result;
+  const bool valid = ReadObject( obj_id, result );
+  try {
+    done( valid, result );
+  } CATCH();
+  FinishAsync();
+}
+
+void CacheImpl::writeObjectAsync( const ObjectId& obj_id, const std::vector< uint8_t >& value, const WriteCallback& done )
+{
+  StartAsync();
+  workers_->Submit( boost::bind( &CacheImpl::RunWrite, this, StartCall(), obj_id, value, done ) );
+}
+
+void CacheImpl::RunWrite( uint64_t start, const ObjectId& obj_id, const std::vector< uint8_t >& value, const WriteCallback& done )
+{
+  SPAN( "RunWrite" );
+  const bool written = EndCall( CacheStats::WriteAsyncOperation, start, obj_id, value.size(),
+                                WriteObject( obj_id, value, 0, 0, NormalPriority ) );
+  try {
+    done( written );
+  } CATCH();
+  FinishAsync();
+}
+
+void CacheImpl::EncodeObject( const ObjectId& obj_id, const std::vector< uint8_t >& value, std::vector< uint8_t >& buffer,
+                              bool compressed )
+{
+  SPAN( "EncodeObject" );
+  if ( writeAead_ ) {
+    // One pass encrypts and authenticates every chunk
+    StageTimer timer( stages_[ CacheStats::EncryptStage ] );
+    const ChunkLayout layout( AeadPrefixSize( obj_id.size() ), value.size() );
+    buffer.resize( static_cast< size_t >( layout.RecordSize() ) );
+    WriteRecordPrefix( obj_id, &buffer[0], compressed );
+    for ( uint64_t chunk = 0; chunk < layout.chunks_; ++chunk ) {
+      SealChunk( *writeAead_, &buffer[0], obj_id, chunk, chunk + 1 == layout.chunks_,
+                 Begin( value ) + chunk * recordChunkSize, layout.Size( chunk ), &buffer[ layout.Offset( chunk ) ] );
+    }
+    return;
+  }
+
+  // Calculate hash signature
+  Crypt::Sha1HashValue hash;
+  {
+    StageTimer timer( stages_[ CacheStats::HashStage ] );
+    hash = Crypt::Sha1Hash( value );
+  }
+
+  // Write a buffer that contains the signature + the object
+  std::vector< uint8_t >::iterator iter;
+  buffer.resize( sizeof( Crypt::Sha1HashValue ) + obj_id.size() + value.size() );
+  iter = std::copy( hash.begin(), hash.end(), buffer.begin() );
+  iter = std::copy( obj_id.begin(), obj_id.end(), iter );
+  iter = std::copy( value.begin(), value.end(), iter );
+
+  // Now, encrypt the buffer
+  StageTimer timer( stages_[ CacheStats::EncryptStage ] );
+  Crypt::Rc4EncryptDecrypt( encryptionKey_, buffer );
+}
+
+bool CacheImpl::DecodeObject( const ObjectId& obj_id, const uint8_t* data, size_t size, std::vector< uint8_t >& result )
+{
+  SPAN( "DecodeObject" );
+  const uint8_t version = RecordVersion( data, size );
+  if ( !version ) {
+    return DecodeLegacyObject( obj_id, data, size, result );
+  }
+  const size_t prefixSize( AeadPrefixSize( obj_id.size() ) );
+  if ( size < prefixSize + Crypt::Aead::tagSize ) {
+    return false;
+  }
+  if ( version >= chunkedRecordVersion ) {
+    Crypt::Aead* aead = RecordAead( data );
+    ChunkLayout layout( 0, 0 );
+    if ( !aead || !ChunkLayout::FromRecord( prefixSize, size, layout ) ) {
+      return false;
+    }
+    std::vector< uint8_t > compressed;
+    std::vector< uint8_t >& stored( version == compressedRecordVersion ? compressed : result );
+    stored.resize( static_cast< size_t >( layout.objectSize_ ) );
+    {
+      StageTimer timer( stages_[ CacheStats::DecryptStage ] );
+      for ( uint64_t chunk = 0; chunk < layout.chunks_; ++chunk ) {
+        if ( !OpenChunk( *aead, data, obj_id, chunk, chunk + 1 == layout.chunks_, data + layout.Offset( chunk ),
+                         layout.Size( chunk ), Begin( stored ) + chunk * recordChunkSize ) ) {
+          return false;
+        }
+      }
+    }
+    if ( version != compressedRecordVersion ) {
+      return true;
+    }
+    StageTimer timer( stages_[ CacheStats::DecompressStage ] );
+    return DecompressObject( Begin( compressed ), compressed.size(), result );
+  }
+
+  StageTimer timer( stages_[ CacheStats::DecryptStage ] );
+  boost::scoped_ptr< Crypt::Aead::Operation > operation;
+  if ( !OpenRecord( obj_id, data, operation ) ) {
+    return false;
+  }
+  result.resize( size - prefixSize - Crypt::Aead::tagSize );
+  operation->Process( data + prefixSize, Begin( result ), result.size() );
+  return operation->Open( data + size - Crypt::Aead::tagSize );
+}
+
+void CacheImpl::WriteRecordPrefix( const ObjectId& obj_id, uint8_t* prefix, bool compressed )
+{
+  std::copy( recordMagic, recordMagic + sizeof( recordMagic ), prefix );
+  prefix[ sizeof( recordMagic ) ] = compressed ? compressedRecordVersion : chunkedRecordVersion;
+  prefix[ sizeof( recordMagic ) + 1 ] = static_cast< uint8_t >( writeAead_->GetAlgorithm() );
+  uint8_t* nonce = prefix + recordHeaderSize;
+  Crypt::RandomBytes( nonce, Crypt::Aead::nonceSize );
+
+  // Only encrypted here. Every chunk authenticates it.
+  Crypt::Aead::Operation operation( *writeAead_, true, nonce );
+  operation.Process( Begin( obj_id ), nonce + Crypt::Aead::nonceSize, obj_id.size() );
+}
+
+Crypt::Aead* CacheImpl::RecordAead( const uint8_t* prefix )
+{
+  const uint8_t algorithm = prefix[ sizeof( recordMagic ) + 1 ];
+  if ( algorithm >= sizeof( aeads_ ) / sizeof( aeads_[0] ) ) {
+    return 0;
+  }
+  // 0 too if it isn't in this build of OpenSSL
+  return aeads_[ algorithm ].get();
+}
+
+bool CacheImpl::OpenRecord( const ObjectId& obj_id, const uint8_t* prefix, boost::scoped_ptr< Crypt::Aead::Operation >& operation )
+{
+  Crypt::Aead* aead = RecordAead( prefix );
+  if ( !aead ) {
+    return false;
+  }
+  const uint8_t* nonce = prefix + recordHeaderSize;
+  operation.reset( new Crypt::Aead::Operation( *aead, false, nonce ) );
+  operation->Authenticate( prefix, recordHeaderSize );
+  operation->Authenticate( Begin( obj_id ), obj_id.size() );
+
+  // The id isn't verified until the tag is, but a record of another
+  // object can be turned away early
+  std::vector< uint8_t > id( obj_id.size() );
+  operation->Process( nonce + Crypt::Aead::nonceSize, Begin( id ), id.size() );
+  return id == obj_id;
+}
+
+CacheImpl::ObjectId CacheImpl::RecordObjectId( const std::vector< uint8_t >& prefix, size_t idSize )
+{
+  if ( prefix.size() < RecordPrefixSize( idSize ) ) {
+    return ObjectId();
+  }
+  if ( !IsAeadRecord( &prefix[0], prefix.size() ) ) {
+    std::vector< uint8_t > header( prefix.begin(), prefix.begin() + LegacyPrefixSize( idSize ) );
+    Crypt::Rc4EncryptDecrypt( encryptionKey_, header );
+    return ObjectId( header.begin() + sizeof( Crypt::Sha1HashValue ), header.end() );
+  }
+
+  Crypt::Aead* aead = RecordAead( &prefix[0] );
+  if ( !aead ) {
+    return ObjectId();
+  }
+  // The key stream doesn't depend on the associated data, and the tag is
+  // left unchecked, so neither is needed
+  const uint8_t* nonce = &prefix[ recordHeaderSize ];
+  Crypt::Aead::Operation operation( *aead, false, nonce );
+  ObjectId objId( idSize );
+  operation.Process( nonce + Crypt::Aead::nonceSize, Begin( objId ), idSize );
+  return objId;
+}
+
+bool CacheImpl::DecodeLegacyObject( const ObjectId& obj_id, const uint8_t* data, size_t size, std::vector< uint8_t >& result )
+{
+  // The raw data should start with a heading that
+  // contains the hash value and the object id.
+  size_t headerSize( sizeof( Crypt::Sha1HashValue ) + obj_id.size() );
+  if ( size <= headerSize ) {
+    // The buffer is too small to event hold the hash code.
+    // Invalid.
+    return false;
+  }
+
+  // Decrypt the header first. The cipher keeps its key stream, so
+  // the payload can then be decrypted directly into the result.
+  const uint64_t start = OsNanoseconds();
+  Crypt::Rc4Cipher cipher( encryptionKey_ );
+  std::vector< uint8_t > header( headerSize );
+  cipher.Process( data, &header[0], headerSize );
+
+  // First we should have the hash
+  Crypt::Sha1HashValue hash;
+  std::vector< uint8_t >::iterator iter;
+  iter = header.begin() + sizeof( Crypt::Sha1HashValue );
+  std::copy( header.begin(), iter , hash.begin() );
+
+  // Then we should have the object id. Check if the object id:s match
+  if ( !std::equal( iter, header.end(), obj_id.begin() ) ) {
+    // Hmm object may be tampered with.
+    return false;
+  }
+
+  // Set the correct size of the resulting object
+  result.resize( size - headerSize );
+  cipher.Process( data + headerSize, &result[0], result.size() );
+  stages_[ CacheStats::DecryptStage ].Add( OsNanoseconds() - start );
+
+  // Now check hash
+  StageTimer timer( stages_[ CacheStats::HashStage ] );
+  return Crypt::Sha1Hash( result ) == hash;
+}
+
+void CacheImpl::AddToObjects( Shard& shard, const ObjectId& obj_id, uint64_t fingerprint, uint32_t size, const StoreLocation& location,
+                              uint32_t expiry, uint8_t priority, uint8_t partition, const ObjectId* blobId )
+{
+  // Remove it in case it is aleady there
+  StoreLocation previous;
+  if ( RemoveFromObjects( shard, obj_id, fingerprint, &previous ) && previous.length_ != 0 ) {
+    store_->Overwritten( obj_id, previous );
+  }
+
+  InsertObject( shard, obj_id, fingerprint, size, location, expiry, priority, partition, blobId );
+  journal_->Append( JournalRecord( JournalRecord::Write, obj_id, size, location, expiry, priority, partition,
+                                   blobId ? *blobId : ObjectId() ) );
+}
+
+void CacheImpl::InsertObject( Shard& shard, const ObjectId& obj_id, uint64_t fingerprint, uint32_t size, const StoreLocation& location,
+                              uint32_t expiry, uint8_t priority, uint8_t partition, const ObjectId* blobId )
+{
+  if ( blobId ) {
+    boost::mutex::scoped_lock lock( blobMutex_ );
+    links_[ obj_id ] = *blobId;
+  }
+  const size_t policy = PolicyOf( partition, priority );
+  ObjectIndex::Entry& entry( shard.objects_.Insert( obj_id, fingerprint, policy * policyQueues ) );
+  entry.size_ = size;
+  entry.sequence_ = ++ sequence_;
+  entry.expiry_ = expiry;
+  entry.SetLocation( location );
+  shard.policies_[ policy ]->Inserted( shard.objects_, entry, fingerprint );
+  partitions_[ partition ].size_ += size;
+  ++ partitions_[ partition ].objects_;
+  if ( expiry != 0 ) {
+    boost::mutex::scoped_lock lock( expiryMutex_ );
+    expiryTimers_.Add( obj_id, expiry );
+  }
+  currSize_ += size;
+  ++ objectCount_;
+  shard.presence_.Insert( fingerprint );
+}
+
+// Writes the record of an object as it arrives. A chunked record is
+// sealed a chunk at a time, and a chunk is only sealed once it is known
+// whether it is the last, so up to one chunk is held back. A legacy record
+// starts with the hash, which is only known at the end, but RC4 is a
+// stream cipher, so the key stream the hash will be encrypted with is
+// taken first, the id and the payload are encrypted after it as they
+// come, and the hash goes in on commit.
+class CacheImpl::ObjectWriter : public Cache::Writer
+{
+ public:
+  ObjectWriter( CacheImpl& cache, const ObjectId& obj_id, size_t partition, std::time_t expiry, Priority priority,
+                uint64_t expectedSize );
+  virtual ~ObjectWriter();
+  virtual bool append( const uint8_t* data, size_t size );
+  virtual bool commit();
+  virtual void abort();
+
+ private:
+  // Reserves room for size bytes of payload in the cache, pruning other
+  // objects to make it
+  void Reserve( uint64_t size );
+  // Seals the data held back as the next chunk
+  void SealPending( bool last );
+  void Publish();
+  // Deletes the file, if it hasn't been taken over, and gives back the
+  // space still reserved
+  void Close();
+
+  CacheImpl& cache_;
+  const ObjectId objId_;
+  const size_t partition_;
+  const std::time_t expiry_;
+  const Priority priority_;
+  std::string filename_; // Empty once taken over by the store
+  boost::scoped_ptr< OsFile > file_; // 0 once committed or aborted
+  boost::scoped_ptr< Crypt::Rc4Cipher > cipher_; // Only for a legacy record
+  std::vector< uint8_t > prefix_; // Of a chunked record
+  std::vector< uint8_t > pending_; // Not yet sealed
+  uint64_t chunks_; // Sealed so far
+  Crypt::Sha1Hasher hasher_;
+  Crypt::Sha1HashValue hashKey_; // The key stream for the hash
+  size_t prefixSize_; // Of the record, before the payload
+  uint64_t size_; // Of the payload written so far
+  uint64_t reserved_;
+  std::vector< uint8_t > buffer_;
+};
+
+CacheImpl::ObjectWriter::ObjectWriter( CacheImpl& cache, const ObjectId& obj_id, size_t partition, std::time_t expiry,
+                                       Priority priority, uint64_t expectedSize )
+    : cache_( cache ), objId_( obj_id ), partition_( partition ), expiry_( expiry ), priority_( priority ),
+      chunks_( 0 ), prefixSize_( 0 ), size_( 0 ), reserved_( 0 )
+{
+  if ( static_cast< size_t >( priority ) >= noOfPriorities ) {
+    throw std::invalid_argument( "Unknown priority" );
+  }
+  // In temporaryDirectory, so that it is deleted when the cache opens
+  // again if the process dies before the write is finished
+  std::ostringstream ss;
+  ss << "writer" << ++ cache.nextWriter_ << ".tmp";
+  filename_ = OsConcatPath( OsConcatPath( cache.path_, temporaryDirectory ), ss.str() );
+
+  std::vector< uint8_t > header;
+  if ( cache.writeAead_ ) {
+    header.resize( AeadPrefixSize( obj_id.size() ) );
+    cache.WriteRecordPrefix( obj_id, &header[0] );
+    prefix_ = header;
+  } else {
+    cipher_.reset( new Crypt::Rc4Cipher( cache.encryptionKey_ ) );
+    header.resize( LegacyPrefixSize( obj_id.size() ) );
+    cipher_->Process( &header[0], &header[0], hashKey_.size() );
+    std::copy( header.begin(), header.begin() + hashKey_.size(), hashKey_.begin() );
+    std::copy( obj_id.begin(), obj_id.end(), header.begin() + hashKey_.size() );
+    cipher_->Process( &header[ hashKey_.size() ], &header[ hashKey_.size() ], obj_id.size() );
+  }
+  prefixSize_ = header.size();
+  try {
+    file_.reset( new OsFile( filename_, true ) );
+    file_->WriteAt( 0, &header[0], header.size() );
+    Reserve( expectedSize );
+  } catch ( ... ) {
+    Close();
+    throw;
+  }
+}
+
+CacheImpl::ObjectWriter::~ObjectWriter()
+{
+  Close();
+}
+
+void CacheImpl::ObjectWriter::Reserve( uint64_t size )
+{
+  if ( size <= reserved_ ) {
+    return;
+  }
+  const uint64_t recordSize = cipher_ ? prefixSize_ + size : ChunkLayout( prefixSize_, size ).RecordSize();
+  if ( size > cache_.maxSize_ || recordSize > std::numeric_limits< uint32_t >::max() ) {
+    // There is no way this object will fit in the cache
+    throw std::invalid_argument( "Too large object" );
+  }
+  cache_.reservedSize_ += size - reserved_;
+  reserved_ = size;
+  if ( cache_.currSize_ + cache_.reservedSize_ > cache_.maxSize_ ) {
+    cache_.ExpireObjects();
+    cache_.PruneObjects( cache_.maxSize_ );
+    cache_.FlushJournal();
+  }
+}
+
+bool CacheImpl::ObjectWriter::append( const uint8_t* data, size_t size )
+{
+  bool appended = false;
+  try {
+    if ( !file_ ) {
+      throw std::logic_error( "Writer already finished" );
+    }
+    Reserve( size_ + size );
+    if ( !cipher_ ) {
+      while ( size > 0 ) {
+        if ( pending_.size() == recordChunkSize ) {
+          SealPending( false );
+        }
+        const size_t piece = std::min( size, recordChunkSize - pending_.size() );
+        pending_.insert( pending_.end(), data, data + piece );
+        size_ += piece;
+        data += piece;
+        size -= piece;
+      }
+    } else {
+      hasher_.Update( data, size );
+      while ( size > 0 ) {
+        const size_t piece = std::min( size, streamChunkSize );
+        buffer_.resize( std::max( buffer_.size(), piece ) );
+        cipher_->Process( data, &buffer_[0], piece );
+        file_->WriteAt( prefixSize_ + size_, &buffer_[0], piece );
+        size_ += piece;
+        data += piece;
+        size -= piece;
+      }
+    }
+    appended = true;
+  } CATCH();
+  if ( !appended ) {
+    // The key stream has moved on, so there is no way to go on
+    Close();
+  }
+  return appended;
+}
+
+bool CacheImpl::ObjectWriter::commit()
+{
+  SPAN( "Writer::commit" );
+  const uint64_t start = cache_.StartCall();
+  bool committed = false;
+  try {
+    if ( !file_ ) {
+      throw std::logic_error( "Writer already finished" );
+    }
+    if ( !cipher_ ) {
+      SealPending( true );
+    } else {
+      const Crypt::Sha1HashValue hash( hasher_.Final() );
+      Crypt::Sha1HashValue header;
+      for ( size_t i = 0; i < header.size(); ++i ) {
+        header[i] = hash[i] ^ hashKey_[i];
+      }
+      file_->WriteAt( 0, &header[0], header.size() );
+    }
+    file_.reset();
+
+    if ( cache_.options_.writeBack ) {
+      // Replaces any version still staged
+      boost::mutex::scoped_lock lock( cache_.flushMutex_ );
+      cache_.Unstage( objId_ );
+      Publish();
+    } else {
+      Publish();
+    }
+    committed = true;
+  } CATCH();
+  Close();
+  return cache_.EndCall( CacheStats::CommitOperation, start, objId_, size_, committed );
+}
+
+void CacheImpl::ObjectWriter::SealPending( bool last )
+{
+  buffer_.resize( pending_.size() + Crypt::Aead::tagSize );
+  SealChunk( *cache_.writeAead_, &prefix_[0], objId_, chunks_, last, Begin( pending_ ), pending_.size(), &buffer_[0] );
+  file_->WriteAt( ChunkLayout( prefixSize_, 0 ).Offset( chunks_ ), &buffer_[0], buffer_.size() );
+  ++ chunks_;
+  pending_.clear();
+}
+
+void CacheImpl::ObjectWriter::Publish()
+{
+  StoreLocation location;
+  cache_.store_->WriteFile( objId_, filename_, location );
+  filename_.clear();
+  cache_.PublishObject( objId_, size_, location, partition_, expiry_, priority_, true, &reserved_ );
+}
+
+void CacheImpl::ObjectWriter::abort()
+{
+  Close();
+}
+
+void CacheImpl::ObjectWriter::Close()
+{
+  file_.reset();
+  pending_.clear();
+  if ( !filename_.empty() ) {
+    try {
+      OsDeleteFile( filename_ );
+    } CATCH();
+    filename_.clear();
+  }
+  cache_.reservedSize_ -= reserved_;
+  reserved_ = 0;
+}
+
+bool CacheImpl::writeObject( const ObjectId& obj_id, const std::vector< uint8_t >& value )
+{
+  SPAN( "writeObject" );
+  const uint64_t start = StartCall();
+  return EndCall( CacheStats::WriteOperation, start, obj_id, value.size(), WriteObject( obj_id, value, 0, 0, NormalPriority ) );
+}
+
+bool CacheImpl::writeObject( const ObjectId& obj_id, const std::vector< uint8_t >& value, std::time_t expiry, Priority priority )
+{
+  SPAN( "writeObject" );
+  const uint64_t start = StartCall();
+  return EndCall( CacheStats::WriteOperation, start, obj_id, value.size(), WriteObject( obj_id, value, 0, expiry, priority ) );
+}
+
+bool CacheImpl::writeObject( const ObjectId& obj_id, const std::vector< uint8_t >& value, const std::string& partition,
+                             std::time_t expiry, Priority priority )
+{
+  SPAN( "writeObject" );
+  const uint64_t start = StartCall();
+  size_t found;
+  if ( !FindPartition( partition, found ) ) {
+    std::clog << "Unknown partition " << partition << std::endl;
+    return EndCall( CacheStats::WriteOperation, start, obj_id, value.size(), false );
+  }
+  return EndCall( CacheStats::WriteOperation, start, obj_id, value.size(), WriteObject( obj_id, value, found, expiry, priority ) );
+}
+
+bool CacheImpl::FindPartition( const std::string& name, size_t& partition ) const
+{
+  for ( size_t i = 0; i < noOfPartitions_; ++i ) {
+    if ( partitions_[i].name_ == name ) {
+      partition = i;
+      return true;
+    }
+  }
+  return false;
+}
+
+Cache::Writer* CacheImpl::beginWrite( const ObjectId& obj_id, uint64_t expectedSize )
+{
+  try {
+    return new ObjectWriter( *this, obj_id, 0, 0, NormalPriority, expectedSize );
+  } CATCH();
+  return 0;
+}
+
+Cache::Writer* CacheImpl::beginWrite( const ObjectId& obj_id, uint64_t expectedSize, const std::string& partition,
+                                      std::time_t expiry, Priority priority )
+{
+  size_t found;
+  if ( !FindPartition( partition, found ) ) {
+    std::clog << "Unknown partition " << partition << std::endl;
+    return 0;
+  }
+  try {
+    return new ObjectWriter( *this, obj_id, found, expiry, priority, expectedSize );
+  } CATCH();
+  return 0;
+}
+
+bool CacheImpl::WriteObject( const ObjectId& obj_id, const std::vector< uint8_t >& value, size_t partition, std::time_t expiry,
+                             Priority priority )
+{
+  if ( !options_.writeBack ) {
+    return PersistObject( obj_id, value, partition, expiry, priority );
+  }
+  if ( value.size() > options_.writeBackBytes ) {
+    // Too large to stage, so it is stored straight away, and replaces
+    // any version still staged
+    boost::mutex::scoped_lock lock( flushMutex_ );
+    Unstage( obj_id );
+    return PersistObject( obj_id, value, partition, expiry, priority );
+  }
+  try {
+    if ( static_cast< size_t >( priority ) >= noOfPriorities ) {
+      throw std::invalid_argument( "Unknown priority" );
+    }
+    if ( value.size() > maxSize_ ) {
+      throw std::invalid_argument( "Too large object" );
+    }
+    StageObject( obj_id, value, partition, expiry, priority );
+  } CATCH_RETURN();
+}
+
+bool CacheImpl::CompressRecord( const std::vector< uint8_t >& value, size_t partition, std::vector< uint8_t >& compressed )
+{
+  // Records of the older format can't be compressed
+  if ( !writeAead_ || partitions_[ partition ].compression_ == CacheOptions::NoCompression ) {
+    return false;
+  }
+  StageTimer timer( stages_[ CacheStats::CompressStage ] );
+  return CompressObject( value, partitions_[ partition ].compression_, compressed );
+}
+
+bool CacheImpl::PersistObject( const ObjectId& obj_id, const std::vector< uint8_t >& value, size_t partition, std::time_t expiry,
+                               Priority priority, bool flushJournal, uint64_t* reserved )
+{
+  try {
+    if ( static_cast< size_t >( priority ) >= noOfPriorities ) {
+      throw std::invalid_argument( "Unknown priority" );
+    }
+    if ( options_.deduplicate ) {
+      // Only the first object with these contents stores them
+      const ObjectId blobId( BlobId( value ) );
+      if ( !ReferenceBlob( blobId ) ) {
+        StoreBlob( blobId, value, partition );
+      }
+      PublishObject( obj_id, 0, StoreLocation(), partition, expiry, priority, flushJournal, reserved, &blobId );
+      return true;
+    }
+
+    // Compress, encode and store the object without holding any lock.
+    // What is stored is what counts towards the size of the cache.
+    std::vector< uint8_t > compressed;
+    const bool compress = CompressRecord( value, partition, compressed );
+    const std::vector< uint8_t >& stored( compress ? compressed : value );
+    if ( stored.size() > maxSize_ ) {
+      // There is no way this object will fit in the cache
+      throw std::invalid_argument( "Too large object" );
+    }
+    std::vector< uint8_t > buffer;
+    EncodeObject( obj_id, stored, buffer, compress );
+    StoreLocation location;
+    {
+      StageTimer timer( stages_[ CacheStats::FileWriteStage ] );
+      store_->Write( obj_id, buffer, location );
+    }
+    PublishObject( obj_id, stored.size(), location, partition, expiry, priority, flushJournal, reserved );
+  } CATCH_RETURN();
+}
+
+size_t CacheImpl::WriteObjects( const std::vector< ObjectId >& obj_ids, const std::vector< std::vector< uint8_t > >& values,
+                                std::vector< bool >& written )
+{
+  written.assign( obj_ids.size(), false );
+  if ( values.size() != obj_ids.size() ) {
+    std::clog << "writeObjects: " << obj_ids.size() << " ids but " << values.size() << " values" << std::endl;
+    return 0;
+  }
+  if ( options_.writeBack ) {
+    // Staging is cheap already, and the flusher stores in batches anyway
+    for ( size_t i = 0; i < obj_ids.size(); ++i ) {
+      written[i] = WriteObject( obj_ids[i], values[i], 0, 0, NormalPriority );
+    }
+    return static_cast< size_t >( std::count( written.begin(), written.end(), true ) );
+  }
+
+  // Room is made for a run of objects that fit in the cache together up
+  // front, with one pruning pass, and the run shares one journal flush
+  for ( size_t begin = 0; begin < obj_ids.size(); ) {
+    uint64_t runSize = 0;
+    size_t end = begin;
+    for ( ; end < obj_ids.size(); ++ end ) {
+      if ( values[ end ].size() > maxSize_ ) {
+        // Fails on its own
+        continue;
+      }
+      if ( end > begin && runSize + values[ end ].size() > maxSize_ ) {
+        break;
+      }
+      runSize += values[ end ].size();
+    }
+    try {
+      reservedSize_ += runSize;
+      ExpireObjects();
+      PruneObjects( maxSize_ );
+    } CATCH();
+    for ( size_t i = begin; i < end; ++i ) {
+      uint64_t reserved = values[i].size() > maxSize_ ? 0 : values[i].size();
+      written[i] = PersistObject( obj_ids[i], values[i], 0, 0, NormalPriority, false, &reserved );
+      // Whatever a failed write had reserved
+      reservedSize_ -= reserved;
+    }
+    try {
+      FlushJournal();
+    } CATCH();
+    begin = end;
+  }
+  return static_cast< size_t >( std::count( written.begin(), written.end(), true ) );
+}
+
+void CacheImpl::PublishObject( const ObjectId& obj_id, uint64_t size, const StoreLocation& location, size_t partition,
+                               std::time_t expiry, Priority priority, bool flushJournal, uint64_t* reserved, const ObjectId* blobId )
+{
+  {
+    // Update internal structures after the write, because
+    // we don't want them updated in case the write throws
+    // an exception
+    const uint64_t fingerprint = Fingerprint( obj_id );
+    Shard& shard( GetShard( fingerprint ) );
+    boost::mutex::scoped_lock lock( shard.mutex_ );
+    try {
+      if ( !blobId ) {
+        store_->Commit( obj_id, location );
+      }
+    } catch ( ... ) {
+      store_->Abort( obj_id, location );
+      throw;
+    }
+    AddToObjects( shard, obj_id, fingerprint, static_cast< uint32_t >( size ), location, IndexExpiry( expiry ),
+                  static_cast< uint8_t >( priority ), static_cast< uint8_t >( partition ), blobId );
+    if ( reserved ) {
+      reservedSize_ -= *reserved;
+      *reserved = 0;
+    }
+  }
+  ++ partitions_[ partition ].writes_;
+
+  // Make it fit, after making room by erasing what has expired. The new
+  // object is the newest, so it is pruned last of its priority.
+  ExpireObjects();
+  PruneObjects( maxSize_ );
+  if ( flushJournal ) {
+    FlushJournal();
+  }
+}
+
+CacheImpl::ObjectId CacheImpl::BlobId( const std::vector< uint8_t >& value )
+{
+  StageTimer timer( stages_[ CacheStats::HashStage ] );
+  const Crypt::DigestValue digest( Crypt::KeyedDigest( encryptionKey_, Begin( value ), value.size() ) );
+  return ObjectId( digest.begin(), digest.end() );
+}
 
-CacheImpl::~CacheImpl()
+bool CacheImpl::ReferenceBlob( const ObjectId& blobId )
 {
-  try {
-    SaveMetaData();
-  } CATCH();
+  boost::mutex::scoped_lock lock( blobMutex_ );
+  BlobMap::iterator blob = blobs_.find( blobId );
+  if ( blob == blobs_.end() ) {
+    return false;
+  }
+  ++ blob->second.refs_;
+  return true;
 }
 
-bool CacheImpl::hasObject( const ObjectId& obj_id )
+void CacheImpl::StoreBlob( const ObjectId& blobId, const std::vector< uint8_t >& value, size_t partition )
 {
+  // A blob is stored like any object, under its own id
+  std::vector< uint8_t > compressed;
+  const bool compress = CompressRecord( value, partition, compressed );
+  const std::vector< uint8_t >& stored( compress ? compressed : value );
+  if ( stored.size() > maxSize_ ) {
+    throw std::invalid_argument( "Too large object" );
+  }
+  std::vector< uint8_t > buffer;
+  EncodeObject( blobId, stored, buffer, compress );
+  StoreLocation location;
+  {
+    StageTimer timer( stages_[ CacheStats::FileWriteStage ] );
+    store_->Write( blobId, buffer, location );
+  }
+
+  boost::mutex::scoped_lock lock( blobMutex_ );
+  BlobMap::iterator found = blobs_.find( blobId );
+  if ( found != blobs_.end() ) {
+    // Another writer of the same contents got there first
+    ++ found->second.refs_;
+    store_->Abort( blobId, location );
+    return;
+  }
   try {
-    return objects_.find( obj_id ) != objects_.end();
-  } CATCH_RETURN();
+    store_->Commit( blobId, location );
+  } catch ( ... ) {
+    store_->Abort( blobId, location );
+    throw;
+  }
+  Blob& blob( blobs_[ blobId ] );
+  blob.location_ = location;
+  blob.size_ = static_cast< uint32_t >( stored.size() );
+  blob.partition_ = static_cast< uint8_t >( partition );
+  blob.refs_ = 1;
+  currSize_ += blob.size_;
+  partitions_[ partition ].size_ += blob.size_;
+  journal_->Append( JournalRecord( JournalRecord::Blob, blobId, blob.size_, location, 0, NormalPriority, blob.partition_ ) );
 }
 
+void CacheImpl::ReleaseBlob( BlobMap::iterator blob )
+{
+  // Not counted yet while loading
+  if ( blob->second.refs_ == 0 || -- blob->second.refs_ != 0 ) {
+    return;
+  }
+  currSize_ -= blob->second.size_;
+  partitions_[ blob->second.partition_ ].size_ -= blob->second.size_;
+  StageTimer timer( stages_[ CacheStats::DeleteStage ] );
+  store_->Erase( blob->first, blob->second.location_ );
+  blobs_.erase( blob );
+}
 
-bool CacheImpl::readObject( const ObjectId& obj_id, std::vector< uint8_t >& result )
+void CacheImpl::StageObject( const ObjectId& obj_id, const std::vector< uint8_t >& value, size_t partition, std::time_t expiry,
+                             Priority priority )
 {
-  try {
-    if ( !hasObject( obj_id ) ) {
-      return false;
+  // Copy the object before taking the lock
+  boost::shared_ptr< const std::vector< uint8_t > > copy( new std::vector< uint8_t >( value ) );
+  boost::mutex::scoped_lock lock( stagingMutex_ );
+  StagedMap::iterator it;
+  for ( ;; ) {
+    // A version that is still staged makes room for the new one
+    it = staged_.find( obj_id );
+    const uint64_t replaced = it == staged_.end() ? 0 : it->second.value_->size();
+    if ( stagedBytes_ - replaced + value.size() <= options_.writeBackBytes ) {
+      break;
     }
-    std::string filename( OsConcatPath( path_, Crypt::EncodeFilenameFromBuffer( obj_id, fileExtension ) ) );
+    objectsStored_.wait( lock );
+  }
+  if ( it == staged_.end() ) {
+    it = staged_.insert( std::make_pair( obj_id, StagedObject() ) ).first;
+  } else {
+    stagedBytes_ -= it->second.value_->size();
+    stagedOrder_.erase( it->second.sequence_ );
+  }
+  StagedObject& staged( it->second );
+  staged.value_ = copy;
+  staged.partition_ = partition;
+  staged.expiry_ = expiry;
+  staged.priority_ = priority;
+  staged.sequence_ = ++ stagingSequence_;
+  stagedOrder_[ staged.sequence_ ] = obj_id;
+  stagedBytes_ += value.size();
+  objectStaged_.notify_one();
+}
 
-    std::vector< uint8_t > rawBuffer;
-    OsReadFile( filename, rawBuffer );
+bool CacheImpl::Unstage( const ObjectId& obj_id )
+{
+  boost::mutex::scoped_lock lock( stagingMutex_ );
+  StagedMap::iterator it = staged_.find( obj_id );
+  if ( it == staged_.end() ) {
+    return false;
+  }
+  stagedBytes_ -= it->second.value_->size();
+  stagedOrder_.erase( it->second.sequence_ );
+  staged_.erase( it );
+  objectsStored_.notify_all();
+  return true;
+}
 
-    // Now, decrypt the buffer
-    Crypt::Rc4EncryptDecrypt( encryptionKey_, rawBuffer );
+bool CacheImpl::FindStaged( const ObjectId& obj_id, boost::shared_ptr< const std::vector< uint8_t > >& value, size_t& partition )
+{
+  boost::mutex::scoped_lock lock( stagingMutex_ );
+  StagedMap::const_iterator it = staged_.find( obj_id );
+  if ( it == staged_.end() ) {
+    return false;
+  }
+  const uint32_t expiry = IndexExpiry( it->second.expiry_ );
+  if ( expiry == 0 || expiry > Now() ) {
+    value = it->second.value_;
+  }
+  partition = it->second.partition_;
+  return true;
+}
 
-    // The raw buffer should contain a heading that
-    // contains the hash value and the object id.
-    size_t headerSize( sizeof( Crypt::Sha1HashValue ) + obj_id.size() );
-    if ( rawBuffer.size() <= headerSize ) {
-      // The buffer is too small to event hold the hash code.
-      // Invalid.
-      RemoveFromObjects( obj_id );
-      return false;
+void CacheImpl::FlushStaged()
+{
+  SPAN( "FlushStaged" );
+  // Objects are stored a batch at a time, with one journal flush
+  const size_t batchSize = 64;
+  for ( ;; ) {
+    std::vector< std::pair< uint64_t, ObjectId > > batch;
+    {
+      boost::mutex::scoped_lock lock( stagingMutex_ );
+      while ( stagedOrder_.empty() && !stopFlusher_ ) {
+        objectStaged_.wait( lock );
+      }
+      if ( stagedOrder_.empty() ) {
+        return;
+      }
+      for ( std::map< uint64_t, ObjectId >::const_iterator it = stagedOrder_.begin();
+            it != stagedOrder_.end() && batch.size() < batchSize; ++ it ) {
+        batch.push_back( *it );
+      }
     }
-    // First we should have the hash
-    Crypt::Sha1HashValue hash;
-    std::vector< uint8_t >::iterator iter;
-    iter = rawBuffer.begin() + sizeof( Crypt::Sha1HashValue );
-    std::copy( rawBuffer.begin(), iter , hash.begin() );
-
-    // Then we should have the object id
-    ObjectId bufferObjectId( obj_id.size() );
-    std::copy( iter, iter + bufferObjectId.size(), bufferObjectId.begin() );
 
-    // Now check if the object id:s match
-    if ( bufferObjectId != bufferObjectId ) {
-      // Hmm object may be tampered with.
-      RemoveFromObjects( obj_id );
-      return false;
+    for ( size_t i = 0; i < batch.size(); ++i ) {
+      boost::mutex::scoped_lock flushLock( flushMutex_ );
+      StagedObject object;
+      {
+        boost::mutex::scoped_lock lock( stagingMutex_ );
+        StagedMap::const_iterator it = staged_.find( batch[i].second );
+        if ( it == staged_.end() || it->second.sequence_ != batch[i].first ) {
+          // Erased or written again since
+          continue;
+        }
+        object = it->second;
+      }
+      // A failure is logged, and the object dropped
+      PersistObject( batch[i].second, *object.value_, object.partition_, object.expiry_, object.priority_, false );
     }
+    try {
+      FlushJournal();
+    } CATCH();
 
-    // Set the correct size of the resulting object
-    result.resize( rawBuffer.size() - headerSize );
-    iter = iter + bufferObjectId.size();
-    std::copy( iter, rawBuffer.end(), result.begin() );
-
-    // Now check hash
-    if ( Crypt::Sha1Hash( result ) != hash ) {
-      RemoveFromObjects( obj_id );
-      return false;
+    // Readers use the staged copies until the journal is written
+    boost::mutex::scoped_lock lock( stagingMutex_ );
+    for ( size_t i = 0; i < batch.size(); ++i ) {
+      StagedMap::iterator it = staged_.find( batch[i].second );
+      if ( it != staged_.end() && it->second.sequence_ == batch[i].first ) {
+        stagedBytes_ -= it->second.value_->size();
+        stagedOrder_.erase( it->second.sequence_ );
+        staged_.erase( it );
+      }
     }
-
-    return true;
-  } CATCH_RETURN();
+    objectsStored_.notify_all();
+  }
 }
 
-void CacheImpl::AddToObjects( const ObjectId& obj_id, CacheObject& cacheObject )
+bool CacheImpl::getMemoryTierStats( MemoryTierStats& stats )
 {
-  RemoveFromObjects( obj_id ); // Remove it in case it is aleady there
-
-  // Make sure it will fit
-  PruneObjects( maxSize_ - cacheObject.size_ );
-  currSize_ += cacheObject.size_;
-
-  objects_[ obj_id ] = cacheObject;
-  // Reach into the unordered map to get a reference to actual element stored
-  HashMap::value_type &elem = *objects_.find( obj_id );
-  // Store a pointer to that element inside the element itself. Thay way
-  // we can find the element (key + value) from the value (CacheObject)
-  // that is stored inside the prune list
-  elem.second.mapElement_ = &elem;
-  // Add to prune list
-  pruneList_.push_back( elem.second );
+  if ( !memoryTier_ ) {
+    return false;
+  }
+  stats.maxSize = memoryTier_->MaxSize();
+  stats.currentSize = memoryTier_->Size();
+  stats.objects = memoryTier_->Objects();
+  stats.hits = memoryTier_->Hits();
+  stats.misses = memoryTier_->Misses();
+  return true;
+}
 
-  // Make sure structures are in sync
-  assert( objects_.size() == pruneList_.size() );
+void CacheImpl::flush()
+{
+  boost::mutex::scoped_lock lock( stagingMutex_ );
+  const uint64_t written = stagingSequence_;
+  while ( !stagedOrder_.empty() && stagedOrder_.begin()->first <= written ) {
+    objectsStored_.wait( lock );
+  }
 }
 
-bool CacheImpl::writeObject( const ObjectId& obj_id, const std::vector< uint8_t >& value )
+bool CacheImpl::RemoveFromObjects( Shard& shard, const ObjectId& obj_id, uint64_t fingerprint, StoreLocation* location )
 {
-  try {
-    if ( value.size() > maxSize_ ) {
-      // There is no way this object will fit in the cache
-      throw std::invalid_argument( "Too large object" );
+  ObjectIndex::Entry* entry( shard.objects_.Find( obj_id, fingerprint ) );
+  if ( !entry ) {
+    return false;
+  }
+
+  currSize_ -= entry->size_;
+  -- objectCount_;
+  partitions_[ PartitionOf( *entry ) ].size_ -= entry->size_;
+  -- partitions_[ PartitionOf( *entry ) ].objects_;
+  if ( location ) {
+    *location = entry->Location();
+  }
+  if ( entry->length_ == 0 ) {
+    boost::mutex::scoped_lock lock( blobMutex_ );
+    boost::unordered_map< ObjectId, ObjectId >::iterator link = links_.find( obj_id );
+    if ( link != links_.end() ) {
+      BlobMap::iterator blob = blobs_.find( link->second );
+      links_.erase( link );
+      if ( blob != blobs_.end() ) {
+        ReleaseBlob( blob );
+      }
     }
+  }
+  shard.objects_.Erase( *entry );
+  shard.presence_.Erase( fingerprint );
+  if ( memoryTier_ ) {
+    memoryTier_->Erase( obj_id, fingerprint );
+  }
 
-    std::string filename( OsConcatPath( path_, Crypt::EncodeFilenameFromBuffer( obj_id, fileExtension ) ) );
+  return true;
+}
 
-    // Calculate hash signature
-    Crypt::Sha1HashValue hash( Crypt::Sha1Hash( value ) );
+void CacheImpl::PruneObjects( uint64_t maxCacheSize )
+{
+  SPAN( "PruneObjects" );
+  // Space reserved by writers counts as taken
+  if ( currSize_ + reservedSize_ <= maxCacheSize ) {
+    return;
+  }
 
-    // Write a buffer that contains the signature + the object
-    std::vector< uint8_t >::iterator iter;
-    std::vector< uint8_t > buffer( sizeof( Crypt::Sha1HashValue ) + obj_id.size() + value.size() );
-    iter = std::copy( hash.begin(), hash.end(), buffer.begin() );
-    iter = std::copy( obj_id.begin(), obj_id.end(), iter );
-    iter = std::copy( value.begin(), value.end(), iter );
+  // Every shard's eviction policies pick its next victim, and the victim
+  // of the lowest priority, then with the lowest sequence, goes first.
+  // With FIFO eviction this is the oldest object of that priority
+  // overall, and with segment storage write order is also segment
+  // order. Once pruning has started on a sealed segment it goes on until
+  // the segment is empty, so that it is retired as a whole instead of
+  // leaving dead records behind.
+  boost::mutex::scoped_lock pruneLock( pruneMutex_ );
+  bool retiring = false;
+  uint32_t retiringSegment = 0;
 
-    // Now, encrypt the buffer
-    Crypt::Rc4EncryptDecrypt( encryptionKey_, buffer );
+  for ( ;; ) {
+    // Find the shard with the first victim, and the order of the runner up
+    const std::pair< size_t, uint64_t > last( noOfPriorities, std::numeric_limits< uint64_t >::max() );
+    size_t oldest = noOfShards_;
+    std::pair< size_t, uint64_t > oldestOrder( last );
+    std::pair< size_t, uint64_t > nextOrder( last );
+    for ( size_t i = 0; i < noOfShards_; ++i ) {
+      boost::mutex::scoped_lock lock( shards_[i].mutex_ );
+      const ObjectIndex::Entry* victim( Victim( shards_[i] ) );
+      if ( !victim ) {
+        continue;
+      }
+      const std::pair< size_t, uint64_t > order( PruneOrder( *victim ) );
+      if ( order < oldestOrder ) {
+        nextOrder = oldestOrder;
+        oldestOrder = order;
+        oldest = i;
+      } else if ( order < nextOrder ) {
+        nextOrder = order;
+      }
+    }
+    if ( oldest == noOfShards_ ) {
+      return;
+    }
 
-    // And write the file
-    OsWriteFile( filename, buffer );
+    // Prune from that shard for as long as it holds the first victims
+    Shard& shard( shards_[ oldest ] );
+    boost::mutex::scoped_lock lock( shard.mutex_ );
+    bool pruned = false;
+    for ( ObjectIndex::Entry* victim = Victim( shard ); victim && PruneOrder( *victim ) <= nextOrder; victim = Victim( shard ) ) {
+      if ( ( maxCacheSize >= currSize_ + reservedSize_ ) && !( retiring && victim->segment_ == retiringSegment ) ) {
+        if ( !pruned ) {
+          return;
+        }
+        break;
+      }
 
-    // Update internal structures after the write, because
-    // we don't want them updated in case the write throws
-    // an exception
+      ObjectId objId( victim->Id() );
+      StoreLocation location( victim->Location() );
+      const uint64_t fingerprint = Fingerprint( objId );
 
-    CacheObject obj;
-    obj.size_ = static_cast< uint32_t > ( value.size() );
+      if ( segmentStore_ && ( !retiring || location.segment_ != retiringSegment ) ) {
+        retiringSegment = location.segment_;
+        retiring = segmentStore_->IsSealed( retiringSegment );
+      }
 
-    AddToObjects( obj_id, obj );
+      shard.Policy( *victim ).Evicted( shard.objects_, *victim, fingerprint );
+      ++ partitions_[ PartitionOf( *victim ) ].prunes_;
+      RemoveFromObjects( shard, objId, fingerprint );
+      journal_->Append( JournalRecord( JournalRecord::Prune, objId ) );
 
-    return true;
-  } CATCH_RETURN();
+      // The store ignores records that are no longer there, but they
+      // are counted
+      if ( !EraseRecord( objId, location ) ) {
+        ++ deleteFailures_;
+      }
+      pruned = true;
+    }
+  }
 }
 
-bool CacheImpl::RemoveFromObjects( const ObjectId& obj_id )
+ObjectIndex::Entry* CacheImpl::Victim( Shard& shard )
 {
-  // Make sure structures are in sync
-  assert( objects_.size() == pruneList_.size() );
-  HashMap::iterator it = objects_.find( obj_id );
-  if ( it == objects_.end() ) {
-    return false;
+  // Partitions that have borrowed room from the others give it back first
+  bool overBudget = false;
+  for ( size_t i = 0; i < noOfPartitions_ && !overBudget; ++i ) {
+    overBudget = partitions_[i].size_ > partitions_[i].maxSize_;
   }
 
-  currSize_ -= it->second.size_;
-  // Remove object from linked list
-  it->second.unlink();
-  // Remove object from unordered map
-  objects_.erase( it );
-
-  return true;
+  ObjectIndex::Entry* first = 0;
+  for ( size_t policy = 0; policy < shard.policies_.size(); ++policy ) {
+    const Partition& partition( partitions_[ policy / noOfPriorities ] );
+    if ( overBudget && partition.size_ <= partition.maxSize_ ) {
+      continue;
+    }
+    ObjectIndex::Entry* victim( shard.policies_[ policy ]->Victim( shard.objects_ ) );
+    if ( victim && ( !first || PruneOrder( *victim ) < PruneOrder( *first ) ) ) {
+      first = victim;
+    }
+  }
+  return first;
 }
 
-void CacheImpl::PruneObjects( uint64_t maxCacheSize )
+void CacheImpl::ExpireObjects()
 {
-  // Prune objects, oldest first.
-  PruneList::iterator it = pruneList_.begin();
-
-  while ( ( it != pruneList_.end() ) && ( maxCacheSize < getCurrentSize() ) ) {
-    std::string filename( OsConcatPath( path_, Crypt::EncodeFilenameFromBuffer( it->mapElement_->first, fileExtension ) ) );
-
-    PruneList::iterator removeIter( it );
-    ++ it;
-
-    RemoveFromObjects( removeIter->mapElement_->first );
+  SPAN( "ExpireObjects" );
+  std::vector< TimerWheel::Timer > expired;
+  {
+    boost::mutex::scoped_lock lock( expiryMutex_ );
+    expiryTimers_.Advance( Now(), expired );
+  }
 
-    // The following could thrown an exception if the file is no longer available
-    // The user could have restarted the cache after removing a file manually.
-    // This is an "ok" error case
-    try {
-      OsDeleteFile( filename );
-    } catch ( OsDeleteFileException& )
-    {
+  for ( std::vector< TimerWheel::Timer >::const_iterator it = expired.begin(); it != expired.end(); ++ it ) {
+    const uint64_t fingerprint = Fingerprint( it->objId_ );
+    Shard& shard( GetShard( fingerprint ) );
+    boost::mutex::scoped_lock lock( shard.mutex_ );
+    // Timers aren't cancelled, so the object may have been erased or
+    // written again since
+    const ObjectIndex::Entry* found( shard.objects_.Find( it->objId_, fingerprint ) );
+    if ( !found || found->expiry_ != it->expiry_ ) {
+      continue;
     }
+    StoreLocation location;
+    RemoveFromObjects( shard, it->objId_, fingerprint, &location );
+    journal_->Append( JournalRecord( JournalRecord::Erase, it->objId_ ) );
+    EraseRecord( it->objId_, location );
   }
-
-  // Make sure structures are in sync
-  assert( objects_.size() == pruneList_.size() );
 }
 
 bool CacheImpl::eraseObject( const ObjectId& obj_id )
 {
+  SPAN( "eraseObject" );
+  const uint64_t start = StartCall();
+  bool erased;
+  if ( options_.writeBack ) {
+    // Keeps the flusher from storing a staged version after the erase
+    boost::mutex::scoped_lock lock( flushMutex_ );
+    const bool staged = Unstage( obj_id );
+    erased = EraseObject( obj_id ) || staged;
+  } else {
+    erased = EraseObject( obj_id );
+  }
+  return EndCall( CacheStats::EraseOperation, start, obj_id, 0, erased );
+}
+
+size_t CacheImpl::EraseObjects( const std::vector< ObjectId >& obj_ids, std::vector< bool >& erased )
+{
+  erased.assign( obj_ids.size(), false );
   try {
-    if ( !hasObject( obj_id ) ) {
-      return false;
+    // Keeps the flusher from storing staged versions after the erase
+    boost::unique_lock< boost::mutex > flushLock( flushMutex_, boost::defer_lock );
+    if ( options_.writeBack ) {
+      flushLock.lock();
+      for ( size_t i = 0; i < obj_ids.size(); ++i ) {
+        erased[i] = Unstage( obj_ids[i] );
+      }
     }
-    std::string filename( OsConcatPath( path_, Crypt::EncodeFilenameFromBuffer( obj_id, fileExtension ) ) );
-    try {
-      OsDeleteFile( filename );
-    } catch ( OsDeleteFileException& ) {
+
+    std::vector< size_t > indices( obj_ids.size() );
+    for ( size_t i = 0; i < indices.size(); ++i ) {
+      indices[i] = i;
+    }
+    std::vector< uint64_t > fingerprints;
+    std::vector< std::vector< size_t > > groups;
+    GroupByShard( obj_ids, indices, fingerprints, groups );
+    for ( size_t i = 0; i < noOfShards_; ++i ) {
+      if ( groups[i].empty() ) {
+        continue;
+      }
+      Shard& shard( shards_[i] );
+      boost::mutex::scoped_lock lock( shard.mutex_ );
+      for ( std::vector< size_t >::const_iterator it = groups[i].begin(); it != groups[i].end(); ++ it ) {
+        StoreLocation location;
+        if ( RemoveFromObjects( shard, obj_ids[ *it ], fingerprints[ *it ], &location ) ) {
+          journal_->Append( JournalRecord( JournalRecord::Erase, obj_ids[ *it ] ) );
+          EraseRecord( obj_ids[ *it ], location );
+          erased[ *it ] = true;
+        }
+      }
     }
-    RemoveFromObjects( obj_id );
+    ExpireObjects();
+    FlushJournal();
+  } CATCH();
+  return static_cast< size_t >( std::count( erased.begin(), erased.end(), true ) );
+}
 
-    // Make sure structures are in sync
-    assert( objects_.size() == pruneList_.size() );
+bool CacheImpl::EraseObject( const ObjectId& obj_id )
+{
+  try {
+    {
+      const uint64_t fingerprint = Fingerprint( obj_id );
+      Shard& shard( GetShard( fingerprint ) );
+      boost::mutex::scoped_lock lock( shard.mutex_ );
+      StoreLocation location;
+      if ( !RemoveFromObjects( shard, obj_id, fingerprint, &location ) ) {
+        return false;
+      }
+      journal_->Append( JournalRecord( JournalRecord::Erase, obj_id ) );
+      EraseRecord( obj_id, location );
+    }
+    ExpireObjects();
+    FlushJournal();
 
     return true;
   } CATCH_RETURN();
 }
 
+bool CacheImpl::EraseRecord( const ObjectId& obj_id, const StoreLocation& location )
+{
+  if ( location.length_ == 0 ) {
+    return true;
+  }
+  StageTimer timer( stages_[ CacheStats::DeleteStage ] );
+  return store_->Erase( obj_id, location );
+}
+
 void CacheImpl::setMaxSize( uint64_t max_size )
 {
+  SPAN( "setMaxSize" );
+  const uint64_t start = StartCall();
   try {
+    ExpireObjects();
     PruneObjects( max_size );
     maxSize_ = max_size;
+    FlushJournal();
   } CATCH();
+  operations_[ CacheStats::SetMaxSizeOperation ].Add( OsNanoseconds() - start );
+  if ( trace_ ) {
+    try {
+      trace_->Add( TraceRecord::SetMaxSize, start / 1000, 0, max_size, true );
+    } CATCH();
+  }
 }
 
 uint64_t CacheImpl::getCurrentSize()
 {
-  return currSize_;
+  // A staged object that replaces a stored one counts twice until it is
+  // stored itself
+  return currSize_ + stagedBytes_ + reservedSize_;
+}
+
+void CacheImpl::getStats( CacheStats& stats )
+{
+  stats.hits = 0;
+  stats.prunes = 0;
+  for ( size_t i = 0; i < noOfPartitions_; ++i ) {
+    stats.hits += partitions_[i].hits_;
+    stats.prunes += partitions_[i].prunes_;
+  }
+  stats.misses = misses_;
+  stats.integrityFailures = integrityFailures_;
+  stats.bytesRead = bytesRead_;
+  stats.bytesWritten = bytesWritten_;
+  stats.deleteFailures = deleteFailures_;
+  for ( size_t i = 0; i < CacheStats::noOfOperations; ++i ) {
+    operations_[i].Get( stats.operations[i] );
+  }
+  for ( size_t i = 0; i < CacheStats::noOfStages; ++i ) {
+    stages_[i].Get( stats.stages[i] );
+  }
+}
+
+bool CacheImpl::getPartitionStats( const std::string& partition, PartitionStats& stats )
+{
+  size_t i;
+  if ( !FindPartition( partition, i ) ) {
+    return false;
+  }
+  const Partition& found( partitions_[i] );
+  stats.maxSize = found.maxSize_;
+  stats.currentSize = found.size_;
+  stats.objects = found.objects_;
+  stats.hits = found.hits_;
+  stats.writes = found.writes_;
+  stats.prunes = found.prunes_;
+  return true;
+}
+
+void CacheImpl::CompactSegments()
+{
+  uint32_t segment;
+  while ( segmentStore_->WaitForCompaction( segment ) ) {
+    CompactSegment( segment );
+    try {
+      FlushJournal();
+    } CATCH();
+  }
 }
 
-void CacheImpl::SaveMetaData()
+void CacheImpl::CompactSegment( uint32_t segment )
 {
-  std::vector< uint8_t > out;
-  if ( !pruneList_.empty() ) {
-    // Allocate space for hash
-    out.resize( sizeof ( Crypt::Sha1HashValue ) );
+  SPAN( "CompactSegment" );
+  std::vector< SegmentStore::RecordInfo > records;
+  try {
+    segmentStore_->ListRecords( segment, records );
+  } catch ( OsReadFileException& ) {
+    // Retired by pruning before we got to it
+    return;
+  } CATCH();
+
+  for ( std::vector< SegmentStore::RecordInfo >::const_iterator it = records.begin(); it != records.end(); ++ it ) {
+    try {
+      // Decrypt just enough of the record to find the object id
+      std::vector< uint8_t > prefix;
+      segmentStore_->ReadPrefix( it->location_, std::min< size_t >( RecordPrefixSize( it->idSize_ ), it->location_.length_ ), prefix );
+      ObjectId objId( RecordObjectId( prefix, it->idSize_ ) );
+      {
+        boost::mutex::scoped_lock lock( blobMutex_ );
+        if ( blobs_.count( objId ) ) {
+          lock.unlock();
+          CompactBlob( objId, it->location_ );
+          continue;
+        }
+      }
+      const uint64_t fingerprint = Fingerprint( objId );
+      Shard& shard( GetShard( fingerprint ) );
+
+      {
+        // Dead records are simply left behind
+        boost::mutex::scoped_lock lock( shard.mutex_ );
+        const ObjectIndex::Entry* found( shard.objects_.Find( objId, fingerprint ) );
+        if ( !found || !( found->Location() == it->location_ ) ) {
+          continue;
+        }
+      }
+
+      // Copy the record forward without holding the lock
+      StoredRecord record;
+      segmentStore_->Read( objId, it->location_, record );
+      StoreLocation moved;
+      segmentStore_->Write( objId, record.buffer(), moved );
 
-    std::ostringstream oss;
-    for ( PruneList::const_iterator it = pruneList_.begin(); it != pruneList_.end(); ++ it ) {
-      CacheObject& cacheObject( it->mapElement_->second );
-      // Write size and object id
-      oss <<  cacheObject.size_ << " " << Crypt::Base64Encode( it->mapElement_->first ) << " ";
+      boost::mutex::scoped_lock lock( shard.mutex_ );
+      ObjectIndex::Entry* found( shard.objects_.Find( objId, fingerprint ) );
+      if ( found && found->Location() == it->location_ ) {
+        found->SetLocation( moved );
+        shard.Policy( *found ).Relocated( shard.objects_, *found );
+        // The old record may be gone for good once erased, so the move
+        // has to be on disk first
+        journal_->Append( JournalRecord( JournalRecord::Write, objId, found->size_, moved, found->expiry_, PriorityOf( *found ),
+                                         PartitionOf( *found ) ) );
+        journal_->Flush();
+        segmentStore_->Erase( objId, it->location_ );
+      } else {
+        // Erased or rewritten while we were copying
+        segmentStore_->Erase( objId, moved );
+      }
+    } catch ( OsReadFileException& ) {
+      // The segment was retired by pruning while we were compacting it
+      return;
+    } CATCH();
+  }
+}
+
+void CacheImpl::CompactBlob( const ObjectId& blobId, const StoreLocation& location )
+{
+  {
+    boost::mutex::scoped_lock lock( blobMutex_ );
+    BlobMap::const_iterator blob = blobs_.find( blobId );
+    if ( blob == blobs_.end() || !( blob->second.location_ == location ) ) {
+      return;
     }
+  }
+
+  // Only the blob moves. The objects pointing to it don't know where it is.
+  StoredRecord record;
+  segmentStore_->Read( blobId, location, record );
+  StoreLocation moved;
+  segmentStore_->Write( blobId, record.buffer(), moved );
+
+  boost::mutex::scoped_lock lock( blobMutex_ );
+  BlobMap::iterator blob = blobs_.find( blobId );
+  if ( blob != blobs_.end() && blob->second.location_ == location ) {
+    blob->second.location_ = moved;
+    journal_->Append( JournalRecord( JournalRecord::Blob, blobId, blob->second.size_, moved, 0, NormalPriority,
+                                     blob->second.partition_ ) );
+    journal_->Flush();
+    segmentStore_->Erase( blobId, location );
+  } else {
+    segmentStore_->Erase( blobId, moved );
+  }
+}
+
+void CacheImpl::Checkpoint()
+{
+  SPAN( "Checkpoint" );
+  // Only one thread writes a checkpoint, the others just go on
+  boost::mutex::scoped_try_lock lock( checkpointMutex_ );
+  if ( !lock.owns_lock() ) {
+    return;
+  }
 
-    const std::string& metaData( oss.str() );
-    std::copy( metaData.begin(), metaData.end(), back_inserter( out ) );
+  // Everything changed from now on goes to the new journal, so the
+  // checkpoint may be taken from the live index, shard by shard.
+  journal_->StartCheckpoint();
 
-    // Calculate hash. Put it first in the out buffer.
-    std::vector< uint8_t >::iterator objectDataBegin( out.begin() + sizeof ( Crypt::Sha1HashValue ) );
-    Crypt::Sha1Hash( objectDataBegin , out.end(), out.begin() );
+  JournalCheckpoint checkpoint;
+  if ( segmentStore_ ) {
+    // Write the segments, so that unreferenced ones can be deleted when loading
+    segmentStore_->GetSegments( checkpoint.segments_, checkpoint.nextSegment_ );
+  }
 
-    // Encrypt
-    Crypt::Rc4EncryptDecrypt( encryptionKey_, out );
+  // Save the objects of all shards in write order, so that they are
+  // pruned in the same order after loading
+  std::vector< std::pair< uint64_t, size_t > > order;
+  for ( size_t i = 0; i < noOfShards_; ++i ) {
+    boost::mutex::scoped_lock lock( shards_[i].mutex_ );
+    for ( size_t n = 0; n < shards_[i].objects_.size(); ++n ) {
+      const ObjectIndex::Entry& entry( shards_[i].objects_.At( n ) );
+      const ObjectId objId( entry.Id() );
+      StoreLocation location;
+      ObjectId blobId;
+      FindRecord( objId, entry, location, blobId );
+      order.push_back( std::make_pair( entry.sequence_, checkpoint.objects_.size() ) );
+      checkpoint.Add( objId, entry.size_, entry.Location(), entry.expiry_, PriorityOf( entry ), PartitionOf( entry ), blobId );
+    }
+  }
+  std::sort( order.begin(), order.end() );
+  std::vector< JournalCheckpoint::Object > objects;
+  objects.reserve( order.size() );
+  for ( size_t i = 0; i < order.size(); ++i ) {
+    objects.push_back( checkpoint.objects_[ order[i].second ] );
+  }
+  checkpoint.objects_.swap( objects );
+  {
+    boost::mutex::scoped_lock lock( blobMutex_ );
+    for ( BlobMap::const_iterator it = blobs_.begin(); it != blobs_.end(); ++ it ) {
+      checkpoint.AddBlob( it->first, it->second.size_, it->second.location_, it->second.partition_ );
+    }
   }
 
-  // Save to file
-  OsWriteFile( OsConcatPath( path_, metaDataFilename ), out );
+  journal_->CommitCheckpoint( checkpoint );
 }
 
-void CacheImpl::LoadMetaData()
+void CacheImpl::FlushJournal()
 {
-  // Clear previous data
-  objects_.clear();
-  pruneList_.clear();
+  SPAN( "FlushJournal" );
+  journal_->Flush();
+  // Keep the journal from growing much beyond the size of the index
+  if ( journal_->RecordCount() > std::max< uint64_t >( options_.checkpointRecords, objectCount_ ) ) {
+    Checkpoint();
+  }
+}
 
+bool CacheImpl::LoadLegacyMetaData( const std::string& fullPath, JournalCheckpoint& checkpoint )
+{
+  // The text format used before the journal: the (encrypted) SHA1 hash of
+  // the rest, then "size base64id " per object, with segment storage
+  // preceded by the segments and followed by the segment and offset.
   std::vector< uint8_t > in;
-  std::string fullPath( OsConcatPath( path_, metaDataFilename ) );
-
-  if ( OsFileExists( fullPath ) ) {
-    OsReadFile( fullPath, in );
-    if ( in.size() > sizeof( Crypt::Sha1HashValue ) ) {
-      // Decrypt
-      Crypt::Rc4EncryptDecrypt( encryptionKey_, in );
-
-      std::vector< uint8_t >::iterator objectDataBegin( in.begin() + sizeof( Crypt::Sha1HashValue ) );
-
-      Crypt::Sha1HashValue hash;
-      std::copy( in.begin(), objectDataBegin, hash.begin() );
-
-      // First, check the has to see that the file is intact.
-      Crypt::Sha1HashValue calculatedHash;
-      Crypt::Sha1Hash( objectDataBegin, in.end(), calculatedHash.begin() );
-       
-      if ( hash == calculatedHash ) {
-        // Ok, go on
-        std::string metaData( objectDataBegin, in.end() );
-        std::istringstream is( metaData );
-
-        while ( is ) {
-          CacheObject cacheObj;
-          std::string encodedObjId;
-
-          if ( ( is >> cacheObj.size_ ) &&
-               ( is >> encodedObjId ) ) {
-            ObjectId objId( Crypt::Base64Decode( encodedObjId ) );
-
-            if ( cacheObj.size_ <= maxSize_ ) {
-              // This object will fit, at least after pruning.
-              AddToObjects( objId, cacheObj );
-            }
-          }
+  OsReadFile( fullPath, in );
+  if ( in.size() <= sizeof( Crypt::Sha1HashValue ) ) {
+    return false;
+  }
+
+  // Decrypt
+  Crypt::Rc4EncryptDecrypt( encryptionKey_, in );
+
+  std::vector< uint8_t >::iterator objectDataBegin( in.begin() + sizeof( Crypt::Sha1HashValue ) );
+
+  Crypt::Sha1HashValue hash;
+  std::copy( in.begin(), objectDataBegin, hash.begin() );
+
+  // First, check the has to see that the file is intact.
+  Crypt::Sha1HashValue calculatedHash;
+  Crypt::Sha1Hash( objectDataBegin, in.end(), calculatedHash.begin() );
+  if ( hash != calculatedHash ) {
+    return false;
+  }
+
+  std::string metaData( objectDataBegin, in.end() );
+  std::istringstream is( metaData );
+
+  size_t noOfSegments = 0;
+  if ( segmentStore_ && ( is >> checkpoint.nextSegment_ ) && ( is >> noOfSegments ) ) {
+    for ( size_t i = 0; i < noOfSegments && is; ++i ) {
+      uint32_t segment;
+      if ( is >> segment ) {
+        checkpoint.segments_.push_back( segment );
+      }
+    }
+  }
+
+  while ( is ) {
+    uint32_t size;
+    std::string encodedObjId;
+    StoreLocation location;
+
+    if ( ( is >> size ) &&
+         ( is >> encodedObjId ) ) {
+      const ObjectId obj_id( Crypt::Base64Decode( encodedObjId ) );
+
+      if ( segmentStore_ &&
+           ( !( is >> location.segment_ ) || !( is >> location.offset_ ) ) ) {
+        break;
+      }
+      location.length_ = static_cast< uint32_t >( sizeof( Crypt::Sha1HashValue ) + obj_id.size() + size );
+      checkpoint.Add( obj_id, size, location );
+    }
+  }
+  return true;
+}
+
+void CacheImpl::ApplyRecord( const JournalRecord& record )
+{
+  // Objects of partitions that are no longer there go to the first one
+  const uint8_t partition = record.partition_ < noOfPartitions_ ? record.partition_ : 0;
+  if ( record.type_ == JournalRecord::Blob ) {
+    Blob& blob( blobs_[ record.objId_ ] );
+    blob.location_ = record.location_;
+    blob.size_ = record.size_;
+    blob.partition_ = partition;
+    return;
+  }
+  const uint64_t fingerprint = Fingerprint( record.objId_ );
+  Shard& shard( GetShard( fingerprint ) );
+  boost::mutex::scoped_lock lock( shard.mutex_ );
+  RemoveFromObjects( shard, record.objId_, fingerprint );
+  if ( record.type_ == JournalRecord::Write && record.size_ <= maxSize_ ) {
+    InsertObject( shard, record.objId_, fingerprint, record.size_, record.location_, record.expiry_, record.priority_,
+                  partition, record.blobId_.empty() ? 0 : &record.blobId_ );
+  }
+}
+
+void CacheImpl::LoadBlobs( std::vector< ObjectId >& gone )
+{
+  for ( boost::unordered_map< ObjectId, ObjectId >::const_iterator it = links_.begin(); it != links_.end(); ++ it ) {
+    BlobMap::iterator blob = blobs_.find( it->second );
+    if ( blob == blobs_.end() ) {
+      gone.push_back( it->first );
+    } else {
+      ++ blob->second.refs_;
+    }
+  }
+
+  std::vector< ObjectId > lost;
+  for ( BlobMap::iterator it = blobs_.begin(); it != blobs_.end(); ) {
+    Blob& blob( it->second );
+    if ( blob.refs_ == 0 ) {
+      // Whatever pointed to it has gone since. The blob was erased then.
+      it = blobs_.erase( it );
+      continue;
+    }
+    if ( segmentStore_ ) {
+      try {
+        segmentStore_->Restore( blob.location_ );
+      } catch ( OsFileException& ) {
+        // The segment is gone, and with it the blob and its objects
+        lost.push_back( it->first );
+        it = blobs_.erase( it );
+        continue;
+      }
+    }
+    currSize_ += blob.size_;
+    partitions_[ blob.partition_ ].size_ += blob.size_;
+    ++ it;
+  }
+  if ( !lost.empty() ) {
+    const std::set< ObjectId > lostBlobs( lost.begin(), lost.end() );
+    for ( boost::unordered_map< ObjectId, ObjectId >::const_iterator it = links_.begin(); it != links_.end(); ++ it ) {
+      if ( lostBlobs.count( it->second ) ) {
+        gone.push_back( it->first );
+      }
+    }
+  }
+}
+
+void CacheImpl::LoadCheckpoint( const JournalCheckpoint& checkpoint )
+{
+  // Nobody else can use the cache yet, so the shards are filled without
+  // locking, after making room for all of their objects
+  std::vector< size_t > shardCounts( noOfShards_ );
+  for ( std::vector< JournalCheckpoint::Object >::const_iterator it = checkpoint.objects_.begin(); it != checkpoint.objects_.end(); ++ it ) {
+    if ( !it->blob_ ) {
+      ++ shardCounts[ &GetShard( it->fingerprint_ ) - &shards_[0] ];
+    }
+  }
+  for ( size_t i = 0; i < noOfShards_; ++i ) {
+    shards_[i].objects_.Reserve( shardCounts[i] );
+    shards_[i].presence_.Reserve( shardCounts[i] );
+  }
+
+  // Inserting is bound by cache misses on the tables, so start fetching
+  // the slots of the objects a bit ahead
+  const size_t prefetchDistance = 16;
+  std::vector< uint64_t > sizes( noOfPartitions_ );
+  std::vector< uint64_t > counts( noOfPartitions_ );
+  for ( std::vector< JournalCheckpoint::Object >::const_iterator it = checkpoint.objects_.begin(); it != checkpoint.objects_.end(); ++ it ) {
+    if ( static_cast< size_t >( checkpoint.objects_.end() - it ) > prefetchDistance ) {
+      const uint64_t ahead = it[ prefetchDistance ].fingerprint_;
+      GetShard( ahead ).objects_.Prefetch( ahead );
+      GetShard( ahead ).presence_.Prefetch( ahead );
+    }
+    const size_t partition = it->partition_ < noOfPartitions_ ? it->partition_ : 0;
+    if ( it->blob_ ) {
+      // Counted by LoadBlobs
+      Blob& blob( blobs_[ checkpoint.Id( *it ) ] );
+      blob.location_ = it->location_;
+      blob.size_ = it->size_;
+      blob.partition_ = static_cast< uint8_t >( partition );
+      continue;
+    }
+    if ( it->size_ > maxSize_ ) {
+      continue;
+    }
+    if ( it->blobIdSize_ ) {
+      links_[ checkpoint.Id( *it ) ] = checkpoint.BlobId( *it );
+    }
+    Shard& shard( GetShard( it->fingerprint_ ) );
+    const size_t policy = PolicyOf( partition, it->priority_ );
+    ObjectIndex::Entry& entry( shard.objects_.Insert( checkpoint.IdData( *it ), it->idSize_, it->fingerprint_,
+                                                      policy * policyQueues ) );
+    entry.size_ = it->size_;
+    entry.sequence_ = ++ sequence_;
+    entry.expiry_ = it->expiry_;
+    entry.SetLocation( it->location_ );
+    shard.policies_[ policy ]->Inserted( shard.objects_, entry, it->fingerprint_ );
+    shard.presence_.Insert( it->fingerprint_ );
+    if ( it->expiry_ != 0 ) {
+      expiryTimers_.Add( checkpoint.Id( *it ), it->expiry_ );
+    }
+    sizes[ partition ] += it->size_;
+    ++ counts[ partition ];
+  }
+  for ( size_t i = 0; i < noOfPartitions_; ++i ) {
+    partitions_[i].size_ += sizes[i];
+    partitions_[i].objects_ += counts[i];
+    currSize_ += sizes[i];
+    objectCount_ += counts[i];
+  }
+}
+
+void CacheImpl::LoadMetaData()
+{
+  JournalCheckpoint checkpoint;
+  std::vector< JournalRecord > records;
+  std::string legacyPath;
+  if ( !journal_->Open( checkpoint, records ) ) {
+    // Convert the meta data of an older version, if there is any
+    legacyPath = OsConcatPath( path_, segmentStore_ ? segmentMetaDataFilename : metaDataFilename );
+    if ( !OsFileExists( legacyPath ) || !LoadLegacyMetaData( legacyPath, checkpoint ) ) {
+      legacyPath.clear();
+    }
+  }
+
+  // Replay the checkpoint and the journal into the index. The store is
+  // only told about the objects that are left at the end.
+  if ( legacyPath.empty() ) {
+    // A checkpoint holds every object once
+    LoadCheckpoint( checkpoint );
+  } else {
+    // Older meta data may list an object more than once
+    for ( std::vector< JournalCheckpoint::Object >::const_iterator it = checkpoint.objects_.begin(); it != checkpoint.objects_.end(); ++ it ) {
+      ApplyRecord( JournalRecord( JournalRecord::Write, checkpoint.Id( *it ), it->size_, it->location_ ) );
+    }
+  }
+  uint32_t lastSegment = 0;
+  for ( std::vector< JournalRecord >::const_iterator it = records.begin(); it != records.end(); ++ it ) {
+    ApplyRecord( *it );
+    lastSegment = std::max( lastSegment, it->location_.segment_ );
+  }
+
+  // Objects whose record is gone
+  std::vector< ObjectId > gone;
+  LoadBlobs( gone );
+  if ( segmentStore_ ) {
+    for ( size_t i = 0; i < noOfShards_; ++i ) {
+      for ( size_t n = 0; n < shards_[i].objects_.size(); ++n ) {
+        const ObjectIndex::Entry& entry( shards_[i].objects_.At( n ) );
+        if ( entry.length_ == 0 ) {
+          // Deduplicated, its blob is restored by LoadBlobs
+          continue;
+        }
+        try {
+          segmentStore_->Restore( entry.Location() );
+        } catch ( OsFileException& ) {
+          // The segment is gone. So is the object.
+          gone.push_back( entry.Id() );
         }
       }
     }
   }
+  for ( std::vector< ObjectId >::const_iterator it = gone.begin(); it != gone.end(); ++ it ) {
+    ApplyRecord( JournalRecord( JournalRecord::Erase, *it ) );
+  }
+
+  if ( segmentStore_ ) {
+    // Segments started after the checkpoint may have emptied out too
+    std::vector< uint32_t > segments( checkpoint.segments_ );
+    for ( uint32_t segment = checkpoint.nextSegment_; segment <= lastSegment; ++segment ) {
+      segments.push_back( segment );
+    }
+    segmentStore_->FinishRestore( segments, std::max( checkpoint.nextSegment_, lastSegment + 1 ) );
+  }
+  ExpireObjects();
+  PruneObjects( maxSize_ );
+
+  if ( !legacyPath.empty() ) {
+    // The checkpoint takes over from the old meta data
+    Checkpoint();
+    OsDeleteFile( legacyPath );
+  } else if ( journal_->NeedsCheckpoint() ) {
+    Checkpoint();
+  }
+  journal_->Flush();
 }
 
 
@@ -321,3 +2986,8 @@ Cache* createCache( const std::string& path, const std::vector< uint8_t >& encry
 {
   return cache_s = new CacheImpl( path, encryption_key );
 }
+
+Cache* createCache( const std::string& path, const std::vector< uint8_t >& encryption_key, const CacheOptions& options )
+{
+  return cache_s = new CacheImpl( path, encryption_key, options );
+}
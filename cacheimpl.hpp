@@ -2,53 +2,410 @@
 #define __CACHEIMPL_HPP__
 
 #include "cache.hpp"
+#include "crypt.hpp"
+#include "objectstore.hpp"
+#include "objectindex.hpp"
+#include "presenceindex.hpp"
+#include "journal.hpp"
+#include "evictionpolicy.hpp"
+#include "timerwheel.hpp"
+#include "workerpool.hpp"
+#include "memorytier.hpp"
+#include "trace.hpp"
+#include "stats.hpp"
 
-const std::string fileExtension = ".CDF";
+// Meta data files of older versions, converted to a journal when found
 const std::string metaDataFilename = "cache.db";
+const std::string segmentMetaDataFilename = "segments.db";
 
-namespace intrusive = boost::intrusive;
+// hasObject only times one call in this many for getStats
+const uint64_t timedLookups = 16;
+// readObjectStream hands objects to the sink in chunks of this size
+const size_t streamChunkSize = 64 * 1024;
+// Objects are encrypted and authenticated in chunks of this size, which
+// is what a range read has to read and verify at least
+const size_t recordChunkSize = 64 * 1024;
+
+class SegmentStore;
+class OsFile;
 
 class CacheImpl : public Cache
 {
  public:
-  CacheImpl( const std::string& path, const std::vector< uint8_t >& encryption_key );
+  CacheImpl( const std::string& path, const std::vector< uint8_t >& encryption_key, const CacheOptions& options = CacheOptions() );
   virtual ~CacheImpl();
   virtual bool hasObject( const ObjectId& obj_id );
   virtual bool readObject( const ObjectId& obj_id, std::vector< uint8_t >& result );
   virtual bool writeObject( const ObjectId& obj_id, const std::vector< uint8_t >& value );
+  virtual bool writeObject( const ObjectId& obj_id, const std::vector< uint8_t >& value, std::time_t expiry,
+                            Priority priority = NormalPriority );
+  virtual bool writeObject( const ObjectId& obj_id, const std::vector< uint8_t >& value, const std::string& partition,
+                            std::time_t expiry = 0, Priority priority = NormalPriority );
+  virtual Writer* beginWrite( const ObjectId& obj_id, uint64_t expectedSize = 0 );
+  virtual Writer* beginWrite( const ObjectId& obj_id, uint64_t expectedSize, const std::string& partition,
+                              std::time_t expiry = 0, Priority priority = NormalPriority );
+  virtual bool readObjectStream( const ObjectId& obj_id, const ReadSink& sink );
+  virtual bool readObjectRange( const ObjectId& obj_id, uint64_t offset, uint64_t length, std::vector< uint8_t >& result );
+  virtual void readObjectAsync( const ObjectId& obj_id, const ReadCallback& done );
+  virtual void writeObjectAsync( const ObjectId& obj_id, const std::vector< uint8_t >& value, const WriteCallback& done );
   virtual bool eraseObject( const ObjectId& obj_id );
+  virtual size_t hasObjects( const std::vector< ObjectId >& obj_ids, std::vector< bool >& found );
+  virtual size_t readObjects( const std::vector< ObjectId >& obj_ids, std::vector< std::vector< uint8_t > >& results,
+                              std::vector< bool >& found );
+  virtual size_t writeObjects( const std::vector< ObjectId >& obj_ids, const std::vector< std::vector< uint8_t > >& values,
+                               std::vector< bool >& written );
+  virtual size_t eraseObjects( const std::vector< ObjectId >& obj_ids, std::vector< bool >& erased );
   virtual void setMaxSize( uint64_t max_size );
   virtual uint64_t getCurrentSize();
+  virtual bool getPartitionStats( const std::string& partition, PartitionStats& stats );
+  virtual bool getMemoryTierStats( MemoryTierStats& stats );
+  virtual void getStats( CacheStats& stats );
+  virtual void flush();
 
  private:
-  typedef intrusive::list_base_hook<
-   intrusive::link_mode< intrusive::auto_unlink> > auto_unlink_hook;
+  // A slice of the index, picked by the fingerprint of the object id.
+  // Every shard has its own lock, so callers working on different shards
+  // don't wait for each other. hasObject only looks at presence_, which
+  // needs no lock at all. Every priority of every partition has an
+  // eviction policy of its own, each using its own queues of objects_.
+  struct Shard
+  {
+    boost::mutex mutex_;
+    ObjectIndex objects_;
+    PresenceIndex presence_; // Changed together with objects_
+    std::vector< boost::shared_ptr< EvictionPolicy > > policies_;
+
+    EvictionPolicy& Policy( const ObjectIndex::Entry& entry ) { return *policies_[ entry.Queue() / policyQueues ]; }
+  };
 
-  struct CacheObject : public auto_unlink_hook
+  // A partition of the cache, and its share of the objects of all shards
+  struct Partition
   {
-    boost::unordered_map< ObjectId, CacheObject >::pointer mapElement_;
+    Partition()
+        : maxSize_( 0 ), compression_( CacheOptions::NoCompression ), size_( 0 ), objects_( 0 ), hits_( 0 ), writes_( 0 ),
+          prunes_( 0 ) {}
+    std::string name_;
+    uint64_t maxSize_;
+    CacheOptions::Compression compression_;
+    boost::atomic< uint64_t > size_;
+    boost::atomic< uint64_t > objects_;
+    boost::atomic< uint64_t > hits_;
+    boost::atomic< uint64_t > writes_;
+    boost::atomic< uint64_t > prunes_;
+  };
+
+  // A record shared by deduplicated objects with the same contents. It
+  // counts towards the size of the partition it was first written to.
+  struct Blob
+  {
+    Blob() : size_( 0 ), partition_( 0 ), refs_( 0 ) {}
+    StoreLocation location_;
     uint32_t size_;
+    uint8_t partition_;
+    uint32_t refs_; // Objects pointing to it, only counted once loaded
+  };
+  typedef boost::unordered_map< ObjectId, Blob > BlobMap;
+
+  // A read handed to readQueue_, on its way to the callback
+  struct AsyncRead
+  {
+    ObjectId objId_;
+    uint64_t fingerprint_;
+    StoreLocation location_;
+    ObjectId blobId_; // Empty if the record is the object's own
+    size_t partition_;
+    std::vector< uint8_t > buffer_; // The encoded object
+    ReadCallback done_;
+  };
+
+  // Returned by beginWrite
+  class ObjectWriter;
+  friend class ObjectWriter;
+
+  // Where FindObjects found an object of a batch
+  struct FoundObject
+  {
+    size_t index_; // In the batch
+    uint64_t fingerprint_;
+    StoreLocation location_;
+    ObjectId blobId_;
+    size_t partition_;
+  };
+
+  // The public calls count themselves in the stats, and record
+  // themselves in trace_ if there is one. A call takes the time with
+  // StartCall first, or passes 0 if it isn't timed, and returns through
+  // EndCall, which returns ok. A batch counts once in the histogram of
+  // its operation, but every object of it is counted, and gets a trace
+  // record of its own with the duration of the whole batch.
+  uint64_t StartCall() const;
+  bool EndCall( CacheStats::Operation operation, uint64_t start, const ObjectId& obj_id, uint64_t size, bool ok );
+  void EndBatch( CacheStats::Operation operation, uint64_t start, const std::vector< ObjectId >& obj_ids,
+                 const std::vector< std::vector< uint8_t > >* values, const std::vector< bool >& ok );
+  // Counts an object read or written by a call, ok if it was
+  void CountObject( CacheStats::Operation operation, uint64_t size, bool ok );
+  // What the public calls of the same names do
+  bool HasObject( const ObjectId& obj_id );
+  bool ReadObject( const ObjectId& obj_id, std::vector< uint8_t >& result );
+  size_t HasObjects( const std::vector< ObjectId >& obj_ids, std::vector< bool >& found );
+  size_t ReadObjects( const std::vector< ObjectId >& obj_ids, std::vector< std::vector< uint8_t > >& results,
+                      std::vector< bool >& found );
+  size_t WriteObjects( const std::vector< ObjectId >& obj_ids, const std::vector< std::vector< uint8_t > >& values,
+                       std::vector< bool >& written );
+  size_t EraseObjects( const std::vector< ObjectId >& obj_ids, std::vector< bool >& erased );
+  bool ReadObjectStream( const ObjectId& obj_id, const ReadSink& sink );
+  bool ReadObjectRange( const ObjectId& obj_id, uint64_t offset, uint64_t length, std::vector< uint8_t >& result );
+
+  size_t ShardIndex( uint64_t fingerprint ) const;
+  Shard& GetShard( uint64_t fingerprint );
+  // Splits the objects of a batch at indices by shard, so that every
+  // shard's lock is taken once. fingerprints is indexed like obj_ids.
+  void GroupByShard( const std::vector< ObjectId >& obj_ids, const std::vector< size_t >& indices,
+                     std::vector< uint64_t >& fingerprints, std::vector< std::vector< size_t > >& groups );
+  // An object written in write-back mode that hasn't been stored yet
+  struct StagedObject
+  {
+    boost::shared_ptr< const std::vector< uint8_t > > value_;
+    size_t partition_;
+    std::time_t expiry_;
+    Priority priority_;
+    uint64_t sequence_; // Position in stagedOrder_
   };
+  typedef std::map< ObjectId, StagedObject > StagedMap;
+
+  // Looks an object up to read it, and drops it if it has expired. The
+  // record of a deduplicated object is its blob's, and blobId is set to
+  // the id of the blob; otherwise it is left empty.
+  bool FindObject( const ObjectId& obj_id, uint64_t fingerprint, StoreLocation& location, ObjectId& blobId, size_t& partition );
+  void FindObjects( const std::vector< ObjectId >& obj_ids, const std::vector< size_t >& indices,
+                    std::vector< FoundObject >& found );
+  // Where the record of the object of entry is, like FindObject.
+  // Requires the shard lock.
+  void FindRecord( const ObjectId& obj_id, const ObjectIndex::Entry& entry, StoreLocation& location, ObjectId& blobId );
+  // Reads the object found at location, from the memory tier if it is
+  // there. If the record turns out to be bad, the object is read again
+  // if it has moved meanwhile, and dropped if it is still there.
+  bool ReadFound( const ObjectId& obj_id, uint64_t fingerprint, StoreLocation location, ObjectId blobId, size_t partition,
+                  std::vector< uint8_t >& result );
+  // Looks an object up and reads its record with read, which is given
+  // the id the record was written for and sets delivered once it has
+  // handed over any part of it. If the read fails the object is read
+  // again if it has moved meanwhile and nothing was delivered, and
+  // dropped if it is still there.
+  typedef boost::function< bool ( const ObjectId& recordId, const StoreLocation& location, bool& delivered ) > StoredRead;
+  bool ReadStored( const ObjectId& obj_id, const StoredRead& read );
+
+  bool WriteObject( const ObjectId& obj_id, const std::vector< uint8_t >& value, size_t partition, std::time_t expiry,
+                    Priority priority );
+  // Compresses an object for a record in partition, if the partition
+  // compresses and it is worth it, like CompressObject
+  bool CompressRecord( const std::vector< uint8_t >& value, size_t partition, std::vector< uint8_t >& compressed );
+  // Encrypts and stores an object, whatever the write mode
+  bool PersistObject( const ObjectId& obj_id, const std::vector< uint8_t >& value, size_t partition, std::time_t expiry,
+                      Priority priority, bool flushJournal = true, uint64_t* reserved = 0 );
+  // Commits a stored record and adds it to the index, then prunes to
+  // make it fit. The space a writer had reserved for it is given back,
+  // and *reserved set to 0, as soon as the object itself counts. A
+  // deduplicated object has no record, and is added with the reference
+  // to its blob that was taken for it.
+  void PublishObject( const ObjectId& obj_id, uint64_t size, const StoreLocation& location, size_t partition,
+                      std::time_t expiry, Priority priority, bool flushJournal = true, uint64_t* reserved = 0,
+                      const ObjectId* blobId = 0 );
+  bool EraseObject( const ObjectId& obj_id );
+  // Erases the record of an object that was removed from the index, if
+  // it had one of its own. False if the store couldn't.
+  bool EraseRecord( const ObjectId& obj_id, const StoreLocation& location );
+  // Deletes what writes that never finished left in temporaryDirectory
+  void RemoveTemporaries();
 
+  // Blobs of deduplicated objects. BlobId names the blob of an object.
+  // ReferenceBlob takes a reference to a blob for an object about to be
+  // written, and returns false if there is no such blob; StoreBlob then
+  // stores one, with a reference. ReleaseBlob drops a reference, erasing
+  // the blob with its last one, and requires blobMutex_.
+  ObjectId BlobId( const std::vector< uint8_t >& value );
+  bool ReferenceBlob( const ObjectId& blobId );
+  void StoreBlob( const ObjectId& blobId, const std::vector< uint8_t >& value, size_t partition );
+  void ReleaseBlob( BlobMap::iterator blob );
+  // Returns false if there is no such partition
+  bool FindPartition( const std::string& name, size_t& partition ) const;
+
+  // Records are written in the format options_.encryption asks for, and
+  // decoded whatever format they are in. A compressed value is what
+  // CompressObject made of the object, and only goes in an AEAD record.
+  void EncodeObject( const ObjectId& obj_id, const std::vector< uint8_t >& value, std::vector< uint8_t >& buffer,
+                     bool compressed = false );
+  bool DecodeObject( const ObjectId& obj_id, const uint8_t* data, size_t size, std::vector< uint8_t >& result );
+  bool DecodeLegacyObject( const ObjectId& obj_id, const uint8_t* data, size_t size, std::vector< uint8_t >& result );
+  // Writes the header, a new nonce and the encrypted object id of a
+  // chunked record, of a compressed object or not, to prefix
+  void WriteRecordPrefix( const ObjectId& obj_id, uint8_t* prefix, bool compressed = false );
+  // The cipher of the AEAD record that prefix begins, 0 if there is none
+  Crypt::Aead* RecordAead( const uint8_t* prefix );
+  // Starts operation on the object of the version 2 record that prefix
+  // begins. Returns false if the record isn't one of obj_id.
+  bool OpenRecord( const ObjectId& obj_id, const uint8_t* prefix, boost::scoped_ptr< Crypt::Aead::Operation >& operation );
+  // The object id of a record of either format, from the first
+  // RecordPrefixSize( idSize ) bytes, without checking the record. Empty
+  // if it can't be decrypted.
+  ObjectId RecordObjectId( const std::vector< uint8_t >& prefix, size_t idSize );
+  // Reads, decodes and hands the record at location to sink a chunk at a
+  // time. delivered is set once sink has been called.
+  bool StreamObject( const ObjectId& obj_id, const StoreLocation& location, const ReadSink& sink, bool& delivered );
+  bool StreamLegacyObject( const ObjectId& obj_id, OsFile& file, uint64_t offset, uint64_t length, const ReadSink& sink,
+                           bool& delivered );
+  // Reads and verifies only the chunks of a chunked record that hold the
+  // range. Other records are streamed in full. inRange is cleared if the
+  // object ends before offset, which doesn't make the record invalid.
+  bool RangeObject( const ObjectId& obj_id, const StoreLocation& location, uint64_t offset, uint64_t length,
+                    std::vector< uint8_t >& result, bool& inRange, bool& delivered );
+
+  // Meta data is kept in a MetaJournal
   void LoadMetaData();
-  void SaveMetaData();
+  bool LoadLegacyMetaData( const std::string& fullPath, JournalCheckpoint& checkpoint );
+  // Fills the empty index from a checkpoint in one pass
+  void LoadCheckpoint( const JournalCheckpoint& checkpoint );
+  void ApplyRecord( const JournalRecord& record );
+  // Counts the references to every blob once the index is loaded, drops
+  // the blobs nothing refers to, and adds the objects whose blob is gone
+  // to gone
+  void LoadBlobs( std::vector< ObjectId >& gone );
+  void Checkpoint();
+  // Writes out the journal, and a checkpoint when it has grown too long.
+  // Call without holding any shard lock.
+  void FlushJournal();
 
-  bool RemoveFromObjects( const ObjectId& obj_id );
-  void AddToObjects( const ObjectId& obj_id, CacheObject& cacheObject );
+  // The following require the shard to be locked. Removing a
+  // deduplicated object releases its blob, and gives it an empty
+  // location. Adding one with blobId hands its reference to the index.
+  bool RemoveFromObjects( Shard& shard, const ObjectId& obj_id, uint64_t fingerprint, StoreLocation* location = 0 );
+  void AddToObjects( Shard& shard, const ObjectId& obj_id, uint64_t fingerprint, uint32_t size, const StoreLocation& location,
+                     uint32_t expiry, uint8_t priority, uint8_t partition, const ObjectId* blobId = 0 );
+  // Like AddToObjects, without telling the store or the journal
+  void InsertObject( Shard& shard, const ObjectId& obj_id, uint64_t fingerprint, uint32_t size, const StoreLocation& location,
+                     uint32_t expiry, uint8_t priority, uint8_t partition, const ObjectId* blobId = 0 );
+  // The next object to prune from the shard: of the victims of its
+  // policies, the one of the lowest priority that was put last in line.
+  // Only partitions over budget are looked at, if there are any.
+  ObjectIndex::Entry* Victim( Shard& shard );
 
   void PruneObjects( uint64_t maxCacheSize );
+  // Erases the objects whose timers have expired. Call without holding
+  // any shard lock.
+  void ExpireObjects();
+
+  // Waits for room for another asynchronous operation, starting the
+  // workers on first use. FinishAsync gives the room back.
+  void StartWorkers();
+  void StartAsync();
+  void FinishAsync();
+  // Reads an object found in the index asynchronously, after StartAsync.
+  // done is called once, on any thread.
+  void SubmitRead( const ObjectId& obj_id, uint64_t fingerprint, const StoreLocation& location, const ObjectId& blobId,
+                   size_t partition, const ReadCallback& done );
+  // Body of the thread that hands the reads completed by readQueue_ to
+  // the workers
+  void CollectReads();
+  // Run on the workers
+  void CompleteRead( AsyncRead* read, bool ok );
+  void RunRead( const ObjectId& obj_id, const ReadCallback& done );
+  void RunWrite( uint64_t start, const ObjectId& obj_id, const std::vector< uint8_t >& value, const WriteCallback& done );
+  // What readObjectAsync hands on instead of done, to count the read
+  void EndAsyncRead( uint64_t start, const ObjectId& obj_id, const ReadCallback& done, bool ok,
+                     const std::vector< uint8_t >& value );
+
+  // Write-back support. StageObject waits while the staging area is
+  // full. Unstage drops a staged object, and requires flushMutex_.
+  void StageObject( const ObjectId& obj_id, const std::vector< uint8_t >& value, size_t partition, std::time_t expiry,
+                    Priority priority );
+  bool Unstage( const ObjectId& obj_id );
+  // Returns false if obj_id isn't staged. value is left empty if it has
+  // expired.
+  bool FindStaged( const ObjectId& obj_id, boost::shared_ptr< const std::vector< uint8_t > >& value, size_t& partition );
+  // Body of the flusher thread, used with write-back
+  void FlushStaged();
+
+  // Body of the compactor thread, used with segment storage
+  void CompactSegments();
+  void CompactSegment( uint32_t segment );
+  // Copies the blob forward if it is still at location
+  void CompactBlob( const ObjectId& blobId, const StoreLocation& location );
 
   const std::string path_;
   const std::vector< uint8_t > encryptionKey_;
+  const CacheOptions options_;
+
+  // AEAD ciphers by algorithm, 0 where OpenSSL has none, and the one
+  // records are written with, or 0 for the legacy format
+  boost::scoped_ptr< Crypt::Aead > aeads_[ Crypt::Aead::ChaCha20Poly1305 + 1 ];
+  Crypt::Aead* writeAead_;
+
+  boost::scoped_ptr< ObjectStore > store_;
+  SegmentStore* segmentStore_; // store_ when using segment storage, otherwise 0
+  boost::scoped_ptr< boost::thread > compactor_;
+  boost::scoped_ptr< MetaJournal > journal_;
+  boost::scoped_ptr< MemoryTier > memoryTier_; // 0 if there is none
+  boost::scoped_ptr< TraceWriter > trace_; // 0 unless CacheOptions::traceFile is set
+
+  // For getStats. Hits and prunes are counted by partition.
+  AtomicHistogram operations_[ CacheStats::noOfOperations ];
+  AtomicHistogram stages_[ CacheStats::noOfStages ];
+  boost::atomic< uint64_t > lookups_; // By hasObject, which only times every timedLookups:th
+  boost::atomic< uint64_t > misses_;
+  boost::atomic< uint64_t > integrityFailures_;
+  boost::atomic< uint64_t > bytesRead_;
+  boost::atomic< uint64_t > bytesWritten_;
+  boost::atomic< uint64_t > deleteFailures_;
+  boost::mutex checkpointMutex_;
+
+  boost::scoped_array< Shard > shards_;
+  const size_t noOfShards_;
+  boost::scoped_array< Partition > partitions_;
+  const size_t noOfPartitions_;
+
+  // Only one thread prunes at a time
+  boost::mutex pruneMutex_;
+
+  // The blobs of deduplicated objects, and the blob every deduplicated
+  // object points to. Their index entries have an empty location. Taken
+  // after a shard lock.
+  boost::mutex blobMutex_;
+  BlobMap blobs_;
+  boost::unordered_map< ObjectId, ObjectId > links_;
+
+  // Timers of the objects that expire. Taken after a shard lock.
+  boost::mutex expiryMutex_;
+  TimerWheel expiryTimers_;
 
-  typedef boost::unordered_map< ObjectId, CacheObject > HashMap;
-  HashMap objects_;
+  // Asynchronous operations. Started on first use.
+  boost::mutex asyncMutex_;
+  boost::condition_variable asyncFinished_;
+  size_t asyncInFlight_;
+  boost::scoped_ptr< WorkerPool > workers_;
+  boost::scoped_ptr< OsReadQueue > readQueue_;
+  boost::scoped_ptr< boost::thread > readCollector_; // Only if readQueue_ is available
 
-  typedef intrusive::list< CacheObject, intrusive::constant_time_size< false > > PruneList;
-  PruneList pruneList_;
+  // Objects staged in write-back mode. A flusher thread stores them in
+  // the order they were staged, holding flushMutex_ while it stores one
+  // so that an erase or a direct write can't be overtaken by it. Taken
+  // before any shard lock, and stagingMutex_ after flushMutex_.
+  boost::mutex flushMutex_;
+  boost::mutex stagingMutex_;
+  boost::condition_variable objectStaged_;
+  boost::condition_variable objectsStored_;
+  StagedMap staged_;
+  std::map< uint64_t, ObjectId > stagedOrder_;
+  boost::atomic< uint64_t > stagedBytes_; // Also read without the lock
+  uint64_t stagingSequence_;
+  bool stopFlusher_;
+  boost::scoped_ptr< boost::thread > flusher_;
 
-  uint64_t maxSize_;
-  uint64_t currSize_;
+  boost::atomic< uint64_t > sequence_;
+  boost::atomic< uint64_t > maxSize_;
+  boost::atomic< uint64_t > currSize_;
+  boost::atomic< uint64_t > reservedSize_; // By writers, for what they haven't committed yet
+  boost::atomic< uint64_t > nextWriter_; // Names the files of writers
+  boost::atomic< uint64_t > objectCount_;
 };
 
 #endif // __CACHEIMPL_HPP__
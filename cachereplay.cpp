@@ -0,0 +1,321 @@
+#include "stdinc.hpp"
+#include "os.hpp"
+#include "cache.hpp"
+#include "objectindex.hpp"
+#include "presenceindex.hpp"
+#include "evictionpolicy.hpp"
+#include "trace.hpp"
+#include "benchutil.hpp"
+
+#include <boost/unordered_set.hpp>
+
+// Replays a trace written with CacheOptions::traceFile against a fresh
+// cache, or against a model of one in memory, and prints what happened
+// as JSON. Run with the trace, an optional scratch directory and
+// name=value parameters: mode (cache or simulate), storage (files or
+// segments), eviction (fifo, lru, clock, sieve or s3-fifo), shards,
+// memorytier (bytes) and maxsize (bytes, instead of what the trace set).
+
+namespace
+{
+typedef std::vector< uint8_t > BinaryBuffer;
+
+#ifdef _WIN32
+const std::string defaultReplayPath( "c:\\temp\\replay" );
+#else
+const std::string defaultReplayPath( "/tmp/clientcache/replay" );
+#endif
+
+const char* operationNames[] = { "has", "read", "write", "erase", "set_max_size" };
+// The id an object of the trace is replayed with
+Cache::ObjectId ReplayId( uint64_t objId )
+{
+  Cache::ObjectId id( 8 );
+  for ( size_t i = 0; i < id.size(); ++i ) {
+    id[i] = static_cast< uint8_t >( objId >> ( 8 * i ) );
+  }
+  return id;
+}
+
+// What the calls of a trace, or of its replay, came to
+struct ReplayResult
+{
+  ReplayResult() : reads( 0 ), hits( 0 ), bytesRead( 0 ), bytesWritten( 0 ), skippedWrites( 0 ), seconds( 0 ) {}
+  size_t reads;
+  size_t hits;
+  uint64_t bytesRead;
+  uint64_t bytesWritten;
+  size_t skippedWrites;
+  double seconds;
+  std::vector< double > latencies[ TraceRecord::SetMaxSize + 1 ]; // Microseconds, by operation
+
+  void Add( const TraceRecord& record, double latency ) {
+    if ( record.operation_ == TraceRecord::Read ) {
+      ++ reads;
+      if ( record.ok_ ) {
+        ++ hits;
+        bytesRead += record.size_;
+      }
+    } else if ( record.operation_ == TraceRecord::Write && record.ok_ ) {
+      bytesWritten += record.size_;
+    }
+    if ( latency >= 0 ) {
+      latencies[ record.operation_ ].push_back( latency );
+    }
+  }
+};
+
+/**
+   A model of a cache with a single shard and partition: the index and
+   eviction policy of the cache, and the size of every object, but no
+   contents and no files. Answers as the cache would, as far as which
+   objects it holds goes.
+*/
+class SimulatedCache
+{
+ public:
+  explicit SimulatedCache( CacheOptions::Eviction eviction )
+      : sequence_( 0 ), policy_( CreateEvictionPolicy( eviction, sequence_, 0 ) ), maxSize_( 500000000 ), size_( 0 ) {}
+
+  bool Has( const Cache::ObjectId& id ) {
+    return index_.Find( id, Fingerprint( id ) ) != 0;
+  }
+  bool Read( const Cache::ObjectId& id, uint64_t& size ) {
+    ObjectIndex::Entry* entry( index_.Find( id, Fingerprint( id ) ) );
+    if ( !entry ) {
+      return false;
+    }
+    policy_->Accessed( index_, *entry );
+    size = entry->size_;
+    return true;
+  }
+  bool Write( const Cache::ObjectId& id, uint64_t size ) {
+    if ( size > maxSize_ ) {
+      return false;
+    }
+    Erase( id );
+    Prune( maxSize_ - size );
+    const uint64_t fingerprint = Fingerprint( id );
+    ObjectIndex::Entry& entry( index_.Insert( id, fingerprint ) );
+    entry.size_ = static_cast< uint32_t >( size );
+    entry.sequence_ = ++ sequence_;
+    entry.expiry_ = 0;
+    policy_->Inserted( index_, entry, fingerprint );
+    size_ += size;
+    return true;
+  }
+  bool Erase( const Cache::ObjectId& id ) {
+    ObjectIndex::Entry* entry( index_.Find( id, Fingerprint( id ) ) );
+    if ( !entry ) {
+      return false;
+    }
+    size_ -= entry->size_;
+    index_.Erase( *entry );
+    return true;
+  }
+  void SetMaxSize( uint64_t maxSize ) {
+    Prune( maxSize );
+    maxSize_ = maxSize;
+  }
+
+ private:
+  void Prune( uint64_t maxSize ) {
+    while ( size_ > maxSize ) {
+      ObjectIndex::Entry* victim( policy_->Victim( index_ ) );
+      if ( !victim ) {
+        break;
+      }
+      policy_->Evicted( index_, *victim, Fingerprint( victim->Id() ) );
+      size_ -= victim->size_;
+      index_.Erase( *victim );
+    }
+  }
+
+  ObjectIndex index_;
+  boost::atomic< uint64_t > sequence_;
+  boost::scoped_ptr< EvictionPolicy > policy_;
+  uint64_t maxSize_;
+  uint64_t size_;
+};
+
+// Replays record, and returns whether it succeeded. Only one of cache and
+// model is set. size is set to the size of what was read.
+bool ReplayRecord( Cache* cache, SimulatedCache* model, const TraceRecord& record, BinaryBuffer& value, uint64_t& size )
+{
+  const Cache::ObjectId id( ReplayId( record.objId_ ) );
+  switch ( record.operation_ ) {
+    case TraceRecord::Has:
+      return cache ? cache->hasObject( id ) : model->Has( id );
+    case TraceRecord::Read:
+      if ( !cache ) {
+        return model->Read( id, size );
+      }
+      if ( !cache->readObject( id, value ) ) {
+        return false;
+      }
+      size = value.size();
+      return true;
+    case TraceRecord::Write:
+      if ( !cache ) {
+        return model->Write( id, record.size_ );
+      }
+      value.resize( static_cast< size_t >( record.size_ ) );
+      return cache->writeObject( id, value );
+    case TraceRecord::Erase:
+      return cache ? cache->eraseObject( id ) : model->Erase( id );
+    case TraceRecord::SetMaxSize:
+      if ( cache ) {
+        cache->setMaxSize( record.size_ );
+      } else {
+        model->SetMaxSize( record.size_ );
+      }
+      return true;
+  }
+  return false;
+}
+
+void PrintResult( const std::string& name, const ReplayResult& result, bool last )
+{
+  std::cout << "  \"" << name << "\": { \"reads\": " << result.reads << ", \"hit_ratio\": " << std::fixed << std::setprecision( 4 )
+            << ( result.reads ? static_cast< double >( result.hits ) / result.reads : 0.0 )
+            << ", \"bytes_read\": " << result.bytesRead << ", \"bytes_written\": " << result.bytesWritten
+            << ", \"skipped_writes\": " << result.skippedWrites
+            << ", \"seconds\": " << std::setprecision( 3 ) << result.seconds << ", \"latency_us\": {";
+  bool first = true;
+  for ( size_t op = 0; op <= TraceRecord::SetMaxSize; ++op ) {
+    if ( result.latencies[ op ].empty() ) {
+      continue;
+    }
+    std::cout << ( first ? " " : ", " ) << "\"" << operationNames[ op ] << "\": ";
+    PrintLatencies( std::cout, result.latencies[ op ] );
+    first = false;
+  }
+  std::cout << " } }" << ( last ? "" : "," ) << std::endl;
+}
+
+void Replay( const std::string& traceFile, const std::string& path, const BenchParameters& parameters )
+{
+  std::vector< TraceRecord > records;
+  std::time_t started;
+  if ( !ReadTrace( traceFile, records, started ) ) {
+    throw std::runtime_error( "Not a trace: " + traceFile );
+  }
+  // Replayed in the order the calls were made
+  std::stable_sort( records.begin(), records.end(),
+                    boost::bind( &TraceRecord::time_, _1 ) < boost::bind( &TraceRecord::time_, _2 ) );
+
+  const std::string mode( GetParameter( parameters, "mode", std::string( "cache" ) ) );
+  if ( mode != "cache" && mode != "simulate" ) {
+    throw std::runtime_error( "Unknown mode: " + mode );
+  }
+  CacheOptions options;
+  const std::string storage( GetParameter( parameters, "storage", std::string( "files" ) ) );
+  options.storage = storage == "segments" ? CacheOptions::SegmentStorage : CacheOptions::FileStorage;
+  options.eviction = GetEviction( parameters, options.eviction );
+  options.shards = GetParameter( parameters, "shards", options.shards );
+  options.memoryTierSize = GetParameter( parameters, "memorytier", options.memoryTierSize );
+  const uint64_t maxSize = GetParameter( parameters, "maxsize", 0 );
+
+  boost::scoped_ptr< Cache > cache;
+  boost::scoped_ptr< SimulatedCache > model;
+  if ( mode == "simulate" ) {
+    model.reset( new SimulatedCache( options.eviction ) );
+  } else {
+    OsEnsureDirectory( path );
+    const std::string key( "replaykey" );
+    cache.reset( createCache( path, BinaryBuffer( key.begin(), key.end() ), options ) );
+    if ( !cache ) {
+      throw std::runtime_error( "Can't create a cache in " + path );
+    }
+    // Start from an empty cache
+    cache->setMaxSize( 0 );
+    cache->setMaxSize( 500000000 );
+  }
+  if ( maxSize ) {
+    TraceRecord record;
+    record.operation_ = TraceRecord::SetMaxSize;
+    record.size_ = maxSize;
+    BinaryBuffer value;
+    uint64_t size;
+    ReplayRecord( cache.get(), model.get(), record, value, size );
+  }
+
+  ReplayResult recorded;
+  ReplayResult replayed;
+  // Objects whose read missed when traced but hits now. The client wrote
+  // them after fetching them, which it wouldn't have had to now.
+  boost::unordered_set< uint64_t > fetched;
+  BinaryBuffer value;
+  const uint64_t begin = OsMicroseconds();
+  for ( std::vector< TraceRecord >::const_iterator it = records.begin(); it != records.end(); ++ it ) {
+    recorded.Add( *it, it->duration_ );
+    if ( maxSize && it->operation_ == TraceRecord::SetMaxSize ) {
+      continue;
+    }
+    if ( it->operation_ == TraceRecord::Write && fetched.erase( it->objId_ ) ) {
+      ++ replayed.skippedWrites;
+      continue;
+    }
+    TraceRecord record( *it );
+    uint64_t size = 0;
+    const uint64_t start = OsMicroseconds();
+    record.ok_ = ReplayRecord( cache.get(), model.get(), *it, value, size );
+    const uint64_t end = OsMicroseconds();
+    if ( record.operation_ == TraceRecord::Read ) {
+      record.size_ = size;
+      if ( record.ok_ && !it->ok_ ) {
+        fetched.insert( it->objId_ );
+      } else {
+        fetched.erase( it->objId_ );
+      }
+    } else if ( record.operation_ != TraceRecord::SetMaxSize ) {
+      fetched.erase( it->objId_ );
+    }
+    replayed.Add( record, cache ? static_cast< double >( end - start ) : -1 );
+  }
+  replayed.seconds = ( OsMicroseconds() - begin ) / 1e6;
+  if ( !records.empty() ) {
+    recorded.seconds = ( records.back().time_ + records.back().duration_ ) / 1e6;
+  }
+  if ( cache ) {
+    cache->setMaxSize( 0 );
+  }
+
+  std::cout << "{ \"trace\": \"" << traceFile << "\", \"started\": " << started << ", \"records\": " << records.size()
+            << ", \"mode\": \"" << mode << "\", \"storage\": \"" << storage << "\", \"eviction\": \"" << EvictionName( options.eviction )
+            << "\", \"shards\": " << options.shards << ", \"memory_tier\": " << options.memoryTierSize
+            << ", \"max_size\": " << maxSize << "," << std::endl;
+  PrintResult( "recorded", recorded, false );
+  PrintResult( "replayed", replayed, true );
+  std::cout << "}" << std::endl;
+}
+}
+
+int main( int argc, char* argv[] )
+{
+  try {
+    if ( argc < 2 ) {
+      std::cerr << "Usage: cachereplay trace [scratch directory] [name=value...]" << std::endl;
+      return 2;
+    }
+    std::string path( defaultReplayPath );
+    BenchParameters parameters;
+    for ( int i = 2; i < argc; ++i ) {
+      const std::string argument( argv[i] );
+      const size_t equals = argument.find( '=' );
+      if ( equals != std::string::npos ) {
+        parameters[ argument.substr( 0, equals ) ] = argument.substr( equals + 1 );
+      } else {
+        path = argument;
+      }
+    }
+    Replay( argv[1], path, parameters );
+  } catch( boost::exception& ex ) {
+    std::cerr << diagnostic_information( ex ) << std::endl;
+    return 1;
+  } catch( std::exception& ex ) {
+    std::cerr << ex.what() << std::endl;
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,79 @@
+#include "stdinc.hpp"
+#include "compress.hpp"
+#include "span.hpp"
+
+#include <cmath>
+
+namespace
+{
+typedef boost::error_info< struct tag_errno,int > ErrNo;
+typedef boost::error_info< struct tag_errstr,const char* > ErrStr;
+
+const size_t noOfSamples = 4;
+const size_t sampleSize = 1024;
+}
+
+namespace Compress
+{
+double SampledEntropy( const uint8_t* data, size_t size )
+{
+  if ( size == 0 ) {
+    return 0;
+  }
+  size_t counts[ 256 ] = { 0 };
+  size_t total = 0;
+  if ( size <= noOfSamples * sampleSize ) {
+    for ( size_t i = 0; i < size; ++i ) {
+      ++ counts[ data[i] ];
+    }
+    total = size;
+  } else {
+    const size_t stride = ( size - sampleSize ) / ( noOfSamples - 1 );
+    for ( size_t sample = 0; sample < noOfSamples; ++sample ) {
+      const uint8_t* begin = data + sample * stride;
+      for ( size_t i = 0; i < sampleSize; ++i ) {
+        ++ counts[ begin[i] ];
+      }
+    }
+    total = noOfSamples * sampleSize;
+  }
+
+  double entropy = 0;
+  for ( size_t i = 0; i < 256; ++i ) {
+    if ( counts[i] ) {
+      const double p = static_cast< double >( counts[i] ) / total;
+      entropy -= p * std::log( p );
+    }
+  }
+  return entropy / std::log( 2.0 );
+}
+
+void Deflate( const uint8_t* data, size_t size, int level, std::vector< uint8_t >& out )
+{
+  SPAN( "Deflate" );
+  if ( size > std::numeric_limits< uLong >::max() / 2 ) {
+    throw Exception() << ErrStr( "Deflate: Too large" );
+  }
+  const size_t before = out.size();
+  uLongf length = compressBound( static_cast< uLong >( size ) );
+  out.resize( before + length );
+  const int result = compress2( &out[ before ], &length, data, static_cast< uLong >( size ), level );
+  if ( result != Z_OK ) {
+    out.resize( before );
+    throw Exception() << ErrStr( "Deflate: compress2" ) << ErrNo( result );
+  }
+  out.resize( before + length );
+}
+
+bool Inflate( const uint8_t* data, size_t size, uint8_t* out, size_t outSize )
+{
+  SPAN( "Inflate" );
+  if ( size > std::numeric_limits< uLong >::max() || outSize > std::numeric_limits< uLong >::max() ) {
+    return false;
+  }
+  uLongf length = static_cast< uLong >( outSize );
+  uint8_t empty = 0;
+  // zlib wants somewhere to write even when there is nothing to write
+  return uncompress( outSize ? out : &empty, &length, data, static_cast< uLong >( size ) ) == Z_OK && length == outSize;
+}
+}
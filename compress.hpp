@@ -0,0 +1,21 @@
+#ifndef __COMPRESS_HPP__
+#define __COMPRESS_HPP__
+
+namespace Compress
+{
+// Bits of entropy per byte of data, estimated from the byte frequencies
+// of a few small samples spread over it. 8 for random or already
+// compressed data, around 5 for text.
+double SampledEntropy( const uint8_t* data, size_t size );
+
+// Appends data deflated with zlib at level, 1 for the fastest to 9 for
+// the smallest, to out
+void Deflate( const uint8_t* data, size_t size, int level, std::vector< uint8_t >& out );
+// Inflates data into out, which takes exactly outSize bytes. False if
+// data is damaged or doesn't inflate to that size.
+bool Inflate( const uint8_t* data, size_t size, uint8_t* out, size_t outSize );
+
+class Exception: public boost::exception, public std::exception {};
+}
+
+#endif // __COMPRESS_HPP__
@@ -1,6 +1,7 @@
 #include "stdinc.hpp"
 #include "scoped_handle.hpp"
 #include "crypt.hpp"
+#include "span.hpp"
 
 namespace
 {
@@ -15,7 +16,7 @@ struct BioTraits
 typedef scoped_handle< BioTraits > BioHandle;
 
 typedef boost::error_info< struct tag_errno,int > ErrNo;
-typedef boost::error_info< struct tag_errstr,char* > ErrStr;
+typedef boost::error_info< struct tag_errstr,const char* > ErrStr;
 }
 
 namespace Crypt
@@ -93,6 +94,7 @@ std::vector< uint8_t > Base64Decode( const std::string& in )
 
 Sha1HashValue Sha1Hash( const std::vector< uint8_t >& buffer )
 {
+  SPAN( "Sha1Hash" );
   if ( buffer.empty() ) {
     throw std::invalid_argument( "Can't hash an empty buffer" );
   }
@@ -114,47 +116,269 @@ Sha1HashValue Sha1Hash( const std::vector< uint8_t >& buffer )
   return ret;
 }
 
+Sha1Hasher::Sha1Hasher()
+{
+  if ( !SHA1_Init( &ctx_ ) ) {
+    throw Exception() << ErrStr( "Sha1Hasher: SHA1_Init" ) << ErrNo( ERR_get_error() );
+  }
+}
+
+void Sha1Hasher::Update( const uint8_t* data, size_t size )
+{
+  if ( size && !SHA1_Update( &ctx_, data, size ) ) {
+    throw Exception() << ErrStr( "Sha1Hasher: SHA1_Update" ) << ErrNo( ERR_get_error() );
+  }
+}
+
+Sha1HashValue Sha1Hasher::Final()
+{
+  Sha1HashValue ret;
+  if ( !SHA1_Final( ret.c_array(), &ctx_ ) ) {
+    throw Exception() << ErrStr( "Sha1Hasher: SHA1_Final" ) << ErrNo( ERR_get_error() );
+  }
+  return ret;
+}
+
 
 void Rc4EncryptDecrypt( const std::vector< uint8_t >& key,  std::vector< uint8_t >& buffer )
 {
+  SPAN( "Rc4EncryptDecrypt" );
   if ( key.empty() || buffer.empty() ) {
     throw std::invalid_argument( "Rc4EncryptDecrypt, empty key or buffer" );
   }
-  RC4_KEY rc4Key;
-  RC4_set_key( &rc4Key, static_cast< int >(  key.size() ), static_cast< const unsigned char* >( &key[0] ) );
-  RC4( &rc4Key, static_cast< int >( buffer.size() ), static_cast< const unsigned char* > (&buffer[0]), static_cast< unsigned char* > (&buffer[0]) );
-}
-
-std::string EncodeFilenameFromBuffer( const std::vector< uint8_t > buffer, const std::string& fileExtension )
-{
-  std::ostringstream ss;
-  ss << std::setbase(16);
-  for( std::vector< uint8_t >::const_iterator it = buffer.begin(); it != buffer.end(); ++it ) {
-    ss << std::setw(2) << std::setfill('0') << ((unsigned int) *it );
-  }
-  return ss.str() + fileExtension;
-}
-
-//bool DecodeBufferFromFilename( const std::string& filename, std::vector< uint8_t >& buffer, const std::string& fileExtension )
-//{
-//      if ( filename.size() < fileExtension.size() + 1 ) {
-//              return false;
-//      }
-//
-//      if ( filename.substr( filename.size() - fileExtension.size(), fileExtension.size() ) != fileExtension ) {
-//              return false;
-//      }
-//
-//      std::string filenameNoExtension( filename.substr( 0, filename.size() - fileExtension.size() ) );
-//      if ( filenameNoExtension.size() % 2 ) {
-//              return false; // Should be even number of chars
-//      }
-//      for ( size_t i = 0; i < filenameNoExtension.size(); i = i + 2 ) {
-//              std::string byte( filenameNoExtension.substr( i, 2 ) );
-//              int byteNo = strtol( byte.c_str(), 0, 16 );
-//              buffer.push_back( byteNo );
-//      }
-//      return true;
-//}
+  Rc4Cipher cipher( key );
+  cipher.Process( &buffer[0], &buffer[0], buffer.size() );
+}
+
+Rc4Cipher::Rc4Cipher( const std::vector< uint8_t >& key )
+{
+  if ( key.empty() ) {
+    throw std::invalid_argument( "Rc4Cipher, empty key" );
+  }
+  RC4_set_key( &key_, static_cast< int >(  key.size() ), static_cast< const unsigned char* >( &key[0] ) );
+}
+
+void Rc4Cipher::Process( const uint8_t* in, uint8_t* out, size_t size )
+{
+  SPAN( "Rc4Cipher::Process" );
+  if ( size ) {
+    RC4( &key_, size, static_cast< const unsigned char* > ( in ), static_cast< unsigned char* > ( out ) );
+  }
+}
+
+namespace
+{
+const EVP_CIPHER* AeadCipher( Aead::Algorithm algorithm )
+{
+  switch ( algorithm ) {
+  case Aead::AesGcm:
+    return EVP_aes_256_gcm();
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L && !defined( OPENSSL_NO_CHACHA ) && !defined( OPENSSL_NO_POLY1305 )
+  case Aead::ChaCha20Poly1305:
+    return EVP_chacha20_poly1305();
+#endif
+  default:
+    return 0;
+  }
+}
+
+// Whether the CPU has AES-NI and PCLMULQDQ, which OpenSSL uses for GCM
+bool HasAesInstructions()
+{
+#if defined( __GNUC__ ) && ( defined( __x86_64__ ) || defined( __i386__ ) )
+  __builtin_cpu_init();
+  return __builtin_cpu_supports( "aes" ) && __builtin_cpu_supports( "pclmul" );
+#elif defined( _MSC_VER ) && ( defined( _M_X64 ) || defined( _M_IX86 ) )
+  int info[4];
+  __cpuid( info, 1 );
+  return ( info[2] & ( 1 << 25 ) ) && ( info[2] & ( 1 << 1 ) );
+#elif defined( __aarch64__ ) && defined( __ARM_FEATURE_CRYPTO )
+  return true;
+#else
+  return false;
+#endif
+}
+}
+
+Aead::Algorithm Aead::Fastest()
+{
+  if ( HasAesInstructions() || !Supported( ChaCha20Poly1305 ) ) {
+    return AesGcm;
+  }
+  return ChaCha20Poly1305;
+}
+
+bool Aead::Supported( Algorithm algorithm )
+{
+  return AeadCipher( algorithm ) != 0;
+}
+
+Aead::Aead( Algorithm algorithm, const std::vector< uint8_t >& key ) : algorithm_( algorithm )
+{
+  if ( !Supported( algorithm ) ) {
+    throw std::invalid_argument( "Aead, unsupported algorithm" );
+  }
+  if ( key.empty() ) {
+    throw std::invalid_argument( "Aead, empty key" );
+  }
+  SHA256( &key[0], key.size(), key_.data() );
+}
+
+Aead::~Aead()
+{
+  for ( std::vector< EVP_CIPHER_CTX* >::iterator it = contexts_.begin(); it != contexts_.end(); ++ it ) {
+    EVP_CIPHER_CTX_free( *it );
+  }
+  OPENSSL_cleanse( key_.data(), key_.size() );
+}
+
+EVP_CIPHER_CTX* Aead::Acquire()
+{
+  {
+    boost::mutex::scoped_lock lock( mutex_ );
+    if ( !contexts_.empty() ) {
+      EVP_CIPHER_CTX* ctx = contexts_.back();
+      contexts_.pop_back();
+      return ctx;
+    }
+  }
+  // Set up the key schedule once per context
+  EVP_CIPHER_CTX* ctx = EVP_CIPHER_CTX_new();
+  if ( !ctx ) {
+    throw Exception() << ErrStr( "Aead: EVP_CIPHER_CTX_new" ) << ErrNo( ERR_get_error() );
+  }
+  if ( EVP_CipherInit_ex( ctx, AeadCipher( algorithm_ ), 0, key_.data(), 0, 1 ) != 1 ) {
+    EVP_CIPHER_CTX_free( ctx );
+    throw Exception() << ErrStr( "Aead: EVP_CipherInit_ex" ) << ErrNo( ERR_get_error() );
+  }
+  return ctx;
+}
+
+void Aead::Release( EVP_CIPHER_CTX* ctx )
+{
+  boost::mutex::scoped_lock lock( mutex_ );
+  contexts_.push_back( ctx );
+}
+
+Aead::Operation::Operation( Aead& aead, bool encrypt, const uint8_t* nonce ) : aead_( aead ), ctx_( aead.Acquire() )
+{
+  // Only the nonce changes, the key schedule is kept
+  if ( EVP_CipherInit_ex( ctx_, 0, 0, 0, nonce, encrypt ? 1 : 0 ) != 1 ) {
+    EVP_CIPHER_CTX_free( ctx_ );
+    throw Exception() << ErrStr( "Aead: EVP_CipherInit_ex" ) << ErrNo( ERR_get_error() );
+  }
+}
+
+Aead::Operation::~Operation()
+{
+  aead_.Release( ctx_ );
+}
+
+void Aead::Operation::Authenticate( const uint8_t* data, size_t size )
+{
+  int length;
+  if ( size && EVP_CipherUpdate( ctx_, 0, &length, data, static_cast< int >( size ) ) != 1 ) {
+    throw Exception() << ErrStr( "Aead: EVP_CipherUpdate" ) << ErrNo( ERR_get_error() );
+  }
+}
+
+void Aead::Operation::Process( const uint8_t* in, uint8_t* out, size_t size )
+{
+  SPAN( "Aead::Process" );
+  // Both ciphers are stream ciphers, so all of the input comes out at once
+  while ( size ) {
+    const int piece = static_cast< int >( std::min< size_t >( size, 1 << 30 ) );
+    int length;
+    if ( EVP_CipherUpdate( ctx_, out, &length, in, piece ) != 1 || length != piece ) {
+      throw Exception() << ErrStr( "Aead: EVP_CipherUpdate" ) << ErrNo( ERR_get_error() );
+    }
+    in += piece;
+    out += piece;
+    size -= piece;
+  }
+}
+
+void Aead::Operation::Seal( uint8_t* tag )
+{
+  uint8_t rest[ EVP_MAX_BLOCK_LENGTH ];
+  int length;
+  if ( EVP_CipherFinal_ex( ctx_, rest, &length ) != 1 ||
+       EVP_CIPHER_CTX_ctrl( ctx_, EVP_CTRL_GCM_GET_TAG, static_cast< int >( tagSize ), tag ) != 1 ) {
+    throw Exception() << ErrStr( "Aead: Seal" ) << ErrNo( ERR_get_error() );
+  }
+}
+
+bool Aead::Operation::Open( const uint8_t* tag )
+{
+  if ( EVP_CIPHER_CTX_ctrl( ctx_, EVP_CTRL_GCM_SET_TAG, static_cast< int >( tagSize ), const_cast< uint8_t* >( tag ) ) != 1 ) {
+    throw Exception() << ErrStr( "Aead: Open" ) << ErrNo( ERR_get_error() );
+  }
+  uint8_t rest[ EVP_MAX_BLOCK_LENGTH ];
+  int length;
+  return EVP_CipherFinal_ex( ctx_, rest, &length ) == 1;
+}
+
+DigestValue KeyedDigest( const std::vector< uint8_t >& key, const uint8_t* data, size_t size )
+{
+  SPAN( "KeyedDigest" );
+  DigestValue ret;
+  unsigned int length = static_cast< unsigned int >( ret.size() );
+  uint8_t empty = 0;
+  if ( !HMAC( EVP_sha256(), key.empty() ? &empty : &key[0], static_cast< int >( key.size() ), size ? data : &empty, size,
+              ret.c_array(), &length ) || length != ret.size() ) {
+    throw Exception() << ErrStr( "KeyedDigest: HMAC" ) << ErrNo( ERR_get_error() );
+  }
+  return ret;
+}
+
+void RandomBytes( uint8_t* buffer, size_t size )
+{
+  if ( RAND_bytes( buffer, static_cast< int >( size ) ) != 1 ) {
+    throw Exception() << ErrStr( "RandomBytes: RAND_bytes" ) << ErrNo( ERR_get_error() );
+  }
+}
+
+std::string EncodeFilenameFromBuffer( const std::vector< uint8_t >& buffer, const std::string& fileExtension )
+{
+  return EncodeFilenameFromBuffer( buffer.empty() ? 0 : &buffer[0], buffer.size(), fileExtension );
+}
+
+std::string EncodeFilenameFromBuffer( const uint8_t* data, size_t size, const std::string& fileExtension )
+{
+  SPAN( "EncodeFilenameFromBuffer" );
+  static const char digits[] = "0123456789abcdef";
+  std::string ret( size * 2, '0' );
+  for ( size_t i = 0; i < size; ++i ) {
+    ret[ i * 2 ] = digits[ data[i] >> 4 ];
+    ret[ i * 2 + 1 ] = digits[ data[i] & 0xf ];
+  }
+  return ret + fileExtension;
+}
+
+bool DecodeBufferFromFilename( const std::string& filename, std::vector< uint8_t >& buffer, const std::string& fileExtension )
+{
+  if ( filename.size() <= fileExtension.size() ||
+       filename.compare( filename.size() - fileExtension.size(), fileExtension.size(), fileExtension ) != 0 ) {
+    return false;
+  }
+  const size_t length = filename.size() - fileExtension.size();
+  if ( length % 2 ) {
+    return false; // Should be even number of chars
+  }
+  buffer.resize( length / 2 );
+  for ( size_t i = 0; i < length; ++i ) {
+    const char c = filename[i];
+    uint8_t nibble;
+    if ( c >= '0' && c <= '9' ) {
+      nibble = static_cast< uint8_t >( c - '0' );
+    } else if ( c >= 'a' && c <= 'f' ) {
+      nibble = static_cast< uint8_t >( c - 'a' + 10 );
+    } else {
+      return false;
+    }
+    buffer[ i / 2 ] = static_cast< uint8_t >( i % 2 ? buffer[ i / 2 ] | nibble : nibble << 4 );
+  }
+  return true;
+}
 
 }
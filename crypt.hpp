@@ -3,26 +3,131 @@
 
 namespace Crypt
 {
-std::string EncodeFilenameFromBuffer( const std::vector< uint8_t > buffer, const std::string& fileExtension );
-// bool DecodeBufferFromFilename( const std::string& filename, std::vector< uint8_t >& buffer, const std::string& fileExtension );
+std::string EncodeFilenameFromBuffer( const std::vector< uint8_t >& buffer, const std::string& fileExtension );
+std::string EncodeFilenameFromBuffer( const uint8_t* data, size_t size, const std::string& fileExtension );
+// The reverse. False unless filename is lower case hex followed by
+// fileExtension.
+bool DecodeBufferFromFilename( const std::string& filename, std::vector< uint8_t >& buffer, const std::string& fileExtension );
 
 typedef boost::array< uint8_t, 20 > Sha1HashValue; // SHA1 is 160 bit
 Sha1HashValue Sha1Hash( const std::vector< uint8_t >& buffer );
 
+// SHA1 of data that comes a piece at a time. Hashing a buffer in several
+// calls gives the same hash as Sha1Hash on the whole buffer.
+class Sha1Hasher
+{
+ public:
+  Sha1Hasher();
+  void Update( const uint8_t* data, size_t size );
+  Sha1HashValue Final();
+
+ private:
+  SHA_CTX ctx_;
+};
+
 // Does a hash "in-place" into a buffer
 template < typename InIter, typename OutIter >
 void Sha1Hash( InIter begin, InIter end, OutIter out )
 {
-  // TODO: Possible improvement is to create hash in chunks
-  // to avoid having to allocate a large buffer.
-  std::vector< uint8_t > buffer( begin, end );
-  Sha1HashValue value( Sha1Hash( buffer ) );
+  // Hash in chunks, so that only a small buffer is needed whatever the
+  // size of the input
+  Sha1Hasher hasher;
+  uint8_t chunk[ 4096 ];
+  while ( begin != end ) {
+    size_t size = 0;
+    for ( ; begin != end && size < sizeof( chunk ); ++ begin ) {
+      chunk[ size++ ] = *begin;
+    }
+    hasher.Update( chunk, size );
+  }
+  Sha1HashValue value( hasher.Final() );
   std::copy( value.begin(), value.end(), out );
 }
 
 
 void Rc4EncryptDecrypt( const std::vector< uint8_t >& key,  std::vector< uint8_t >& buffer );
 
+// RC4 with the key stream kept between calls, so that a buffer can be
+// decrypted piece by piece, and from a read-only source into another
+// buffer. Processing a buffer in several calls gives the same result as
+// Rc4EncryptDecrypt on the whole buffer.
+class Rc4Cipher
+{
+ public:
+  explicit Rc4Cipher( const std::vector< uint8_t >& key );
+  void Process( const uint8_t* in, uint8_t* out, size_t size );
+
+ private:
+  RC4_KEY key_;
+};
+
+// Authenticated encryption with associated data: AES-256-GCM or
+// ChaCha20-Poly1305, which encrypt and authenticate in a single pass.
+// The key schedule is set up once, and the cipher contexts are kept in a
+// pool and reused for every message. Thread safe.
+class Aead
+{
+ public:
+  enum Algorithm
+  {
+    AesGcm = 1,
+    ChaCha20Poly1305 = 2
+  };
+  static const size_t nonceSize = 12;
+  static const size_t tagSize = 16;
+
+  // AES-GCM where the CPU has instructions for AES and carry-less
+  // multiplication, ChaCha20-Poly1305 otherwise, if OpenSSL has it
+  static Algorithm Fastest();
+  static bool Supported( Algorithm algorithm );
+
+  // The key may be of any length. It is hashed into a 256 bit one.
+  Aead( Algorithm algorithm, const std::vector< uint8_t >& key );
+  ~Aead();
+  Algorithm GetAlgorithm() const { return algorithm_; }
+
+  // Encrypts or decrypts one message, a piece at a time. Associated data
+  // goes first. Never use a nonce twice with the same key.
+  class Operation
+  {
+   public:
+    Operation( Aead& aead, bool encrypt, const uint8_t* nonce );
+    ~Operation();
+    void Authenticate( const uint8_t* data, size_t size );
+    void Process( const uint8_t* in, uint8_t* out, size_t size );
+    // Finishes encrypting, and writes the tag of tagSize bytes
+    void Seal( uint8_t* tag );
+    // Finishes decrypting. False if the message, or the associated data,
+    // doesn't match the tag.
+    bool Open( const uint8_t* tag );
+
+   private:
+    Aead& aead_;
+    EVP_CIPHER_CTX* ctx_;
+    Operation( const Operation& ); // not copyable
+    bool operator=( const Operation& ); // not assignable
+  };
+
+ private:
+  EVP_CIPHER_CTX* Acquire();
+  void Release( EVP_CIPHER_CTX* ctx );
+
+  const Algorithm algorithm_;
+  boost::array< uint8_t, 32 > key_;
+  boost::mutex mutex_;
+  std::vector< EVP_CIPHER_CTX* > contexts_; // Keyed and not in use
+  Aead( const Aead& ); // not copyable
+  bool operator=( const Aead& ); // not assignable
+};
+
+// HMAC-SHA256 of data under key. Equal data gives equal digests, but
+// without the key there is no telling what data a digest is of.
+typedef boost::array< uint8_t, 32 > DigestValue;
+DigestValue KeyedDigest( const std::vector< uint8_t >& key, const uint8_t* data, size_t size );
+
+// Fills buffer with cryptographically strong random bytes
+void RandomBytes( uint8_t* buffer, size_t size );
+
 class Exception: public boost::exception, public std::exception {};
 std::string Base64Encode( const std::vector< uint8_t >& buffer );
 std::vector< uint8_t > Base64Decode( const std::string& in );
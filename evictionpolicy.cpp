@@ -0,0 +1,203 @@
+#include "stdinc.hpp"
+#include "evictionpolicy.hpp"
+
+#include <deque>
+
+void EvictionPolicy::Inserted( ObjectIndex& /* index */, ObjectIndex::Entry& /* entry */, uint64_t /* fingerprint */ )
+{
+}
+
+void EvictionPolicy::Relocated( ObjectIndex& /* index */, ObjectIndex::Entry& /* entry */ )
+{
+  // The object keeps its place, only its location changed
+}
+
+void EvictionPolicy::Evicted( ObjectIndex& /* index */, const ObjectIndex::Entry& /* victim */, uint64_t /* fingerprint */ )
+{
+}
+
+namespace
+{
+// Evicts the oldest written object. Reads don't matter. With segment
+// storage this evicts in segment order, so whole segments are retired.
+class FifoPolicy : public EvictionPolicy
+{
+ public:
+  FifoPolicy( boost::atomic< uint64_t >& sequence, size_t firstQueue ) : EvictionPolicy( sequence, firstQueue ) {}
+
+  virtual void Accessed( ObjectIndex& /* index */, ObjectIndex::Entry& /* entry */ ) {}
+
+  virtual void Relocated( ObjectIndex& index, ObjectIndex::Entry& entry ) {
+    // The object now lives in the newest segment, so it becomes the
+    // newest entry to keep write order and segment order the same.
+    Renew( entry );
+    index.MoveToBack( entry, entry.Queue() );
+  }
+
+  virtual ObjectIndex::Entry* Victim( ObjectIndex& index ) {
+    return index.Oldest( Queue( 0 ) );
+  }
+};
+
+// Evicts the least recently used object. Every hit moves the entry to
+// the back of the list.
+class LruPolicy : public EvictionPolicy
+{
+ public:
+  LruPolicy( boost::atomic< uint64_t >& sequence, size_t firstQueue ) : EvictionPolicy( sequence, firstQueue ) {}
+
+  virtual void Accessed( ObjectIndex& index, ObjectIndex::Entry& entry ) {
+    Renew( entry );
+    index.MoveToBack( entry, entry.Queue() );
+  }
+
+  virtual ObjectIndex::Entry* Victim( ObjectIndex& index ) {
+    return index.Oldest( Queue( 0 ) );
+  }
+};
+
+// CLOCK, in its FIFO with reinsertion form: a hit only sets a bit, and
+// the oldest entry is moved to the back instead of evicted if its bit is
+// set.
+class ClockPolicy : public EvictionPolicy
+{
+ public:
+  ClockPolicy( boost::atomic< uint64_t >& sequence, size_t firstQueue ) : EvictionPolicy( sequence, firstQueue ) {}
+
+  virtual void Accessed( ObjectIndex& /* index */, ObjectIndex::Entry& entry ) {
+    entry.hits_ = 1;
+  }
+
+  virtual ObjectIndex::Entry* Victim( ObjectIndex& index ) {
+    for ( ObjectIndex::Entry* oldest = index.Oldest( Queue( 0 ) ); oldest; oldest = index.Oldest( Queue( 0 ) ) ) {
+      if ( !oldest->hits_ ) {
+        return oldest;
+      }
+      oldest->hits_ = 0;
+      Renew( *oldest );
+      index.MoveToBack( *oldest, Queue( 0 ) );
+    }
+    return 0;
+  }
+};
+
+// SIEVE: a hit only sets a bit. A hand sweeps from the oldest entry to
+// the newest and back again, clearing bits, and stops at the first entry
+// without one. Entries stay where they are, so new ones keep coming in
+// behind the hand.
+class SievePolicy : public EvictionPolicy
+{
+ public:
+  SievePolicy( boost::atomic< uint64_t >& sequence, size_t firstQueue ) : EvictionPolicy( sequence, firstQueue ) {}
+
+  virtual void Accessed( ObjectIndex& /* index */, ObjectIndex::Entry& entry ) {
+    entry.hits_ = 1;
+  }
+
+  virtual ObjectIndex::Entry* Victim( ObjectIndex& index ) {
+    ObjectIndex::Entry* hand = index.Hand( Queue( 0 ) );
+    if ( !hand ) {
+      hand = index.Oldest( Queue( 0 ) );
+    }
+    // Every entry passed loses its bit, so this ends within one sweep
+    while ( hand && hand->hits_ ) {
+      hand->hits_ = 0;
+      hand = index.Next( *hand );
+      if ( !hand ) {
+        hand = index.Oldest( Queue( 0 ) );
+      }
+    }
+    index.SetHand( Queue( 0 ), hand );
+    return hand;
+  }
+};
+
+// S3-FIFO: new objects go to a small FIFO queue holding about a tenth of
+// the objects. Those read while there move on to the main queue, the
+// others are evicted and remembered in a ghost queue of fingerprints.
+// An object written again while remembered goes straight to the main
+// queue. The main queue is a CLOCK with a hit counter of up to 3.
+class S3FifoPolicy : public EvictionPolicy
+{
+ public:
+  S3FifoPolicy( boost::atomic< uint64_t >& sequence, size_t firstQueue ) : EvictionPolicy( sequence, firstQueue ) {}
+
+  virtual void Inserted( ObjectIndex& index, ObjectIndex::Entry& entry, uint64_t fingerprint ) {
+    if ( ghosts_.count( fingerprint ) ) {
+      index.MoveToBack( entry, Queue( mainQueue ) );
+    }
+  }
+
+  virtual void Accessed( ObjectIndex& /* index */, ObjectIndex::Entry& entry ) {
+    if ( entry.hits_ < maxHits ) {
+      ++ entry.hits_;
+    }
+  }
+
+  virtual ObjectIndex::Entry* Victim( ObjectIndex& index ) {
+    for ( ;; ) {
+      const size_t small = index.QueueSize( Queue( smallQueue ) );
+      const size_t main = index.QueueSize( Queue( mainQueue ) );
+      if ( small > 0 && ( small * 10 > small + main || main == 0 ) ) {
+        ObjectIndex::Entry& oldest( *index.Oldest( Queue( smallQueue ) ) );
+        if ( !oldest.hits_ ) {
+          return &oldest;
+        }
+        oldest.hits_ = 0;
+        Renew( oldest );
+        index.MoveToBack( oldest, Queue( mainQueue ) );
+        continue;
+      }
+
+      ObjectIndex::Entry* oldest = index.Oldest( Queue( mainQueue ) );
+      if ( !oldest || !oldest->hits_ ) {
+        return oldest;
+      }
+      -- oldest->hits_;
+      Renew( *oldest );
+      index.MoveToBack( *oldest, Queue( mainQueue ) );
+    }
+  }
+
+  virtual void Evicted( ObjectIndex& index, const ObjectIndex::Entry& victim, uint64_t fingerprint ) {
+    if ( victim.Queue() != Queue( smallQueue ) ) {
+      return;
+    }
+    // Remember about as many evicted objects as there are objects
+    ghostOrder_.push_back( fingerprint );
+    ++ ghosts_[ fingerprint ];
+    while ( ghostOrder_.size() > std::max< size_t >( 1, index.size() ) ) {
+      boost::unordered_map< uint64_t, size_t >::iterator it( ghosts_.find( ghostOrder_.front() ) );
+      if ( -- it->second == 0 ) {
+        ghosts_.erase( it );
+      }
+      ghostOrder_.pop_front();
+    }
+  }
+
+ private:
+  static const size_t smallQueue = 0;
+  static const size_t mainQueue = 1;
+  static const uint8_t maxHits = 3;
+
+  std::deque< uint64_t > ghostOrder_;
+  boost::unordered_map< uint64_t, size_t > ghosts_; // Times each fingerprint is in ghostOrder_
+};
+}
+
+EvictionPolicy* CreateEvictionPolicy( CacheOptions::Eviction eviction, boost::atomic< uint64_t >& sequence, size_t firstQueue )
+{
+  switch ( eviction ) {
+    case CacheOptions::LruEviction:
+      return new LruPolicy( sequence, firstQueue );
+    case CacheOptions::ClockEviction:
+      return new ClockPolicy( sequence, firstQueue );
+    case CacheOptions::SieveEviction:
+      return new SievePolicy( sequence, firstQueue );
+    case CacheOptions::S3FifoEviction:
+      return new S3FifoPolicy( sequence, firstQueue );
+    case CacheOptions::FifoEviction:
+    default:
+      return new FifoPolicy( sequence, firstQueue );
+  }
+}
@@ -0,0 +1,54 @@
+#ifndef __EVICTIONPOLICY_HPP__
+#define __EVICTIONPOLICY_HPP__
+
+#include "cache.hpp"
+#include "objectindex.hpp"
+
+/**
+   Decides which object of a shard to evict next. Every shard has a policy
+   of its own, and the policy is only called with the shard locked.
+
+   A policy keeps its order in policyQueues queues of the ObjectIndex,
+   starting at the one it was created with, and in the hits_ of the
+   entries. Several policies may share an index, one per priority. The
+   cache evicts from the shard whose victim has the lowest sequence_, so
+   a policy that keeps an entry around for another round renews its
+   sequence.
+*/
+class EvictionPolicy
+{
+ public:
+  EvictionPolicy( boost::atomic< uint64_t >& sequence, size_t firstQueue ) : sequence_( sequence ), firstQueue_( firstQueue ) {}
+  virtual ~EvictionPolicy() {}
+
+  // entry has just been inserted, as the newest entry of the first queue
+  virtual void Inserted( ObjectIndex& index, ObjectIndex::Entry& entry, uint64_t fingerprint );
+  // entry was read. Called on every hit, so it should be cheap.
+  virtual void Accessed( ObjectIndex& index, ObjectIndex::Entry& entry ) = 0;
+  // The compactor has copied entry to the newest segment
+  virtual void Relocated( ObjectIndex& index, ObjectIndex::Entry& entry );
+  // Returns the entry to evict next, or 0 if there is none. May give
+  // entries another round on the way, but keeps returning the same entry
+  // until the index changes.
+  virtual ObjectIndex::Entry* Victim( ObjectIndex& index ) = 0;
+  // The victim is about to be erased from the index
+  virtual void Evicted( ObjectIndex& index, const ObjectIndex::Entry& victim, uint64_t fingerprint );
+
+ protected:
+  void Renew( ObjectIndex::Entry& entry ) { entry.sequence_ = ++ sequence_; }
+  // The index queue the policy uses as its queue i
+  size_t Queue( size_t i ) const { return firstQueue_ + i; }
+
+ private:
+  boost::atomic< uint64_t >& sequence_;
+  const size_t firstQueue_;
+};
+
+// Index queues used by a policy
+const size_t policyQueues = 2;
+
+// sequence is the counter the cache numbers its writes with. The policy
+// uses the index queues from firstQueue on.
+EvictionPolicy* CreateEvictionPolicy( CacheOptions::Eviction eviction, boost::atomic< uint64_t >& sequence, size_t firstQueue );
+
+#endif // __EVICTIONPOLICY_HPP__
@@ -0,0 +1,188 @@
+#include "stdinc.hpp"
+#include "os.hpp"
+#include "crypt.hpp"
+#include "filestore.hpp"
+
+namespace
+{
+const char hexDigits[] = "0123456789abcdef";
+
+// Hex of the hash of an object id, with the extension after it
+std::string HashedName( const Cache::ObjectId& obj_id, Crypt::Sha1HashValue& hash )
+{
+  // Empty ids are allowed, so the hasher, which takes those
+  Crypt::Sha1Hasher hasher;
+  hasher.Update( obj_id.empty() ? 0 : &obj_id[0], obj_id.size() );
+  hash = hasher.Final();
+  return Crypt::EncodeFilenameFromBuffer( hash.data(), hash.size(), fileExtension );
+}
+
+// Whether name is the temporary file of an uncommitted write, from before
+// the files were moved into directories
+bool IsLegacyTemporary( const std::string& name )
+{
+  const std::string suffix( ".tmp" );
+  const size_t at = name.find( fileExtension + "." );
+  Cache::ObjectId obj_id;
+  return at != std::string::npos && name.size() > suffix.size() &&
+    name.compare( name.size() - suffix.size(), suffix.size(), suffix ) == 0 &&
+    Crypt::DecodeBufferFromFilename( name.substr( 0, at + fileExtension.size() ), obj_id, fileExtension );
+}
+}
+
+FileStore::FileStore( const std::string& path ) : root_( path ), temporary_( root_, temporaryDirectory ), nextTemporary_( 0 )
+{
+  // All directories are made up front, so that writes never have to
+  for ( size_t i = 0; i < noOfDirectories; ++i ) {
+    directories_[i].reset( new OsDirectory( root_, std::string( 1, hexDigits[i] ) ) );
+    for ( size_t j = 0; j < noOfDirectories; ++j ) {
+      directories_[i]->EnsureDirectory( std::string( 1, hexDigits[j] ) );
+    }
+  }
+  Migrate();
+}
+
+std::string FileStore::Filename( const ObjectId& obj_id )
+{
+  Crypt::Sha1HashValue hash;
+  const std::string hashed( HashedName( obj_id, hash ) );
+  std::string ret;
+  ret.reserve( hashed.size() + 4 );
+  ret += hashed[0];
+  ret += '/';
+  ret += hashed[1];
+  ret += '/';
+  return ret + hashed;
+}
+
+OsDirectory& FileStore::Directory( const ObjectId& obj_id, std::string& name )
+{
+  Crypt::Sha1HashValue hash;
+  const std::string hashed( HashedName( obj_id, hash ) );
+  name.reserve( hashed.size() + 2 );
+  name.assign( 1, hashed[1] );
+  name += '/';
+  name += hashed;
+  return *directories_[ hash[0] >> 4 ];
+}
+
+std::string FileStore::TemporaryFilename( const std::string& name, const StoreLocation& location )
+{
+  char digits[ 20 ]; // Enough for any uint64_t
+  char* const end = digits + sizeof( digits );
+  char* begin = end;
+  uint64_t offset = location.offset_;
+  do {
+    *--begin = static_cast< char >( '0' + offset % 10 );
+    offset /= 10;
+  } while ( offset );
+  // Without the directory the file is committed to
+  return name.substr( name.find( '/' ) + 1 ) + "." + std::string( begin, end ) + ".tmp";
+}
+
+void FileStore::Migrate()
+{
+  std::vector< std::string > names;
+  root_.List( names );
+  ObjectId obj_id;
+  for ( std::vector< std::string >::const_iterator it = names.begin(); it != names.end(); ++it ) {
+    try {
+      if ( Crypt::DecodeBufferFromFilename( *it, obj_id, fileExtension ) ) {
+        root_.Rename( *it, Filename( obj_id ) );
+      } else if ( IsLegacyTemporary( *it ) ) {
+        // Left behind by a write that was never committed
+        root_.Delete( *it );
+      }
+    } catch ( OsFileException& ) {
+      // Left where it is. The object can't be read, so the cache drops it
+      // the first time it is asked for.
+    }
+  }
+}
+
+void FileStore::Write( const ObjectId& obj_id, const std::vector< uint8_t >& record, StoreLocation& location )
+{
+  location = StoreLocation();
+  location.length_ = static_cast< uint32_t >( record.size() );
+  location.offset_ = ++ nextTemporary_;
+  std::string name;
+  Directory( obj_id, name );
+  temporary_.Write( TemporaryFilename( name, location ), record );
+}
+
+void FileStore::WriteFile( const ObjectId& obj_id, const std::string& filename, StoreLocation& location )
+{
+  uint64_t size;
+  {
+    OsFile file( filename, false );
+    size = file.Size();
+  }
+  if ( size > std::numeric_limits< uint32_t >::max() ) {
+    throw std::invalid_argument( "Invalid record size" );
+  }
+  location = StoreLocation();
+  location.length_ = static_cast< uint32_t >( size );
+  location.offset_ = ++ nextTemporary_;
+  // Committed like any other write
+  std::string name;
+  Directory( obj_id, name );
+  temporary_.Move( filename, TemporaryFilename( name, location ) );
+}
+
+void FileStore::Commit( const ObjectId& obj_id, const StoreLocation& location )
+{
+  std::string name;
+  OsDirectory& directory( Directory( obj_id, name ) );
+  temporary_.Rename( TemporaryFilename( name, location ), directory, name );
+}
+
+void FileStore::Abort( const ObjectId& obj_id, const StoreLocation& location )
+{
+  std::string name;
+  Directory( obj_id, name );
+  try {
+    temporary_.Delete( TemporaryFilename( name, location ) );
+  } catch ( OsDeleteFileException& ) {
+  }
+}
+
+void FileStore::Read( const ObjectId& obj_id, const StoreLocation& location, StoredRecord& record )
+{
+  std::string name;
+  OsDirectory& directory( Directory( obj_id, name ) );
+  if ( location.length_ >= mappedReadThreshold ) {
+    // Map large files instead of reading them. The decryption reads
+    // straight from the mapping, so the encrypted data is never copied.
+    record.map( directory, name );
+  } else {
+    // Setting up a mapping costs more than copying a small file
+    directory.Read( name, record.buffer() );
+  }
+}
+
+bool FileStore::Erase( const ObjectId& obj_id, const StoreLocation& /* location */ )
+{
+  // The following could thrown an exception if the file is no longer available
+  // The user could have restarted the cache after removing a file manually.
+  // This is an "ok" error case
+  std::string name;
+  OsDirectory& directory( Directory( obj_id, name ) );
+  try {
+    directory.Delete( name );
+  } catch ( OsDeleteFileException& ) {
+    return false;
+  }
+  return true;
+}
+
+void FileStore::Overwritten( const ObjectId& /* obj_id */, const StoreLocation& /* previous */ )
+{
+  // Committing the new file has already replaced the old one
+}
+
+void FileStore::Locate( const ObjectId& obj_id, const StoreLocation& /* location */, std::string& filename, uint64_t& offset )
+{
+  std::string name;
+  filename = Directory( obj_id, name ).Path( name );
+  offset = 0;
+}
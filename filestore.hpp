@@ -0,0 +1,57 @@
+#ifndef __FILESTORE_HPP__
+#define __FILESTORE_HPP__
+
+#include "objectstore.hpp"
+
+const std::string fileExtension = ".CDF";
+
+// Objects at least this large are read through a memory mapping
+// instead of being copied into a buffer first.
+const uint32_t mappedReadThreshold = 256 * 1024;
+
+// Keeps every object in a file of its own. The file is named from a hash
+// of the object id, so every name has the same length however long the
+// id is, and is two levels of directories down, picked by the first two
+// hex digits of the name, so that no directory gets too many files.
+// Files are opened relative to the directories on the first level, which
+// are kept open.
+//
+// Writes go to a temporary file in temporaryDirectory that is renamed
+// into place on commit, so a file is always either the old or the new
+// version of an object.
+//
+// Caches from before the directories kept every object directly in path,
+// named from the hex of its id. Those files are moved into place when the
+// store is opened.
+class FileStore : public ObjectStore
+{
+ public:
+  explicit FileStore( const std::string& path );
+  virtual void Write( const ObjectId& obj_id, const std::vector< uint8_t >& record, StoreLocation& location );
+  virtual void WriteFile( const ObjectId& obj_id, const std::string& filename, StoreLocation& location );
+  virtual void Commit( const ObjectId& obj_id, const StoreLocation& location );
+  virtual void Abort( const ObjectId& obj_id, const StoreLocation& location );
+  virtual void Read( const ObjectId& obj_id, const StoreLocation& location, StoredRecord& record );
+  virtual bool Erase( const ObjectId& obj_id, const StoreLocation& location );
+  virtual void Overwritten( const ObjectId& obj_id, const StoreLocation& previous );
+  virtual void Locate( const ObjectId& obj_id, const StoreLocation& location, std::string& filename, uint64_t& offset );
+
+  // The file of an object, relative to path
+  static std::string Filename( const ObjectId& obj_id );
+
+ private:
+  static const size_t noOfDirectories = 16;
+
+  // The directory on the first level that the file of an object is in,
+  // and the name of the file relative to it
+  OsDirectory& Directory( const ObjectId& obj_id, std::string& name );
+  static std::string TemporaryFilename( const std::string& name, const StoreLocation& location );
+  void Migrate();
+
+  OsDirectory root_;
+  OsDirectory temporary_;
+  boost::scoped_ptr< OsDirectory > directories_[ noOfDirectories ];
+  boost::atomic< uint64_t > nextTemporary_;
+};
+
+#endif // __FILESTORE_HPP__
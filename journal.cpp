@@ -0,0 +1,621 @@
+#include "stdinc.hpp"
+#include "os.hpp"
+#include "crypt.hpp"
+#include "journal.hpp"
+#include "presenceindex.hpp"
+
+namespace
+{
+// Both files start with a plain text header: magic, format version and
+// generation. Everything after it is encrypted.
+const char journalMagic[] = "CCJN";
+const char checkpointMagic[] = "CCCP";
+const uint32_t journalVersion = 1;
+const uint32_t checkpointVersion = 5;
+const uint32_t oldestCheckpointVersion = 2;
+const size_t headerSize = 16;
+
+// The objects of a checkpoint are written in blocks of this many. Every
+// object starts with fixed size fields: size, segment, offset, length,
+// expiry, priority, partition, whether it is a blob, the size of the id
+// of its blob and the size of the id that follows, then the id of its
+// blob. Version 2 checkpoints lack the expiry, priority and partition,
+// version 3 ones the partition, and version 4 ones the blobs.
+const uint32_t objectsPerBlock = 4096;
+
+size_t FixedObjectSize( uint32_t version )
+{
+  return version == 2 ? 24 : version == 3 ? 29 : version == 4 ? 30 : 35;
+}
+
+// Every journal record is framed by its length and a checksum
+const size_t recordLengthSize = 4;
+const size_t checksumSize = 4;
+
+void PutUint32( std::vector< uint8_t >& out, uint32_t value )
+{
+  for ( int i = 0; i < 4; ++i ) {
+    out.push_back( static_cast< uint8_t >( value >> ( 8 * i ) ) );
+  }
+}
+
+void PutUint64( std::vector< uint8_t >& out, uint64_t value )
+{
+  PutUint32( out, static_cast< uint32_t >( value ) );
+  PutUint32( out, static_cast< uint32_t >( value >> 32 ) );
+}
+
+// Reads little endian values from a buffer, failing instead of reading
+// past its end
+class Reader
+{
+ public:
+  Reader( const uint8_t* data, size_t size ) : data_( data ), size_( size ), pos_( 0 ) {}
+  bool GetUint8( uint8_t& value ) {
+    if ( size_ - pos_ < 1 ) {
+      return false;
+    }
+    value = data_[ pos_ ++ ];
+    return true;
+  }
+  bool GetUint32( uint32_t& value ) {
+    if ( size_ - pos_ < 4 ) {
+      return false;
+    }
+    value = 0;
+    for ( int i = 0; i < 4; ++i ) {
+      value |= static_cast< uint32_t >( data_[ pos_ ++ ] ) << ( 8 * i );
+    }
+    return true;
+  }
+  bool GetUint64( uint64_t& value ) {
+    uint32_t low, high;
+    if ( !GetUint32( low ) || !GetUint32( high ) ) {
+      return false;
+    }
+    value = ( static_cast< uint64_t >( high ) << 32 ) | low;
+    return true;
+  }
+  bool GetBytes( size_t size, std::vector< uint8_t >& bytes ) {
+    if ( size_ - pos_ < size ) {
+      return false;
+    }
+    bytes.assign( data_ + pos_, data_ + pos_ + size );
+    pos_ += size;
+    return true;
+  }
+  bool GetBytes( size_t size, uint8_t* bytes ) {
+    if ( size_ - pos_ < size ) {
+      return false;
+    }
+    std::memcpy( bytes, data_ + pos_, size );
+    pos_ += size;
+    return true;
+  }
+  size_t pos() const { return pos_; }
+  bool AtEnd() const { return pos_ == size_; }
+
+ private:
+  const uint8_t* data_;
+  size_t size_;
+  size_t pos_;
+};
+
+void PutHeader( std::vector< uint8_t >& out, const char* magic, uint32_t version, uint64_t generation )
+{
+  out.insert( out.end(), magic, magic + 4 );
+  PutUint32( out, version );
+  PutUint64( out, generation );
+}
+
+bool GetHeader( Reader& reader, const char* magic, uint32_t& version, uint64_t& generation )
+{
+  std::vector< uint8_t > foundMagic;
+  return reader.GetBytes( 4, foundMagic ) && std::equal( foundMagic.begin(), foundMagic.end(), magic ) &&
+    reader.GetUint32( version ) && reader.GetUint64( generation );
+}
+
+void PutRecord( std::vector< uint8_t >& out, const JournalRecord& record )
+{
+  out.push_back( static_cast< uint8_t >( record.type_ ) );
+  PutUint32( out, static_cast< uint32_t >( record.objId_.size() ) );
+  out.insert( out.end(), record.objId_.begin(), record.objId_.end() );
+  if ( record.type_ == JournalRecord::Write || record.type_ == JournalRecord::Blob ) {
+    PutUint32( out, record.size_ );
+    PutUint32( out, record.location_.segment_ );
+    PutUint64( out, record.location_.offset_ );
+    PutUint32( out, record.location_.length_ );
+    PutUint32( out, record.expiry_ );
+    out.push_back( record.priority_ );
+    out.push_back( record.partition_ );
+    if ( !record.blobId_.empty() ) {
+      PutUint32( out, static_cast< uint32_t >( record.blobId_.size() ) );
+      out.insert( out.end(), record.blobId_.begin(), record.blobId_.end() );
+    }
+  }
+}
+
+bool GetRecord( Reader& reader, JournalRecord& record )
+{
+  uint8_t type;
+  uint32_t idSize;
+  if ( !reader.GetUint8( type ) || !reader.GetUint32( idSize ) || !reader.GetBytes( idSize, record.objId_ ) ) {
+    return false;
+  }
+  if ( type == JournalRecord::Write || type == JournalRecord::Blob ) {
+    record.type_ = static_cast< JournalRecord::Type >( type );
+    if ( !reader.GetUint32( record.size_ ) || !reader.GetUint32( record.location_.segment_ ) ||
+         !reader.GetUint64( record.location_.offset_ ) || !reader.GetUint32( record.location_.length_ ) ) {
+      return false;
+    }
+    // Records written before objects could expire end here, those
+    // written before partitions after the priority, and those of objects
+    // with a record of their own after the partition
+    if ( reader.AtEnd() ) {
+      return true;
+    }
+    if ( !reader.GetUint32( record.expiry_ ) || !reader.GetUint8( record.priority_ ) ||
+         record.priority_ >= Cache::noOfPriorities ) {
+      return false;
+    }
+    if ( reader.AtEnd() ) {
+      return true;
+    }
+    if ( !reader.GetUint8( record.partition_ ) ) {
+      return false;
+    }
+    return reader.AtEnd() || ( reader.GetUint32( idSize ) && idSize > 0 && reader.GetBytes( idSize, record.blobId_ ) );
+  }
+  if ( type == JournalRecord::Erase || type == JournalRecord::Prune ) {
+    record.type_ = static_cast< JournalRecord::Type >( type );
+    return true;
+  }
+  return false;
+}
+
+uint32_t Checksum( const uint8_t* data, size_t size )
+{
+  Crypt::Sha1HashValue hash( Crypt::Sha1Hash( std::vector< uint8_t >( data, data + size ) ) );
+  return static_cast< uint32_t >( hash[0] ) | ( static_cast< uint32_t >( hash[1] ) << 8 ) |
+    ( static_cast< uint32_t >( hash[2] ) << 16 ) | ( static_cast< uint32_t >( hash[3] ) << 24 );
+}
+
+// A block of checkpoint objects, as listed at the start of the checkpoint
+struct CheckpointBlock
+{
+  uint64_t offset_; // From the end of the directory
+  uint32_t size_;
+  uint32_t noOfObjects_;
+  Crypt::Sha1HashValue hash_; // Of the plain block
+  // Where the objects of the block go in the checkpoint
+  size_t firstObject_;
+  size_t firstId_;
+  std::vector< uint8_t > key_;
+};
+
+// Decrypts and checks the blocks first, first + step, ... from the mapped
+// file, whose blocks start at firstBlock, and fills in their objects.
+// Runs on several threads at once.
+void LoadBlocks( const OsMappedFile* file, uint32_t version, uint64_t firstBlock, const std::vector< CheckpointBlock >* blocks,
+                 size_t first, size_t step, JournalCheckpoint* checkpoint, boost::atomic< bool >* valid )
+{
+  std::vector< uint8_t > plain;
+  for ( size_t i = first; i < blocks->size() && *valid; i += step ) {
+    const CheckpointBlock& block( ( *blocks )[i] );
+    plain.resize( block.size_ );
+    Crypt::Rc4Cipher cipher( block.key_ );
+    cipher.Process( file->data() + firstBlock + block.offset_, &plain[0], plain.size() );
+    if ( Crypt::Sha1Hash( plain ) != block.hash_ ) {
+      *valid = false;
+      return;
+    }
+
+    Reader reader( &plain[0], plain.size() );
+    size_t idOffset = block.firstId_;
+    for ( size_t n = 0; n < block.noOfObjects_; ++n ) {
+      JournalCheckpoint::Object& object( checkpoint->objects_[ block.firstObject_ + n ] );
+      object.expiry_ = 0;
+      object.priority_ = Cache::NormalPriority;
+      object.partition_ = 0;
+      object.blobIdSize_ = 0;
+      uint8_t blob = 0;
+      if ( !reader.GetUint32( object.size_ ) || !reader.GetUint32( object.location_.segment_ ) ||
+           !reader.GetUint64( object.location_.offset_ ) || !reader.GetUint32( object.location_.length_ ) ||
+           ( version >= 3 &&
+             ( !reader.GetUint32( object.expiry_ ) || !reader.GetUint8( object.priority_ ) ||
+               object.priority_ >= Cache::noOfPriorities ) ) ||
+           ( version >= 4 && !reader.GetUint8( object.partition_ ) ) ||
+           ( version >= 5 && ( !reader.GetUint8( blob ) || !reader.GetUint32( object.blobIdSize_ ) ) ) ||
+           !reader.GetUint32( object.idSize_ ) ||
+           idOffset + object.idSize_ + static_cast< uint64_t >( object.blobIdSize_ ) > checkpoint->ids_.size() ||
+           !reader.GetBytes( object.idSize_ + object.blobIdSize_, checkpoint->ids_.empty() ? 0 : &checkpoint->ids_[ idOffset ] ) ) {
+        *valid = false;
+        return;
+      }
+      object.blob_ = blob != 0;
+      object.idOffset_ = idOffset;
+      object.fingerprint_ = Fingerprint( checkpoint->IdData( object ), object.idSize_ );
+      idOffset += object.idSize_ + object.blobIdSize_;
+    }
+  }
+}
+}
+
+void JournalCheckpoint::Add( const Cache::ObjectId& obj_id, uint32_t size, const StoreLocation& location, uint32_t expiry,
+                             uint8_t priority, uint8_t partition, const Cache::ObjectId& blob_id )
+{
+  Object object;
+  object.fingerprint_ = Fingerprint( obj_id );
+  object.idOffset_ = ids_.size();
+  object.idSize_ = static_cast< uint32_t >( obj_id.size() );
+  object.size_ = size;
+  object.location_ = location;
+  object.expiry_ = expiry;
+  object.priority_ = priority;
+  object.partition_ = partition;
+  object.blob_ = false;
+  object.blobIdSize_ = static_cast< uint32_t >( blob_id.size() );
+  objects_.push_back( object );
+  ids_.insert( ids_.end(), obj_id.begin(), obj_id.end() );
+  ids_.insert( ids_.end(), blob_id.begin(), blob_id.end() );
+}
+
+void JournalCheckpoint::AddBlob( const Cache::ObjectId& blob_id, uint32_t size, const StoreLocation& location, uint8_t partition )
+{
+  Add( blob_id, size, location, 0, Cache::NormalPriority, partition );
+  objects_.back().blob_ = true;
+}
+
+Cache::ObjectId JournalCheckpoint::Id( const Object& object ) const
+{
+  const uint8_t* data = IdData( object );
+  return Cache::ObjectId( data, data + object.idSize_ );
+}
+
+Cache::ObjectId JournalCheckpoint::BlobId( const Object& object ) const
+{
+  const uint8_t* data = IdData( object ) + object.idSize_;
+  return Cache::ObjectId( data, data + object.blobIdSize_ );
+}
+
+MetaJournal::MetaJournal( const std::string& path, const std::vector< uint8_t >& encryption_key )
+    : path_( path ), encryptionKey_( encryption_key ), generation_( 0 ), checkpointGeneration_( 0 ),
+      offset_( 0 ), recordCount_( 0 ), needsCheckpoint_( false )
+{
+}
+
+MetaJournal::~MetaJournal()
+{
+}
+
+std::vector< uint8_t > MetaJournal::Key( const std::string& purpose, uint64_t generation ) const
+{
+  // Every file gets a key stream of its own
+  std::vector< uint8_t > material( encryptionKey_ );
+  material.insert( material.end(), purpose.begin(), purpose.end() );
+  PutUint64( material, generation );
+  Crypt::Sha1HashValue key( Crypt::Sha1Hash( material ) );
+  return std::vector< uint8_t >( key.begin(), key.end() );
+}
+
+std::vector< uint8_t > MetaJournal::BlockKey( uint64_t generation, uint32_t block ) const
+{
+  std::ostringstream purpose;
+  purpose << checkpointMagic << "/" << block;
+  return Key( purpose.str(), generation );
+}
+
+std::string MetaJournal::JournalFilename( uint64_t generation ) const
+{
+  return OsConcatPath( path_, journalFilenames[ generation % 2 ] );
+}
+
+bool MetaJournal::ReadCheckpoint( JournalCheckpoint& checkpoint )
+{
+  const std::string filename( OsConcatPath( path_, checkpointFilename ) );
+  if ( !OsFileExists( filename ) ) {
+    return false;
+  }
+  OsMappedFile file( filename );
+  Reader header( file.data(), file.size() );
+  uint32_t version;
+  uint64_t generation;
+  uint32_t directorySize;
+  if ( !GetHeader( header, checkpointMagic, version, generation ) ||
+       version < oldestCheckpointVersion || version > checkpointVersion || !header.GetUint32( directorySize ) ||
+       directorySize <= sizeof( Crypt::Sha1HashValue ) || file.size() - header.pos() < directorySize ) {
+    return false;
+  }
+
+  // The directory: segments and where the blocks of objects are, with
+  // the hash of the rest in front
+  std::vector< uint8_t > directory( directorySize );
+  Crypt::Rc4Cipher( Key( checkpointMagic, generation ) ).Process( file.data() + header.pos(), &directory[0], directory.size() );
+  Crypt::Sha1HashValue hash;
+  std::copy( directory.begin(), directory.begin() + hash.size(), hash.begin() );
+  directory.erase( directory.begin(), directory.begin() + hash.size() );
+  if ( Crypt::Sha1Hash( directory ) != hash ) {
+    return false;
+  }
+
+  Reader reader( &directory[0], directory.size() );
+  uint32_t noOfSegments;
+  if ( !reader.GetUint32( checkpoint.nextSegment_ ) || !reader.GetUint32( noOfSegments ) ) {
+    return false;
+  }
+  for ( uint32_t i = 0; i < noOfSegments; ++i ) {
+    uint32_t segment;
+    if ( !reader.GetUint32( segment ) ) {
+      return false;
+    }
+    checkpoint.segments_.push_back( segment );
+  }
+
+  uint32_t noOfBlocks;
+  if ( !reader.GetUint32( noOfBlocks ) ) {
+    return false;
+  }
+  const uint64_t firstBlock = header.pos() + directorySize;
+  std::vector< CheckpointBlock > blocks( noOfBlocks );
+  const size_t objectSize = FixedObjectSize( version );
+  size_t noOfObjects = 0;
+  size_t idBytes = 0;
+  for ( uint32_t i = 0; i < noOfBlocks; ++i ) {
+    CheckpointBlock& block( blocks[i] );
+    if ( !reader.GetUint64( block.offset_ ) || !reader.GetUint32( block.size_ ) || !reader.GetUint32( block.noOfObjects_ ) ||
+         !reader.GetBytes( block.hash_.size(), block.hash_.c_array() ) ||
+         block.offset_ > file.size() - firstBlock || file.size() - firstBlock - block.offset_ < block.size_ ||
+         block.size_ < static_cast< uint64_t >( block.noOfObjects_ ) * objectSize || block.size_ == 0 ) {
+      return false;
+    }
+    block.firstObject_ = noOfObjects;
+    block.firstId_ = idBytes;
+    block.key_ = BlockKey( generation, i );
+    noOfObjects += block.noOfObjects_;
+    idBytes += block.size_ - static_cast< size_t >( block.noOfObjects_ ) * objectSize;
+  }
+
+  // Decrypt, check and parse the blocks in parallel, straight from the
+  // mapping into their place in the checkpoint
+  checkpoint.objects_.resize( noOfObjects );
+  checkpoint.ids_.resize( idBytes );
+  boost::atomic< bool > valid( true );
+  const size_t noOfThreads = std::max< size_t >( 1, std::min< size_t >( boost::thread::hardware_concurrency(), blocks.size() ) );
+  boost::thread_group threads;
+  for ( size_t i = 1; i < noOfThreads; ++i ) {
+    threads.create_thread( boost::bind( &LoadBlocks, &file, version, firstBlock, &blocks, i, noOfThreads, &checkpoint, &valid ) );
+  }
+  LoadBlocks( &file, version, firstBlock, &blocks, 0, noOfThreads, &checkpoint, &valid );
+  threads.join_all();
+  if ( !valid ) {
+    checkpoint = JournalCheckpoint();
+    return false;
+  }
+
+  generation_ = checkpointGeneration_ = generation;
+  return true;
+}
+
+bool MetaJournal::ReadJournal( uint64_t generation, std::vector< JournalRecord >& records )
+{
+  const std::string filename( JournalFilename( generation ) );
+  if ( !OsFileExists( filename ) ) {
+    return false;
+  }
+  std::vector< uint8_t > in;
+  OsReadFile( filename, in );
+  Reader header( in.empty() ? 0 : &in[0], in.size() );
+  uint32_t version;
+  uint64_t foundGeneration;
+  if ( !GetHeader( header, journalMagic, version, foundGeneration ) || version != journalVersion || foundGeneration != generation ) {
+    // Left over from an older generation
+    return false;
+  }
+
+  boost::scoped_ptr< Crypt::Rc4Cipher > cipher( new Crypt::Rc4Cipher( Key( journalMagic, generation ) ) );
+  std::vector< uint8_t > plain( in.size() - headerSize );
+  if ( !plain.empty() ) {
+    cipher->Process( &in[ headerSize ], &plain[0], plain.size() );
+  }
+
+  // Replay up to the first record that is cut short or damaged
+  size_t good = 0;
+  uint64_t noOfRecords = 0;
+  for ( ;; ) {
+    Reader frame( plain.empty() ? 0 : &plain[ good ], plain.size() - good );
+    uint32_t length, checksum;
+    std::vector< uint8_t > payload;
+    if ( !frame.GetUint32( length ) || !frame.GetBytes( length, payload ) || !frame.GetUint32( checksum ) ||
+         payload.empty() || Checksum( &payload[0], payload.size() ) != checksum ) {
+      break;
+    }
+    JournalRecord record;
+    Reader reader( &payload[0], payload.size() );
+    if ( !GetRecord( reader, record ) || reader.pos() != payload.size() ) {
+      break;
+    }
+    records.push_back( record );
+    ++ noOfRecords;
+    good += frame.pos();
+  }
+
+  if ( good != plain.size() ) {
+    // Drop the torn tail, so that new records follow the good ones. The
+    // key stream has to be wound back to the end of the good records.
+    std::vector< uint8_t > kept( in.begin(), in.begin() + headerSize + good );
+    OsWriteFile( filename, kept );
+    cipher.reset( new Crypt::Rc4Cipher( Key( journalMagic, generation ) ) );
+    if ( good > 0 ) {
+      cipher->Process( &plain[0], &plain[0], good );
+    }
+  }
+
+  // Append to this journal from now on
+  file_.reset( new OsFile( filename, false ) );
+  cipher_.swap( cipher );
+  generation_ = generation;
+  offset_ = headerSize + good;
+  recordCount_ += noOfRecords;
+  return true;
+}
+
+bool MetaJournal::Open( JournalCheckpoint& checkpoint, std::vector< JournalRecord >& records )
+{
+  boost::mutex::scoped_lock lock( mutex_ );
+  bool found = ReadCheckpoint( checkpoint );
+  if ( !found ) {
+    checkpoint = JournalCheckpoint();
+  }
+
+  // The journal of the checkpoint's generation, then the one of the next
+  // generation if a checkpoint was being written when we stopped
+  const uint64_t generation = generation_;
+  found = ReadJournal( generation, records ) || found;
+  if ( ReadJournal( generation + 1, records ) ) {
+    needsCheckpoint_ = found = true;
+  }
+
+  if ( !file_ ) {
+    CreateJournal( generation );
+  }
+  return found;
+}
+
+void MetaJournal::CreateJournal( uint64_t generation )
+{
+  std::vector< uint8_t > header;
+  PutHeader( header, journalMagic, journalVersion, generation );
+  file_.reset( new OsFile( JournalFilename( generation ), true ) );
+  file_->WriteAt( 0, &header[0], header.size() );
+  cipher_.reset( new Crypt::Rc4Cipher( Key( journalMagic, generation ) ) );
+  generation_ = generation;
+  offset_ = header.size();
+}
+
+void MetaJournal::Append( const JournalRecord& record )
+{
+  std::vector< uint8_t > payload;
+  PutRecord( payload, record );
+  std::vector< uint8_t > frame;
+  PutUint32( frame, static_cast< uint32_t >( payload.size() ) );
+  frame.insert( frame.end(), payload.begin(), payload.end() );
+  PutUint32( frame, Checksum( &payload[0], payload.size() ) );
+
+  boost::mutex::scoped_lock lock( mutex_ );
+  // Encrypt in the order the records end up in the file
+  size_t pos = pending_.size();
+  pending_.resize( pos + frame.size() );
+  cipher_->Process( &frame[0], &pending_[ pos ], frame.size() );
+  ++ recordCount_;
+}
+
+void MetaJournal::Flush()
+{
+  boost::mutex::scoped_lock lock( mutex_ );
+  FlushPending();
+}
+
+void MetaJournal::FlushPending()
+{
+  if ( !pending_.empty() ) {
+    file_->WriteAt( offset_, &pending_[0], pending_.size() );
+    offset_ += pending_.size();
+    pending_.clear();
+  }
+}
+
+uint64_t MetaJournal::RecordCount()
+{
+  boost::mutex::scoped_lock lock( mutex_ );
+  return recordCount_;
+}
+
+bool MetaJournal::NeedsCheckpoint()
+{
+  boost::mutex::scoped_lock lock( mutex_ );
+  return needsCheckpoint_;
+}
+
+void MetaJournal::StartCheckpoint()
+{
+  boost::mutex::scoped_lock lock( mutex_ );
+  FlushPending();
+  if ( generation_ != checkpointGeneration_ ) {
+    // The last checkpoint never made it. Keep appending to the current
+    // journal, which still follows it.
+    return;
+  }
+  CreateJournal( generation_ + 1 );
+  recordCount_ = 0;
+}
+
+void MetaJournal::CommitCheckpoint( const JournalCheckpoint& checkpoint )
+{
+  uint64_t generation;
+  {
+    boost::mutex::scoped_lock lock( mutex_ );
+    generation = generation_;
+  }
+
+  // Encrypt the objects block by block, each with a key of its own
+  std::vector< uint8_t > blocks;
+  std::vector< uint8_t > directory;
+  PutUint32( directory, checkpoint.nextSegment_ );
+  PutUint32( directory, static_cast< uint32_t >( checkpoint.segments_.size() ) );
+  for ( std::vector< uint32_t >::const_iterator it = checkpoint.segments_.begin(); it != checkpoint.segments_.end(); ++ it ) {
+    PutUint32( directory, *it );
+  }
+  const uint32_t noOfBlocks = static_cast< uint32_t >( ( checkpoint.objects_.size() + objectsPerBlock - 1 ) / objectsPerBlock );
+  PutUint32( directory, noOfBlocks );
+  for ( uint32_t i = 0; i < noOfBlocks; ++i ) {
+    std::vector< uint8_t > block;
+    const size_t end = std::min< size_t >( checkpoint.objects_.size(), ( i + 1 ) * static_cast< size_t >( objectsPerBlock ) );
+    for ( size_t n = i * static_cast< size_t >( objectsPerBlock ); n < end; ++n ) {
+      const JournalCheckpoint::Object& object( checkpoint.objects_[n] );
+      PutUint32( block, object.size_ );
+      PutUint32( block, object.location_.segment_ );
+      PutUint64( block, object.location_.offset_ );
+      PutUint32( block, object.location_.length_ );
+      PutUint32( block, object.expiry_ );
+      block.push_back( object.priority_ );
+      block.push_back( object.partition_ );
+      block.push_back( object.blob_ ? 1 : 0 );
+      PutUint32( block, object.blobIdSize_ );
+      PutUint32( block, object.idSize_ );
+      block.insert( block.end(), checkpoint.IdData( object ), checkpoint.IdData( object ) + object.idSize_ + object.blobIdSize_ );
+    }
+    Crypt::Sha1HashValue hash( Crypt::Sha1Hash( block ) );
+    PutUint64( directory, blocks.size() );
+    PutUint32( directory, static_cast< uint32_t >( block.size() ) );
+    PutUint32( directory, static_cast< uint32_t >( end - i * static_cast< size_t >( objectsPerBlock ) ) );
+    directory.insert( directory.end(), hash.begin(), hash.end() );
+    Crypt::Rc4EncryptDecrypt( BlockKey( generation, i ), block );
+    blocks.insert( blocks.end(), block.begin(), block.end() );
+  }
+
+  // Hash, then encrypt hash and directory
+  Crypt::Sha1HashValue hash( Crypt::Sha1Hash( directory ) );
+  directory.insert( directory.begin(), hash.begin(), hash.end() );
+  Crypt::Rc4EncryptDecrypt( Key( checkpointMagic, generation ), directory );
+
+  std::vector< uint8_t > out;
+  PutHeader( out, checkpointMagic, checkpointVersion, generation );
+  PutUint32( out, static_cast< uint32_t >( directory.size() ) );
+  out.insert( out.end(), directory.begin(), directory.end() );
+  out.insert( out.end(), blocks.begin(), blocks.end() );
+
+  // Replace the checkpoint atomically. Only then is the journal of the
+  // previous generation no longer needed.
+  const std::string filename( OsConcatPath( path_, checkpointFilename ) );
+  const std::string temporary( filename + ".tmp" );
+  OsWriteFile( temporary, out );
+  OsRenameFile( temporary, filename );
+  try {
+    OsDeleteFile( JournalFilename( generation - 1 ) );
+  } catch ( OsDeleteFileException& ) {
+  }
+
+  boost::mutex::scoped_lock lock( mutex_ );
+  checkpointGeneration_ = generation;
+  needsCheckpoint_ = false;
+}
@@ -0,0 +1,145 @@
+#ifndef __JOURNAL_HPP__
+#define __JOURNAL_HPP__
+
+#include "objectstore.hpp"
+#include "crypt.hpp"
+
+const std::string checkpointFilename = "index.ckp";
+// Journals alternate between two files, one per checkpoint generation
+const std::string journalFilenames[] = { "index0.jnl", "index1.jnl" };
+
+// A change to the index, as kept in the journal
+struct JournalRecord
+{
+  enum Type
+  {
+    Write = 1, // The object was written, or moved by the compactor
+    Erase = 2,
+    Prune = 3,
+    Blob = 4 // A blob was stored, or moved by the compactor. objId_ is its id.
+  };
+
+  JournalRecord() : type_( Write ), size_( 0 ), expiry_( 0 ), priority_( Cache::NormalPriority ), partition_( 0 ) {}
+  JournalRecord( Type type, const Cache::ObjectId& obj_id, uint32_t size = 0, const StoreLocation& location = StoreLocation(),
+                 uint32_t expiry = 0, uint8_t priority = Cache::NormalPriority, uint8_t partition = 0,
+                 const Cache::ObjectId& blob_id = Cache::ObjectId() )
+      : type_( type ), objId_( obj_id ), size_( size ), location_( location ), expiry_( expiry ), priority_( priority ),
+        partition_( partition ), blobId_( blob_id ) {}
+
+  Type type_;
+  Cache::ObjectId objId_;
+  uint32_t size_;
+  StoreLocation location_;
+  uint32_t expiry_; // Seconds since the epoch, 0 for never
+  uint8_t priority_;
+  uint8_t partition_; // Position in CacheOptions::partitions
+  // The blob a deduplicated object was written to, which holds its
+  // record. Empty for an object with a record of its own.
+  Cache::ObjectId blobId_;
+};
+
+// The whole index at one point in time
+struct JournalCheckpoint
+{
+  // An object of the checkpoint. The id is kept in ids_, so that loading
+  // doesn't allocate per object.
+  struct Object
+  {
+    uint64_t fingerprint_; // Fingerprint of the id
+    size_t idOffset_;
+    uint32_t idSize_;
+    uint32_t size_;
+    StoreLocation location_;
+    uint32_t expiry_;
+    uint8_t priority_;
+    uint8_t partition_;
+    bool blob_; // A blob rather than an object
+    uint32_t blobIdSize_; // The blob of a deduplicated object, whose id follows its own
+  };
+
+  JournalCheckpoint() : nextSegment_( 1 ) {}
+
+  // Adds obj_id as the newest object
+  void Add( const Cache::ObjectId& obj_id, uint32_t size, const StoreLocation& location, uint32_t expiry = 0,
+            uint8_t priority = Cache::NormalPriority, uint8_t partition = 0, const Cache::ObjectId& blob_id = Cache::ObjectId() );
+  void AddBlob( const Cache::ObjectId& blob_id, uint32_t size, const StoreLocation& location, uint8_t partition );
+  const uint8_t* IdData( const Object& object ) const { return ids_.empty() ? 0 : &ids_[ object.idOffset_ ]; }
+  Cache::ObjectId Id( const Object& object ) const;
+  Cache::ObjectId BlobId( const Object& object ) const;
+
+  std::vector< uint32_t > segments_;
+  uint32_t nextSegment_;
+  std::vector< Object > objects_; // Oldest first
+  std::vector< uint8_t > ids_;
+};
+
+/**
+   Keeps the cache index on disk as a checkpoint plus a journal of the
+   changes made since. Records are appended as the index changes, so a
+   crash only loses what had not been flushed yet, and shutting down
+   doesn't have to write the whole index.
+
+   Both files are binary and encrypted with a key derived from the cache
+   key. Every journal record carries a checksum; replay stops at the
+   first record that doesn't check out, which is where a crash tore the
+   journal. The checkpoint is replaced atomically. It is mapped rather
+   than read, and its objects are split into blocks that each have a key
+   and a hash of their own, so that they are decrypted and checked in
+   parallel.
+
+   Writing a checkpoint starts a new generation. Records go to a new
+   journal file from then on, and the old journal is only dropped once
+   the checkpoint is safely in place.
+*/
+class MetaJournal
+{
+ public:
+  MetaJournal( const std::string& path, const std::vector< uint8_t >& encryption_key );
+  ~MetaJournal();
+
+  // Reads the last checkpoint and the records appended after it, and
+  // opens the journal for appending. Returns false if there was neither
+  // a checkpoint nor a journal.
+  bool Open( JournalCheckpoint& checkpoint, std::vector< JournalRecord >& records );
+
+  // Records are buffered until Flush. Thread safe.
+  void Append( const JournalRecord& record );
+  void Flush();
+  // Records appended since the last checkpoint
+  uint64_t RecordCount();
+  // True if Open found an unfinished checkpoint
+  bool NeedsCheckpoint();
+
+  // Starts a new generation. Call CommitCheckpoint with the index as it
+  // is after StartCheckpoint returns. Only one checkpoint at a time.
+  void StartCheckpoint();
+  void CommitCheckpoint( const JournalCheckpoint& checkpoint );
+
+ private:
+  std::vector< uint8_t > Key( const std::string& purpose, uint64_t generation ) const;
+  std::vector< uint8_t > BlockKey( uint64_t generation, uint32_t block ) const;
+  std::string JournalFilename( uint64_t generation ) const;
+  bool ReadJournal( uint64_t generation, std::vector< JournalRecord >& records );
+  bool ReadCheckpoint( JournalCheckpoint& checkpoint );
+  // The following require mutex_ to be held
+  void CreateJournal( uint64_t generation );
+  void FlushPending();
+
+  const std::string path_;
+  const std::vector< uint8_t > encryptionKey_;
+
+  boost::mutex mutex_;
+  uint64_t generation_; // Of the journal being appended to
+  uint64_t checkpointGeneration_; // Of the last checkpoint written
+  boost::scoped_ptr< OsFile > file_;
+  boost::scoped_ptr< Crypt::Rc4Cipher > cipher_;
+  uint64_t offset_; // Where the pending records go
+  std::vector< uint8_t > pending_; // Encrypted
+  uint64_t recordCount_;
+  bool needsCheckpoint_;
+
+  MetaJournal( const MetaJournal& ); // not copyable
+  bool operator=( const MetaJournal& ); // not assignable
+};
+
+#endif // __JOURNAL_HPP__
@@ -0,0 +1,81 @@
+#include "stdinc.hpp"
+#include "presenceindex.hpp"
+#include "memorytier.hpp"
+
+MemoryTier::MemoryTier( uint64_t maxSize, CacheOptions::Eviction eviction )
+    : maxSize_( maxSize ), sequence_( 0 ), policy_( CreateEvictionPolicy( eviction, sequence_, 0 ) ), size_( 0 ), objects_( 0 ),
+      hits_( 0 ), misses_( 0 )
+{
+}
+
+bool MemoryTier::Get( const ObjectId& obj_id, uint64_t fingerprint, const StoreLocation& location, std::vector< uint8_t >& value )
+{
+  Value found;
+  {
+    boost::mutex::scoped_lock lock( mutex_ );
+    ObjectIndex::Entry* entry( index_.Find( obj_id, fingerprint ) );
+    if ( entry && entry->Location() == location ) {
+      policy_->Accessed( index_, *entry );
+      found = values_[ obj_id ];
+    }
+  }
+  if ( !found ) {
+    ++ misses_;
+    return false;
+  }
+  // Copy without holding the lock. The value is never changed, only
+  // replaced.
+  value = *found;
+  ++ hits_;
+  return true;
+}
+
+void MemoryTier::Put( const ObjectId& obj_id, uint64_t fingerprint, const StoreLocation& location, const std::vector< uint8_t >& value )
+{
+  if ( value.size() > maxSize_ ) {
+    return;
+  }
+  Value copy( new std::vector< uint8_t >( value ) );
+
+  boost::mutex::scoped_lock lock( mutex_ );
+  ObjectIndex::Entry* entry( index_.Find( obj_id, fingerprint ) );
+  if ( entry ) {
+    Remove( *entry, obj_id );
+  }
+  while ( size_ + value.size() > maxSize_ ) {
+    ObjectIndex::Entry* victim( policy_->Victim( index_ ) );
+    if ( !victim ) {
+      break;
+    }
+    const ObjectId victimId( victim->Id() );
+    policy_->Evicted( index_, *victim, Fingerprint( victimId ) );
+    Remove( *victim, victimId );
+  }
+
+  ObjectIndex::Entry& inserted( index_.Insert( obj_id, fingerprint ) );
+  inserted.size_ = static_cast< uint32_t >( value.size() );
+  inserted.sequence_ = ++ sequence_;
+  inserted.expiry_ = 0;
+  inserted.SetLocation( location );
+  policy_->Inserted( index_, inserted, fingerprint );
+  values_[ obj_id ] = copy;
+  size_ += value.size();
+  ++ objects_;
+}
+
+void MemoryTier::Erase( const ObjectId& obj_id, uint64_t fingerprint )
+{
+  boost::mutex::scoped_lock lock( mutex_ );
+  ObjectIndex::Entry* entry( index_.Find( obj_id, fingerprint ) );
+  if ( entry ) {
+    Remove( *entry, obj_id );
+  }
+}
+
+void MemoryTier::Remove( ObjectIndex::Entry& entry, const ObjectId& obj_id )
+{
+  size_ -= entry.size_;
+  -- objects_;
+  values_.erase( obj_id );
+  index_.Erase( entry );
+}
@@ -0,0 +1,61 @@
+#ifndef __MEMORYTIER_HPP__
+#define __MEMORYTIER_HPP__
+
+#include "cache.hpp"
+#include "objectindex.hpp"
+#include "evictionpolicy.hpp"
+
+/**
+   Keeps decrypted and verified objects in memory, so that reading one
+   again costs neither file I/O nor decryption and hashing. It has a
+   byte budget and an eviction policy of its own, and keeps its order in
+   an ObjectIndex like a shard of the cache does.
+
+   Every object is kept with the store location it was read from. The
+   cache looks an object up in its own index first, and only takes the
+   copy here if the locations match, so a copy of an older version is
+   never returned. The cache still erases objects here when they leave
+   its index, to give the memory back early.
+
+   Thread safe.
+*/
+class MemoryTier
+{
+ public:
+  typedef Cache::ObjectId ObjectId;
+
+  MemoryTier( uint64_t maxSize, CacheOptions::Eviction eviction );
+
+  // Returns false unless obj_id is kept with location
+  bool Get( const ObjectId& obj_id, uint64_t fingerprint, const StoreLocation& location, std::vector< uint8_t >& value );
+  // Keeps value as what is at location, replacing any other version.
+  // Evicts other objects to make it fit. Larger objects than the budget
+  // are not kept.
+  void Put( const ObjectId& obj_id, uint64_t fingerprint, const StoreLocation& location, const std::vector< uint8_t >& value );
+  void Erase( const ObjectId& obj_id, uint64_t fingerprint );
+
+  uint64_t MaxSize() const { return maxSize_; }
+  uint64_t Size() const { return size_; }
+  uint64_t Objects() const { return objects_; }
+  uint64_t Hits() const { return hits_; }
+  uint64_t Misses() const { return misses_; }
+
+ private:
+  typedef boost::shared_ptr< const std::vector< uint8_t > > Value;
+
+  // The following require mutex_ to be held
+  void Remove( ObjectIndex::Entry& entry, const ObjectId& obj_id );
+
+  const uint64_t maxSize_;
+  boost::mutex mutex_;
+  ObjectIndex index_;
+  boost::unordered_map< ObjectId, Value > values_;
+  boost::atomic< uint64_t > sequence_;
+  boost::scoped_ptr< EvictionPolicy > policy_;
+  boost::atomic< uint64_t > size_;
+  boost::atomic< uint64_t > objects_;
+  boost::atomic< uint64_t > hits_;
+  boost::atomic< uint64_t > misses_;
+};
+
+#endif // __MEMORYTIER_HPP__
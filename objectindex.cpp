@@ -0,0 +1,425 @@
+#include "stdinc.hpp"
+#include "objectindex.hpp"
+#include "presenceindex.hpp"
+
+#if defined( __SSE2__ ) || defined( _M_X64 ) || ( defined( _M_IX86_FP ) && _M_IX86_FP >= 2 )
+#include <emmintrin.h>
+#define OBJECTINDEX_SSE2
+#endif
+
+namespace
+{
+const size_t groupSize = 16;
+const uint32_t noEntry = 0xffffffff;
+
+// Control bytes. A full slot holds the top 7 bits of the fingerprint.
+const uint8_t emptyCtrl = 0x80;
+const uint8_t deletedCtrl = 0xfe;
+
+uint8_t ShortHash( uint64_t fingerprint )
+{
+  return static_cast< uint8_t >( fingerprint >> 57 );
+}
+
+// Bit i is set in the following masks when byte i of the group matches
+#ifdef OBJECTINDEX_SSE2
+uint32_t MatchByte( const uint8_t* group, uint8_t value )
+{
+  __m128i ctrl = _mm_loadu_si128( reinterpret_cast< const __m128i* >( group ) );
+  return static_cast< uint32_t >( _mm_movemask_epi8( _mm_cmpeq_epi8( ctrl, _mm_set1_epi8( static_cast< char >( value ) ) ) ) );
+}
+
+// Empty or deleted
+uint32_t MatchFree( const uint8_t* group )
+{
+  __m128i ctrl = _mm_loadu_si128( reinterpret_cast< const __m128i* >( group ) );
+  return static_cast< uint32_t >( _mm_movemask_epi8( ctrl ) );
+}
+#else
+uint32_t MatchByte( const uint8_t* group, uint8_t value )
+{
+  uint32_t mask = 0;
+  for ( size_t i = 0; i < groupSize; ++i ) {
+    mask |= static_cast< uint32_t >( group[i] == value ) << i;
+  }
+  return mask;
+}
+
+uint32_t MatchFree( const uint8_t* group )
+{
+  uint32_t mask = 0;
+  for ( size_t i = 0; i < groupSize; ++i ) {
+    mask |= static_cast< uint32_t >( group[i] >> 7 ) << i;
+  }
+  return mask;
+}
+#endif
+
+void PrefetchAddress( const void* address )
+{
+#ifdef _MSC_VER
+  _mm_prefetch( static_cast< const char* >( address ), _MM_HINT_T0 );
+#else
+  __builtin_prefetch( address );
+#endif
+}
+
+// Index of the lowest set bit. mask must not be 0.
+size_t LowestBit( uint32_t mask )
+{
+#ifdef _MSC_VER
+  unsigned long index;
+  _BitScanForward( &index, mask );
+  return index;
+#else
+  return __builtin_ctz( mask );
+#endif
+}
+}
+
+StoreLocation ObjectIndex::Entry::Location() const
+{
+  StoreLocation location;
+  location.segment_ = segment_;
+  location.length_ = length_;
+  location.offset_ = offset_;
+  return location;
+}
+
+void ObjectIndex::Entry::SetLocation( const StoreLocation& location )
+{
+  segment_ = location.segment_;
+  length_ = location.length_;
+  offset_ = location.offset_;
+}
+
+const uint8_t* ObjectIndex::Entry::IdData() const
+{
+  if ( idSize_ != outOfLineId ) {
+    return id_;
+  }
+  const ObjectId* id;
+  std::memcpy( &id, id_, sizeof( id ) );
+  return id->empty() ? 0 : &( *id )[0];
+}
+
+size_t ObjectIndex::Entry::IdSize() const
+{
+  if ( idSize_ != outOfLineId ) {
+    return idSize_;
+  }
+  const ObjectId* id;
+  std::memcpy( &id, id_, sizeof( id ) );
+  return id->size();
+}
+
+ObjectIndex::ObjectId ObjectIndex::Entry::Id() const
+{
+  if ( idSize_ != outOfLineId ) {
+    return ObjectId( id_, id_ + idSize_ );
+  }
+  const ObjectId* id;
+  std::memcpy( &id, id_, sizeof( id ) );
+  return *id;
+}
+
+bool ObjectIndex::Entry::HasId( const ObjectId& obj_id ) const
+{
+  return HasId( obj_id.empty() ? 0 : &obj_id[0], obj_id.size() );
+}
+
+bool ObjectIndex::Entry::HasId( const uint8_t* id, size_t idSize ) const
+{
+  return IdSize() == idSize && std::equal( id, id + idSize, IdData() );
+}
+
+ObjectIndex::Queue::Queue() : oldest_( noEntry ), newest_( noEntry ), hand_( noEntry ), size_( 0 )
+{
+}
+
+ObjectIndex::ObjectIndex()
+    : capacity_( 0 ), deleted_( 0 ), outOfLineBytes_( 0 ), queues_( 1 )
+{
+  Rehash( groupSize );
+}
+
+ObjectIndex::~ObjectIndex()
+{
+  for ( std::vector< Entry >::iterator it = entries_.begin(); it != entries_.end(); ++ it ) {
+    if ( it->idSize_ == outOfLineId ) {
+      ObjectId* id;
+      std::memcpy( &id, it->id_, sizeof( id ) );
+      delete id;
+    }
+  }
+}
+
+size_t ObjectIndex::MemoryUsage() const
+{
+  return capacity_ * ( sizeof( uint8_t ) + sizeof( uint32_t ) ) + entries_.capacity() * sizeof( Entry ) + outOfLineBytes_;
+}
+
+void ObjectIndex::Reserve( size_t count )
+{
+  entries_.reserve( count );
+  // The capacity Insert would have grown to
+  size_t capacity = capacity_;
+  while ( ( count + 1 ) * 8 > capacity * 7 ) {
+    capacity *= 2;
+  }
+  if ( capacity != capacity_ ) {
+    Rehash( capacity );
+  }
+}
+
+void ObjectIndex::Prefetch( uint64_t fingerprint ) const
+{
+  const size_t group = fingerprint & ( capacity_ / groupSize - 1 );
+  PrefetchAddress( &ctrl_[ group * groupSize ] );
+  PrefetchAddress( &slots_[ group * groupSize ] );
+}
+
+ObjectIndex::Entry* ObjectIndex::Find( const ObjectId& obj_id, uint64_t fingerprint )
+{
+  return Find( obj_id.empty() ? 0 : &obj_id[0], obj_id.size(), fingerprint );
+}
+
+ObjectIndex::Entry* ObjectIndex::Find( const uint8_t* id, size_t idSize, uint64_t fingerprint )
+{
+  const size_t groupMask = capacity_ / groupSize - 1;
+  const uint8_t shortHash = ShortHash( fingerprint );
+  size_t group = fingerprint & groupMask;
+  for ( size_t step = 1; step <= groupMask + 1; ++step ) {
+    const uint8_t* ctrl = &ctrl_[ group * groupSize ];
+    for ( uint32_t match = MatchByte( ctrl, shortHash ); match != 0; match &= match - 1 ) {
+      Entry& entry( entries_[ slots_[ group * groupSize + LowestBit( match ) ] ] );
+      if ( entry.HasId( id, idSize ) ) {
+        return &entry;
+      }
+    }
+    // A probe sequence ends at the first group with an empty slot
+    if ( MatchByte( ctrl, emptyCtrl ) != 0 ) {
+      return 0;
+    }
+    group = ( group + step ) & groupMask;
+  }
+  return 0;
+}
+
+size_t ObjectIndex::FindFreeSlot( uint64_t fingerprint ) const
+{
+  // There is always a free slot, since the table is never full
+  const size_t groupMask = capacity_ / groupSize - 1;
+  size_t group = fingerprint & groupMask;
+  for ( size_t step = 1; ; ++step ) {
+    uint32_t free = MatchFree( &ctrl_[ group * groupSize ] );
+    if ( free != 0 ) {
+      return group * groupSize + LowestBit( free );
+    }
+    group = ( group + step ) & groupMask;
+  }
+}
+
+size_t ObjectIndex::FindSlot( uint32_t entry ) const
+{
+  const Entry& found( entries_[ entry ] );
+  const uint64_t fingerprint = Fingerprint( found.IdData(), found.IdSize() );
+  const size_t groupMask = capacity_ / groupSize - 1;
+  const uint8_t shortHash = ShortHash( fingerprint );
+  size_t group = fingerprint & groupMask;
+  for ( size_t step = 1; ; ++step ) {
+    for ( uint32_t match = MatchByte( &ctrl_[ group * groupSize ], shortHash ); match != 0; match &= match - 1 ) {
+      size_t slot = group * groupSize + LowestBit( match );
+      if ( slots_[ slot ] == entry ) {
+        return slot;
+      }
+    }
+    group = ( group + step ) & groupMask;
+  }
+}
+
+ObjectIndex::Entry& ObjectIndex::Insert( const ObjectId& obj_id, uint64_t fingerprint, size_t queue )
+{
+  return Insert( obj_id.empty() ? 0 : &obj_id[0], obj_id.size(), fingerprint, queue );
+}
+
+ObjectIndex::Entry& ObjectIndex::Insert( const uint8_t* id, size_t idSize, uint64_t fingerprint, size_t queue )
+{
+  if ( entries_.size() >= noEntry ) {
+    throw std::length_error( "Too many objects" );
+  }
+
+  // Keep at most 7/8 of the slots in use. Grow if most of them are live,
+  // otherwise just clear out the deleted ones.
+  const size_t size = entries_.size();
+  if ( ( size + deleted_ + 1 ) * 8 > capacity_ * 7 ) {
+    Rehash( ( size + 1 ) * 16 > capacity_ * 7 ? capacity_ * 2 : capacity_ );
+  }
+
+  size_t slot = FindFreeSlot( fingerprint );
+  if ( ctrl_[ slot ] == deletedCtrl ) {
+    -- deleted_;
+  }
+  ctrl_[ slot ] = ShortHash( fingerprint );
+  slots_[ slot ] = static_cast< uint32_t >( size );
+
+  entries_.push_back( Entry() );
+  Entry& entry( entries_.back() );
+  if ( idSize <= inlineIdSize ) {
+    entry.idSize_ = static_cast< uint8_t >( idSize );
+    std::copy( id, id + idSize, entry.id_ );
+  } else {
+    entry.idSize_ = outOfLineId;
+    ObjectId* outOfLine = new ObjectId( id, id + idSize );
+    std::memcpy( entry.id_, &outOfLine, sizeof( outOfLine ) );
+    outOfLineBytes_ += sizeof( ObjectId ) + idSize;
+  }
+  entry.sequence_ = 0;
+  entry.offset_ = 0;
+  entry.segment_ = 0;
+  entry.length_ = 0;
+  entry.size_ = 0;
+  entry.expiry_ = 0;
+  entry.hits_ = 0;
+  Link( static_cast< uint32_t >( size ), queue );
+  return entry;
+}
+
+void ObjectIndex::Erase( Entry& entry )
+{
+  const uint32_t erased = static_cast< uint32_t >( &entry - &entries_[0] );
+  const size_t slot = FindSlot( erased );
+  Unlink( erased );
+  if ( entry.idSize_ == outOfLineId ) {
+    ObjectId* id;
+    std::memcpy( &id, entry.id_, sizeof( id ) );
+    outOfLineBytes_ -= sizeof( ObjectId ) + id->size();
+    delete id;
+  }
+
+  // If the group has an empty slot, no probe sequence goes past it, so
+  // the slot can be made empty. Otherwise it has to be marked deleted.
+  const uint8_t* group = &ctrl_[ slot - slot % groupSize ];
+  if ( MatchByte( group, emptyCtrl ) != 0 ) {
+    ctrl_[ slot ] = emptyCtrl;
+  } else {
+    ctrl_[ slot ] = deletedCtrl;
+    ++ deleted_;
+  }
+
+  // Keep the entries packed by moving the last one into the hole
+  const uint32_t last = static_cast< uint32_t >( entries_.size() - 1 );
+  if ( erased != last ) {
+    slots_[ FindSlot( last ) ] = erased;
+    Entry& moved( entries_[ last ] );
+    if ( moved.prev_ != noEntry ) {
+      entries_[ moved.prev_ ].next_ = erased;
+    } else {
+      queues_[ moved.queue_ ].oldest_ = erased;
+    }
+    if ( moved.next_ != noEntry ) {
+      entries_[ moved.next_ ].prev_ = erased;
+    } else {
+      queues_[ moved.queue_ ].newest_ = erased;
+    }
+    if ( queues_[ moved.queue_ ].hand_ == last ) {
+      queues_[ moved.queue_ ].hand_ = erased;
+    }
+    entries_[ erased ] = moved;
+  }
+  entries_.pop_back();
+}
+
+ObjectIndex::Entry* ObjectIndex::Oldest( size_t queue )
+{
+  if ( queue >= queues_.size() || queues_[ queue ].oldest_ == noEntry ) {
+    return 0;
+  }
+  return &entries_[ queues_[ queue ].oldest_ ];
+}
+
+ObjectIndex::Entry* ObjectIndex::Next( const Entry& entry )
+{
+  return entry.next_ == noEntry ? 0 : &entries_[ entry.next_ ];
+}
+
+void ObjectIndex::MoveToBack( Entry& entry, size_t queue )
+{
+  const uint32_t moved = static_cast< uint32_t >( &entry - &entries_[0] );
+  Unlink( moved );
+  Link( moved, queue );
+}
+
+ObjectIndex::Entry* ObjectIndex::Hand( size_t queue )
+{
+  if ( queue >= queues_.size() || queues_[ queue ].hand_ == noEntry ) {
+    return 0;
+  }
+  return &entries_[ queues_[ queue ].hand_ ];
+}
+
+void ObjectIndex::SetHand( size_t queue, Entry* entry )
+{
+  if ( queue >= queues_.size() ) {
+    queues_.resize( queue + 1 );
+  }
+  queues_[ queue ].hand_ = entry ? static_cast< uint32_t >( entry - &entries_[0] ) : noEntry;
+}
+
+void ObjectIndex::Link( uint32_t entry, size_t queue )
+{
+  assert( queue < maxQueues );
+  if ( queue >= queues_.size() ) {
+    queues_.resize( queue + 1 );
+  }
+  Queue& linkedTo( queues_[ queue ] );
+  Entry& linked( entries_[ entry ] );
+  linked.queue_ = static_cast< uint8_t >( queue );
+  linked.prev_ = linkedTo.newest_;
+  linked.next_ = noEntry;
+  if ( linkedTo.newest_ != noEntry ) {
+    entries_[ linkedTo.newest_ ].next_ = entry;
+  } else {
+    linkedTo.oldest_ = entry;
+  }
+  linkedTo.newest_ = entry;
+  ++ linkedTo.size_;
+}
+
+void ObjectIndex::Unlink( uint32_t entry )
+{
+  Entry& unlinked( entries_[ entry ] );
+  Queue& unlinkedFrom( queues_[ unlinked.queue_ ] );
+  if ( unlinkedFrom.hand_ == entry ) {
+    unlinkedFrom.hand_ = unlinked.next_;
+  }
+  if ( unlinked.prev_ != noEntry ) {
+    entries_[ unlinked.prev_ ].next_ = unlinked.next_;
+  } else {
+    unlinkedFrom.oldest_ = unlinked.next_;
+  }
+  if ( unlinked.next_ != noEntry ) {
+    entries_[ unlinked.next_ ].prev_ = unlinked.prev_;
+  } else {
+    unlinkedFrom.newest_ = unlinked.prev_;
+  }
+  -- unlinkedFrom.size_;
+}
+
+void ObjectIndex::Rehash( size_t capacity )
+{
+  boost::scoped_array< uint8_t > ctrl( new uint8_t[ capacity ] );
+  std::fill( ctrl.get(), ctrl.get() + capacity, emptyCtrl );
+  ctrl_.swap( ctrl );
+  slots_.reset( new uint32_t[ capacity ] );
+  capacity_ = capacity;
+  deleted_ = 0;
+
+  // Entries stay where they are, only the table is rebuilt
+  for ( size_t i = 0; i < entries_.size(); ++i ) {
+    const uint64_t fingerprint = Fingerprint( entries_[i].IdData(), entries_[i].IdSize() );
+    size_t slot = FindFreeSlot( fingerprint );
+    ctrl_[ slot ] = ShortHash( fingerprint );
+    slots_[ slot ] = static_cast< uint32_t >( i );
+  }
+}
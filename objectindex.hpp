@@ -0,0 +1,134 @@
+#ifndef __OBJECTINDEX_HPP__
+#define __OBJECTINDEX_HPP__
+
+#include "objectstore.hpp"
+
+/**
+   The index of a cache shard. A flat open addressing hash table instead
+   of a node based map: entries live densely packed in one array, object
+   ids of up to inlineIdSize bytes are stored inside the entry, and the
+   write order list is linked with 32 bit entry numbers instead of
+   pointers.
+
+   Entries are kept in write order on one of up to maxQueues lists, which
+   the eviction policies move them between.
+
+   The hash table itself only holds a control byte and an entry number
+   per slot. The control byte holds 7 bits of the fingerprint of the
+   object id, or marks the slot as empty or deleted. Slots are probed in
+   groups of 16, matching all control bytes of a group at once with SSE2
+   where available, so entries are only touched on a likely hit.
+
+   Not thread safe. Pointers to entries are invalidated by Insert and
+   Erase.
+*/
+class ObjectIndex
+{
+ public:
+  typedef Cache::ObjectId ObjectId;
+
+  // Object ids up to this size are kept inside the entry
+  static const size_t inlineIdSize = 20;
+  static const size_t maxQueues = 256;
+
+  // A cached object. 64 bytes with the id.
+  class Entry
+  {
+   public:
+    StoreLocation Location() const;
+    void SetLocation( const StoreLocation& location );
+    ObjectId Id() const;
+    bool HasId( const ObjectId& obj_id ) const;
+    bool HasId( const uint8_t* id, size_t idSize ) const;
+    size_t Queue() const { return queue_; }
+
+    uint64_t sequence_; // Write order across all shards
+    uint64_t offset_;
+    uint32_t segment_;
+    uint32_t length_;
+    uint32_t size_;
+    uint32_t expiry_; // Seconds since the epoch, 0 for never
+    uint8_t hits_; // Kept by the eviction policy
+
+   private:
+    friend class ObjectIndex;
+    const uint8_t* IdData() const;
+    size_t IdSize() const;
+
+    uint8_t queue_;
+    uint8_t idSize_; // outOfLineId when id_ holds a pointer to the id
+    uint32_t prev_;
+    uint32_t next_;
+    uint8_t id_[ inlineIdSize ];
+  };
+
+  ObjectIndex();
+  ~ObjectIndex();
+
+  size_t size() const { return entries_.size(); }
+  bool empty() const { return entries_.empty(); }
+  // Bytes allocated by the index
+  size_t MemoryUsage() const;
+
+  // Makes room for count entries in all, so that inserting them doesn't
+  // have to grow the index again and again
+  void Reserve( size_t count );
+
+  // fingerprint must be Fingerprint( obj_id )
+  Entry* Find( const ObjectId& obj_id, uint64_t fingerprint );
+  Entry* Find( const uint8_t* id, size_t idSize, uint64_t fingerprint );
+  // obj_id must not be in the index. The new entry is the newest of
+  // queue.
+  Entry& Insert( const ObjectId& obj_id, uint64_t fingerprint, size_t queue = 0 );
+  Entry& Insert( const uint8_t* id, size_t idSize, uint64_t fingerprint, size_t queue = 0 );
+  // Starts loading the part of the table a Find or Insert of fingerprint
+  // looks at first, to overlap the cache misses of a run of them
+  void Prefetch( uint64_t fingerprint ) const;
+  void Erase( Entry& entry );
+
+  // All entries, in no particular order
+  Entry& At( size_t i ) { return entries_[i]; }
+
+  // The entries of a queue in write order, oldest first
+  Entry* Oldest( size_t queue = 0 );
+  Entry* Next( const Entry& entry );
+  size_t QueueSize( size_t queue ) const { return queue < queues_.size() ? queues_[ queue ].size_ : 0; }
+  // Makes entry the newest of queue
+  void MoveToBack( Entry& entry, size_t queue = 0 );
+
+  // A position in queue kept for the eviction policy, 0 if none. When
+  // its entry leaves the queue it moves on to the next newer entry.
+  Entry* Hand( size_t queue );
+  void SetHand( size_t queue, Entry* entry );
+
+ private:
+  static const uint8_t outOfLineId = 0xff;
+
+  struct Queue
+  {
+    Queue();
+    uint32_t oldest_;
+    uint32_t newest_;
+    uint32_t hand_;
+    size_t size_;
+  };
+
+  size_t FindFreeSlot( uint64_t fingerprint ) const;
+  size_t FindSlot( uint32_t entry ) const;
+  void Rehash( size_t capacity );
+  void Link( uint32_t entry, size_t queue );
+  void Unlink( uint32_t entry );
+
+  size_t capacity_; // A multiple of the group size, and a power of two
+  size_t deleted_;
+  size_t outOfLineBytes_;
+  boost::scoped_array< uint8_t > ctrl_;
+  boost::scoped_array< uint32_t > slots_; // Entry number of every full slot
+  std::vector< Entry > entries_;
+  std::vector< Queue > queues_; // Grown as queues are used
+
+  ObjectIndex( const ObjectIndex& ); // not copyable
+  bool operator=( const ObjectIndex& ); // not assignable
+};
+
+#endif // __OBJECTINDEX_HPP__
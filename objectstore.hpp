@@ -0,0 +1,84 @@
+#ifndef __OBJECTSTORE_HPP__
+#define __OBJECTSTORE_HPP__
+
+#include "cache.hpp"
+#include "os.hpp"
+
+// Files are written here, in the cache directory, until they are
+// committed. The cache empties it when it opens, since anything left in
+// it is from writes that never finished.
+const std::string temporaryDirectory = "tmp";
+
+// Where an encoded object is kept by a store. The file store derives the
+// file name from the object id, and uses offset_ to number the temporary
+// file a write goes to until it is committed.
+struct StoreLocation
+{
+  StoreLocation() : segment_( 0 ), length_( 0 ), offset_( 0 ) {}
+  bool operator==( const StoreLocation& other ) const {
+    return segment_ == other.segment_ && offset_ == other.offset_ && length_ == other.length_;
+  }
+
+  uint32_t segment_;
+  uint32_t length_; // Size of the encoded object
+  uint64_t offset_;
+};
+
+// An encoded object read back from a store. It is either copied into
+// buffer() or mapped straight from its file with map().
+class StoredRecord
+{
+ public:
+  StoredRecord() {}
+  const uint8_t* data() const {
+    if ( mapped_ ) {
+      return mapped_->data();
+    }
+    return buffer_.empty() ? 0 : &buffer_[0];
+  }
+  size_t size() const { return mapped_ ? mapped_->size() : buffer_.size(); }
+  std::vector< uint8_t >& buffer() { mapped_.reset(); return buffer_; }
+  void map( const std::string& filename ) { mapped_.reset( new OsMappedFile( filename ) ); }
+  void map( const OsDirectory& directory, const std::string& name ) { mapped_.reset( new OsMappedFile( directory, name ) ); }
+
+ private:
+  std::vector< uint8_t > buffer_;
+  boost::scoped_ptr< OsMappedFile > mapped_;
+  StoredRecord( const StoredRecord& ); // not copyable
+  bool operator=( const StoredRecord& ); // not assignable
+};
+
+// Persists encoded (hashed and encrypted) objects. The cache keeps the
+// index; a store only knows how to put the bytes somewhere and get them
+// back. Failures are reported with OsFileException.
+//
+// Write and Read do the heavy I/O and are called without any index lock
+// held. A write only becomes visible when it is committed. Commit, Abort,
+// Erase and Overwritten are cheap and are called with the object's index
+// lock held, which keeps the store in step with the index.
+class ObjectStore
+{
+ public:
+  typedef Cache::ObjectId ObjectId;
+  virtual ~ObjectStore() {}
+  // Stores record and fills in where it went
+  virtual void Write( const ObjectId& obj_id, const std::vector< uint8_t >& record, StoreLocation& location ) = 0;
+  // Stores the record written to the file filename, like Write. The
+  // file is taken over by the store, unless this throws.
+  virtual void WriteFile( const ObjectId& obj_id, const std::string& filename, StoreLocation& location ) = 0;
+  // Publishes a write, or throws it away
+  virtual void Commit( const ObjectId& obj_id, const StoreLocation& location ) = 0;
+  virtual void Abort( const ObjectId& obj_id, const StoreLocation& location ) = 0;
+  virtual void Read( const ObjectId& obj_id, const StoreLocation& location, StoredRecord& record ) = 0;
+  // Returns false if the record was already gone
+  virtual bool Erase( const ObjectId& obj_id, const StoreLocation& location ) = 0;
+  // The file and offset the record at location can be read from without
+  // the store, e.g. by an OsReadQueue. The record may be gone by the time
+  // it is read, so what is read has to be checked.
+  virtual void Locate( const ObjectId& obj_id, const StoreLocation& location, std::string& filename, uint64_t& offset ) = 0;
+  // Called after obj_id has been written again, with the location of
+  // the version that was replaced
+  virtual void Overwritten( const ObjectId& obj_id, const StoreLocation& previous ) = 0;
+};
+
+#endif // __OBJECTSTORE_HPP__
@@ -20,6 +20,144 @@ void OsReadFile( const std::string& filename, std::vector< uint8_t >& buffer );
 std::string OsConcatPath( const std::string& path, const std::string& filename );
 bool OsFileExists( const std::string& filename );
 void OsDeleteFile( const std::string& filename );
+// Renames from to to, atomically replacing to if it exists
+void OsRenameFile( const std::string& from, const std::string& to );
+// Microseconds since some fixed point in the past, never going backwards
+uint64_t OsMicroseconds();
+// The same, in nanoseconds
+uint64_t OsNanoseconds();
+
+/**
+   An open directory, that files are then read, written, renamed and
+   deleted relative to. The path of the directory is only looked up
+   once, when it is opened, instead of for every file. Names may have
+   subdirectories in them, separated by '/'. On POSIX this is a
+   directory descriptor used with openat and friends. Elsewhere the
+   path is kept and joined with the names.
+
+   Write, Read, Delete and Rename throw the same exceptions as
+   OsWriteFile, OsReadFile, OsDeleteFile and OsRenameFile.
+*/
+class OsDirectory
+{
+ public:
+  // Opens path, creating it and any intermediate directories if needed
+  explicit OsDirectory( const std::string& path );
+  // Opens name in parent, creating it if needed
+  OsDirectory( const OsDirectory& parent, const std::string& name );
+  ~OsDirectory();
+  // The full path of name
+  std::string Path( const std::string& name ) const;
+  // Creates the directory name, unless it exists. True if it was created.
+  bool EnsureDirectory( const std::string& name );
+  void Write( const std::string& name, const std::vector< uint8_t >& buffer );
+  void Read( const std::string& name, std::vector< uint8_t >& buffer );
+  void Delete( const std::string& name );
+  // Renames from to to, both in this directory, atomically replacing to
+  void Rename( const std::string& from, const std::string& to );
+  // The same, to name to in directory toDirectory
+  void Rename( const std::string& from, const OsDirectory& toDirectory, const std::string& to );
+  // Renames the file at the full path from to name to in this directory
+  void Move( const std::string& from, const std::string& to );
+  // Names of everything in the directory, except . and ..
+  void List( std::vector< std::string >& names ) const;
+
+ private:
+  friend class OsMappedFile;
+  const std::string path_;
+  intptr_t handle_; // Directory descriptor, if the platform has them
+  OsDirectory( const OsDirectory& ); // not copyable
+  bool operator=( const OsDirectory& ); // not assignable
+};
+
+/**
+   A read-only view of a whole file, mapped into memory instead of
+   being copied into a buffer. The view stays valid until the object
+   is destroyed. An empty file gives a null data() and a zero size().
+   Throws OsReadFileException if the file can't be opened or mapped.
+*/
+class OsMappedFile
+{
+ public:
+  explicit OsMappedFile( const std::string& filename );
+  // Maps the file name in directory
+  OsMappedFile( const OsDirectory& directory, const std::string& name );
+  ~OsMappedFile();
+  const uint8_t* data() const { return data_; }
+  size_t size() const { return size_; }
+
+ private:
+  void Map( intptr_t handle );
+
+  const uint8_t* data_;
+  size_t size_;
+  void* mapping_; // Platform specific mapping handle, if any
+  OsMappedFile( const OsMappedFile& ); // not copyable
+  bool operator=( const OsMappedFile& ); // not assignable
+};
+
+/**
+   An open file for positioned reads and writes, for files that are
+   kept open across operations. Several threads may read and write
+   different parts of the file at the same time. The file is closed
+   when the object is destroyed.
+*/
+class OsFile
+{
+ public:
+  /**
+     Opens filename for reading and writing. If create is true the file
+     is created, or emptied if it already exists. Otherwise the file must
+     exist or an OsReadFileException is thrown.
+  */
+  OsFile( const std::string& filename, bool create );
+  ~OsFile();
+  uint64_t Size() const;
+  // Throws OsReadFileException unless all size bytes could be read
+  void ReadAt( uint64_t offset, uint8_t* buffer, size_t size ) const;
+  void WriteAt( uint64_t offset, const uint8_t* buffer, size_t size );
+
+ private:
+  intptr_t handle_; // File descriptor or HANDLE
+  OsFile( const OsFile& ); // not copyable
+  bool operator=( const OsFile& ); // not assignable
+};
+
+/**
+   Reads parts of files without blocking the caller, with up to depth
+   reads in flight at once. On Linux this is an io_uring. Elsewhere, or
+   where the kernel doesn't allow one, Available() is false and the
+   caller has to read some other way.
+
+   Any thread may start reads. Completions are collected by one thread
+   at a time, with Wait.
+*/
+class OsReadQueue
+{
+ public:
+  explicit OsReadQueue( size_t depth );
+  ~OsReadQueue();
+  bool Available() const { return ring_ != 0; }
+
+  /**
+     Starts reading size bytes at offset of filename into buffer, which
+     must stay valid until the read has completed. Returns false if the
+     file could not be opened, or the kernel didn't take the read. The
+     caller keeps at most depth reads, and calls to Wake, in flight.
+  */
+  bool Read( const std::string& filename, uint64_t offset, uint8_t* buffer, size_t size, void* tag );
+  // Makes Wait return a null tag, e.g. to stop the collecting thread
+  void Wake();
+  // Waits for a read to complete and returns its tag. ok is set if all of
+  // it was read.
+  void* Wait( bool& ok );
+
+ private:
+  struct Ring;
+  Ring* ring_; // 0 when not available
+  OsReadQueue( const OsReadQueue& ); // not copyable
+  bool operator=( const OsReadQueue& ); // not assignable
+};
 
 /**
  */
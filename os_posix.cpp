@@ -0,0 +1,655 @@
+#include "stdinc.hpp"
+#include "scoped_handle.hpp"
+#include "os.hpp"
+#include "span.hpp"
+
+#include <dirent.h>
+
+#if defined( __linux__ )
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
+
+
+namespace
+{
+struct FileTraits
+{
+  typedef int HandleType;
+  static void close_fcn( HandleType handle ) { ::close( handle ); }
+  static bool is_valid( HandleType handle ) { return handle >= 0; };
+  static HandleType invalid() { return -1; }
+};
+
+typedef scoped_handle< FileTraits > FileHandle;
+typedef boost::error_info< struct tag_errno, int > ErrNo;
+typedef boost::error_info< struct tag_errstr, std::string > ErrStr;
+
+// Removes trailing separators, except for the root directory itself
+std::string StripTrailingSeparators( const std::string& path )
+{
+  std::string ret( path );
+  while ( ret.size() > 1 && *( ret.end()-1 ) == '/' ) {
+    ret.erase( ret.end()-1 );
+  }
+  return ret;
+}
+
+// Writes all of buffer to a file just opened for writing
+void WriteWhole( int fd, const std::vector< uint8_t >& buffer )
+{
+  // pwrite may write less than asked for, so loop
+  size_t written = 0;
+  while ( written < buffer.size() ) {
+    ssize_t res = ::pwrite( fd, &buffer[ written ], buffer.size() - written, static_cast< off_t >( written ) );
+    if ( res < 0 ) {
+      if ( errno == EINTR ) {
+        continue;
+      }
+      throw OsWriteFileException() << ErrStr( "pwrite" ) << ErrNo( errno );
+    }
+    written += static_cast< size_t >( res );
+  }
+}
+
+// Reads all of a file just opened for reading into buffer
+void ReadWhole( int fd, std::vector< uint8_t >& buffer )
+{
+  // Get file size
+  struct stat st;
+  if ( ::fstat( fd, &st ) != 0 ) {
+    throw OsReadFileException() << ErrStr( "fstat" ) << ErrNo( errno );
+  }
+  if ( static_cast< uint64_t >( st.st_size ) > std::numeric_limits< size_t >::max() ) {
+    throw OsReadFileException() << ErrStr( "Too large file" );
+  }
+
+  buffer.resize( static_cast< size_t >( st.st_size ) );
+  size_t read = 0;
+  while ( read < buffer.size() ) {
+    ssize_t res = ::pread( fd, &buffer[ read ], buffer.size() - read, static_cast< off_t >( read ) );
+    if ( res < 0 ) {
+      if ( errno == EINTR ) {
+        continue;
+      }
+      throw OsReadFileException() << ErrStr( "pread" ) << ErrNo( errno );
+    }
+    if ( res == 0 ) {
+      // The file was truncated while we were reading it
+      buffer.resize( read );
+      break;
+    }
+    read += static_cast< size_t >( res );
+  }
+}
+
+// Opens, and if needed creates, the directory name relative to dir
+int OpenDirectory( int dir, const std::string& name )
+{
+  int fd = ::openat( dir, name.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC );
+  if ( fd < 0 && errno == ENOENT ) {
+    if ( ::mkdirat( dir, name.c_str(), 0700 ) != 0 && errno != EEXIST ) {
+      throw OsEnsureDirectoryException() << ErrStr( "mkdirat" ) << ErrNo( errno );
+    }
+    fd = ::openat( dir, name.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC );
+  }
+  if ( fd < 0 ) {
+    throw OsEnsureDirectoryException() << ErrStr( "openat" ) << ErrNo( errno );
+  }
+  return fd;
+}
+
+}
+
+bool OsEnsureDirectory( const std::string& path )
+{
+  const std::string dir( StripTrailingSeparators( path ) );
+  if ( dir.empty() ) {
+    throw std::invalid_argument( "Invalid path" );
+  }
+
+  struct stat st;
+  if ( ::stat( dir.c_str(), &st ) == 0 ) {
+    if ( S_ISDIR( st.st_mode ) ) {
+      // Ok, it is a directory. Just return false
+      return false;
+    }
+    // There is a file. Can't create directory
+    throw OsEnsureDirectoryException() << ErrStr( "File exists" ) << ErrNo( ENOTDIR );
+  }
+
+  // Create all intermediate directories first
+  std::string::size_type sep = dir.find_last_of( '/' );
+  if ( sep != std::string::npos && sep != 0 ) {
+    OsEnsureDirectory( dir.substr( 0, sep ) );
+  }
+
+  if ( ::mkdir( dir.c_str(), 0700 ) != 0 ) {
+    if ( errno == EEXIST ) {
+      // Someone else created it in the meantime
+      return false;
+    }
+    throw OsEnsureDirectoryException() << ErrStr( "mkdir" ) << ErrNo( errno );
+  }
+  return true;
+}
+
+void OsWriteFile( const std::string& filename, const std::vector< uint8_t >& buffer )
+{
+  SPAN( "OsWriteFile" );
+  // Create (or truncate) the file with permission to write
+  FileHandle handle( ::open( filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600 ) ); // Will auto-close
+  if ( !handle.is_valid() ) {
+    throw OsWriteFileException() << ErrStr( "open" ) << ErrNo( errno );
+  }
+  WriteWhole( handle.get(), buffer );
+}
+
+std::string OsConcatPath( const std::string& path, const std::string& filename )
+{
+  if ( path.size() < 2 || filename.empty() ) {
+    throw std::invalid_argument( "Invalid path" );
+  }
+  std::string ret( path );
+  if ( *( path.end()-1 ) != '/' ) {
+    ret.push_back( '/' );
+  }
+  return ret + filename;
+}
+
+bool OsFileExists( const std::string& filename )
+{
+  struct stat st;
+  if ( ::stat( filename.c_str(), &st ) != 0 ) {
+    // Does not exist
+    return false;
+  }
+  return S_ISREG( st.st_mode ); // Directories and devices don't count
+}
+
+void OsDeleteFile( const std::string& filename )
+{
+  SPAN( "OsDeleteFile" );
+  if ( ::unlink( filename.c_str() ) != 0 ) {
+    throw OsDeleteFileException() << ErrStr( "unlink" ) << ErrNo( errno );
+  }
+}
+
+void OsRenameFile( const std::string& from, const std::string& to )
+{
+  if ( ::rename( from.c_str(), to.c_str() ) != 0 ) {
+    throw OsWriteFileException() << ErrStr( "rename" ) << ErrNo( errno );
+  }
+}
+
+uint64_t OsMicroseconds()
+{
+  struct timespec now;
+  ::clock_gettime( CLOCK_MONOTONIC, &now );
+  return static_cast< uint64_t >( now.tv_sec ) * 1000000 + now.tv_nsec / 1000;
+}
+
+uint64_t OsNanoseconds()
+{
+  struct timespec now;
+  ::clock_gettime( CLOCK_MONOTONIC, &now );
+  return static_cast< uint64_t >( now.tv_sec ) * 1000000000 + now.tv_nsec;
+}
+
+void OsReadFile( const std::string& filename, std::vector< uint8_t >& buffer )
+{
+  SPAN( "OsReadFile" );
+  // Open the existing file for reading
+  FileHandle handle( ::open( filename.c_str(), O_RDONLY | O_CLOEXEC ) ); // Will auto-close
+  if ( !handle.is_valid() ) {
+    throw OsReadFileException() << ErrStr( "open" ) << ErrNo( errno );
+  }
+  ReadWhole( handle.get(), buffer );
+}
+
+OsDirectory::OsDirectory( const std::string& path ) : path_( path ), handle_( -1 )
+{
+  OsEnsureDirectory( path );
+  int fd = ::open( path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC );
+  if ( fd < 0 ) {
+    throw OsEnsureDirectoryException() << ErrStr( "open" ) << ErrNo( errno );
+  }
+  handle_ = fd;
+}
+
+OsDirectory::OsDirectory( const OsDirectory& parent, const std::string& name ) :
+  path_( parent.Path( name ) ), handle_( OpenDirectory( static_cast< int >( parent.handle_ ), name ) )
+{
+}
+
+OsDirectory::~OsDirectory()
+{
+  ::close( static_cast< int >( handle_ ) );
+}
+
+std::string OsDirectory::Path( const std::string& name ) const
+{
+  return OsConcatPath( path_, name );
+}
+
+bool OsDirectory::EnsureDirectory( const std::string& name )
+{
+  if ( ::mkdirat( static_cast< int >( handle_ ), name.c_str(), 0700 ) == 0 ) {
+    return true;
+  }
+  struct stat st;
+  if ( errno == EEXIST && ::fstatat( static_cast< int >( handle_ ), name.c_str(), &st, 0 ) == 0 && S_ISDIR( st.st_mode ) ) {
+    return false;
+  }
+  throw OsEnsureDirectoryException() << ErrStr( "mkdirat" ) << ErrNo( errno == EEXIST ? ENOTDIR : errno );
+}
+
+void OsDirectory::Write( const std::string& name, const std::vector< uint8_t >& buffer )
+{
+  SPAN( "OsDirectory::Write" );
+  FileHandle handle( ::openat( static_cast< int >( handle_ ), name.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600 ) ); // Will auto-close
+  if ( !handle.is_valid() ) {
+    throw OsWriteFileException() << ErrStr( "openat" ) << ErrNo( errno );
+  }
+  WriteWhole( handle.get(), buffer );
+}
+
+void OsDirectory::Read( const std::string& name, std::vector< uint8_t >& buffer )
+{
+  SPAN( "OsDirectory::Read" );
+  FileHandle handle( ::openat( static_cast< int >( handle_ ), name.c_str(), O_RDONLY | O_CLOEXEC ) ); // Will auto-close
+  if ( !handle.is_valid() ) {
+    throw OsReadFileException() << ErrStr( "openat" ) << ErrNo( errno );
+  }
+  ReadWhole( handle.get(), buffer );
+}
+
+void OsDirectory::Delete( const std::string& name )
+{
+  SPAN( "OsDirectory::Delete" );
+  if ( ::unlinkat( static_cast< int >( handle_ ), name.c_str(), 0 ) != 0 ) {
+    throw OsDeleteFileException() << ErrStr( "unlinkat" ) << ErrNo( errno );
+  }
+}
+
+void OsDirectory::Rename( const std::string& from, const std::string& to )
+{
+  if ( ::renameat( static_cast< int >( handle_ ), from.c_str(), static_cast< int >( handle_ ), to.c_str() ) != 0 ) {
+    throw OsWriteFileException() << ErrStr( "renameat" ) << ErrNo( errno );
+  }
+}
+
+void OsDirectory::Rename( const std::string& from, const OsDirectory& toDirectory, const std::string& to )
+{
+  if ( ::renameat( static_cast< int >( handle_ ), from.c_str(), static_cast< int >( toDirectory.handle_ ), to.c_str() ) != 0 ) {
+    throw OsWriteFileException() << ErrStr( "renameat" ) << ErrNo( errno );
+  }
+}
+
+void OsDirectory::Move( const std::string& from, const std::string& to )
+{
+  if ( ::renameat( AT_FDCWD, from.c_str(), static_cast< int >( handle_ ), to.c_str() ) != 0 ) {
+    throw OsWriteFileException() << ErrStr( "renameat" ) << ErrNo( errno );
+  }
+}
+
+void OsDirectory::List( std::vector< std::string >& names ) const
+{
+  // The stream closes the descriptor it is given, so give it a copy
+  const int fd = ::openat( static_cast< int >( handle_ ), ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC );
+  if ( fd < 0 ) {
+    throw OsReadFileException() << ErrStr( "openat" ) << ErrNo( errno );
+  }
+  DIR* dir = ::fdopendir( fd );
+  if ( !dir ) {
+    const int err = errno;
+    ::close( fd );
+    throw OsReadFileException() << ErrStr( "fdopendir" ) << ErrNo( err );
+  }
+  names.clear();
+  while ( struct dirent* entry = ::readdir( dir ) ) {
+    const std::string name( entry->d_name );
+    if ( name != "." && name != ".." ) {
+      names.push_back( name );
+    }
+  }
+  ::closedir( dir );
+}
+
+OsMappedFile::OsMappedFile( const std::string& filename ) : data_( 0 ), size_( 0 ), mapping_( 0 )
+{
+  SPAN( "OsMappedFile" );
+  // The descriptor may be closed as soon as the mapping exists
+  FileHandle handle( ::open( filename.c_str(), O_RDONLY | O_CLOEXEC ) ); // Will auto-close
+  if ( !handle.is_valid() ) {
+    throw OsReadFileException() << ErrStr( "open" ) << ErrNo( errno );
+  }
+  Map( handle.get() );
+}
+
+OsMappedFile::OsMappedFile( const OsDirectory& directory, const std::string& name ) : data_( 0 ), size_( 0 ), mapping_( 0 )
+{
+  SPAN( "OsMappedFile" );
+  FileHandle handle( ::openat( static_cast< int >( directory.handle_ ), name.c_str(), O_RDONLY | O_CLOEXEC ) ); // Will auto-close
+  if ( !handle.is_valid() ) {
+    throw OsReadFileException() << ErrStr( "openat" ) << ErrNo( errno );
+  }
+  Map( handle.get() );
+}
+
+void OsMappedFile::Map( intptr_t fd )
+{
+  struct stat st;
+  if ( ::fstat( static_cast< int >( fd ), &st ) != 0 ) {
+    throw OsReadFileException() << ErrStr( "fstat" ) << ErrNo( errno );
+  }
+  if ( static_cast< uint64_t >( st.st_size ) > std::numeric_limits< size_t >::max() ) {
+    throw OsReadFileException() << ErrStr( "Too large file" );
+  }
+  if ( st.st_size == 0 ) {
+    // Empty files can't be mapped. Nothing to read.
+    return;
+  }
+  size_t size = static_cast< size_t >( st.st_size );
+  void* view = ::mmap( 0, size, PROT_READ, MAP_PRIVATE, static_cast< int >( fd ), 0 );
+  if ( view == MAP_FAILED ) {
+    throw OsReadFileException() << ErrStr( "mmap" ) << ErrNo( errno );
+  }
+  // Objects are decrypted front to back, so ask for aggressive read-ahead
+  ::madvise( view, size, MADV_SEQUENTIAL );
+  data_ = static_cast< const uint8_t* >( view );
+  size_ = size;
+}
+
+OsMappedFile::~OsMappedFile()
+{
+  if ( data_ ) {
+    ::munmap( const_cast< uint8_t* >( data_ ), size_ );
+  }
+}
+
+OsFile::OsFile( const std::string& filename, bool create ) : handle_( -1 )
+{
+  int flags = O_RDWR | O_CLOEXEC | ( create ? O_CREAT | O_TRUNC : 0 );
+  int fd = ::open( filename.c_str(), flags, 0600 );
+  if ( fd < 0 ) {
+    if ( create ) {
+      throw OsWriteFileException() << ErrStr( "open" ) << ErrNo( errno );
+    }
+    throw OsReadFileException() << ErrStr( "open" ) << ErrNo( errno );
+  }
+  handle_ = fd;
+}
+
+OsFile::~OsFile()
+{
+  ::close( static_cast< int >( handle_ ) );
+}
+
+uint64_t OsFile::Size() const
+{
+  struct stat st;
+  if ( ::fstat( static_cast< int >( handle_ ), &st ) != 0 ) {
+    throw OsGetFileInfoException() << ErrStr( "fstat" ) << ErrNo( errno );
+  }
+  return static_cast< uint64_t >( st.st_size );
+}
+
+void OsFile::ReadAt( uint64_t offset, uint8_t* buffer, size_t size ) const
+{
+  SPAN( "OsFile::ReadAt" );
+  size_t read = 0;
+  while ( read < size ) {
+    ssize_t res = ::pread( static_cast< int >( handle_ ), buffer + read, size - read, static_cast< off_t >( offset + read ) );
+    if ( res < 0 ) {
+      if ( errno == EINTR ) {
+        continue;
+      }
+      throw OsReadFileException() << ErrStr( "pread" ) << ErrNo( errno );
+    }
+    if ( res == 0 ) {
+      throw OsReadFileException() << ErrStr( "Unexpected end of file" );
+    }
+    read += static_cast< size_t >( res );
+  }
+}
+
+void OsFile::WriteAt( uint64_t offset, const uint8_t* buffer, size_t size )
+{
+  SPAN( "OsFile::WriteAt" );
+  size_t written = 0;
+  while ( written < size ) {
+    ssize_t res = ::pwrite( static_cast< int >( handle_ ), buffer + written, size - written, static_cast< off_t >( offset + written ) );
+    if ( res < 0 ) {
+      if ( errno == EINTR ) {
+        continue;
+      }
+      throw OsWriteFileException() << ErrStr( "pwrite" ) << ErrNo( errno );
+    }
+    written += static_cast< size_t >( res );
+  }
+}
+
+#if defined( __linux__ ) && defined( __NR_io_uring_setup )
+
+// The shared rings of an io_uring, mapped from the kernel
+struct OsReadQueue::Ring
+{
+  Ring() : fd_( -1 ), sqRing_( MAP_FAILED ), sqRingSize_( 0 ), cqRing_( MAP_FAILED ), cqRingSize_( 0 ),
+           sqes_( MAP_FAILED ), sqesSize_( 0 ) {}
+  ~Ring() {
+    if ( sqes_ != MAP_FAILED ) {
+      ::munmap( sqes_, sqesSize_ );
+    }
+    if ( cqRing_ != MAP_FAILED && cqRing_ != sqRing_ ) {
+      ::munmap( cqRing_, cqRingSize_ );
+    }
+    if ( sqRing_ != MAP_FAILED ) {
+      ::munmap( sqRing_, sqRingSize_ );
+    }
+    if ( fd_ >= 0 ) {
+      ::close( fd_ );
+    }
+  }
+
+  // Maps the rings of the io_uring fd, and takes ownership of it
+  bool Map( int fd, const io_uring_params& params ) {
+    fd_ = fd;
+    sqRingSize_ = params.sq_off.array + params.sq_entries * sizeof( unsigned );
+    cqRingSize_ = params.cq_off.cqes + params.cq_entries * sizeof( io_uring_cqe );
+    if ( params.features & IORING_FEAT_SINGLE_MMAP ) {
+      sqRingSize_ = cqRingSize_ = std::max( sqRingSize_, cqRingSize_ );
+    }
+    sqRing_ = ::mmap( 0, sqRingSize_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING );
+    if ( sqRing_ == MAP_FAILED ) {
+      return false;
+    }
+    if ( params.features & IORING_FEAT_SINGLE_MMAP ) {
+      cqRing_ = sqRing_;
+    } else {
+      cqRing_ = ::mmap( 0, cqRingSize_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING );
+      if ( cqRing_ == MAP_FAILED ) {
+        return false;
+      }
+    }
+    sqesSize_ = params.sq_entries * sizeof( io_uring_sqe );
+    sqes_ = ::mmap( 0, sqesSize_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES );
+    if ( sqes_ == MAP_FAILED ) {
+      return false;
+    }
+
+    uint8_t* sq = static_cast< uint8_t* >( sqRing_ );
+    uint8_t* cq = static_cast< uint8_t* >( cqRing_ );
+    sqTail_ = reinterpret_cast< unsigned* >( sq + params.sq_off.tail );
+    sqMask_ = reinterpret_cast< unsigned* >( sq + params.sq_off.ring_mask );
+    sqArray_ = reinterpret_cast< unsigned* >( sq + params.sq_off.array );
+    cqHead_ = reinterpret_cast< unsigned* >( cq + params.cq_off.head );
+    cqTail_ = reinterpret_cast< unsigned* >( cq + params.cq_off.tail );
+    cqMask_ = reinterpret_cast< unsigned* >( cq + params.cq_off.ring_mask );
+    cqes_ = reinterpret_cast< io_uring_cqe* >( cq + params.cq_off.cqes );
+    return true;
+  }
+
+  // Queues an operation and hands it to the kernel. Returns false if the
+  // kernel didn't take it.
+  bool Submit( const io_uring_sqe& sqe ) {
+    boost::mutex::scoped_lock lock( submitMutex_ );
+    const unsigned tail = *sqTail_;
+    const unsigned index = tail & *sqMask_;
+    static_cast< io_uring_sqe* >( sqes_ )[ index ] = sqe;
+    sqArray_[ index ] = index;
+    __atomic_store_n( sqTail_, tail + 1, __ATOMIC_RELEASE );
+    long res;
+    do {
+      res = ::syscall( __NR_io_uring_enter, fd_, 1, 0, 0, 0, 0 );
+    } while ( res < 0 && errno == EINTR );
+    if ( res != 1 ) {
+      // Nothing was consumed, so the entry can be taken back
+      __atomic_store_n( sqTail_, tail, __ATOMIC_RELEASE );
+      return false;
+    }
+    return true;
+  }
+
+  int fd_;
+  void* sqRing_;
+  size_t sqRingSize_;
+  void* cqRing_; // sqRing_ if the kernel maps both rings at once
+  size_t cqRingSize_;
+  void* sqes_;
+  size_t sqesSize_;
+  unsigned* sqTail_;
+  unsigned* sqMask_;
+  unsigned* sqArray_;
+  unsigned* cqHead_;
+  unsigned* cqTail_;
+  unsigned* cqMask_;
+  io_uring_cqe* cqes_;
+  boost::mutex submitMutex_;
+};
+
+namespace
+{
+// A read in flight
+struct PendingRead
+{
+  int fd_;
+  size_t size_;
+  void* tag_;
+};
+}
+
+OsReadQueue::OsReadQueue( size_t depth ) : ring_( 0 )
+{
+  io_uring_params params;
+  std::memset( &params, 0, sizeof( params ) );
+  const int fd = static_cast< int >( ::syscall( __NR_io_uring_setup, static_cast< unsigned >( depth ), &params ) );
+  if ( fd < 0 ) {
+    // Too old a kernel, or io_uring is not allowed here
+    return;
+  }
+  Ring* ring = new Ring;
+  if ( ring->Map( fd, params ) ) {
+    ring_ = ring;
+  } else {
+    delete ring;
+  }
+}
+
+OsReadQueue::~OsReadQueue()
+{
+  delete ring_;
+}
+
+bool OsReadQueue::Read( const std::string& filename, uint64_t offset, uint8_t* buffer, size_t size, void* tag )
+{
+  assert( ring_ && tag );
+  const int fd = ::open( filename.c_str(), O_RDONLY | O_CLOEXEC );
+  if ( fd < 0 ) {
+    return false;
+  }
+  PendingRead* pending = new PendingRead;
+  pending->fd_ = fd;
+  pending->size_ = size;
+  pending->tag_ = tag;
+
+  io_uring_sqe sqe;
+  std::memset( &sqe, 0, sizeof( sqe ) );
+  sqe.opcode = IORING_OP_READ;
+  sqe.fd = fd;
+  sqe.off = offset;
+  sqe.addr = reinterpret_cast< uintptr_t >( buffer );
+  sqe.len = static_cast< uint32_t >( size );
+  sqe.user_data = reinterpret_cast< uintptr_t >( pending );
+  if ( !ring_->Submit( sqe ) ) {
+    ::close( fd );
+    delete pending;
+    return false;
+  }
+  return true;
+}
+
+void OsReadQueue::Wake()
+{
+  assert( ring_ );
+  io_uring_sqe sqe;
+  std::memset( &sqe, 0, sizeof( sqe ) );
+  sqe.opcode = IORING_OP_NOP;
+  while ( !ring_->Submit( sqe ) ) {
+    boost::this_thread::yield();
+  }
+}
+
+void* OsReadQueue::Wait( bool& ok )
+{
+  assert( ring_ );
+  for ( ;; ) {
+    // Only the collecting thread moves the head
+    const unsigned head = *ring_->cqHead_;
+    if ( head != __atomic_load_n( ring_->cqTail_, __ATOMIC_ACQUIRE ) ) {
+      const io_uring_cqe& cqe( ring_->cqes_[ head & *ring_->cqMask_ ] );
+      PendingRead* pending = reinterpret_cast< PendingRead* >( static_cast< uintptr_t >( cqe.user_data ) );
+      const int32_t res = cqe.res;
+      __atomic_store_n( ring_->cqHead_, head + 1, __ATOMIC_RELEASE );
+      if ( !pending ) {
+        ok = false;
+        return 0;
+      }
+      ::close( pending->fd_ );
+      ok = res >= 0 && static_cast< size_t >( res ) == pending->size_;
+      void* tag = pending->tag_;
+      delete pending;
+      return tag;
+    }
+    ::syscall( __NR_io_uring_enter, ring_->fd_, 0, 1, IORING_ENTER_GETEVENTS, 0, 0 );
+  }
+}
+
+#else
+
+struct OsReadQueue::Ring {};
+
+OsReadQueue::OsReadQueue( size_t ) : ring_( 0 )
+{
+}
+
+OsReadQueue::~OsReadQueue()
+{
+}
+
+bool OsReadQueue::Read( const std::string&, uint64_t, uint8_t*, size_t, void* )
+{
+  return false;
+}
+
+void OsReadQueue::Wake()
+{
+}
+
+void* OsReadQueue::Wait( bool& ok )
+{
+  ok = false;
+  return 0;
+}
+
+#endif
@@ -0,0 +1,380 @@
+#include "stdinc.hpp"
+#include "scoped_handle.hpp"
+#include "os.hpp"
+#include "span.hpp"
+
+
+namespace
+{
+struct FileTraits
+{
+  typedef HANDLE HandleType;
+  static void close_fcn( HandleType handle ) { CloseHandle( handle ); }
+  static bool is_valid( HandleType handle ) { return handle != 0; };
+  static HandleType invalid() { return 0; }
+};
+
+typedef scoped_handle< FileTraits > FileHandle;
+typedef boost::error_info< struct tag_errno, int > ErrNo;
+typedef boost::error_info< struct tag_errstr, std::string > ErrStr;
+
+}
+
+// Note requires shell32.dll version 5.0 or later
+bool OsEnsureDirectory( const std::string& path )
+{
+  // Ok, lets attempt to create the directory
+  int res = SHCreateDirectoryExA( 0, path.c_str(), 0 );
+  if ( res == ERROR_SUCCESS ) {
+    return true;
+  } else if ( res == ERROR_ALREADY_EXISTS || res == ERROR_FILE_EXISTS ) {
+    // Ok, the directory already exists
+    // See if it is a file
+    WIN32_FILE_ATTRIBUTE_DATA data;
+    if ( !GetFileAttributesExA( path.c_str(), GetFileExInfoStandard, &data ) ) {
+      throw OsEnsureDirectoryException() << ErrStr( "GetFileAttributesEx" ) << ErrNo( GetLastError() );
+    }
+    if ( data.dwFileAttributes &= FILE_ATTRIBUTE_DIRECTORY ) {
+      // Ok, it is a directory. Just return false
+      return false;
+    } else {
+      // There is a file. Can't create directory
+      throw OsEnsureDirectoryException() << ErrStr( "File exists" ) << ErrNo( GetLastError() );
+    }
+  } else {
+    // A file exists where the directory should be created.
+    throw OsEnsureDirectoryException() << ErrStr( "ShCreateDirectoryExA" ) << ErrNo( res );
+  }
+}
+
+void OsWriteFile( const std::string& filename, const std::vector< uint8_t >& buffer )
+{
+  SPAN( "OsWriteFile" );
+  // Create (or open) the file with permission to write
+  FileHandle handle( CreateFileA( filename.c_str(), FILE_WRITE_DATA, 0, 0, CREATE_ALWAYS, 0, 0 ) ); // Will auto-close
+  if ( handle.get() == INVALID_HANDLE_VALUE ) {
+    throw OsWriteFileException() << ErrStr( "CreateFileA" ) << ErrNo( GetLastError() );
+  }
+  // Write the buffer (if it isn't empty)
+  if ( !buffer.empty() ) {
+    DWORD dwWritten = 0;
+    if  ( !WriteFile( handle.get(), &buffer[0], static_cast< DWORD > ( buffer.size() ), &dwWritten, 0 ) ) {
+      throw OsWriteFileException() << ErrStr( "WriteFile" ) << ErrNo( GetLastError() );
+    }
+  }
+}
+
+std::string OsConcatPath( const std::string& path, const std::string& filename )
+{
+  if ( path.size() < 2 || filename.empty() ) {
+    throw std::invalid_argument( "Invalid path" );
+  }
+  std::string ret( path );
+  if ( *( path.end()-1 ) != '\\' ) {
+    ret.push_back( '\\' );
+  }
+  return ret + filename;
+}
+
+bool OsFileExists( const std::string& filename )
+{
+  WIN32_FILE_ATTRIBUTE_DATA data;
+  BOOL ret = GetFileAttributesExA( filename.c_str(), GetFileExInfoStandard, &data );
+  if ( !ret ) {
+    // Does not exist
+    return false;
+  } else if ( data.dwFileAttributes &= FILE_ATTRIBUTE_DIRECTORY  ) {
+    return false; // Is a directory
+  } else {
+    return true; // Ok exists
+  }
+}
+
+void OsDeleteFile( const std::string& filename )
+{
+  SPAN( "OsDeleteFile" );
+  if ( !DeleteFileA( filename.c_str() ) ) {
+    throw OsDeleteFileException() << ErrStr( "DeleteFile" ) << ErrNo( GetLastError() );
+  }
+}
+
+void OsRenameFile( const std::string& from, const std::string& to )
+{
+  if ( !MoveFileExA( from.c_str(), to.c_str(), MOVEFILE_REPLACE_EXISTING ) ) {
+    throw OsWriteFileException() << ErrStr( "MoveFileExA" ) << ErrNo( GetLastError() );
+  }
+}
+
+uint64_t OsMicroseconds()
+{
+  LARGE_INTEGER frequency;
+  LARGE_INTEGER now;
+  QueryPerformanceFrequency( &frequency );
+  QueryPerformanceCounter( &now );
+  return static_cast< uint64_t >( now.QuadPart / frequency.QuadPart * 1000000 +
+                                  now.QuadPart % frequency.QuadPart * 1000000 / frequency.QuadPart );
+}
+
+uint64_t OsNanoseconds()
+{
+  LARGE_INTEGER frequency;
+  LARGE_INTEGER now;
+  QueryPerformanceFrequency( &frequency );
+  QueryPerformanceCounter( &now );
+  return static_cast< uint64_t >( now.QuadPart / frequency.QuadPart * 1000000000 +
+                                  now.QuadPart % frequency.QuadPart * 1000000000 / frequency.QuadPart );
+}
+
+void OsReadFile( const std::string& filename, std::vector< uint8_t >& buffer )
+{
+  SPAN( "OsReadFile" );
+  // Open the existing file for reading
+  FileHandle handle( CreateFileA( filename.c_str(), FILE_READ_DATA, 0, 0, OPEN_EXISTING, 0, 0 ) ); // Will auto-close
+  if ( handle.get() == INVALID_HANDLE_VALUE ) {
+    throw OsReadFileException() << ErrStr( "CreateFileA" ) << ErrNo( GetLastError() );
+  }
+  // Get file size
+  LARGE_INTEGER liSize;
+  if (!GetFileSizeEx( handle.get(), &liSize ) ) {
+    throw OsReadFileException() << ErrStr( "GetFileSizeEx" ) << ErrNo( GetLastError() );
+  }
+
+  if ( liSize.QuadPart >> 32 ) {
+    // File must be bigger then 4G. Blow up.
+    throw OsReadFileException() << ErrStr( "Too large file" );
+  }
+  size_t fileSize = static_cast< size_t >( liSize.QuadPart );
+  if ( fileSize == 0 ) {
+    // Nothing to read
+    buffer.clear();
+  } else {
+    // Resize the buffer
+    buffer.resize( fileSize );
+    DWORD dwBytesRead = 0;
+    if ( !ReadFile( handle.get(), &buffer[0], static_cast< DWORD > ( buffer.size() ), &dwBytesRead, 0 ) ) {
+      throw OsReadFileException() << ErrStr( "ReadFile" ) << ErrNo( GetLastError() );
+    }
+  }
+}
+
+OsDirectory::OsDirectory( const std::string& path ) : path_( path ), handle_( 0 )
+{
+  OsEnsureDirectory( path );
+}
+
+OsDirectory::OsDirectory( const OsDirectory& parent, const std::string& name ) : path_( parent.Path( name ) ), handle_( 0 )
+{
+  OsEnsureDirectory( path_ );
+}
+
+OsDirectory::~OsDirectory()
+{
+}
+
+std::string OsDirectory::Path( const std::string& name ) const
+{
+  // The file functions take '/' as well as '\\' between directories
+  return OsConcatPath( path_, name );
+}
+
+bool OsDirectory::EnsureDirectory( const std::string& name )
+{
+  return OsEnsureDirectory( Path( name ) );
+}
+
+void OsDirectory::Write( const std::string& name, const std::vector< uint8_t >& buffer )
+{
+  OsWriteFile( Path( name ), buffer );
+}
+
+void OsDirectory::Read( const std::string& name, std::vector< uint8_t >& buffer )
+{
+  OsReadFile( Path( name ), buffer );
+}
+
+void OsDirectory::Delete( const std::string& name )
+{
+  OsDeleteFile( Path( name ) );
+}
+
+void OsDirectory::Rename( const std::string& from, const std::string& to )
+{
+  OsRenameFile( Path( from ), Path( to ) );
+}
+
+void OsDirectory::Rename( const std::string& from, const OsDirectory& toDirectory, const std::string& to )
+{
+  OsRenameFile( Path( from ), toDirectory.Path( to ) );
+}
+
+void OsDirectory::Move( const std::string& from, const std::string& to )
+{
+  OsRenameFile( from, Path( to ) );
+}
+
+void OsDirectory::List( std::vector< std::string >& names ) const
+{
+  names.clear();
+  WIN32_FIND_DATAA data;
+  HANDLE find = FindFirstFileA( Path( "*" ).c_str(), &data );
+  if ( find == INVALID_HANDLE_VALUE ) {
+    if ( GetLastError() == ERROR_FILE_NOT_FOUND ) {
+      return;
+    }
+    throw OsReadFileException() << ErrStr( "FindFirstFileA" ) << ErrNo( GetLastError() );
+  }
+  do {
+    const std::string name( data.cFileName );
+    if ( name != "." && name != ".." ) {
+      names.push_back( name );
+    }
+  } while ( FindNextFileA( find, &data ) );
+  FindClose( find );
+}
+
+OsMappedFile::OsMappedFile( const std::string& filename ) : data_( 0 ), size_( 0 ), mapping_( 0 )
+{
+  SPAN( "OsMappedFile" );
+  // Open the existing file for reading. The file handle may be closed as soon
+  // as the mapping has been created.
+  FileHandle handle( CreateFileA( filename.c_str(), GENERIC_READ, FILE_SHARE_READ, 0, OPEN_EXISTING, 0, 0 ) ); // Will auto-close
+  if ( handle.get() == INVALID_HANDLE_VALUE ) {
+    throw OsReadFileException() << ErrStr( "CreateFileA" ) << ErrNo( GetLastError() );
+  }
+  Map( reinterpret_cast< intptr_t >( handle.get() ) );
+}
+
+OsMappedFile::OsMappedFile( const OsDirectory& directory, const std::string& name ) : data_( 0 ), size_( 0 ), mapping_( 0 )
+{
+  SPAN( "OsMappedFile" );
+  FileHandle handle( CreateFileA( directory.Path( name ).c_str(), GENERIC_READ, FILE_SHARE_READ, 0, OPEN_EXISTING, 0, 0 ) ); // Will auto-close
+  if ( handle.get() == INVALID_HANDLE_VALUE ) {
+    throw OsReadFileException() << ErrStr( "CreateFileA" ) << ErrNo( GetLastError() );
+  }
+  Map( reinterpret_cast< intptr_t >( handle.get() ) );
+}
+
+void OsMappedFile::Map( intptr_t file )
+{
+  LARGE_INTEGER liSize;
+  if (!GetFileSizeEx( reinterpret_cast< HANDLE >( file ), &liSize ) ) {
+    throw OsReadFileException() << ErrStr( "GetFileSizeEx" ) << ErrNo( GetLastError() );
+  }
+  if ( liSize.QuadPart >> 32 ) {
+    throw OsReadFileException() << ErrStr( "Too large file" );
+  }
+  if ( liSize.QuadPart == 0 ) {
+    // Empty files can't be mapped. Nothing to read.
+    return;
+  }
+  HANDLE mapping = CreateFileMappingA( reinterpret_cast< HANDLE >( file ), 0, PAGE_READONLY, 0, 0, 0 );
+  if ( !mapping ) {
+    throw OsReadFileException() << ErrStr( "CreateFileMappingA" ) << ErrNo( GetLastError() );
+  }
+  void* view = MapViewOfFile( mapping, FILE_MAP_READ, 0, 0, 0 );
+  if ( !view ) {
+    DWORD err = GetLastError();
+    CloseHandle( mapping );
+    throw OsReadFileException() << ErrStr( "MapViewOfFile" ) << ErrNo( err );
+  }
+  mapping_ = mapping;
+  data_ = static_cast< const uint8_t* >( view );
+  size_ = static_cast< size_t >( liSize.QuadPart );
+}
+
+OsMappedFile::~OsMappedFile()
+{
+  if ( data_ ) {
+    UnmapViewOfFile( data_ );
+  }
+  if ( mapping_ ) {
+    CloseHandle( mapping_ );
+  }
+}
+
+OsFile::OsFile( const std::string& filename, bool create ) : handle_( 0 )
+{
+  // FILE_SHARE_DELETE lets a file be deleted while other objects still read it
+  HANDLE handle = CreateFileA( filename.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+                               0, create ? CREATE_ALWAYS : OPEN_EXISTING, 0, 0 );
+  if ( handle == INVALID_HANDLE_VALUE ) {
+    if ( create ) {
+      throw OsWriteFileException() << ErrStr( "CreateFileA" ) << ErrNo( GetLastError() );
+    }
+    throw OsReadFileException() << ErrStr( "CreateFileA" ) << ErrNo( GetLastError() );
+  }
+  handle_ = reinterpret_cast< intptr_t >( handle );
+}
+
+OsFile::~OsFile()
+{
+  CloseHandle( reinterpret_cast< HANDLE >( handle_ ) );
+}
+
+uint64_t OsFile::Size() const
+{
+  LARGE_INTEGER liSize;
+  if (!GetFileSizeEx( reinterpret_cast< HANDLE >( handle_ ), &liSize ) ) {
+    throw OsGetFileInfoException() << ErrStr( "GetFileSizeEx" ) << ErrNo( GetLastError() );
+  }
+  return static_cast< uint64_t >( liSize.QuadPart );
+}
+
+void OsFile::ReadAt( uint64_t offset, uint8_t* buffer, size_t size ) const
+{
+  SPAN( "OsFile::ReadAt" );
+  size_t read = 0;
+  while ( read < size ) {
+    OVERLAPPED overlapped = { 0 };
+    overlapped.Offset = static_cast< DWORD >( offset + read );
+    overlapped.OffsetHigh = static_cast< DWORD >( ( offset + read ) >> 32 );
+    DWORD dwBytesRead = 0;
+    if ( !ReadFile( reinterpret_cast< HANDLE >( handle_ ), buffer + read, static_cast< DWORD > ( size - read ), &dwBytesRead, &overlapped ) ) {
+      throw OsReadFileException() << ErrStr( "ReadFile" ) << ErrNo( GetLastError() );
+    }
+    if ( dwBytesRead == 0 ) {
+      throw OsReadFileException() << ErrStr( "Unexpected end of file" );
+    }
+    read += dwBytesRead;
+  }
+}
+
+void OsFile::WriteAt( uint64_t offset, const uint8_t* buffer, size_t size )
+{
+  SPAN( "OsFile::WriteAt" );
+  size_t written = 0;
+  while ( written < size ) {
+    OVERLAPPED overlapped = { 0 };
+    overlapped.Offset = static_cast< DWORD >( offset + written );
+    overlapped.OffsetHigh = static_cast< DWORD >( ( offset + written ) >> 32 );
+    DWORD dwWritten = 0;
+    if ( !WriteFile( reinterpret_cast< HANDLE >( handle_ ), buffer + written, static_cast< DWORD > ( size - written ), &dwWritten, &overlapped ) ) {
+      throw OsWriteFileException() << ErrStr( "WriteFile" ) << ErrNo( GetLastError() );
+    }
+    written += dwWritten;
+  }
+}
+
+OsReadQueue::OsReadQueue( size_t /* depth */ ) : ring_( 0 )
+{
+  // Not implemented with overlapped I/O yet. Callers read on threads.
+}
+
+OsReadQueue::~OsReadQueue()
+{
+}
+
+bool OsReadQueue::Read( const std::string& /* filename */, uint64_t /* offset */, uint8_t* /* buffer */, size_t /* size */, void* /* tag */ )
+{
+  return false;
+}
+
+void OsReadQueue::Wake()
+{
+}
+
+void* OsReadQueue::Wait( bool& ok )
+{
+  ok = false;
+  return 0;
+}
@@ -0,0 +1,197 @@
+#include "stdinc.hpp"
+#include "presenceindex.hpp"
+
+namespace
+{
+const size_t initialCapacity = 16;
+}
+
+uint64_t Fingerprint( const uint8_t* data, size_t size )
+{
+  // Mixes in eight bytes at a time, followed by a finalizer that spreads
+  // the bits, since the tables use the low bits and the cache the high
+  // bits.
+  const uint64_t multiplier = 0x9e3779b97f4a7c15ULL;
+  uint64_t hash = size * multiplier;
+  for ( ; size >= 8; data += 8, size -= 8 ) {
+    uint64_t word;
+    std::memcpy( &word, data, 8 );
+    hash = ( hash ^ word ) * multiplier;
+    hash ^= hash >> 29;
+  }
+  if ( size > 0 ) {
+    uint64_t word = 0;
+    std::memcpy( &word, data, size );
+    hash = ( hash ^ word ) * multiplier;
+  }
+  hash ^= hash >> 33;
+  hash *= 0xff51afd7ed558ccdULL;
+  hash ^= hash >> 33;
+  hash *= 0xc4ceb9fe1a85ec53ULL;
+  hash ^= hash >> 33;
+  return hash != 0 ? hash : 1;
+}
+
+uint64_t Fingerprint( const std::vector< uint8_t >& obj_id )
+{
+  return Fingerprint( obj_id.empty() ? 0 : &obj_id[0], obj_id.size() );
+}
+
+PresenceIndex::Table::Table( size_t capacity ) : mask_( capacity - 1 ), slots_( new boost::atomic< uint64_t >[ capacity ] )
+{
+  for ( size_t i = 0; i < capacity; ++i ) {
+    slots_[i].store( 0, boost::memory_order_relaxed );
+  }
+}
+
+PresenceIndex::PresenceIndex() : version_( 0 ), size_( 0 )
+{
+  tables_.push_back( boost::shared_ptr< Table >( new Table( initialCapacity ) ) );
+  table_.store( tables_.back().get(), boost::memory_order_release );
+}
+
+bool PresenceIndex::Probe( const Table& table, uint64_t fingerprint )
+{
+  // A reader racing with a writer may see a table without any empty
+  // slot, so never look at more slots than there are.
+  size_t i = fingerprint & table.mask_;
+  for ( size_t n = 0; n <= table.mask_; ++n, i = ( i + 1 ) & table.mask_ ) {
+    uint64_t slot = table.slots_[i].load( boost::memory_order_relaxed );
+    if ( slot == fingerprint ) {
+      return true;
+    }
+    if ( slot == 0 ) {
+      return false;
+    }
+  }
+  return false;
+}
+
+bool PresenceIndex::Contains( uint64_t fingerprint ) const
+{
+  for ( ;; ) {
+    uint32_t before = version_.load( boost::memory_order_acquire );
+    if ( before & 1 ) {
+      // A writer is moving slots around
+      boost::this_thread::yield();
+      continue;
+    }
+    bool found = Probe( *table_.load( boost::memory_order_acquire ), fingerprint );
+    boost::atomic_thread_fence( boost::memory_order_acquire );
+    if ( version_.load( boost::memory_order_relaxed ) == before ) {
+      return found;
+    }
+  }
+}
+
+void PresenceIndex::BeginWrite()
+{
+  version_.store( version_.load( boost::memory_order_relaxed ) + 1, boost::memory_order_relaxed );
+  boost::atomic_thread_fence( boost::memory_order_release );
+}
+
+void PresenceIndex::EndWrite()
+{
+  version_.store( version_.load( boost::memory_order_relaxed ) + 1, boost::memory_order_release );
+}
+
+void PresenceIndex::Insert( uint64_t fingerprint )
+{
+  // Keep at least half of the slots empty, so probes stay short
+  if ( ( size_ + 1 ) * 2 > tables_.back()->mask_ + 1 ) {
+    Grow( ( tables_.back()->mask_ + 1 ) * 2 );
+  }
+
+  // Filling an empty slot is a single store that readers can't see half
+  // done, so no need to bump the version.
+  Table& table( *tables_.back() );
+  size_t i = fingerprint & table.mask_;
+  while ( table.slots_[i].load( boost::memory_order_relaxed ) != 0 ) {
+    i = ( i + 1 ) & table.mask_;
+  }
+  table.slots_[i].store( fingerprint, boost::memory_order_release );
+  ++ size_;
+}
+
+void PresenceIndex::Erase( uint64_t fingerprint )
+{
+  Table& table( *tables_.back() );
+  size_t i = fingerprint & table.mask_;
+  for ( ;; i = ( i + 1 ) & table.mask_ ) {
+    uint64_t slot = table.slots_[i].load( boost::memory_order_relaxed );
+    if ( slot == 0 ) {
+      return;
+    }
+    if ( slot == fingerprint ) {
+      break;
+    }
+  }
+
+  // Shift the following entries back over the hole, so that no probe
+  // sequence is broken. Readers may miss an entry while it moves.
+  BeginWrite();
+  size_t j = i;
+  for ( ;; ) {
+    j = ( j + 1 ) & table.mask_;
+    uint64_t slot = table.slots_[j].load( boost::memory_order_relaxed );
+    if ( slot == 0 ) {
+      break;
+    }
+    // An entry may move to the hole unless its home slot is after the
+    // hole, counting cyclically up to where the entry is now.
+    size_t home = slot & table.mask_;
+    bool homeAfterHole = ( i <= j ) ? ( i < home && home <= j ) : ( i < home || home <= j );
+    if ( !homeAfterHole ) {
+      table.slots_[i].store( slot, boost::memory_order_relaxed );
+      i = j;
+    }
+  }
+  table.slots_[i].store( 0, boost::memory_order_relaxed );
+  EndWrite();
+  -- size_;
+}
+
+void PresenceIndex::Prefetch( uint64_t fingerprint ) const
+{
+  const Table& table( *tables_.back() );
+#ifdef _MSC_VER
+  _mm_prefetch( reinterpret_cast< const char* >( &table.slots_[ fingerprint & table.mask_ ] ), _MM_HINT_T0 );
+#else
+  __builtin_prefetch( &table.slots_[ fingerprint & table.mask_ ] );
+#endif
+}
+
+void PresenceIndex::Reserve( size_t count )
+{
+  // Grow straight to the final size, since every table outgrown is kept
+  size_t capacity = tables_.back()->mask_ + 1;
+  while ( count * 2 > capacity ) {
+    capacity *= 2;
+  }
+  if ( capacity != tables_.back()->mask_ + 1 ) {
+    Grow( capacity );
+  }
+}
+
+void PresenceIndex::Grow( size_t capacity )
+{
+  const Table& current( *tables_.back() );
+  boost::shared_ptr< Table > grown( new Table( capacity ) );
+  for ( size_t i = 0; i <= current.mask_; ++i ) {
+    uint64_t slot = current.slots_[i].load( boost::memory_order_relaxed );
+    if ( slot != 0 ) {
+      size_t j = slot & grown->mask_;
+      while ( grown->slots_[j].load( boost::memory_order_relaxed ) != 0 ) {
+        j = ( j + 1 ) & grown->mask_;
+      }
+      grown->slots_[j].store( slot, boost::memory_order_relaxed );
+    }
+  }
+
+  // Readers still probing the old table retry when they see the version
+  // change, and then find the new one.
+  BeginWrite();
+  tables_.push_back( grown );
+  table_.store( grown.get(), boost::memory_order_relaxed );
+  EndWrite();
+}
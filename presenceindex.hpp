@@ -0,0 +1,62 @@
+#ifndef __PRESENCEINDEX_HPP__
+#define __PRESENCEINDEX_HPP__
+
+// A 64 bit hash of an object id. Never 0.
+uint64_t Fingerprint( const uint8_t* data, size_t size );
+uint64_t Fingerprint( const std::vector< uint8_t >& obj_id );
+
+/**
+   A set of fingerprints that can be searched without taking any lock,
+   while another thread changes it. It backs hasObject, so that lookups
+   never wait for a writer holding an index lock through pruning or I/O.
+
+   The fingerprints live in an open addressing table of atomic slots,
+   guarded by a sequence lock: writers make the version odd while they
+   move slots around, and a reader that sees the version change retries.
+   Tables that have been outgrown are kept until the index is destroyed,
+   since a reader may still be probing them.
+
+   The same fingerprint may be inserted more than once, it is then
+   contained until it has been erased as many times. Two object ids with
+   the same fingerprint would make one of them look present when it is
+   not, which takes a 64 bit hash collision.
+*/
+class PresenceIndex
+{
+ public:
+  PresenceIndex();
+
+  // Safe to call from any thread at any time
+  bool Contains( uint64_t fingerprint ) const;
+
+  // Writers must be serialized by the caller
+  void Insert( uint64_t fingerprint );
+  void Erase( uint64_t fingerprint );
+  // Makes room for count fingerprints in all
+  void Reserve( size_t count );
+  // Starts loading the slot an Insert of fingerprint looks at first
+  void Prefetch( uint64_t fingerprint ) const;
+
+ private:
+  struct Table
+  {
+    explicit Table( size_t capacity );
+    const size_t mask_;
+    boost::scoped_array< boost::atomic< uint64_t > > slots_;
+  };
+
+  static bool Probe( const Table& table, uint64_t fingerprint );
+  void Grow( size_t capacity );
+  void BeginWrite();
+  void EndWrite();
+
+  boost::atomic< uint32_t > version_;
+  boost::atomic< Table* > table_;
+  std::vector< boost::shared_ptr< Table > > tables_; // The current one is last
+  size_t size_;
+
+  PresenceIndex( const PresenceIndex& ); // not copyable
+  bool operator=( const PresenceIndex& ); // not assignable
+};
+
+#endif // __PRESENCEINDEX_HPP__
@@ -0,0 +1,359 @@
+#include "stdinc.hpp"
+#include "os.hpp"
+#include "segmentstore.hpp"
+
+namespace
+{
+typedef boost::error_info< struct tag_errstr, std::string > ErrStr;
+
+// Every record in a segment is preceded by a frame holding the size of
+// the record and the size of the object id inside it, so that a segment
+// can be scanned without the index.
+const size_t frameSize = 8;
+
+void PutUint32( uint8_t* out, uint32_t value )
+{
+  out[0] = static_cast< uint8_t >( value );
+  out[1] = static_cast< uint8_t >( value >> 8 );
+  out[2] = static_cast< uint8_t >( value >> 16 );
+  out[3] = static_cast< uint8_t >( value >> 24 );
+}
+
+uint32_t GetUint32( const uint8_t* in )
+{
+  return static_cast< uint32_t >( in[0] ) | ( static_cast< uint32_t >( in[1] ) << 8 ) |
+    ( static_cast< uint32_t >( in[2] ) << 16 ) | ( static_cast< uint32_t >( in[3] ) << 24 );
+}
+}
+
+SegmentStore::SegmentStore( const std::string& path, uint64_t segmentSize )
+    : path_( path ), segmentSize_( segmentSize ), active_( 0 ), nextSegment_( 1 ), stopping_( false )
+{
+}
+
+std::string SegmentStore::Filename( uint32_t segment ) const
+{
+  std::ostringstream ss;
+  ss << std::setbase( 16 ) << std::setw( 8 ) << std::setfill( '0' ) << segment << segmentExtension;
+  return OsConcatPath( path_, ss.str() );
+}
+
+void SegmentStore::Write( const ObjectId& obj_id, const std::vector< uint8_t >& record, StoreLocation& location )
+{
+  boost::shared_ptr< OsFile > file( Append( obj_id, record.size(), location ) );
+  try {
+    file->WriteAt( location.offset_, &record[0], record.size() );
+  } catch ( ... ) {
+    // The reserved space is left as a dead hole in the segment
+    Erase( obj_id, location );
+    throw;
+  }
+}
+
+void SegmentStore::WriteFile( const ObjectId& obj_id, const std::string& filename, StoreLocation& location )
+{
+  {
+    OsFile source( filename, false );
+    const uint64_t size = source.Size();
+    boost::shared_ptr< OsFile > file( Append( obj_id, size, location ) );
+    try {
+      // Copy a piece at a time, the record may be large
+      std::vector< uint8_t > buffer( static_cast< size_t >( std::min< uint64_t >( size, 1024 * 1024 ) ) );
+      for ( uint64_t done = 0; done < size; ) {
+        const size_t piece = static_cast< size_t >( std::min< uint64_t >( buffer.size(), size - done ) );
+        source.ReadAt( done, &buffer[0], piece );
+        file->WriteAt( location.offset_ + done, &buffer[0], piece );
+        done += piece;
+      }
+    } catch ( ... ) {
+      Erase( obj_id, location );
+      throw;
+    }
+  }
+  OsDeleteFile( filename );
+}
+
+boost::shared_ptr< OsFile > SegmentStore::Append( const ObjectId& obj_id, uint64_t size, StoreLocation& location )
+{
+  if ( size == 0 || size > std::numeric_limits< uint32_t >::max() ) {
+    throw std::invalid_argument( "Invalid record size" );
+  }
+  uint8_t frame[ frameSize ];
+  PutUint32( frame, static_cast< uint32_t >( size ) );
+  PutUint32( frame + 4, static_cast< uint32_t >( obj_id.size() ) );
+  const uint64_t total = frameSize + size;
+
+  // Reserve space at the end of the active segment, then write without
+  // holding the lock. Reserved space counts as live, so the segment
+  // can't be deleted under our feet.
+  boost::shared_ptr< OsFile > file;
+  uint32_t segment;
+  uint64_t offset;
+  {
+    boost::mutex::scoped_lock lock( mutex_ );
+    SegmentMap::iterator it = segments_.find( active_ );
+    if ( it != segments_.end() && it->second.size_ > 0 && it->second.size_ + total > segmentSize_ ) {
+      // Full. Records larger than a segment get a segment of their own.
+      Seal( it );
+      it = segments_.end();
+    }
+    if ( it == segments_.end() ) {
+      it = StartSegment();
+    }
+    segment = it->first;
+    offset = it->second.size_;
+    file = it->second.file_;
+    it->second.size_ += total;
+    it->second.liveBytes_ += total;
+    ++ it->second.liveRecords_;
+  }
+
+  location.segment_ = segment;
+  location.offset_ = offset + frameSize;
+  location.length_ = static_cast< uint32_t >( size );
+  try {
+    file->WriteAt( offset, frame, frameSize );
+  } catch ( ... ) {
+    Erase( obj_id, location );
+    throw;
+  }
+  return file;
+}
+
+void SegmentStore::Commit( const ObjectId& /* obj_id */, const StoreLocation& /* location */ )
+{
+  // Appended records are only found through the index
+}
+
+void SegmentStore::Abort( const ObjectId& obj_id, const StoreLocation& location )
+{
+  Erase( obj_id, location );
+}
+
+void SegmentStore::Read( const ObjectId& /* obj_id */, const StoreLocation& location, StoredRecord& record )
+{
+  ReadPrefix( location, location.length_, record.buffer() );
+}
+
+void SegmentStore::ReadPrefix( const StoreLocation& location, size_t size, std::vector< uint8_t >& buffer )
+{
+  if ( size > location.length_ ) {
+    throw std::invalid_argument( "Read past end of record" );
+  }
+  boost::shared_ptr< OsFile > file;
+  {
+    boost::mutex::scoped_lock lock( mutex_ );
+    file = GetFile( location.segment_ );
+  }
+  buffer.resize( size );
+  if ( size ) {
+    file->ReadAt( location.offset_, &buffer[0], size );
+  }
+}
+
+bool SegmentStore::Erase( const ObjectId& /* obj_id */, const StoreLocation& location )
+{
+  boost::mutex::scoped_lock lock( mutex_ );
+  SegmentMap::iterator it = segments_.find( location.segment_ );
+  if ( it == segments_.end() ) {
+    return false;
+  }
+  Release( it, frameSize + location.length_ );
+  return true;
+}
+
+void SegmentStore::Overwritten( const ObjectId& obj_id, const StoreLocation& previous )
+{
+  // The new version went to a new place, so the old record is now dead
+  Erase( obj_id, previous );
+}
+
+void SegmentStore::Locate( const ObjectId& /* obj_id */, const StoreLocation& location, std::string& filename, uint64_t& offset )
+{
+  filename = Filename( location.segment_ );
+  offset = location.offset_;
+}
+
+bool SegmentStore::IsSealed( uint32_t segment )
+{
+  boost::mutex::scoped_lock lock( mutex_ );
+  SegmentMap::const_iterator it = segments_.find( segment );
+  return it != segments_.end() && it->second.sealed_;
+}
+
+boost::shared_ptr< OsFile > SegmentStore::GetFile( uint32_t segment )
+{
+  SegmentMap::const_iterator it = segments_.find( segment );
+  if ( it == segments_.end() ) {
+    throw OsReadFileException() << ErrStr( "Segment no longer exists" );
+  }
+  return it->second.file_;
+}
+
+SegmentStore::SegmentMap::iterator SegmentStore::StartSegment()
+{
+  uint32_t segment = nextSegment_ ++;
+  Segment newSegment;
+  newSegment.file_.reset( new OsFile( Filename( segment ), true ) );
+  active_ = segment;
+  return segments_.insert( std::make_pair( segment, newSegment ) ).first;
+}
+
+void SegmentStore::Seal( SegmentMap::iterator it )
+{
+  it->second.sealed_ = true;
+  if ( it->first == active_ ) {
+    active_ = 0;
+  }
+  if ( it->second.liveRecords_ == 0 ) {
+    Retire( it );
+  } else if ( WantsCompaction( it->second ) ) {
+    compactionWanted_.notify_one();
+  }
+}
+
+void SegmentStore::Release( SegmentMap::iterator it, uint64_t bytes )
+{
+  Segment& segment( it->second );
+  assert( segment.liveRecords_ > 0 && segment.liveBytes_ >= bytes );
+  segment.liveBytes_ -= bytes;
+  -- segment.liveRecords_;
+
+  if ( segment.sealed_ && segment.liveRecords_ == 0 ) {
+    Retire( it );
+  } else if ( WantsCompaction( segment ) ) {
+    compactionWanted_.notify_one();
+  }
+}
+
+void SegmentStore::Retire( SegmentMap::iterator it )
+{
+  // Readers that still hold the file can finish their reads
+  std::string filename( Filename( it->first ) );
+  segments_.erase( it );
+  try {
+    OsDeleteFile( filename );
+  } catch ( OsDeleteFileException& ) {
+  }
+}
+
+bool SegmentStore::WantsCompaction( const Segment& segment ) const
+{
+  return segment.sealed_ && !segment.compacted_ && segment.liveRecords_ > 0 &&
+    segment.liveBytes_ < segment.size_ * compactionThreshold;
+}
+
+void SegmentStore::Restore( const StoreLocation& location )
+{
+  boost::mutex::scoped_lock lock( mutex_ );
+  SegmentMap::iterator it = segments_.find( location.segment_ );
+  if ( it == segments_.end() ) {
+    // Throws if the segment is gone. Restored segments are never appended to.
+    Segment restored;
+    restored.file_.reset( new OsFile( Filename( location.segment_ ), false ) );
+    restored.size_ = restored.file_->Size();
+    restored.sealed_ = true;
+    if ( location.offset_ < frameSize || location.offset_ + location.length_ > restored.size_ ) {
+      throw OsReadFileException() << ErrStr( "Record outside of segment" );
+    }
+    it = segments_.insert( std::make_pair( location.segment_, restored ) ).first;
+  } else if ( location.offset_ < frameSize || location.offset_ + location.length_ > it->second.size_ ) {
+    throw OsReadFileException() << ErrStr( "Record outside of segment" );
+  }
+  it->second.liveBytes_ += frameSize + location.length_;
+  ++ it->second.liveRecords_;
+}
+
+void SegmentStore::FinishRestore( const std::vector< uint32_t >& segments, uint32_t nextSegment )
+{
+  boost::mutex::scoped_lock lock( mutex_ );
+  nextSegment_ = std::max( nextSegment_, nextSegment );
+  if ( !segments_.empty() ) {
+    nextSegment_ = std::max( nextSegment_, segments_.rbegin()->first + 1 );
+  }
+
+  // Delete segments that no longer hold anything
+  for ( std::vector< uint32_t >::const_iterator it = segments.begin(); it != segments.end(); ++ it ) {
+    if ( segments_.find( *it ) == segments_.end() ) {
+      try {
+        OsDeleteFile( Filename( *it ) );
+      } catch ( OsDeleteFileException& ) {
+      }
+    }
+  }
+  compactionWanted_.notify_all();
+}
+
+void SegmentStore::GetSegments( std::vector< uint32_t >& segments, uint32_t& nextSegment )
+{
+  boost::mutex::scoped_lock lock( mutex_ );
+  segments.clear();
+  for ( SegmentMap::const_iterator it = segments_.begin(); it != segments_.end(); ++ it ) {
+    segments.push_back( it->first );
+  }
+  nextSegment = nextSegment_;
+}
+
+bool SegmentStore::WaitForCompaction( uint32_t& segment )
+{
+  boost::mutex::scoped_lock lock( mutex_ );
+  for ( ;; ) {
+    if ( stopping_ ) {
+      return false;
+    }
+    // Pick the segment with the least live data
+    SegmentMap::iterator best = segments_.end();
+    double bestRatio = 1.0;
+    for ( SegmentMap::iterator it = segments_.begin(); it != segments_.end(); ++ it ) {
+      if ( WantsCompaction( it->second ) ) {
+        double ratio = static_cast< double >( it->second.liveBytes_ ) / it->second.size_;
+        if ( best == segments_.end() || ratio < bestRatio ) {
+          best = it;
+          bestRatio = ratio;
+        }
+      }
+    }
+    if ( best != segments_.end() ) {
+      best->second.compacted_ = true;
+      segment = best->first;
+      return true;
+    }
+    compactionWanted_.wait( lock );
+  }
+}
+
+void SegmentStore::StopCompaction()
+{
+  boost::mutex::scoped_lock lock( mutex_ );
+  stopping_ = true;
+  compactionWanted_.notify_all();
+}
+
+void SegmentStore::ListRecords( uint32_t segment, std::vector< RecordInfo >& records )
+{
+  boost::shared_ptr< OsFile > file;
+  uint64_t size;
+  {
+    boost::mutex::scoped_lock lock( mutex_ );
+    file = GetFile( segment );
+    size = segments_[ segment ].size_;
+  }
+
+  records.clear();
+  uint64_t offset = 0;
+  while ( offset + frameSize <= size ) {
+    uint8_t frame[ frameSize ];
+    file->ReadAt( offset, frame, frameSize );
+    RecordInfo info;
+    info.location_.segment_ = segment;
+    info.location_.offset_ = offset + frameSize;
+    info.location_.length_ = GetUint32( frame );
+    info.idSize_ = GetUint32( frame + 4 );
+    if ( info.location_.length_ == 0 || info.location_.offset_ + info.location_.length_ > size ) {
+      // A hole left by a failed write. Nothing more can be found.
+      break;
+    }
+    records.push_back( info );
+    offset = info.location_.offset_ + info.location_.length_;
+  }
+}
@@ -0,0 +1,99 @@
+#ifndef __SEGMENTSTORE_HPP__
+#define __SEGMENTSTORE_HPP__
+
+#include "objectstore.hpp"
+
+const std::string segmentExtension = ".SEG";
+
+// Sealed segments with less than this share of live bytes are compacted
+const double compactionThreshold = 0.5;
+
+/**
+   Appends encoded objects to large segment files instead of writing a
+   file per object. A record is only ever written once; erasing it just
+   makes it dead. A segment is sealed when it is full, and deleted with a
+   single unlink when its last live record is gone. Sealed segments with
+   a lot of dead space are handed to a compactor, which copies the live
+   records forward into the active segment.
+
+   The store is thread safe. Reads and appends run without holding the
+   store lock, so they can overlap.
+*/
+class SegmentStore : public ObjectStore
+{
+ public:
+  // A record found by scanning a segment
+  struct RecordInfo
+  {
+    StoreLocation location_;
+    uint32_t idSize_;
+  };
+
+  SegmentStore( const std::string& path, uint64_t segmentSize );
+
+  virtual void Write( const ObjectId& obj_id, const std::vector< uint8_t >& record, StoreLocation& location );
+  virtual void WriteFile( const ObjectId& obj_id, const std::string& filename, StoreLocation& location );
+  virtual void Commit( const ObjectId& obj_id, const StoreLocation& location );
+  virtual void Abort( const ObjectId& obj_id, const StoreLocation& location );
+  virtual void Read( const ObjectId& obj_id, const StoreLocation& location, StoredRecord& record );
+  virtual bool Erase( const ObjectId& obj_id, const StoreLocation& location );
+  virtual void Overwritten( const ObjectId& obj_id, const StoreLocation& previous );
+  virtual void Locate( const ObjectId& obj_id, const StoreLocation& location, std::string& filename, uint64_t& offset );
+
+  // Reads the first size bytes of the record at location
+  void ReadPrefix( const StoreLocation& location, size_t size, std::vector< uint8_t >& buffer );
+  bool IsSealed( uint32_t segment );
+
+  // Meta data support. Restore is called for every index entry loaded
+  // from the meta data, then FinishRestore with the segments that existed
+  // when it was saved. Segments without live records are deleted.
+  void Restore( const StoreLocation& location );
+  void FinishRestore( const std::vector< uint32_t >& segments, uint32_t nextSegment );
+  void GetSegments( std::vector< uint32_t >& segments, uint32_t& nextSegment );
+
+  // Blocks until a sealed segment is worth compacting and returns it,
+  // or returns false once StopCompaction has been called. A segment is
+  // only handed out once.
+  bool WaitForCompaction( uint32_t& segment );
+  void StopCompaction();
+  // Lists the records in segment, in the order they were written
+  void ListRecords( uint32_t segment, std::vector< RecordInfo >& records );
+
+ private:
+  struct Segment
+  {
+    Segment() : size_( 0 ), liveBytes_( 0 ), liveRecords_( 0 ), sealed_( false ), compacted_( false ) {}
+    boost::shared_ptr< OsFile > file_;
+    uint64_t size_;
+    uint64_t liveBytes_;
+    uint32_t liveRecords_;
+    bool sealed_;
+    bool compacted_;
+  };
+  typedef std::map< uint32_t, Segment > SegmentMap;
+
+  std::string Filename( uint32_t segment ) const;
+  // Reserves room for a record of size bytes at the end of the active
+  // segment, and writes its frame. The record then has to be written to
+  // the file returned at location.offset_, or given back with Erase.
+  boost::shared_ptr< OsFile > Append( const ObjectId& obj_id, uint64_t size, StoreLocation& location );
+  // The following require mutex_ to be held
+  boost::shared_ptr< OsFile > GetFile( uint32_t segment );
+  SegmentMap::iterator StartSegment();
+  void Seal( SegmentMap::iterator it );
+  void Release( SegmentMap::iterator it, uint64_t bytes );
+  void Retire( SegmentMap::iterator it );
+  bool WantsCompaction( const Segment& segment ) const;
+
+  const std::string path_;
+  const uint64_t segmentSize_;
+
+  boost::mutex mutex_;
+  boost::condition_variable compactionWanted_;
+  SegmentMap segments_;
+  uint32_t active_; // 0 when no segment is open for appending
+  uint32_t nextSegment_;
+  bool stopping_;
+};
+
+#endif // __SEGMENTSTORE_HPP__
@@ -0,0 +1,157 @@
+#include "stdinc.hpp"
+#include "os.hpp"
+#include "cache.hpp"
+#include "span.hpp"
+
+#include <boost/thread/tss.hpp>
+
+#ifdef CLIENTCACHE_SPANS
+namespace
+{
+// A span that has ended
+struct Event
+{
+  const char* name_;
+  uint64_t start_; // As given by OsNanoseconds
+  uint64_t duration_;
+};
+
+// The spans of a thread
+struct Ring
+{
+  explicit Ring( size_t thread ) : thread_( thread ), events_( Spans::ringSize ), next_( 0 ), owned_( true ) {}
+  const size_t thread_; // Numbers the thread in the trace
+  boost::mutex mutex_; // Only ever waited for while the spans are written
+  std::vector< Event > events_;
+  uint64_t next_; // Spans kept so far, including the overwritten ones
+  bool owned_; // By a running thread. Requires ringsMutex.
+};
+
+// Every ring there is. The ring of a thread that has ended goes to the
+// next new thread, so there are never more than there were threads at
+// once.
+boost::mutex ringsMutex;
+std::vector< boost::shared_ptr< Ring > > rings;
+
+void ReleaseRing( Ring* ring )
+{
+  boost::mutex::scoped_lock lock( ringsMutex );
+  ring->owned_ = false;
+}
+
+boost::thread_specific_ptr< Ring > threadRing( &ReleaseRing );
+
+Ring& ThreadRing()
+{
+  Ring* ring = threadRing.get();
+  if ( ring ) {
+    return *ring;
+  }
+  boost::mutex::scoped_lock lock( ringsMutex );
+  for ( std::vector< boost::shared_ptr< Ring > >::const_iterator it = rings.begin(); it != rings.end() && !ring; ++ it ) {
+    if ( !( *it )->owned_ ) {
+      ring = it->get();
+    }
+  }
+  if ( !ring ) {
+    rings.push_back( boost::shared_ptr< Ring >( new Ring( rings.size() + 1 ) ) );
+    ring = rings.back().get();
+  }
+  ring->owned_ = true;
+  threadRing.reset( ring );
+  return *ring;
+}
+
+// Nanoseconds as the microseconds of the trace-event format
+void PutMicroseconds( std::ostream& out, uint64_t nanoseconds )
+{
+  out << nanoseconds / 1000 << '.' << std::setw( 3 ) << std::setfill( '0' ) << nanoseconds % 1000;
+}
+}
+
+namespace Spans
+{
+boost::atomic< bool > enabled( false );
+
+void Scope::Begin( const char* name )
+{
+  name_ = name;
+  start_ = OsNanoseconds();
+}
+
+void Scope::End()
+{
+  const uint64_t end = OsNanoseconds();
+  try {
+    Ring& ring( ThreadRing() );
+    boost::mutex::scoped_lock lock( ring.mutex_ );
+    Event& event( ring.events_[ static_cast< size_t >( ring.next_ % ringSize ) ] );
+    event.name_ = name_;
+    event.start_ = start_;
+    event.duration_ = end - start_;
+    ++ ring.next_;
+  } catch ( ... ) {
+    // A span is never worth failing a call for
+  }
+}
+}
+#endif
+
+bool enableSpans( bool enable )
+{
+#ifdef CLIENTCACHE_SPANS
+  Spans::enabled = enable;
+  return true;
+#else
+  return !enable;
+#endif
+}
+
+bool writeSpans( const std::string& filename )
+{
+#ifdef CLIENTCACHE_SPANS
+  try {
+    std::vector< boost::shared_ptr< Ring > > all;
+    {
+      boost::mutex::scoped_lock lock( ringsMutex );
+      all = rings;
+    }
+
+    std::ostringstream out;
+    out << "{\"traceEvents\":[";
+    bool first = true;
+    std::vector< Event > events;
+    for ( std::vector< boost::shared_ptr< Ring > >::const_iterator it = all.begin(); it != all.end(); ++ it ) {
+      // Copied out, oldest first, so the thread is held up for as short
+      // a time as possible
+      events.clear();
+      {
+        boost::mutex::scoped_lock lock( ( *it )->mutex_ );
+        const uint64_t kept = std::min< uint64_t >( ( *it )->next_, Spans::ringSize );
+        for ( uint64_t i = ( *it )->next_ - kept; i < ( *it )->next_; ++i ) {
+          events.push_back( ( *it )->events_[ static_cast< size_t >( i % Spans::ringSize ) ] );
+        }
+      }
+      for ( std::vector< Event >::const_iterator event = events.begin(); event != events.end(); ++ event ) {
+        out << ( first ? "\n" : ",\n" ) << "{\"name\":\"" << event->name_ << "\",\"cat\":\"clientcache\",\"ph\":\"X\",\"pid\":1,\"tid\":"
+            << ( *it )->thread_ << ",\"ts\":";
+        PutMicroseconds( out, event->start_ );
+        out << ",\"dur\":";
+        PutMicroseconds( out, event->duration_ );
+        out << "}";
+        first = false;
+      }
+    }
+    out << "\n]}\n";
+
+    const std::string json( out.str() );
+    OsWriteFile( filename, std::vector< uint8_t >( json.begin(), json.end() ) );
+    return true;
+  } catch ( std::exception& ) {
+    return false;
+  }
+#else
+  (void) filename;
+  return false;
+#endif
+}
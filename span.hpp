@@ -0,0 +1,57 @@
+#ifndef __SPAN_HPP__
+#define __SPAN_HPP__
+
+/**
+   Scoped spans of where the time of a call goes. SPAN( "name" ) starts a
+   span there and ends it with the scope; name must be a string literal.
+   While spans are enabled with enableSpans, every thread keeps its last
+   ringSize spans in a ring of its own, and writeSpans writes them all as
+   Chrome trace-event JSON.
+
+   Built without CLIENTCACHE_SPANS, SPAN is nothing at all. With it, a
+   span costs a relaxed load and a branch while spans are disabled.
+*/
+namespace Spans
+{
+// Spans kept per thread. Older ones are overwritten.
+const size_t ringSize = 4096;
+
+#ifdef CLIENTCACHE_SPANS
+extern boost::atomic< bool > enabled;
+
+class Scope
+{
+ public:
+  explicit Scope( const char* name ) : name_( 0 ), start_( 0 ) {
+    if ( enabled.load( boost::memory_order_relaxed ) ) {
+      Begin( name );
+    }
+  }
+  ~Scope() {
+    if ( name_ ) {
+      End();
+    }
+  }
+
+ private:
+  Scope( const Scope& );
+  Scope& operator=( const Scope& );
+
+  void Begin( const char* name );
+  void End();
+
+  const char* name_; // 0 if disabled when the span began
+  uint64_t start_;
+};
+#endif
+}
+
+#ifdef CLIENTCACHE_SPANS
+#define SPAN_NAME2( line ) span_##line
+#define SPAN_NAME( line ) SPAN_NAME2( line )
+#define SPAN( name ) Spans::Scope SPAN_NAME( __LINE__ )( name )
+#else
+#define SPAN( name )
+#endif
+
+#endif // __SPAN_HPP__
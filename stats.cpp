@@ -0,0 +1,50 @@
+#include "stdinc.hpp"
+#include "os.hpp"
+#include "stats.hpp"
+
+AtomicHistogram::AtomicHistogram()
+    : count_( 0 ), nanoseconds_( 0 )
+{
+  for ( size_t i = 0; i < LatencyHistogram::noOfBuckets; ++i ) {
+    buckets_[i] = 0;
+  }
+}
+
+void AtomicHistogram::Add( uint64_t nanoseconds )
+{
+  count_.fetch_add( 1, boost::memory_order_relaxed );
+  nanoseconds_.fetch_add( nanoseconds, boost::memory_order_relaxed );
+  buckets_[ Bucket( nanoseconds ) ].fetch_add( 1, boost::memory_order_relaxed );
+}
+
+void AtomicHistogram::Get( LatencyHistogram& histogram ) const
+{
+  histogram.count = count_.load( boost::memory_order_relaxed );
+  histogram.nanoseconds = nanoseconds_.load( boost::memory_order_relaxed );
+  for ( size_t i = 0; i < LatencyHistogram::noOfBuckets; ++i ) {
+    histogram.buckets[i] = buckets_[i].load( boost::memory_order_relaxed );
+  }
+}
+
+size_t AtomicHistogram::Bucket( uint64_t nanoseconds )
+{
+  // The position of the highest bit set, by halves
+  size_t bucket = 0;
+  for ( size_t shift = 32; shift != 0; shift /= 2 ) {
+    if ( nanoseconds >> shift ) {
+      nanoseconds >>= shift;
+      bucket += shift;
+    }
+  }
+  return std::min( bucket, LatencyHistogram::noOfBuckets - 1 );
+}
+
+StageTimer::StageTimer( AtomicHistogram& histogram )
+    : histogram_( histogram ), start_( OsNanoseconds() )
+{
+}
+
+StageTimer::~StageTimer()
+{
+  histogram_.Add( OsNanoseconds() - start_ );
+}
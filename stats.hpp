@@ -0,0 +1,43 @@
+#ifndef __STATS_HPP__
+#define __STATS_HPP__
+
+#include "cache.hpp"
+
+/**
+   A LatencyHistogram that any thread can add to without a lock. Adding
+   takes three relaxed atomic increments; Get copies the counts one by
+   one, so a snapshot may miss what is added while it is taken.
+*/
+class AtomicHistogram
+{
+ public:
+  AtomicHistogram();
+
+  void Add( uint64_t nanoseconds );
+  void Get( LatencyHistogram& histogram ) const;
+
+  // The bucket that nanoseconds are counted in
+  static size_t Bucket( uint64_t nanoseconds );
+
+ private:
+  boost::atomic< uint64_t > count_;
+  boost::atomic< uint64_t > nanoseconds_;
+  boost::atomic< uint64_t > buckets_[ LatencyHistogram::noOfBuckets ];
+};
+
+// Adds the time from its construction to its destruction to a histogram
+class StageTimer
+{
+ public:
+  explicit StageTimer( AtomicHistogram& histogram );
+  ~StageTimer();
+
+ private:
+  StageTimer( const StageTimer& );
+  StageTimer& operator=( const StageTimer& );
+
+  AtomicHistogram& histogram_;
+  const uint64_t start_;
+};
+
+#endif // __STATS_HPP__
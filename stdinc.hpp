@@ -3,6 +3,7 @@
 #define _SCL_SECURE_NO_WARNINGS // Disable VC++ warnings for correct (but "unsafe") C++ code
 #include <windows.h>
 #include <shlobj.h>
+#include <intrin.h>
 typedef unsigned char uint8_t;
 typedef unsigned __int64 uint64_t;
 typedef unsigned __int32 uint32_t;
@@ -14,13 +15,41 @@ typedef unsigned __int32 uint32_t;
 typedef unsigned char uint8_t;
 typedef unsigned __int64 uint64_t;
 typedef unsigned __int32 uint32_t;
+#else
+// building on a POSIX system
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
 #endif
 
+#include <cassert>
+#include <cstring>
+#include <ctime>
+#include <limits>
+#include <iomanip>
+#include <iterator>
+#include <algorithm>
+#include <stdexcept>
+#include <deque>
 #include <vector>
 #include <string>
 #include <sstream>
 #include <iostream>
+#include <map>
+#include <set>
 #include <boost/bind.hpp>
+#include <boost/function.hpp>
+#include <boost/atomic.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/static_assert.hpp>
+#include <boost/scoped_array.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/thread.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
 #include <boost/array.hpp>
 #include <boost/unordered_map.hpp>
 #include <boost/exception/all.hpp>
@@ -28,3 +57,7 @@ typedef unsigned __int32 uint32_t;
 #include <openssl/ssl.h>
 #include <openssl/err.h>
 #include <openssl/rc4.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include <openssl/rand.h>
+#include <zlib.h>
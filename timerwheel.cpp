@@ -0,0 +1,105 @@
+#include "stdinc.hpp"
+#include "timerwheel.hpp"
+
+namespace
+{
+// Appends timer to timers, without copying its id
+void MoveTimer( TimerWheel::Timer& timer, std::vector< TimerWheel::Timer >& timers )
+{
+  timers.push_back( TimerWheel::Timer() );
+  timers.back().objId_.swap( timer.objId_ );
+  timers.back().expiry_ = timer.expiry_;
+}
+}
+
+TimerWheel::TimerWheel( uint64_t now ) : now_( now ), size_( 0 )
+{
+  std::fill( levelSize_, levelSize_ + noOfLevels, 0 );
+}
+
+void TimerWheel::Add( const ObjectId& obj_id, uint64_t expiry )
+{
+  Timer timer;
+  timer.objId_ = obj_id;
+  timer.expiry_ = expiry;
+  Place( timer );
+  ++ size_;
+}
+
+void TimerWheel::Place( Timer& timer )
+{
+  if ( timer.expiry_ <= now_ ) {
+    MoveTimer( timer, due_ );
+    return;
+  }
+
+  // The lowest level that reaches the expiry. A timer beyond the reach of
+  // the top level waits in its furthest slot, and is placed again when
+  // that slot comes around.
+  const uint64_t delta = timer.expiry_ - now_;
+  size_t level = 0;
+  while ( level + 1 < noOfLevels && ( delta >> ( levelBits * ( level + 1 ) ) ) != 0 ) {
+    ++ level;
+  }
+  uint64_t at = timer.expiry_;
+  if ( ( delta >> ( levelBits * noOfLevels ) ) != 0 ) {
+    at = now_ + ( static_cast< uint64_t >( 1 ) << ( levelBits * noOfLevels ) ) - 1;
+  }
+  MoveTimer( timer, slots_[ level ][ ( at >> ( levelBits * level ) ) & ( slotsPerLevel - 1 ) ] );
+  ++ levelSize_[ level ];
+}
+
+void TimerWheel::Advance( uint64_t now, std::vector< Timer >& expired )
+{
+  const size_t before = expired.size();
+  for ( std::vector< Timer >::iterator it = due_.begin(); it != due_.end(); ++ it ) {
+    MoveTimer( *it, expired );
+  }
+  due_.clear();
+
+  while ( now_ < now ) {
+    // Nothing happens before the next slot boundary of the lowest level
+    // that holds any timers
+    size_t lowest = 0;
+    while ( lowest < noOfLevels && levelSize_[ lowest ] == 0 ) {
+      ++ lowest;
+    }
+    if ( lowest == noOfLevels ) {
+      now_ = now;
+      break;
+    }
+    const uint64_t span = static_cast< uint64_t >( 1 ) << ( levelBits * lowest );
+    const uint64_t boundary = ( now_ / span + 1 ) * span;
+    if ( boundary > now ) {
+      now_ = now;
+      break;
+    }
+    now_ = boundary;
+
+    // Move the timers of the higher level slots that start now down,
+    // from the top, so that they can cascade all the way
+    for ( size_t level = noOfLevels - 1; level > 0; -- level ) {
+      if ( ( now_ & ( ( static_cast< uint64_t >( 1 ) << ( levelBits * level ) ) - 1 ) ) != 0 ) {
+        continue;
+      }
+      std::vector< Timer > timers;
+      timers.swap( slots_[ level ][ ( now_ >> ( levelBits * level ) ) & ( slotsPerLevel - 1 ) ] );
+      levelSize_[ level ] -= timers.size();
+      for ( std::vector< Timer >::iterator it = timers.begin(); it != timers.end(); ++ it ) {
+        Place( *it );
+      }
+    }
+
+    std::vector< Timer >& slot( slots_[0][ now_ & ( slotsPerLevel - 1 ) ] );
+    levelSize_[0] -= slot.size();
+    for ( std::vector< Timer >::iterator it = slot.begin(); it != slot.end(); ++ it ) {
+      MoveTimer( *it, expired );
+    }
+    slot.clear();
+    for ( std::vector< Timer >::iterator it = due_.begin(); it != due_.end(); ++ it ) {
+      MoveTimer( *it, expired );
+    }
+    due_.clear();
+  }
+  size_ -= expired.size() - before;
+}
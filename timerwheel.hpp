@@ -0,0 +1,59 @@
+#ifndef __TIMERWHEEL_HPP__
+#define __TIMERWHEEL_HPP__
+
+#include "cache.hpp"
+
+/**
+   Keeps track of when objects expire, so that expiring them costs time
+   in proportion to the number of expired objects rather than a scan of
+   the whole index.
+
+   A hierarchical timer wheel: level 0 has a slot for each of the next 64
+   seconds, level 1 a slot for each of the next 64 spans of 64 seconds,
+   and so on. A timer goes to the lowest level whose span reaches its
+   expiry. Whenever time passes a slot boundary of a higher level, that
+   slot's timers move down to the levels below, and the timers of the
+   current level 0 slot have expired. Stretches of time with nothing in
+   the lower levels are skipped over in one step.
+
+   Timers are never cancelled. Whoever handles an expired timer checks
+   whether it still applies. Not thread safe.
+*/
+class TimerWheel
+{
+ public:
+  typedef Cache::ObjectId ObjectId;
+
+  struct Timer
+  {
+    ObjectId objId_;
+    uint64_t expiry_; // Seconds since the epoch
+  };
+
+  // now is the current time, in seconds since the epoch
+  explicit TimerWheel( uint64_t now );
+
+  // Timers that are already due expire on the next Advance
+  void Add( const ObjectId& obj_id, uint64_t expiry );
+  // Moves the time forward to now, and appends the timers that expired
+  // on the way to expired
+  void Advance( uint64_t now, std::vector< Timer >& expired );
+
+  size_t size() const { return size_; }
+  uint64_t Now() const { return now_; }
+
+ private:
+  static const size_t levelBits = 6;
+  static const size_t slotsPerLevel = 1 << levelBits;
+  static const size_t noOfLevels = 6;
+
+  void Place( Timer& timer );
+
+  uint64_t now_;
+  size_t size_;
+  std::vector< Timer > slots_[ noOfLevels ][ slotsPerLevel ];
+  size_t levelSize_[ noOfLevels ]; // Timers in all slots of a level
+  std::vector< Timer > due_; // Added when already due
+};
+
+#endif // __TIMERWHEEL_HPP__
@@ -0,0 +1,123 @@
+#include "stdinc.hpp"
+#include "os.hpp"
+#include "trace.hpp"
+
+namespace
+{
+const char traceMagic[] = "CCTR";
+const uint32_t traceVersion = 1;
+const size_t traceHeaderSize = 16;
+const size_t traceRecordSize = 30;
+const size_t traceBufferSize = 64 * 1024;
+
+void PutUint( std::vector< uint8_t >& out, uint64_t value, size_t size )
+{
+  for ( size_t i = 0; i < size; ++i ) {
+    out.push_back( static_cast< uint8_t >( value >> ( 8 * i ) ) );
+  }
+}
+
+uint64_t GetUint( const uint8_t*& data, size_t size )
+{
+  uint64_t value = 0;
+  for ( size_t i = 0; i < size; ++i ) {
+    value |= static_cast< uint64_t >( data[i] ) << ( 8 * i );
+  }
+  data += size;
+  return value;
+}
+}
+
+TraceWriter::TraceWriter( const std::string& filename )
+    : file_( new OsFile( filename, true ) ), start_( OsMicroseconds() ), offset_( 0 )
+{
+  buffer_.reserve( traceBufferSize + traceRecordSize );
+  buffer_.insert( buffer_.end(), traceMagic, traceMagic + 4 );
+  PutUint( buffer_, traceVersion, 4 );
+  PutUint( buffer_, static_cast< uint64_t >( std::time( 0 ) ), 8 );
+  Flush();
+}
+
+TraceWriter::~TraceWriter()
+{
+  try {
+    Flush();
+  } catch ( ... ) {
+    std::clog << "Failed to write the end of the trace" << std::endl;
+  }
+}
+
+void TraceWriter::Add( TraceRecord::Operation operation, uint64_t start, uint64_t objId, uint64_t size, bool ok )
+{
+  const uint64_t now = OsMicroseconds();
+  std::vector< uint8_t > full;
+  uint64_t offset;
+  {
+    boost::mutex::scoped_lock lock( mutex_ );
+    PutUint( buffer_, start - start_, 8 );
+    PutUint( buffer_, std::min< uint64_t >( now - start, std::numeric_limits< uint32_t >::max() ), 4 );
+    PutUint( buffer_, static_cast< uint8_t >( operation ), 1 );
+    PutUint( buffer_, ok ? 1 : 0, 1 );
+    PutUint( buffer_, objId, 8 );
+    PutUint( buffer_, size, 8 );
+    if ( buffer_.size() < traceBufferSize ) {
+      return;
+    }
+    offset = Take( full );
+  }
+  // Written without holding the lock, so that callers don't wait for it
+  file_->WriteAt( offset, &full[0], full.size() );
+}
+
+void TraceWriter::Flush()
+{
+  std::vector< uint8_t > buffer;
+  uint64_t offset;
+  {
+    boost::mutex::scoped_lock lock( mutex_ );
+    offset = Take( buffer );
+  }
+  if ( !buffer.empty() ) {
+    file_->WriteAt( offset, &buffer[0], buffer.size() );
+  }
+}
+
+uint64_t TraceWriter::Take( std::vector< uint8_t >& buffer )
+{
+  buffer.swap( buffer_ );
+  buffer_.clear();
+  buffer_.reserve( traceBufferSize + traceRecordSize );
+  const uint64_t offset = offset_;
+  offset_ += buffer.size();
+  return offset;
+}
+
+bool ReadTrace( const std::string& filename, std::vector< TraceRecord >& records, std::time_t& started )
+{
+  std::vector< uint8_t > buffer;
+  OsReadFile( filename, buffer );
+  if ( buffer.size() < traceHeaderSize || !std::equal( traceMagic, traceMagic + 4, buffer.begin() ) ) {
+    return false;
+  }
+  const uint8_t* data = &buffer[4];
+  if ( GetUint( data, 4 ) != traceVersion ) {
+    return false;
+  }
+  started = static_cast< std::time_t >( GetUint( data, 8 ) );
+  records.clear();
+  records.reserve( ( buffer.size() - traceHeaderSize ) / traceRecordSize );
+  for ( const uint8_t* end = &buffer[0] + buffer.size(); end - data >= static_cast< std::ptrdiff_t >( traceRecordSize ); ) {
+    TraceRecord record;
+    record.time_ = GetUint( data, 8 );
+    record.duration_ = static_cast< uint32_t >( GetUint( data, 4 ) );
+    record.operation_ = static_cast< TraceRecord::Operation >( GetUint( data, 1 ) );
+    record.ok_ = GetUint( data, 1 ) != 0;
+    record.objId_ = GetUint( data, 8 );
+    record.size_ = GetUint( data, 8 );
+    if ( record.operation_ > TraceRecord::SetMaxSize ) {
+      return false;
+    }
+    records.push_back( record );
+  }
+  return true;
+}
@@ -0,0 +1,73 @@
+#ifndef __TRACE_HPP__
+#define __TRACE_HPP__
+
+class OsFile;
+
+// A call made to a cache, as kept in a trace
+struct TraceRecord
+{
+  enum Operation
+  {
+    Has,
+    Read,
+    Write,
+    Erase,
+    SetMaxSize
+  };
+
+  TraceRecord() : time_( 0 ), duration_( 0 ), operation_( Has ), ok_( false ), objId_( 0 ), size_( 0 ) {}
+  uint64_t time_; // Microseconds from the start of the trace to the call
+  uint32_t duration_; // Microseconds
+  Operation operation_;
+  bool ok_; // Found, read, written or erased
+  uint64_t objId_; // Fingerprint of the object id, 0 for SetMaxSize
+  uint64_t size_; // Of what was read or written, or the new maximum size
+};
+
+/**
+   Appends the calls made to a cache to a trace file. A trace starts with
+   a header of magic, format version and the time it was started in
+   seconds since the epoch, followed by records of 30 bytes: the time,
+   duration, operation, outcome, id and size of TraceRecord, little
+   endian. Object ids are only kept as their 64 bit fingerprint, which
+   tells objects apart but doesn't keep the ids secret from anyone who
+   can guess them.
+
+   Records are collected in memory and written 64 KB at a time, and when
+   the writer is destroyed. Thread safe.
+*/
+class TraceWriter
+{
+ public:
+  // Creates filename, or empties it. Throws OsFileException on failure.
+  explicit TraceWriter( const std::string& filename );
+  ~TraceWriter();
+
+  // Adds a call that started at start, as given by OsMicroseconds, and
+  // has just returned
+  void Add( TraceRecord::Operation operation, uint64_t start, uint64_t objId, uint64_t size, bool ok );
+  // Writes the records collected so far
+  void Flush();
+
+ private:
+  // Swaps the collected records into buffer, and returns where they go
+  // in the file. Requires mutex_ to be held.
+  uint64_t Take( std::vector< uint8_t >& buffer );
+
+  boost::mutex mutex_;
+  boost::scoped_ptr< OsFile > file_;
+  const uint64_t start_;
+  uint64_t offset_; // Where the buffer goes in the file
+  std::vector< uint8_t > buffer_;
+
+  TraceWriter( const TraceWriter& ); // not copyable
+  bool operator=( const TraceWriter& ); // not assignable
+};
+
+// Reads the whole trace in filename, in the order the calls returned.
+// Returns false if it isn't a trace. A record cut off at the end, by a
+// cache that didn't get to finish its trace, is left out. Throws
+// OsFileException if it can't be read.
+bool ReadTrace( const std::string& filename, std::vector< TraceRecord >& records, std::time_t& started );
+
+#endif // __TRACE_HPP__
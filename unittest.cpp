@@ -3,6 +3,13 @@
 #include "cache.hpp"
 #include "cacheimpl.hpp"
 #include "os.hpp"
+#include "filestore.hpp"
+#include "segmentstore.hpp"
+#include "presenceindex.hpp"
+#include "objectindex.hpp"
+#include "journal.hpp"
+#include "timerwheel.hpp"
+#include "trace.hpp"
 
 #define BOOST_TEST_MODULE CacheTest
 #include <boost/test/unit_test.hpp>
@@ -17,11 +24,46 @@ const size_t noOfBuffers = 100; // 100
 const uint64_t maxSize = 200000; // 200000
 const uint64_t reducedMaxSize = 100000; // 100000
 
+// Scratch directories used by the tests
+#ifdef _WIN32
+const std::string testPath( "C:\\temp\\test" );
+const std::string cachePath( "c:\\temp\\cache" );
+const std::string segmentCachePath( "c:\\temp\\segmentcache" );
+const std::string shardedCachePath( "c:\\temp\\shardedcache" );
+const std::string journalCachePath( "c:\\temp\\journalcache" );
+const std::string evictionCachePath( "c:\\temp\\evictioncache" );
+const std::string expiryCachePath( "c:\\temp\\expirycache" );
+const std::string partitionCachePath( "c:\\temp\\partitioncache" );
+const std::string asyncCachePath( "c:\\temp\\asynccache" );
+const std::string writeBackCachePath( "c:\\temp\\writebackcache" );
+const std::string memoryTierCachePath( "c:\\temp\\memorytiercache" );
+const std::string dedupCachePath( "c:\\temp\\dedupcache" );
+const std::string dedupSegmentCachePath( "c:\\temp\\dedupsegmentcache" );
+const std::string traceCachePath( "c:\\temp\\tracecache" );
+const std::string statsCachePath( "c:\\temp\\statscache" );
+#else
+const std::string testPath( "/tmp/clientcache/test" );
+const std::string cachePath( "/tmp/clientcache/cache" );
+const std::string segmentCachePath( "/tmp/clientcache/segmentcache" );
+const std::string shardedCachePath( "/tmp/clientcache/shardedcache" );
+const std::string journalCachePath( "/tmp/clientcache/journalcache" );
+const std::string evictionCachePath( "/tmp/clientcache/evictioncache" );
+const std::string expiryCachePath( "/tmp/clientcache/expirycache" );
+const std::string partitionCachePath( "/tmp/clientcache/partitioncache" );
+const std::string asyncCachePath( "/tmp/clientcache/asynccache" );
+const std::string writeBackCachePath( "/tmp/clientcache/writebackcache" );
+const std::string memoryTierCachePath( "/tmp/clientcache/memorytiercache" );
+const std::string dedupCachePath( "/tmp/clientcache/dedupcache" );
+const std::string dedupSegmentCachePath( "/tmp/clientcache/dedupsegmentcache" );
+const std::string traceCachePath( "/tmp/clientcache/tracecache" );
+const std::string statsCachePath( "/tmp/clientcache/statscache" );
+#endif
+
 
 struct BuffersFixture
 {
   BuffersFixture() {
-    const std::string path( "C:\\temp\\test" );
+    const std::string& path( testPath );
     BOOST_TEST_MESSAGE( "Creating a test directory: " << path );
     bool ret = OsEnsureDirectory( path );
     if ( ret ) {
@@ -62,14 +104,31 @@ struct BuffersFixture
 
 struct CacheFixture : public BuffersFixture
 {
-  CacheFixture() : objWritten_(0), currSize_(0)
+  CacheFixture( const std::string& path = cachePath, const CacheOptions& options = CacheOptions() )
+      : path_( path ), options_( options ), objWritten_(0), currSize_(0)
   {
-    std::vector< uint8_t > key;
-
     const std::string dummykey( "dummykey" );
-    std::copy( dummykey.begin(), dummykey.end(), back_inserter( key ) );
+    std::copy( dummykey.begin(), dummykey.end(), back_inserter( key_ ) );
+    // Start every test case from an empty cache, even if an earlier
+    // run left its meta data behind.
+    const std::string metaDataFiles[] = { metaDataFilename, segmentMetaDataFilename, checkpointFilename, journalFilenames[0], journalFilenames[1] };
+    for ( size_t i = 0; i < sizeof( metaDataFiles ) / sizeof( metaDataFiles[0] ); ++i ) {
+      OsEnsureDirectory( path_ );
+      const std::string metaData( OsConcatPath( path_, metaDataFiles[i] ) );
+      if ( OsFileExists( metaData ) ) {
+        OsDeleteFile( metaData );
+      }
+    }
     BOOST_TEST_MESSAGE( "Creating Cache instance" );
-    cache_ = createCache( "c:\\temp\\cache", key );;
+    cache_ = createCache( path_, key_, options_ );;
+    BOOST_REQUIRE( cache_ );
+    cache_->setMaxSize( maxSize );
+  }
+
+  // Destroys the cache and creates it again from its meta data
+  void ReopenCache() {
+    delete cache_;
+    cache_ = createCache( path_, key_, options_ );
     BOOST_REQUIRE( cache_ );
     cache_->setMaxSize( maxSize );
   }
@@ -111,21 +170,286 @@ struct CacheFixture : public BuffersFixture
   void EraseObjects() {
     BOOST_TEST_MESSAGE( "Erasing objects. Of course we can only erase objects that have not been pruned." );
 
-    for ( std::vector< BinaryBuffer >::const_iterator it = objectIds_.begin(); it != objectIds_.end(); ++ it )
+    size_t n = 0;
+    for ( std::vector< BinaryBuffer >::const_iterator it = objectIds_.begin(); ( it != objectIds_.end() ) && ( n < objWritten_ ) ; ++ it, ++n )
     {
       BinaryBuffer buffer;
       BOOST_REQUIRE( cache_->eraseObject( *it ) );
       BOOST_REQUIRE( !cache_->hasObject( *it ) );
-      BOOST_REQUIRE( !OsFileExists( OsConcatPath( "c:\\temp\\cache", Crypt::EncodeFilenameFromBuffer( *it, ".CDF" ) ) ) );
+      BOOST_REQUIRE( !OsFileExists( OsConcatPath( path_, FileStore::Filename( *it ) ) ) );
     }
     BOOST_REQUIRE( cache_->getCurrentSize() == 0 );
     currSize_ =  cache_->getCurrentSize();
   }
 
+  // Body of a thread in ConcurrentObjects. Works on every noOfThreads:th
+  // object, and keeps rewriting the first object, which all threads share.
+  void ConcurrentWorker( size_t thread, size_t noOfThreads, boost::atomic< size_t >* failures ) {
+    for ( int round = 0; round < 5; ++round ) {
+      for ( size_t n = 1 + thread; n < objWritten_; n += noOfThreads ) {
+        BinaryBuffer buffer;
+        if ( !cache_->readObject( objectIds_[n], buffer ) || buffer != buffers_[n] ||
+             !cache_->eraseObject( objectIds_[n] ) || cache_->hasObject( objectIds_[n] ) ||
+             !cache_->writeObject( objectIds_[n], buffers_[n] ) ) {
+          ++ *failures;
+        }
+
+        // The shared object may be gone for a moment, but never wrong
+        if ( !cache_->writeObject( objectIds_[0], buffers_[0] ) ) {
+          ++ *failures;
+        }
+        if ( cache_->readObject( objectIds_[0], buffer ) && buffer != buffers_[0] ) {
+          ++ *failures;
+        }
+      }
+    }
+  }
+
+  void ConcurrentObjects() {
+    const size_t noOfThreads = 4;
+    BOOST_TEST_MESSAGE( "Reading, erasing and writing objects from " << noOfThreads << " threads at once." );
+
+    boost::atomic< size_t > failures( 0 );
+    boost::thread_group threads;
+    for ( size_t i = 0; i < noOfThreads; ++i ) {
+      threads.create_thread( boost::bind( &CacheFixture::ConcurrentWorker, this, i, noOfThreads, &failures ) );
+    }
+    threads.join_all();
+    cache_->flush();
+
+    BOOST_REQUIRE( failures == 0 );
+    BOOST_REQUIRE( cache_->getCurrentSize() == currSize_ );
+    ReadObjects();
+  }
+
+  // Body of a thread in ConcurrentLookups. The first half of the written
+  // objects is never touched, so it must always be found.
+  void LookupWorker( const boost::atomic< bool >* stop, boost::atomic< size_t >* failures ) {
+    while ( !*stop ) {
+      for ( size_t n = 0; n < objWritten_ / 2; ++n ) {
+        if ( !cache_->hasObject( objectIds_[n] ) ) {
+          ++ *failures;
+        }
+      }
+    }
+  }
+
+  void ConcurrentLookups() {
+    const size_t noOfThreads = 4;
+    BOOST_TEST_MESSAGE( "Looking up objects from " << noOfThreads << " threads while erasing, writing and pruning others." );
+
+    boost::atomic< bool > stop( false );
+    boost::atomic< size_t > failures( 0 );
+    boost::thread_group threads;
+    for ( size_t i = 0; i < noOfThreads; ++i ) {
+      threads.create_thread( boost::bind( &CacheFixture::LookupWorker, this, &stop, &failures ) );
+    }
+
+    for ( int round = 0; round < 5; ++round ) {
+      for ( size_t n = objWritten_ / 2; n < objWritten_; ++n ) {
+        BOOST_REQUIRE( cache_->eraseObject( objectIds_[n] ) );
+        BOOST_REQUIRE( !cache_->hasObject( objectIds_[n] ) );
+      }
+      for ( size_t n = objWritten_ / 2; n < objWritten_; ++n ) {
+        BOOST_REQUIRE( cache_->writeObject( objectIds_[n], buffers_[n] ) );
+        BOOST_REQUIRE( cache_->hasObject( objectIds_[n] ) );
+      }
+    }
+    stop = true;
+    threads.join_all();
+
+    BOOST_REQUIRE( failures == 0 );
+    BOOST_REQUIRE( cache_->getCurrentSize() == currSize_ );
+  }
+
+  // A ReadSink that collects the chunks, and the size of the largest
+  static void CollectChunk( BinaryBuffer* buffer, size_t* largest, const uint8_t* data, size_t size ) {
+    buffer->insert( buffer->end(), data, data + size );
+    *largest = std::max( *largest, size );
+  }
+
+  // Streams every written object, and a large one that takes several
+  // chunks, which is left in the cache under largeObjectId()
+  void StreamObjects() {
+    BOOST_TEST_MESSAGE( "Streaming objects previously written." );
+    for ( size_t n = 0; n < objWritten_; ++n ) {
+      BinaryBuffer buffer;
+      size_t largest = 0;
+      BOOST_REQUIRE( cache_->readObjectStream( objectIds_[n], boost::bind( &CollectChunk, &buffer, &largest, _1, _2 ) ) );
+      BOOST_REQUIRE( buffer == buffers_[n] );
+    }
+
+    BOOST_TEST_MESSAGE( "Streaming an object of several chunks." );
+    BinaryBuffer large( streamChunkSize * 5 / 2 );
+    for ( size_t i = 0; i < large.size(); ++i ) {
+      large[i] = static_cast< uint8_t >( rand() );
+    }
+    cache_->setMaxSize( maxSize + large.size() );
+    BOOST_REQUIRE( cache_->writeObject( LargeObjectId(), large ) );
+    BinaryBuffer buffer;
+    size_t largest = 0;
+    BOOST_REQUIRE( cache_->readObjectStream( LargeObjectId(), boost::bind( &CollectChunk, &buffer, &largest, _1, _2 ) ) );
+    BOOST_REQUIRE( buffer == large );
+    BOOST_REQUIRE( largest == streamChunkSize );
+
+    BinaryBuffer missing;
+    BOOST_REQUIRE( !cache_->readObjectStream( BinaryBuffer( 5, 0 ), boost::bind( &CollectChunk, &missing, &largest, _1, _2 ) ) );
+    BOOST_REQUIRE( missing.empty() );
+  }
+  // Writes, finds, reads and erases objects in batches, with one more
+  // batch than fits in the cache
+  void BatchObjects() {
+    BOOST_TEST_MESSAGE( "Writing a batch of objects that fits in the cache." );
+    std::vector< BinaryBuffer > ids;
+    std::vector< BinaryBuffer > values;
+    uint64_t size = 0;
+    for ( size_t n = 0; n < noOfBuffers && size + buffers_[n].size() <= maxSize; ++n ) {
+      ids.push_back( objectIds_[n] );
+      values.push_back( buffers_[n] );
+      size += buffers_[n].size();
+    }
+    std::vector< bool > ok;
+    BOOST_REQUIRE( cache_->writeObjects( ids, values, ok ) == ids.size() );
+    BOOST_REQUIRE( std::count( ok.begin(), ok.end(), true ) == static_cast< std::ptrdiff_t >( ids.size() ) );
+    cache_->flush();
+    BOOST_REQUIRE( cache_->getCurrentSize() == size );
+
+    BOOST_TEST_MESSAGE( "Finding and reading them, and one that was never written." );
+    ids.push_back( BinaryBuffer( 5, 0 ) );
+    BOOST_REQUIRE( cache_->hasObjects( ids, ok ) == ids.size() - 1 );
+    BOOST_REQUIRE( ok.size() == ids.size() && !ok.back() );
+    std::vector< BinaryBuffer > results;
+    BOOST_REQUIRE( cache_->readObjects( ids, results, ok ) == ids.size() - 1 );
+    BOOST_REQUIRE( ok.size() == ids.size() && !ok.back() );
+    for ( size_t i = 0; i < values.size(); ++i ) {
+      BOOST_REQUIRE( ok[i] );
+      BOOST_REQUIRE( results[i] == values[i] );
+    }
+    ids.pop_back();
+
+    BOOST_TEST_MESSAGE( "Writing a batch of twice that. The cache must stay within its size, and keep the last ones." );
+    std::vector< BinaryBuffer > more( ids );
+    std::vector< BinaryBuffer > moreValues( values );
+    for ( size_t i = 0; i < ids.size(); ++i ) {
+      more.push_back( objectIds_[ noOfBuffers - 1 - i ] );
+      moreValues.push_back( buffers_[ noOfBuffers - 1 - i ] );
+    }
+    BOOST_REQUIRE( cache_->writeObjects( more, moreValues, ok ) == more.size() );
+    cache_->flush();
+    BOOST_REQUIRE( cache_->getCurrentSize() <= maxSize );
+    BOOST_REQUIRE( cache_->hasObject( more.back() ) );
+    BOOST_REQUIRE( !cache_->hasObject( more.front() ) );
+
+    BOOST_TEST_MESSAGE( "Erasing all of them, whether they are still there or not." );
+    const size_t present = cache_->hasObjects( more, ok );
+    BOOST_REQUIRE( cache_->eraseObjects( more, ok ) == present );
+    BOOST_REQUIRE( cache_->hasObjects( more, ok ) == 0 );
+    BOOST_REQUIRE( cache_->getCurrentSize() == 0 );
+  }
+  // Reads ranges of an object of several chunks, which is left in the
+  // cache under largeObjectId(), and of every written object
+  void RangeReads() {
+    BOOST_TEST_MESSAGE( "Reading ranges of objects previously written." );
+    for ( size_t n = 0; n < objWritten_; ++n ) {
+      BinaryBuffer buffer;
+      BOOST_REQUIRE( cache_->readObjectRange( objectIds_[n], 1, 3, buffer ) );
+      BOOST_REQUIRE( buffer == BinaryBuffer( buffers_[n].begin() + 1, buffers_[n].begin() + std::min< size_t >( 4, buffers_[n].size() ) ) );
+    }
+
+    BOOST_TEST_MESSAGE( "Reading ranges of an object of several chunks." );
+    BinaryBuffer large( recordChunkSize * 7 / 2 );
+    for ( size_t i = 0; i < large.size(); ++i ) {
+      large[i] = static_cast< uint8_t >( rand() );
+    }
+    cache_->setMaxSize( maxSize + large.size() );
+    BOOST_REQUIRE( cache_->writeObject( LargeObjectId(), large ) );
+    const size_t ranges[][2] = {
+      { 0, 100 }, // Within the first chunk
+      { recordChunkSize - 10, 20 }, // Across a boundary
+      { recordChunkSize, recordChunkSize * 2 + 1 }, // Whole chunks and a bit
+      { large.size() - 5, 100 }, // Clipped at the end
+      { large.size(), 100 } // Nothing
+    };
+    for ( size_t i = 0; i < sizeof( ranges ) / sizeof( ranges[0] ); ++i ) {
+      BinaryBuffer buffer( 3, 0 );
+      BOOST_REQUIRE( cache_->readObjectRange( LargeObjectId(), ranges[i][0], ranges[i][1], buffer ) );
+      BOOST_REQUIRE( buffer == BinaryBuffer( large.begin() + ranges[i][0],
+                                             large.begin() + std::min( large.size(), ranges[i][0] + ranges[i][1] ) ) );
+    }
+    BinaryBuffer buffer;
+    BOOST_REQUIRE( !cache_->readObjectRange( LargeObjectId(), large.size() + 1, 1, buffer ) );
+    BOOST_REQUIRE( cache_->hasObject( LargeObjectId() ) );
+    BOOST_REQUIRE( !cache_->readObjectRange( BinaryBuffer( 5, 0 ), 0, 1, buffer ) );
+  }
+  // Writes a large object a piece at a time into a full cache, which
+  // must make room as it goes, and aborts another
+  void StreamWrites() {
+    BOOST_TEST_MESSAGE( "Writing an object a piece at a time into a full cache." );
+    BinaryBuffer large( maxSize / 2 + 1234 );
+    for ( size_t i = 0; i < large.size(); ++i ) {
+      large[i] = static_cast< uint8_t >( rand() );
+    }
+    boost::scoped_ptr< Cache::Writer > writer( cache_->beginWrite( LargeObjectId() ) );
+    BOOST_REQUIRE( writer );
+    for ( size_t offset = 0; offset < large.size(); offset += 7777 ) {
+      BOOST_REQUIRE( writer->append( &large[ offset ], std::min< size_t >( 7777, large.size() - offset ) ) );
+      BOOST_REQUIRE( cache_->getCurrentSize() <= maxSize );
+      BOOST_REQUIRE( !cache_->hasObject( LargeObjectId() ) );
+    }
+    BOOST_REQUIRE( writer->commit() );
+    BOOST_REQUIRE( !writer->commit() );
+    BOOST_REQUIRE( cache_->getCurrentSize() <= maxSize );
+    BinaryBuffer buffer;
+    BOOST_REQUIRE( cache_->readObject( LargeObjectId(), buffer ) );
+    BOOST_REQUIRE( buffer == large );
+
+    BOOST_TEST_MESSAGE( "Aborting a write. Its space must be given back, and nothing be left." );
+    const BinaryBuffer abortedId( 12, 0x41 );
+    writer.reset( cache_->beginWrite( abortedId, maxSize / 4 ) );
+    BOOST_REQUIRE( writer );
+    BOOST_REQUIRE( cache_->getCurrentSize() <= maxSize );
+    const uint64_t reserved = cache_->getCurrentSize();
+    BOOST_REQUIRE( writer->append( &large[0], 1000 ) );
+    writer.reset();
+    BOOST_REQUIRE( cache_->getCurrentSize() <= reserved - maxSize / 4 );
+    BOOST_REQUIRE( !cache_->hasObject( abortedId ) );
+    BOOST_REQUIRE( !cache_->beginWrite( abortedId, maxSize + 1 ) );
+
+    BOOST_TEST_MESSAGE( "The written object must survive a restart, and the file of a writer that never finished must not." );
+    const std::string unfinished( OsConcatPath( OsConcatPath( path_, temporaryDirectory ), "writer1.tmp" ) );
+    OsWriteFile( unfinished, buffers_[0] );
+    ReopenCache();
+    BOOST_REQUIRE( !OsFileExists( unfinished ) );
+    BOOST_REQUIRE( cache_->readObject( LargeObjectId(), buffer ) );
+    BOOST_REQUIRE( buffer == large );
+  }
+  static BinaryBuffer LargeObjectId() {
+    return BinaryBuffer( 12, 0x4c );
+  }
+
+  // With any policy but FIFO, an object that was read must outlive
+  // older objects that weren't
+  void ReadObjectSurvives() {
+    WriteObjects();
+    BinaryBuffer buffer;
+    BOOST_REQUIRE( cache_->readObject( objectIds_[0], buffer ) );
+
+    BOOST_TEST_MESSAGE( "Writing one more object. Something has to be pruned to make room." );
+    BOOST_REQUIRE( cache_->writeObject( objectIds_[ objWritten_ ], buffers_[ objWritten_ ] ) );
+    BOOST_REQUIRE( cache_->getCurrentSize() <= maxSize );
+    BOOST_REQUIRE( cache_->hasObject( objectIds_[0] ) );
+    BOOST_REQUIRE( !cache_->hasObject( objectIds_[1] ) );
+    BOOST_REQUIRE( cache_->readObject( objectIds_[0], buffer ) );
+    BOOST_REQUIRE( buffer == buffers_[0] );
+  }
+
   ~CacheFixture()
   {
     delete cache_;
   }
+  const std::string path_;
+  const CacheOptions options_;
+  std::vector< uint8_t > key_;
   Cache *cache_;
   size_t objWritten_;
   uint64_t currSize_;
@@ -163,7 +487,7 @@ BOOST_AUTO_TEST_CASE( TestSha1Hash )
 
 BOOST_AUTO_TEST_CASE( TestWriteAndReadFiles )
 {
-  const std::string path( "C:\\temp\\test\\" );
+  const std::string& path( testPath );
   BOOST_TEST_MESSAGE( "Writing " << buffers_.size() << " files to " << path );
 
   int n = 0;
@@ -198,6 +522,124 @@ BOOST_AUTO_TEST_CASE( TestWriteAndReadFiles )
   }
 }
 
+BOOST_AUTO_TEST_CASE( TestMappedFiles )
+{
+  BOOST_TEST_MESSAGE( "Mapping " << buffers_.size() << " files and comparing with original buffers." );
+
+  int n = 0;
+  for ( std::vector< BinaryBuffer >::const_iterator it = buffers_.begin(); it != buffers_.end(); ++ it, ++n ) {
+    std::ostringstream ss;
+    ss << "mappedfile" << n;
+    std::string filename( OsConcatPath( testPath, ss.str() ) );
+    OsWriteFile( filename, *it );
+    {
+      OsMappedFile file( filename );
+      BOOST_REQUIRE( file.size() == it->size() );
+      BOOST_REQUIRE( std::equal( it->begin(), it->end(), file.data() ) );
+    }
+    OsDeleteFile( filename );
+  }
+
+  // An empty file gives an empty view
+  std::string filename( OsConcatPath( testPath, "emptyfile" ) );
+  OsWriteFile( filename, BinaryBuffer() );
+  {
+    OsMappedFile file( filename );
+    BOOST_REQUIRE( file.size() == 0 );
+  }
+  OsDeleteFile( filename );
+  BOOST_REQUIRE_THROW( OsMappedFile missing( filename ), OsReadFileException );
+}
+
+BOOST_AUTO_TEST_CASE( TestDirectories )
+{
+  BOOST_TEST_MESSAGE( "Writing, renaming, reading and deleting files relative to an open directory." );
+  OsDirectory parent( testPath );
+  OsDirectory directory( parent, "directory" );
+  BOOST_REQUIRE( !parent.EnsureDirectory( "directory" ) );
+  directory.EnsureDirectory( "sub" );
+  for ( size_t n = 0; n < buffers_.size(); ++n ) {
+    std::ostringstream ss;
+    ss << "sub/dirfile" << n;
+    directory.Write( ss.str() + ".tmp", buffers_[n] );
+    directory.Rename( ss.str() + ".tmp", ss.str() );
+    BOOST_REQUIRE( OsFileExists( OsConcatPath( OsConcatPath( testPath, "directory" ), ss.str() ) ) );
+    BinaryBuffer buf;
+    directory.Read( ss.str(), buf );
+    BOOST_REQUIRE( buf == buffers_[n] );
+    OsMappedFile file( directory, ss.str() );
+    BOOST_REQUIRE( file.size() == buffers_[n].size() );
+    BOOST_REQUIRE( std::equal( buffers_[n].begin(), buffers_[n].end(), file.data() ) );
+  }
+
+  // Files are moved in from elsewhere by their full paths
+  const std::string filename( OsConcatPath( testPath, "movedfile" ) );
+  OsWriteFile( filename, buffers_[0] );
+  directory.Move( filename, "movedfile" );
+  BOOST_REQUIRE( !OsFileExists( filename ) );
+  std::vector< std::string > names;
+  directory.List( names );
+  std::sort( names.begin(), names.end() );
+  BOOST_REQUIRE( names.size() == 2 && names[0] == "movedfile" && names[1] == "sub" );
+
+  directory.Delete( "movedfile" );
+  for ( size_t n = 0; n < buffers_.size(); ++n ) {
+    std::ostringstream ss;
+    ss << "sub/dirfile" << n;
+    directory.Delete( ss.str() );
+  }
+  BOOST_REQUIRE_THROW( directory.Delete( "movedfile" ), OsDeleteFileException );
+}
+
+BOOST_AUTO_TEST_CASE( TestReadQueue )
+{
+  OsReadQueue queue( 8 );
+  if ( !queue.Available() ) {
+    BOOST_TEST_MESSAGE( "No io_uring here. Nothing to test." );
+    return;
+  }
+  BOOST_TEST_MESSAGE( "Reading the second half of " << buffers_.size() << " files, 8 at a time." );
+  std::vector< BinaryBuffer > halves( buffers_.size() );
+  size_t started = 0, completed = 0;
+  while ( completed < buffers_.size() ) {
+    if ( started < buffers_.size() && started - completed < 8 ) {
+      std::ostringstream ss;
+      ss << "queuedfile" << started;
+      std::string filename( OsConcatPath( testPath, ss.str() ) );
+      OsWriteFile( filename, buffers_[ started ] );
+      const size_t offset = buffers_[ started ].size() / 2;
+      halves[ started ].resize( buffers_[ started ].size() - offset + 1 );
+      BOOST_REQUIRE( queue.Read( filename, offset, &halves[ started ][0], halves[ started ].size() - 1, &halves[ started ] ) );
+      ++ started;
+      continue;
+    }
+    bool ok = false;
+    BinaryBuffer* half = static_cast< BinaryBuffer* >( queue.Wait( ok ) );
+    BOOST_REQUIRE( ok && half );
+    const BinaryBuffer& buffer( buffers_[ half - &halves[0] ] );
+    BOOST_REQUIRE( std::equal( buffer.begin() + buffer.size() / 2, buffer.end(), half->begin() ) );
+    ++ completed;
+  }
+  for ( size_t n = 0; n < buffers_.size(); ++n ) {
+    std::ostringstream ss;
+    ss << "queuedfile" << n;
+    OsDeleteFile( OsConcatPath( testPath, ss.str() ) );
+  }
+
+  BOOST_TEST_MESSAGE( "A short read is not ok, a missing file can't be read, and Wake returns no tag." );
+  std::string filename( OsConcatPath( testPath, "shortfile" ) );
+  OsWriteFile( filename, buffers_[0] );
+  BinaryBuffer buffer( buffers_[0].size() + 1 );
+  BOOST_REQUIRE( queue.Read( filename, 0, &buffer[0], buffer.size(), &buffer ) );
+  bool ok = true;
+  BOOST_REQUIRE( queue.Wait( ok ) == &buffer );
+  BOOST_REQUIRE( !ok );
+  OsDeleteFile( filename );
+  BOOST_REQUIRE( !queue.Read( filename, 0, &buffer[0], buffer.size(), &buffer ) );
+  queue.Wake();
+  BOOST_REQUIRE( queue.Wait( ok ) == 0 );
+}
+
 BOOST_AUTO_TEST_CASE( TestEncryptBuffer )
 {
   BOOST_TEST_MESSAGE( "Encrypting and decrypting " << buffers_.size() << " buffers." );
@@ -217,6 +659,260 @@ BOOST_AUTO_TEST_CASE( TestEncryptBuffer )
   }
 }
 
+BOOST_AUTO_TEST_CASE( TestAead )
+{
+  const Crypt::Aead::Algorithm algorithms[] = { Crypt::Aead::AesGcm, Crypt::Aead::ChaCha20Poly1305 };
+  BOOST_REQUIRE( Crypt::Aead::Supported( Crypt::Aead::Fastest() ) );
+  for ( size_t a = 0; a < sizeof( algorithms ) / sizeof( algorithms[0] ); ++a ) {
+    if ( !Crypt::Aead::Supported( algorithms[a] ) ) {
+      continue;
+    }
+    BOOST_TEST_MESSAGE( "Sealing and opening " << buffers_.size() << " buffers with algorithm " << algorithms[a] << "." );
+    Crypt::Aead aead( algorithms[a], GetTestBuffer() );
+    for ( size_t i = 0; i < buffers_.size(); ++i ) {
+      const BinaryBuffer& plain( buffers_[i] );
+      const Cache::ObjectId& data( objectIds_[i] );
+      uint8_t nonce[ Crypt::Aead::nonceSize ];
+      Crypt::RandomBytes( nonce, sizeof( nonce ) );
+
+      // Seal in one go, open in two pieces. The contexts are reused.
+      BinaryBuffer sealed( plain.size() + Crypt::Aead::tagSize );
+      {
+        Crypt::Aead::Operation operation( aead, true, nonce );
+        operation.Authenticate( &data[0], data.size() );
+        operation.Process( &plain[0], &sealed[0], plain.size() );
+        operation.Seal( &sealed[ plain.size() ] );
+      }
+      BOOST_REQUIRE( !std::equal( plain.begin(), plain.end(), sealed.begin() ) || plain.size() < 4 );
+      BinaryBuffer opened( plain.size() );
+      {
+        Crypt::Aead::Operation operation( aead, false, nonce );
+        operation.Authenticate( &data[0], data.size() );
+        const size_t half = plain.size() / 2;
+        operation.Process( &sealed[0], &opened[0], half );
+        operation.Process( &sealed[ half ], &opened[ half ], plain.size() - half );
+        BOOST_REQUIRE( operation.Open( &sealed[ plain.size() ] ) );
+      }
+      BOOST_REQUIRE( opened == plain );
+
+      // Any change to the message or the associated data is found
+      ++ sealed[ i % sealed.size() ];
+      {
+        Crypt::Aead::Operation operation( aead, false, nonce );
+        operation.Authenticate( &data[0], data.size() );
+        operation.Process( &sealed[0], &opened[0], plain.size() );
+        BOOST_REQUIRE( !operation.Open( &sealed[ plain.size() ] ) );
+      }
+    }
+  }
+}
+
+BOOST_AUTO_TEST_CASE( TestPresenceIndex )
+{
+  BOOST_TEST_MESSAGE( "Inserting fingerprints until the index has grown a few times." );
+  PresenceIndex index;
+  for ( size_t i = 0; i < noOfBuffers; ++i ) {
+    BOOST_REQUIRE( !index.Contains( Fingerprint( objectIds_[i] ) ) || std::count( objectIds_.begin(), objectIds_.begin() + i, objectIds_[i] ) );
+    index.Insert( Fingerprint( objectIds_[i] ) );
+    BOOST_REQUIRE( index.Contains( Fingerprint( objectIds_[i] ) ) );
+  }
+
+  BOOST_TEST_MESSAGE( "A fingerprint inserted twice stays until it has been erased twice." );
+  index.Insert( Fingerprint( objectIds_[0] ) );
+  index.Erase( Fingerprint( objectIds_[0] ) );
+  BOOST_REQUIRE( index.Contains( Fingerprint( objectIds_[0] ) ) );
+
+  BOOST_TEST_MESSAGE( "Erasing every other fingerprint must not lose the others." );
+  for ( size_t i = 0; i < noOfBuffers; i += 2 ) {
+    index.Erase( Fingerprint( objectIds_[i] ) );
+  }
+  for ( size_t i = 0; i < noOfBuffers; ++i ) {
+    bool erased = true;
+    for ( size_t j = 0; j < noOfBuffers; ++j ) {
+      if ( j % 2 == 1 && objectIds_[j] == objectIds_[i] ) {
+        erased = false;
+      }
+    }
+    BOOST_REQUIRE( index.Contains( Fingerprint( objectIds_[i] ) ) == !erased );
+  }
+}
+
+BOOST_AUTO_TEST_CASE( TestObjectIndex )
+{
+  BOOST_TEST_MESSAGE( "Inserting " << noOfBuffers << " object id:s, some too long to be kept inline." );
+  ObjectIndex index;
+  std::vector< BinaryBuffer > inserted;
+  for ( size_t i = 0; i < noOfBuffers; ++i ) {
+    if ( index.Find( objectIds_[i], Fingerprint( objectIds_[i] ) ) ) {
+      continue; // Duplicate id
+    }
+    ObjectIndex::Entry& entry( index.Insert( objectIds_[i], Fingerprint( objectIds_[i] ) ) );
+    entry.size_ = static_cast< uint32_t >( i );
+    inserted.push_back( objectIds_[i] );
+  }
+  BOOST_REQUIRE( index.size() == inserted.size() );
+
+  for ( size_t i = 0; i < inserted.size(); ++i ) {
+    ObjectIndex::Entry* entry( index.Find( inserted[i], Fingerprint( inserted[i] ) ) );
+    BOOST_REQUIRE( entry );
+    BOOST_REQUIRE( entry->Id() == inserted[i] );
+  }
+
+  BOOST_TEST_MESSAGE( "The entries must be listed in the order they were inserted, also after growing." );
+  size_t n = 0;
+  for ( ObjectIndex::Entry* entry = index.Oldest(); entry; entry = index.Next( *entry ), ++n ) {
+    BOOST_REQUIRE( n < inserted.size() );
+    BOOST_REQUIRE( entry->Id() == inserted[n] );
+  }
+  BOOST_REQUIRE( n == inserted.size() );
+
+  BOOST_TEST_MESSAGE( "Moving the oldest entry to the back and erasing every other entry." );
+  index.MoveToBack( *index.Oldest() );
+  BOOST_REQUIRE( index.Oldest()->Id() == inserted[1] );
+  for ( size_t i = 0; i < inserted.size(); i += 2 ) {
+    index.Erase( *index.Find( inserted[i], Fingerprint( inserted[i] ) ) );
+  }
+  for ( size_t i = 0; i < inserted.size(); ++i ) {
+    BOOST_REQUIRE( ( index.Find( inserted[i], Fingerprint( inserted[i] ) ) != 0 ) == ( i % 2 == 1 ) );
+  }
+  n = 1;
+  for ( ObjectIndex::Entry* entry = index.Oldest(); entry; entry = index.Next( *entry ), n += 2 ) {
+    BOOST_REQUIRE( entry->Id() == inserted[n] );
+  }
+  BOOST_REQUIRE( index.size() == inserted.size() / 2 );
+
+  BOOST_TEST_MESSAGE( "Moving the oldest entry to the second queue, with the hand on it." );
+  ObjectIndex::Entry* moved = index.Oldest();
+  const BinaryBuffer movedId( moved->Id() );
+  const BinaryBuffer nextId( index.Next( *moved )->Id() );
+  index.SetHand( 0, moved );
+  index.MoveToBack( *moved, 1 );
+  BOOST_REQUIRE( index.QueueSize( 0 ) == index.size() - 1 );
+  BOOST_REQUIRE( index.QueueSize( 1 ) == 1 );
+  BOOST_REQUIRE( index.Oldest( 1 )->Id() == movedId );
+  BOOST_REQUIRE( index.Hand( 0 )->Id() == nextId );
+  BOOST_REQUIRE( index.Hand( 1 ) == 0 );
+  BOOST_REQUIRE( index.Oldest()->Id() == nextId );
+
+  BOOST_TEST_MESSAGE( "Erasing the entry under the hand moves the hand on." );
+  const BinaryBuffer afterId( index.Next( *index.Hand( 0 ) )->Id() );
+  index.Erase( *index.Hand( 0 ) );
+  BOOST_REQUIRE( index.Hand( 0 )->Id() == afterId );
+}
+
+BOOST_AUTO_TEST_CASE( TestTimerWheel )
+{
+  BOOST_TEST_MESSAGE( "Adding timers for every level of the wheel, and one beyond." );
+  const uint64_t start = 1000000007;
+  TimerWheel wheel( start );
+  const uint64_t delays[] = { 0, 1, 2, 63, 64, 65, 100, 4095, 4096, 4097, 300000, 20000000, 5000000000ULL, 100000000000ULL };
+  const size_t noOfDelays = sizeof( delays ) / sizeof( delays[0] );
+  for ( size_t i = 0; i < noOfDelays; ++i ) {
+    wheel.Add( objectIds_[i], start + delays[i] );
+  }
+  BOOST_REQUIRE( wheel.size() == noOfDelays );
+
+  BOOST_TEST_MESSAGE( "Every timer must expire when its time has come, and not before." );
+  std::vector< TimerWheel::Timer > expired;
+  for ( size_t i = 0; i < noOfDelays; ++i ) {
+    if ( delays[i] > 0 ) {
+      wheel.Advance( start + delays[i] - 1, expired );
+      BOOST_REQUIRE( expired.size() == i );
+    }
+    wheel.Advance( start + delays[i], expired );
+    BOOST_REQUIRE( expired.size() == i + 1 );
+    BOOST_REQUIRE( expired.back().objId_ == objectIds_[i] );
+    BOOST_REQUIRE( expired.back().expiry_ == start + delays[i] );
+  }
+  BOOST_REQUIRE( wheel.size() == 0 );
+
+  BOOST_TEST_MESSAGE( "Timers passed by a single long step expire all at once." );
+  expired.clear();
+  for ( size_t i = 0; i < noOfBuffers; ++i ) {
+    wheel.Add( objectIds_[i], wheel.Now() + 1 + i * 977 );
+  }
+  wheel.Advance( wheel.Now() + noOfBuffers * 977, expired );
+  BOOST_REQUIRE( expired.size() == noOfBuffers );
+  BOOST_REQUIRE( wheel.size() == 0 );
+}
+
+BOOST_AUTO_TEST_CASE( TestCheckpointBlocks )
+{
+  const std::string filename( OsConcatPath( testPath, checkpointFilename ) );
+  const std::string metaDataFiles[] = { checkpointFilename, journalFilenames[0], journalFilenames[1] };
+  for ( size_t i = 0; i < sizeof( metaDataFiles ) / sizeof( metaDataFiles[0] ); ++i ) {
+    if ( OsFileExists( OsConcatPath( testPath, metaDataFiles[i] ) ) ) {
+      OsDeleteFile( OsConcatPath( testPath, metaDataFiles[i] ) );
+    }
+  }
+  const BinaryBuffer key( GetTestBuffer() );
+
+  BOOST_TEST_MESSAGE( "Writing a checkpoint large enough to be split into several blocks." );
+  JournalCheckpoint written;
+  written.nextSegment_ = 7;
+  written.segments_.push_back( 5 );
+  for ( size_t i = 0; i < 10000; ++i ) {
+    StoreLocation location;
+    location.segment_ = 5;
+    location.offset_ = i * 100;
+    location.length_ = static_cast< uint32_t >( i );
+    if ( i % 10 == 9 ) {
+      written.AddBlob( objectIds_[ i % noOfBuffers ], static_cast< uint32_t >( i ), location, 2 );
+      continue;
+    }
+    written.Add( objectIds_[ i % noOfBuffers ], static_cast< uint32_t >( i ), location, static_cast< uint32_t >( i * 3 ),
+                 static_cast< uint8_t >( i % Cache::noOfPriorities ), 0,
+                 i % 10 == 8 ? objectIds_[ ( i + 1 ) % noOfBuffers ] : BinaryBuffer() );
+  }
+  {
+    MetaJournal journal( testPath, key );
+    JournalCheckpoint checkpoint;
+    std::vector< JournalRecord > records;
+    BOOST_REQUIRE( !journal.Open( checkpoint, records ) );
+    journal.StartCheckpoint();
+    journal.CommitCheckpoint( written );
+  }
+
+  {
+    MetaJournal journal( testPath, key );
+    JournalCheckpoint checkpoint;
+    std::vector< JournalRecord > records;
+    BOOST_REQUIRE( journal.Open( checkpoint, records ) );
+    BOOST_REQUIRE( checkpoint.nextSegment_ == 7 );
+    BOOST_REQUIRE( checkpoint.segments_ == written.segments_ );
+    BOOST_REQUIRE( checkpoint.objects_.size() == written.objects_.size() );
+    for ( size_t i = 0; i < written.objects_.size(); ++i ) {
+      const JournalCheckpoint::Object& object( checkpoint.objects_[i] );
+      BOOST_REQUIRE( checkpoint.Id( object ) == written.Id( written.objects_[i] ) );
+      BOOST_REQUIRE( object.fingerprint_ == Fingerprint( checkpoint.Id( object ) ) );
+      BOOST_REQUIRE( object.size_ == i );
+      BOOST_REQUIRE( object.location_ == written.objects_[i].location_ );
+      BOOST_REQUIRE( object.blob_ == ( i % 10 == 9 ) );
+      BOOST_REQUIRE( checkpoint.BlobId( object ) == written.BlobId( written.objects_[i] ) );
+      if ( object.blob_ ) {
+        BOOST_REQUIRE( object.partition_ == 2 );
+        continue;
+      }
+      BOOST_REQUIRE( object.expiry_ == i * 3 );
+      BOOST_REQUIRE( object.priority_ == i % Cache::noOfPriorities );
+      BOOST_REQUIRE( checkpoint.BlobId( object ).empty() == ( i % 10 != 8 ) );
+    }
+  }
+
+  BOOST_TEST_MESSAGE( "Damaging the last block. The checkpoint must be rejected." );
+  BinaryBuffer buffer;
+  OsReadFile( filename, buffer );
+  buffer[ buffer.size() - 1 ] ^= 0x01;
+  OsWriteFile( filename, buffer );
+  {
+    MetaJournal journal( testPath, key );
+    JournalCheckpoint checkpoint;
+    std::vector< JournalRecord > records;
+    journal.Open( checkpoint, records );
+    BOOST_REQUIRE( checkpoint.objects_.empty() );
+  }
+}
+
 BOOST_AUTO_TEST_SUITE_END();
 
 BOOST_FIXTURE_TEST_SUITE(CacheTestSuite, CacheFixture);
@@ -236,7 +932,7 @@ BOOST_AUTO_TEST_CASE( TestTamperObjects )
   for ( std::vector< BinaryBuffer >::const_iterator it = objectIds_.begin(); ( it != objectIds_.end() ) && ( n < objWritten_ ) ; ++ it, ++n )
   {
     // Tamper with the file
-    std::string filename( OsConcatPath( "c:\\temp\\cache", Crypt::EncodeFilenameFromBuffer( *it, ".CDF" ) ) );
+    std::string filename( OsConcatPath( cachePath, FileStore::Filename( *it ) ) );
 
     BinaryBuffer origBuffer;
     OsReadFile( filename, origBuffer );
@@ -256,17 +952,124 @@ BOOST_AUTO_TEST_CASE( TestTamperObjects )
 
     // See if we can read the object. It is (remotely) possible
     // that a modification goes undetected.
-    BOOST_WARN( !cache_->readObject( *it, origBuffer ) );
+    BinaryBuffer readBuffer;
+    BOOST_WARN( !cache_->readObject( *it, readBuffer ) );
     BOOST_WARN( !cache_->hasObject( *it ) );
 
     // And current size of the cache should be reduced.
-    BOOST_WARN( cache_->getCurrentSize() == currSize_ - origBuffer.size() );
+    BOOST_WARN( cache_->getCurrentSize() == currSize_ - buffers_[n].size() );
 
     // OK, write the original object again
-    BOOST_REQUIRE( cache_->writeObject( *it, origBuffer ) );
+    BOOST_REQUIRE( cache_->writeObject( *it, buffers_[n] ) );
     BOOST_REQUIRE( cache_->getCurrentSize() == currSize_ );
   }
-  BOOST_MESSAGE( "Have read, tampered with, re-read and re-written " << n << " objects." );
+  BOOST_TEST_MESSAGE( "Have read, tampered with, re-read and re-written " << n << " objects." );
+}
+
+BOOST_AUTO_TEST_CASE( TestStreamObjects )
+{
+  WriteObjects();
+  StreamObjects();
+
+  BOOST_TEST_MESSAGE( "Tampering with the end of the large object. The stream must fail, and the object go." );
+  std::string filename( OsConcatPath( cachePath, FileStore::Filename( LargeObjectId() ) ) );
+  BinaryBuffer file;
+  OsReadFile( filename, file );
+  ++ file.back();
+  OsWriteFile( filename, file );
+  BinaryBuffer buffer;
+  size_t largest = 0;
+  BOOST_REQUIRE( !cache_->readObjectStream( LargeObjectId(), boost::bind( &CollectChunk, &buffer, &largest, _1, _2 ) ) );
+  BOOST_REQUIRE( !cache_->hasObject( LargeObjectId() ) );
+}
+
+BOOST_AUTO_TEST_CASE( TestBatches )
+{
+  BatchObjects();
+}
+
+BOOST_AUTO_TEST_CASE( TestRangeReads )
+{
+  WriteObjects();
+  RangeReads();
+
+  BOOST_TEST_MESSAGE( "Tampering with the third chunk of the large object. Only ranges in it must fail." );
+  std::string filename( OsConcatPath( cachePath, FileStore::Filename( LargeObjectId() ) ) );
+  BinaryBuffer file;
+  OsReadFile( filename, file );
+  ++ file[ file.size() - recordChunkSize ];
+  OsWriteFile( filename, file );
+  BinaryBuffer buffer;
+  BOOST_REQUIRE( cache_->readObjectRange( LargeObjectId(), 10, 1000, buffer ) );
+  BOOST_REQUIRE( buffer.size() == 1000 );
+  BOOST_REQUIRE( !cache_->readObjectRange( LargeObjectId(), recordChunkSize * 2 + 10, 10, buffer ) );
+  BOOST_REQUIRE( !cache_->hasObject( LargeObjectId() ) );
+}
+
+BOOST_AUTO_TEST_CASE( TestLegacyRecords )
+{
+  BOOST_TEST_MESSAGE( "Writing objects with RC4 and SHA1, like older versions did." );
+  delete cache_;
+  CacheOptions legacy;
+  legacy.encryption = CacheOptions::Rc4Sha1Encryption;
+  cache_ = createCache( path_, key_, legacy );
+  BOOST_REQUIRE( cache_ );
+  cache_->setMaxSize( maxSize );
+  WriteObjects();
+
+  BOOST_TEST_MESSAGE( "Reading them with the default encryption, and writing one again." );
+  ReopenCache();
+  ReadObjects();
+  StreamObjects();
+  RangeReads();
+  const std::string filename( OsConcatPath( path_, FileStore::Filename( objectIds_[0] ) ) );
+  const std::string magic( "CCAEAD" );
+  BinaryBuffer file;
+  OsReadFile( filename, file );
+  BOOST_REQUIRE( !std::equal( magic.begin(), magic.end(), file.begin() ) );
+  BOOST_REQUIRE( cache_->writeObject( objectIds_[0], buffers_[0] ) );
+  OsReadFile( filename, file );
+  BOOST_REQUIRE( std::equal( magic.begin(), magic.end(), file.begin() ) );
+  BinaryBuffer buffer;
+  BOOST_REQUIRE( cache_->readObject( objectIds_[0], buffer ) );
+  BOOST_REQUIRE( buffer == buffers_[0] );
+}
+
+BOOST_AUTO_TEST_CASE( TestFlatLayout )
+{
+  WriteObjects();
+
+  BOOST_TEST_MESSAGE( "Moving the files to where older versions kept them, directly in the cache directory." );
+  delete cache_;
+  cache_ = 0;
+  size_t n = 0;
+  for ( std::vector< BinaryBuffer >::const_iterator it = objectIds_.begin(); ( it != objectIds_.end() ) && ( n < objWritten_ ) ; ++ it, ++n )
+  {
+    OsRenameFile( OsConcatPath( path_, FileStore::Filename( *it ) ), OsConcatPath( path_, Crypt::EncodeFilenameFromBuffer( *it, ".CDF" ) ) );
+  }
+  const std::string uncommitted( OsConcatPath( path_, Crypt::EncodeFilenameFromBuffer( objectIds_[0], ".CDF.1.tmp" ) ) );
+  OsWriteFile( uncommitted, buffers_[0] );
+  const std::string interrupted( OsConcatPath( OsConcatPath( path_, temporaryDirectory ), "interrupted.7.tmp" ) );
+  OsWriteFile( interrupted, buffers_[1] );
+
+  BOOST_TEST_MESSAGE( "Reopening the cache moves them into place, and removes the uncommitted writes." );
+  ReopenCache();
+  BOOST_REQUIRE( !OsFileExists( uncommitted ) );
+  BOOST_REQUIRE( !OsFileExists( interrupted ) );
+  n = 0;
+  for ( std::vector< BinaryBuffer >::const_iterator it = objectIds_.begin(); ( it != objectIds_.end() ) && ( n < objWritten_ ) ; ++ it, ++n )
+  {
+    BOOST_REQUIRE( !OsFileExists( OsConcatPath( path_, Crypt::EncodeFilenameFromBuffer( *it, ".CDF" ) ) ) );
+    BOOST_REQUIRE( OsFileExists( OsConcatPath( path_, FileStore::Filename( *it ) ) ) );
+  }
+  ReadObjects();
+  EraseObjects();
+}
+
+BOOST_AUTO_TEST_CASE( TestStreamWrites )
+{
+  WriteObjects();
+  StreamWrites();
 }
 
 size_t nPruneNext = 0;
@@ -320,7 +1123,7 @@ size_t nPruneNext = 0;
   BOOST_REQUIRE( !cache_->hasObject( prunedObjectId ) );
 
   // Check that the file is gone from the file system
-  BOOST_REQUIRE( !OsFileExists( OsConcatPath( "c:\\temp\\cache", Crypt::EncodeFilenameFromBuffer( prunedObjectId, ".CDF" ) ) ) );
+  BOOST_REQUIRE( !OsFileExists( OsConcatPath( cachePath, FileStore::Filename( prunedObjectId ) ) ) );
   }
 
   // Check that the new cache size is correct
@@ -371,6 +1174,1042 @@ size_t nPruneNext = 0;
 */
 BOOST_AUTO_TEST_SUITE_END();
 
+CacheOptions GetSegmentOptions()
+{
+  CacheOptions options;
+  options.storage = CacheOptions::SegmentStorage;
+  options.segmentSize = 32 * 1024; // Room for a handful of test buffers
+  return options;
+}
+
+struct SegmentCacheFixture : public CacheFixture
+{
+  SegmentCacheFixture() : CacheFixture( segmentCachePath, GetSegmentOptions() ) {}
+
+  std::string SegmentFilename( uint32_t segment ) {
+    std::ostringstream ss;
+    ss << std::setbase( 16 ) << std::setw( 8 ) << std::setfill( '0' ) << segment << segmentExtension;
+    return OsConcatPath( path_, ss.str() );
+  }
+};
+
+BOOST_FIXTURE_TEST_SUITE(SegmentTestSuite, SegmentCacheFixture);
+
+BOOST_AUTO_TEST_CASE( TestSegmentReadWriteEraseObjects )
+{
+  WriteObjects();
+  ReadObjects();
+  EraseObjects();
+}
+
+BOOST_AUTO_TEST_CASE( TestSegmentStreamObjects )
+{
+  WriteObjects();
+  StreamObjects();
+}
+
+BOOST_AUTO_TEST_CASE( TestSegmentRangeReads )
+{
+  WriteObjects();
+  RangeReads();
+}
+
+BOOST_AUTO_TEST_CASE( TestSegmentStreamWrites )
+{
+  WriteObjects();
+  StreamWrites();
+}
+
+BOOST_AUTO_TEST_CASE( TestSegmentReopen )
+{
+  WriteObjects();
+  BOOST_TEST_MESSAGE( "Reopening the cache. Objects should be found in the segments." );
+  ReopenCache();
+  BOOST_REQUIRE( cache_->getCurrentSize() == currSize_ );
+  ReadObjects();
+
+  BOOST_TEST_MESSAGE( "Objects written after reopening go to new segments." );
+  BOOST_REQUIRE( cache_->eraseObject( objectIds_[0] ) );
+  BOOST_REQUIRE( cache_->writeObject( objectIds_[0], buffers_[0] ) );
+  ReadObjects();
+}
+
+BOOST_AUTO_TEST_CASE( TestSegmentPruning )
+{
+  WriteObjects();
+
+  BOOST_TEST_MESSAGE( "Halving the maximum size. Pruning should retire whole segments." );
+  cache_->setMaxSize( maxSize / 2 );
+  BOOST_REQUIRE( cache_->getCurrentSize() <= maxSize / 2 );
+  BOOST_REQUIRE( !cache_->hasObject( objectIds_[0] ) );
+  BOOST_REQUIRE( !OsFileExists( SegmentFilename( 1 ) ) );
+
+  // Whatever is left must still be readable, and everything in a
+  // segment that was pruned from must be gone.
+  size_t n = 0;
+  for ( std::vector< BinaryBuffer >::const_iterator it = objectIds_.begin(); ( it != objectIds_.end() ) && ( n < objWritten_ ) ; ++ it, ++n )
+  {
+    BinaryBuffer buffer;
+    if ( cache_->hasObject( *it ) ) {
+      BOOST_REQUIRE( cache_->readObject( *it, buffer ) );
+      BOOST_REQUIRE( buffer == buffers_[n] );
+    }
+  }
+}
+
+BOOST_AUTO_TEST_CASE( TestSegmentConcurrentObjects )
+{
+  WriteObjects();
+  ConcurrentObjects();
+}
+
+BOOST_AUTO_TEST_CASE( TestSegmentCompaction )
+{
+  WriteObjects();
+
+  BOOST_TEST_MESSAGE( "Erasing most objects of the first segment. The compactor should move the rest and delete it." );
+  BOOST_REQUIRE( OsFileExists( SegmentFilename( 1 ) ) );
+  size_t n = 0;
+  for ( std::vector< BinaryBuffer >::const_iterator it = objectIds_.begin(); ( it != objectIds_.end() ) && ( n < objWritten_ ) ; ++ it, ++n )
+  {
+    if ( n % 4 != 0 ) {
+      BOOST_REQUIRE( cache_->eraseObject( *it ) );
+    }
+  }
+
+  for ( int i = 0; i < 100 && OsFileExists( SegmentFilename( 1 ) ); ++i ) {
+    boost::this_thread::sleep( boost::posix_time::milliseconds( 50 ) );
+  }
+  BOOST_REQUIRE( !OsFileExists( SegmentFilename( 1 ) ) );
+
+  n = 0;
+  for ( std::vector< BinaryBuffer >::const_iterator it = objectIds_.begin(); ( it != objectIds_.end() ) && ( n < objWritten_ ) ; ++ it, ++n )
+  {
+    if ( n % 4 == 0 ) {
+      BinaryBuffer buffer;
+      BOOST_REQUIRE( cache_->readObject( *it, buffer ) );
+      BOOST_REQUIRE( buffer == buffers_[n] );
+    }
+  }
+
+  BOOST_TEST_MESSAGE( "Moved objects must survive a restart." );
+  ReopenCache();
+  n = 0;
+  for ( std::vector< BinaryBuffer >::const_iterator it = objectIds_.begin(); ( it != objectIds_.end() ) && ( n < objWritten_ ) ; ++ it, ++n )
+  {
+    BOOST_REQUIRE( cache_->hasObject( *it ) == ( n % 4 == 0 ) );
+  }
+}
+
+BOOST_AUTO_TEST_SUITE_END();
+
+CacheOptions GetShardedOptions()
+{
+  CacheOptions options;
+  options.shards = 8;
+  return options;
+}
+
+struct ShardedCacheFixture : public CacheFixture
+{
+  ShardedCacheFixture() : CacheFixture( shardedCachePath, GetShardedOptions() ) {}
+};
+
+BOOST_FIXTURE_TEST_SUITE(ShardedTestSuite, ShardedCacheFixture);
+
+BOOST_AUTO_TEST_CASE( TestShardedReadWriteEraseObjects )
+{
+  WriteObjects();
+  ReadObjects();
+  EraseObjects();
+}
+
+BOOST_AUTO_TEST_CASE( TestShardedPruning )
+{
+  WriteObjects();
+
+  BOOST_TEST_MESSAGE( "Halving the maximum size. The oldest objects should go first, whatever their shard." );
+  cache_->setMaxSize( maxSize / 2 );
+  BOOST_REQUIRE( cache_->getCurrentSize() <= maxSize / 2 );
+  bool pruned = true;
+  for ( size_t n = 0; n < objWritten_; ++n ) {
+    // Once an object is left, all newer ones must be left too
+    if ( cache_->hasObject( objectIds_[n] ) ) {
+      pruned = false;
+    }
+    BOOST_REQUIRE( cache_->hasObject( objectIds_[n] ) == !pruned );
+  }
+  BOOST_REQUIRE( !cache_->hasObject( objectIds_[0] ) );
+  BOOST_REQUIRE( cache_->hasObject( objectIds_[ objWritten_ - 1 ] ) );
+}
+
+BOOST_AUTO_TEST_CASE( TestShardedReopen )
+{
+  WriteObjects();
+  ReopenCache();
+  BOOST_REQUIRE( cache_->getCurrentSize() == currSize_ );
+  ReadObjects();
+}
+
+BOOST_AUTO_TEST_CASE( TestShardedConcurrentObjects )
+{
+  WriteObjects();
+  ConcurrentObjects();
+}
+
+BOOST_AUTO_TEST_CASE( TestShardedConcurrentLookups )
+{
+  WriteObjects();
+  ConcurrentLookups();
+}
+
+BOOST_AUTO_TEST_SUITE_END();
+
+CacheOptions GetJournalOptions()
+{
+  CacheOptions options;
+  options.checkpointRecords = 16; // Checkpoint every few operations
+  return options;
+}
+
+struct JournalCacheFixture : public CacheFixture
+{
+  JournalCacheFixture() : CacheFixture( journalCachePath, GetJournalOptions() ) {}
+
+  // Creates the cache again without shutting the old one down, as if
+  // the process had died. The old instance is leaked on purpose.
+  void CrashCache() {
+    cache_ = createCache( path_, key_, options_ );
+    BOOST_REQUIRE( cache_ );
+    cache_->setMaxSize( maxSize );
+  }
+};
+
+BOOST_FIXTURE_TEST_SUITE(JournalTestSuite, JournalCacheFixture);
+
+BOOST_AUTO_TEST_CASE( TestJournalCheckpoint )
+{
+  WriteObjects();
+  BOOST_TEST_MESSAGE( "Rewriting objects. The journal should be checkpointed along the way." );
+  for ( size_t n = 0; n < objWritten_; ++n ) {
+    BOOST_REQUIRE( cache_->eraseObject( objectIds_[n] ) );
+    BOOST_REQUIRE( cache_->writeObject( objectIds_[n], buffers_[n] ) );
+  }
+  BOOST_REQUIRE( OsFileExists( OsConcatPath( path_, checkpointFilename ) ) );
+  ReopenCache();
+  BOOST_REQUIRE( cache_->getCurrentSize() == currSize_ );
+  ReadObjects();
+}
+
+BOOST_AUTO_TEST_CASE( TestJournalCrash )
+{
+  WriteObjects();
+  BOOST_REQUIRE( cache_->eraseObject( objectIds_[0] ) );
+  BOOST_TEST_MESSAGE( "Every change is in the journal as soon as the call returns." );
+  CrashCache();
+  BOOST_REQUIRE( !cache_->hasObject( objectIds_[0] ) );
+  BOOST_REQUIRE( cache_->writeObject( objectIds_[0], buffers_[0] ) );
+  BOOST_REQUIRE( cache_->getCurrentSize() == currSize_ );
+  ReadObjects();
+}
+
+BOOST_AUTO_TEST_CASE( TestJournalTornTail )
+{
+  WriteObjects();
+  delete cache_;
+  cache_ = 0;
+
+  BOOST_TEST_MESSAGE( "Appending half a record to the journal, as a crash in the middle of a write would." );
+  for ( size_t i = 0; i < 2; ++i ) {
+    const std::string journal( OsConcatPath( path_, journalFilenames[i] ) );
+    if ( OsFileExists( journal ) ) {
+      BinaryBuffer buffer;
+      OsReadFile( journal, buffer );
+      const BinaryBuffer garbage( GetTestBuffer() );
+      buffer.insert( buffer.end(), garbage.begin(), garbage.end() );
+      OsWriteFile( journal, buffer );
+    }
+  }
+
+  ReopenCache();
+  BOOST_REQUIRE( cache_->getCurrentSize() == currSize_ );
+  ReadObjects();
+
+  BOOST_TEST_MESSAGE( "Records appended after the torn one must survive too." );
+  BOOST_REQUIRE( cache_->eraseObject( objectIds_[0] ) );
+  ReopenCache();
+  BOOST_REQUIRE( !cache_->hasObject( objectIds_[0] ) );
+}
+
+BOOST_AUTO_TEST_SUITE_END();
+
+CacheOptions GetEvictionOptions( CacheOptions::Eviction eviction )
+{
+  CacheOptions options;
+  options.eviction = eviction;
+  options.shards = 4;
+  return options;
+}
+
+template < CacheOptions::Eviction eviction >
+struct EvictionCacheFixture : public CacheFixture
+{
+  EvictionCacheFixture() : CacheFixture( evictionCachePath, GetEvictionOptions( eviction ) ) {}
+};
+
+BOOST_AUTO_TEST_SUITE(EvictionTestSuite);
+
+BOOST_FIXTURE_TEST_CASE( TestLruEviction, EvictionCacheFixture< CacheOptions::LruEviction > )
+{
+  ReadObjectSurvives();
+}
+
+BOOST_FIXTURE_TEST_CASE( TestClockEviction, EvictionCacheFixture< CacheOptions::ClockEviction > )
+{
+  ReadObjectSurvives();
+}
+
+BOOST_FIXTURE_TEST_CASE( TestSieveEviction, EvictionCacheFixture< CacheOptions::SieveEviction > )
+{
+  ReadObjectSurvives();
+}
+
+BOOST_FIXTURE_TEST_CASE( TestS3FifoEviction, EvictionCacheFixture< CacheOptions::S3FifoEviction > )
+{
+  ReadObjectSurvives();
+  BOOST_TEST_MESSAGE( "The objects that were never read leave in write order." );
+  cache_->setMaxSize( reducedMaxSize );
+  BOOST_REQUIRE( cache_->hasObject( objectIds_[0] ) );
+  BOOST_REQUIRE( !cache_->hasObject( objectIds_[2] ) );
+  BOOST_REQUIRE( cache_->hasObject( objectIds_[ objWritten_ ] ) );
+}
+
+BOOST_AUTO_TEST_SUITE_END();
+
+struct ExpiryCacheFixture : public CacheFixture
+{
+  ExpiryCacheFixture() : CacheFixture( expiryCachePath ) {}
+};
+
+BOOST_FIXTURE_TEST_SUITE(ExpiryTestSuite, ExpiryCacheFixture);
+
+BOOST_AUTO_TEST_CASE( TestExpiredObjects )
+{
+  WriteObjects();
+  BOOST_TEST_MESSAGE( "Writing an object that has already expired, and one that expires in an hour." );
+  BinaryBuffer buffer;
+  BOOST_REQUIRE( cache_->writeObject( objectIds_[0], buffers_[0], std::time( 0 ) - 1 ) );
+  BOOST_REQUIRE( !cache_->hasObject( objectIds_[0] ) );
+  BOOST_REQUIRE( !cache_->readObject( objectIds_[0], buffer ) );
+  BOOST_REQUIRE( cache_->writeObject( objectIds_[1], buffers_[1], std::time( 0 ) + 3600 ) );
+  BOOST_REQUIRE( cache_->getCurrentSize() == currSize_ - buffers_[0].size() );
+
+  BOOST_TEST_MESSAGE( "The expiry must survive reopening the cache." );
+  ReopenCache();
+  BOOST_REQUIRE( !cache_->hasObject( objectIds_[0] ) );
+  BOOST_REQUIRE( cache_->readObject( objectIds_[1], buffer ) );
+  BOOST_REQUIRE( buffer == buffers_[1] );
+
+  BOOST_TEST_MESSAGE( "Waiting for an object to expire. The next write must erase it." );
+  BOOST_REQUIRE( cache_->writeObject( objectIds_[2], buffers_[2], std::time( 0 ) + 1 ) );
+  BOOST_REQUIRE( cache_->hasObject( objectIds_[2] ) );
+  boost::this_thread::sleep( boost::posix_time::milliseconds( 2100 ) );
+  BOOST_REQUIRE( cache_->writeObject( objectIds_[0], buffers_[0] ) );
+  BOOST_REQUIRE( !cache_->hasObject( objectIds_[2] ) );
+  BOOST_REQUIRE( cache_->getCurrentSize() == currSize_ - buffers_[2].size() );
+}
+
+BOOST_AUTO_TEST_CASE( TestPriorityPruning )
+{
+  BOOST_TEST_MESSAGE( "Writing every other object with low priority." );
+  for ( size_t n = 0; n < noOfBuffers && cache_->getCurrentSize() + buffers_[n].size() <= maxSize; ++n ) {
+    BOOST_REQUIRE( cache_->writeObject( objectIds_[n], buffers_[n], 0, n % 2 ? Cache::LowPriority : Cache::NormalPriority ) );
+    objWritten_ ++;
+  }
+
+  BOOST_TEST_MESSAGE( "Reopening and pruning. Low priority objects must all go before any other." );
+  ReopenCache();
+  cache_->setMaxSize( reducedMaxSize );
+  bool lowLeft = false;
+  bool normalPruned = false;
+  for ( size_t n = 0; n < objWritten_; ++n ) {
+    if ( n % 2 ) {
+      lowLeft = lowLeft || cache_->hasObject( objectIds_[n] );
+    } else {
+      normalPruned = normalPruned || !cache_->hasObject( objectIds_[n] );
+    }
+  }
+  BOOST_REQUIRE( !lowLeft || !normalPruned );
+  BOOST_REQUIRE( cache_->hasObject( objectIds_[ ( objWritten_ - 1 ) & ~static_cast< size_t >( 1 ) ] ) );
+}
+
+BOOST_AUTO_TEST_SUITE_END();
+
+CacheOptions GetPartitionOptions()
+{
+  CacheOptions options;
+  options.partitions.push_back( CacheOptions::Partition( "images", maxSize / 4 ) );
+  options.partitions.push_back( CacheOptions::Partition( "tracks", maxSize - maxSize / 4 ) );
+  options.partitions.push_back( CacheOptions::Partition( "biographies", maxSize, CacheOptions::BestCompression ) );
+  return options;
+}
+
+struct PartitionCacheFixture : public CacheFixture
+{
+  PartitionCacheFixture() : CacheFixture( partitionCachePath, GetPartitionOptions() ) {}
+};
+
+BOOST_FIXTURE_TEST_SUITE(PartitionTestSuite, PartitionCacheFixture);
+
+BOOST_AUTO_TEST_CASE( TestPartitionBudgets )
+{
+  BOOST_TEST_MESSAGE( "Filling the whole cache with tracks. They may borrow the budget of the images." );
+  size_t n = 0;
+  for ( ; cache_->getCurrentSize() + buffers_[n].size() <= maxSize; ++n ) {
+    BOOST_REQUIRE( cache_->writeObject( objectIds_[n], buffers_[n], "tracks" ) );
+  }
+  PartitionStats tracks;
+  BOOST_REQUIRE( cache_->getPartitionStats( "tracks", tracks ) );
+  BOOST_REQUIRE( tracks.currentSize > tracks.maxSize );
+  BOOST_REQUIRE( tracks.writes == n );
+  BOOST_REQUIRE( tracks.objects == n );
+
+  BOOST_TEST_MESSAGE( "Writing images up to their budget. The tracks must give back what they borrowed." );
+  const size_t firstImage = n;
+  PartitionStats images;
+  for ( ; n < noOfBuffers; ++n ) {
+    BOOST_REQUIRE( cache_->getPartitionStats( "images", images ) );
+    if ( images.currentSize + buffers_[n].size() > images.maxSize ) {
+      break;
+    }
+    BOOST_REQUIRE( cache_->writeObject( objectIds_[n], buffers_[n], "images" ) );
+  }
+  BOOST_REQUIRE( n > firstImage );
+  BOOST_REQUIRE( cache_->getCurrentSize() <= maxSize );
+
+  BOOST_TEST_MESSAGE( "Writing more tracks. Only tracks may be pruned." );
+  for ( size_t i = n; i < noOfBuffers; ++i ) {
+    BOOST_REQUIRE( cache_->writeObject( objectIds_[i], buffers_[i], "tracks" ) );
+  }
+  BinaryBuffer buffer;
+  for ( size_t i = firstImage; i < n; ++i ) {
+    BOOST_REQUIRE( cache_->readObject( objectIds_[i], buffer ) );
+    BOOST_REQUIRE( buffer == buffers_[i] );
+  }
+  BOOST_REQUIRE( cache_->getPartitionStats( "images", images ) );
+  BOOST_REQUIRE( cache_->getPartitionStats( "tracks", tracks ) );
+  BOOST_REQUIRE( images.prunes == 0 );
+  BOOST_REQUIRE( images.hits == n - firstImage );
+  BOOST_REQUIRE( tracks.prunes > 0 );
+  BOOST_REQUIRE( images.currentSize + tracks.currentSize == cache_->getCurrentSize() );
+
+  BOOST_TEST_MESSAGE( "Every object must stay in its partition after reopening." );
+  ReopenCache();
+  PartitionStats reopened;
+  BOOST_REQUIRE( cache_->getPartitionStats( "images", reopened ) );
+  BOOST_REQUIRE( reopened.currentSize == images.currentSize );
+  BOOST_REQUIRE( reopened.objects == n - firstImage );
+
+  BOOST_TEST_MESSAGE( "There is no such partition." );
+  BOOST_REQUIRE( !cache_->writeObject( objectIds_[0], buffers_[0], "videos" ) );
+  BOOST_REQUIRE( !cache_->getPartitionStats( "videos", reopened ) );
+}
+
+BOOST_AUTO_TEST_CASE( TestCompressedPartition )
+{
+  BOOST_TEST_MESSAGE( "Writing text, twice the size of the cache, to a partition that compresses." );
+  std::vector< BinaryBuffer > texts;
+  const std::string words[] = { "The ", "band ", "was ", "formed ", "in ", "Gothenburg ", "and ", "toured ", "Europe. " };
+  uint64_t written = 0;
+  for ( size_t n = 0; written < 2 * maxSize; ++n ) {
+    std::string text;
+    while ( text.size() < 5000 + n * 100 ) {
+      text += words[ rand() % ( sizeof( words ) / sizeof( words[0] ) ) ];
+    }
+    texts.push_back( BinaryBuffer( text.begin(), text.end() ) );
+    BOOST_REQUIRE( cache_->writeObject( objectIds_[n], texts.back(), "biographies" ) );
+    written += text.size();
+  }
+  PartitionStats biographies;
+  BOOST_REQUIRE( cache_->getPartitionStats( "biographies", biographies ) );
+  BOOST_REQUIRE( biographies.objects == texts.size() );
+  BOOST_REQUIRE( biographies.currentSize < written / 2 );
+  BOOST_REQUIRE( cache_->getCurrentSize() == biographies.currentSize );
+
+  BOOST_TEST_MESSAGE( "Reading them whole, streamed, and a range. They must come back as written, also after a restart." );
+  for ( size_t round = 0; round < 2; ++round ) {
+    for ( size_t n = 0; n < texts.size(); ++n ) {
+      BinaryBuffer buffer;
+      BOOST_REQUIRE( cache_->readObject( objectIds_[n], buffer ) );
+      BOOST_REQUIRE( buffer == texts[n] );
+      size_t largest = 0;
+      buffer.clear();
+      BOOST_REQUIRE( cache_->readObjectStream( objectIds_[n], boost::bind( &CollectChunk, &buffer, &largest, _1, _2 ) ) );
+      BOOST_REQUIRE( buffer == texts[n] );
+      BOOST_REQUIRE( cache_->readObjectRange( objectIds_[n], 100, 50, buffer ) );
+      BOOST_REQUIRE( buffer == BinaryBuffer( texts[n].begin() + 100, texts[n].begin() + 150 ) );
+    }
+    ReopenCache();
+  }
+
+  BOOST_TEST_MESSAGE( "Random data doesn't compress, and is stored as it is." );
+  const uint64_t before = cache_->getCurrentSize();
+  const BinaryBuffer& random( buffers_[ noOfBuffers - 1 ] );
+  BOOST_REQUIRE( cache_->writeObject( objectIds_[ noOfBuffers - 1 ], random, "biographies" ) );
+  BOOST_REQUIRE( cache_->getCurrentSize() == before + random.size() );
+  BinaryBuffer buffer;
+  BOOST_REQUIRE( cache_->readObject( objectIds_[ noOfBuffers - 1 ], buffer ) );
+  BOOST_REQUIRE( buffer == random );
+}
+
+BOOST_AUTO_TEST_CASE( TestLargeObjectNotCompressed )
+{
+  BOOST_TEST_MESSAGE( "Text larger than a record chunk is stored as it is, so that reading it doesn't inflate it all." );
+  std::string text;
+  while ( text.size() <= recordChunkSize ) {
+    text += "The band was formed in Gothenburg and toured Europe. ";
+  }
+  const BinaryBuffer value( text.begin(), text.end() );
+  BOOST_REQUIRE( cache_->writeObject( objectIds_[0], value, "biographies" ) );
+  BOOST_REQUIRE( cache_->getCurrentSize() == value.size() );
+  BinaryBuffer buffer;
+  BOOST_REQUIRE( cache_->readObjectRange( objectIds_[0], recordChunkSize - 10, 20, buffer ) );
+  BOOST_REQUIRE( buffer == BinaryBuffer( value.begin() + recordChunkSize - 10, value.begin() + recordChunkSize + 10 ) );
+}
+
+BOOST_AUTO_TEST_SUITE_END();
+
+
+CacheOptions GetAsyncOptions()
+{
+  CacheOptions options;
+  // Segments, so that reads start in the middle of a file, and a queue
+  // shorter than the number of objects, so that callers have to wait
+  options.storage = CacheOptions::SegmentStorage;
+  options.segmentSize = maxSize / 4;
+  options.asyncQueueDepth = 4;
+  return options;
+}
+
+// Collects the results of asynchronous operations
+struct AsyncResults
+{
+  AsyncResults( size_t expected ) : values_( expected ), ok_( expected, false ), completed_( 0 ) {}
+
+  void Read( size_t n, bool ok, const BinaryBuffer& value ) {
+    boost::mutex::scoped_lock lock( mutex_ );
+    ok_[n] = ok;
+    values_[n] = value;
+    ++ completed_;
+    completion_.notify_all();
+  }
+  void Written( size_t n, bool ok ) {
+    Read( n, ok, BinaryBuffer() );
+  }
+  void Wait() {
+    boost::mutex::scoped_lock lock( mutex_ );
+    while ( completed_ < ok_.size() ) {
+      completion_.wait( lock );
+    }
+  }
+
+  boost::mutex mutex_;
+  boost::condition_variable completion_;
+  std::vector< BinaryBuffer > values_;
+  std::vector< bool > ok_;
+  size_t completed_;
+};
+
+struct AsyncCacheFixture : public CacheFixture
+{
+  AsyncCacheFixture() : CacheFixture( asyncCachePath, GetAsyncOptions() ) {}
+};
+
+BOOST_FIXTURE_TEST_SUITE(AsyncTestSuite, AsyncCacheFixture);
+
+BOOST_AUTO_TEST_CASE( TestAsyncReadWriteObjects )
+{
+  size_t n = 0;
+  for ( uint64_t size = 0; n < noOfBuffers && size + buffers_[n].size() <= maxSize; ++n ) {
+    size += buffers_[n].size();
+  }
+  BOOST_TEST_MESSAGE( "Writing " << n << " objects asynchronously." );
+  AsyncResults written( n );
+  for ( size_t i = 0; i < n; ++i ) {
+    cache_->writeObjectAsync( objectIds_[i], buffers_[i], boost::bind( &AsyncResults::Written, &written, i, _1 ) );
+  }
+  written.Wait();
+  for ( size_t i = 0; i < n; ++i ) {
+    BOOST_REQUIRE( written.ok_[i] );
+    BOOST_REQUIRE( cache_->hasObject( objectIds_[i] ) );
+  }
+
+  BOOST_TEST_MESSAGE( "Reading them back asynchronously, plus one that was never written." );
+  AsyncResults read( n + 1 );
+  for ( size_t i = 0; i <= n; ++i ) {
+    cache_->readObjectAsync( objectIds_[i], boost::bind( &AsyncResults::Read, &read, i, _1, _2 ) );
+  }
+  read.Wait();
+  for ( size_t i = 0; i < n; ++i ) {
+    BOOST_REQUIRE( read.ok_[i] );
+    BOOST_REQUIRE( read.values_[i] == buffers_[i] );
+  }
+  BOOST_REQUIRE( !read.ok_[n] );
+}
+
+BOOST_AUTO_TEST_CASE( TestAsyncReadsWhileWriting )
+{
+  WriteObjects();
+  BOOST_TEST_MESSAGE( "Reading asynchronously while the same objects are written again, and compacted." );
+  AsyncResults read( objWritten_ * 4 );
+  for ( size_t round = 0; round < 4; ++round ) {
+    for ( size_t i = 0; i < objWritten_; ++i ) {
+      cache_->readObjectAsync( objectIds_[i], boost::bind( &AsyncResults::Read, &read, round * objWritten_ + i, _1, _2 ) );
+      if ( i % 2 == round % 2 ) {
+        BOOST_REQUIRE( cache_->writeObject( objectIds_[i], buffers_[i] ) );
+      }
+    }
+  }
+  read.Wait();
+  for ( size_t i = 0; i < read.ok_.size(); ++i ) {
+    // Never wrong, and never lost for good
+    BOOST_REQUIRE( read.ok_[i] );
+    BOOST_REQUIRE( read.values_[i] == buffers_[ i % objWritten_ ] );
+  }
+  ReadObjects();
+}
+
+BOOST_AUTO_TEST_SUITE_END();
+
+CacheOptions GetWriteBackOptions()
+{
+  CacheOptions options;
+  // Less than the largest test objects, which are then written directly
+  options.writeBack = true;
+  options.writeBackBytes = 8000;
+  return options;
+}
+
+struct WriteBackCacheFixture : public CacheFixture
+{
+  WriteBackCacheFixture() : CacheFixture( writeBackCachePath, GetWriteBackOptions() ) {}
+};
+
+BOOST_FIXTURE_TEST_SUITE(WriteBackTestSuite, WriteBackCacheFixture);
+
+BOOST_AUTO_TEST_CASE( TestWriteBackObjects )
+{
+  size_t n = 0;
+  uint64_t size = 0;
+  for ( ; n < noOfBuffers && size + buffers_[n].size() <= maxSize; ++n ) {
+    size += buffers_[n].size();
+  }
+  BOOST_TEST_MESSAGE( "Writing " << n << " objects. Every one must be there at once, staged or not." );
+  BinaryBuffer buffer;
+  for ( size_t i = 0; i < n; ++i ) {
+    BOOST_REQUIRE( cache_->writeObject( objectIds_[i], buffers_[i] ) );
+    BOOST_REQUIRE( cache_->hasObject( objectIds_[i] ) );
+    BOOST_REQUIRE( cache_->readObject( objectIds_[i], buffer ) );
+    BOOST_REQUIRE( buffer == buffers_[i] );
+  }
+
+  BOOST_TEST_MESSAGE( "Erasing the last one, which may still be staged. It must never be stored." );
+  BOOST_REQUIRE( cache_->eraseObject( objectIds_[ n - 1 ] ) );
+  BOOST_REQUIRE( !cache_->hasObject( objectIds_[ n - 1 ] ) );
+  size -= buffers_[ n - 1 ].size();
+
+  cache_->flush();
+  BOOST_REQUIRE( cache_->getCurrentSize() == size );
+
+  BOOST_TEST_MESSAGE( "Rewriting the objects and reopening right away. Destroying the cache stores what is staged." );
+  for ( size_t i = 0; i + 1 < n; ++i ) {
+    BOOST_REQUIRE( cache_->writeObject( objectIds_[i], buffers_[ n - 2 - i ] ) );
+  }
+  ReopenCache();
+  BOOST_REQUIRE( cache_->getCurrentSize() == size );
+  BOOST_REQUIRE( !cache_->hasObject( objectIds_[ n - 1 ] ) );
+  for ( size_t i = 0; i + 1 < n; ++i ) {
+    BOOST_REQUIRE( cache_->readObject( objectIds_[i], buffer ) );
+    BOOST_REQUIRE( buffer == buffers_[ n - 2 - i ] );
+  }
+}
+
+BOOST_AUTO_TEST_CASE( TestWriteBackConcurrentObjects )
+{
+  WriteObjects();
+  cache_->flush();
+  ConcurrentObjects();
+}
+
+BOOST_AUTO_TEST_CASE( TestWriteBackBatches )
+{
+  BatchObjects();
+}
+
+BOOST_AUTO_TEST_SUITE_END();
+
+CacheOptions GetMemoryTierOptions()
+{
+  CacheOptions options;
+  options.memoryTierSize = maxSize / 4;
+  return options;
+}
+
+struct MemoryTierCacheFixture : public CacheFixture
+{
+  MemoryTierCacheFixture() : CacheFixture( memoryTierCachePath, GetMemoryTierOptions() ) {}
+};
+
+BOOST_FIXTURE_TEST_SUITE(MemoryTierTestSuite, MemoryTierCacheFixture);
+
+BOOST_AUTO_TEST_CASE( TestMemoryTierReads )
+{
+  WriteObjects();
+  BOOST_TEST_MESSAGE( "Reading the first object over and over. Only the first read may miss." );
+  BinaryBuffer buffer;
+  for ( int i = 0; i < 10; ++i ) {
+    BOOST_REQUIRE( cache_->readObject( objectIds_[0], buffer ) );
+    BOOST_REQUIRE( buffer == buffers_[0] );
+  }
+  MemoryTierStats stats;
+  BOOST_REQUIRE( cache_->getMemoryTierStats( stats ) );
+  BOOST_REQUIRE( stats.hits == 9 );
+  BOOST_REQUIRE( stats.misses == 1 );
+
+  BOOST_TEST_MESSAGE( "Reading everything twice. The tier must stay within its budget." );
+  ReadObjects();
+  ReadObjects();
+  BOOST_REQUIRE( cache_->getMemoryTierStats( stats ) );
+  BOOST_REQUIRE( stats.currentSize <= stats.maxSize );
+  BOOST_REQUIRE( stats.objects > 0 );
+
+  BOOST_TEST_MESSAGE( "Rewriting, erasing and pruning objects the tier holds. It must never return them." );
+  BOOST_REQUIRE( cache_->readObject( objectIds_[1], buffer ) );
+  BOOST_REQUIRE( cache_->readObject( objectIds_[2], buffer ) );
+  BOOST_REQUIRE( cache_->eraseObject( objectIds_[1] ) );
+  BOOST_REQUIRE( !cache_->readObject( objectIds_[1], buffer ) );
+  BOOST_REQUIRE( cache_->writeObject( objectIds_[0], buffers_[1] ) );
+  BOOST_REQUIRE( cache_->readObject( objectIds_[0], buffer ) );
+  BOOST_REQUIRE( buffer == buffers_[1] );
+  cache_->setMaxSize( 0 );
+  BOOST_REQUIRE( !cache_->readObject( objectIds_[2], buffer ) );
+  BOOST_REQUIRE( cache_->getMemoryTierStats( stats ) );
+  BOOST_REQUIRE( stats.currentSize == 0 );
+}
+
+BOOST_AUTO_TEST_SUITE_END();
+
+CacheOptions GetDedupOptions( CacheOptions::Storage storage )
+{
+  CacheOptions options;
+  options.storage = storage;
+  options.segmentSize = 32 * 1024;
+  // Checkpoint often with files, so that both ways of loading links are tried
+  options.checkpointRecords = storage == CacheOptions::FileStorage ? 16 : 65536;
+  options.deduplicate = true;
+  return options;
+}
+
+struct DedupCacheFixture : public CacheFixture
+{
+  DedupCacheFixture( const std::string& path = dedupCachePath, CacheOptions::Storage storage = CacheOptions::FileStorage )
+      : CacheFixture( path, GetDedupOptions( storage ) ) {}
+
+  // The file a blob of value is kept in with file storage
+  std::string BlobFilename( const BinaryBuffer& value ) {
+    const Crypt::DigestValue digest( Crypt::KeyedDigest( key_, &value[0], value.size() ) );
+    return OsConcatPath( path_, FileStore::Filename( BinaryBuffer( digest.begin(), digest.end() ) ) );
+  }
+
+  // Writes every test buffer under its own id, and the first one again
+  // under copies ids of its own
+  void WriteDuplicates( size_t copies ) {
+    WriteObjects();
+    for ( size_t i = 0; i < copies; ++i ) {
+      BOOST_REQUIRE( cache_->writeObject( DuplicateId( i ), buffers_[0] ) );
+    }
+  }
+  static BinaryBuffer DuplicateId( size_t i ) {
+    return BinaryBuffer( 10 + i, 0x44 );
+  }
+};
+
+struct DedupSegmentCacheFixture : public DedupCacheFixture
+{
+  DedupSegmentCacheFixture() : DedupCacheFixture( dedupSegmentCachePath, CacheOptions::SegmentStorage ) {}
+};
+
+BOOST_FIXTURE_TEST_SUITE(DedupTestSuite, DedupCacheFixture);
+
+BOOST_AUTO_TEST_CASE( TestDedupReadWriteEraseObjects )
+{
+  WriteObjects();
+  ReadObjects();
+  EraseObjects();
+}
+
+BOOST_AUTO_TEST_CASE( TestDedupSharedObjects )
+{
+  const size_t copies = 10;
+  WriteDuplicates( copies );
+  BOOST_TEST_MESSAGE( "Writing the first object under " << copies << " more ids. It must only take up room once." );
+  BOOST_REQUIRE( cache_->getCurrentSize() == currSize_ );
+  BOOST_REQUIRE( OsFileExists( BlobFilename( buffers_[0] ) ) );
+  BOOST_REQUIRE( !OsFileExists( OsConcatPath( path_, FileStore::Filename( DuplicateId( 0 ) ) ) ) );
+  BinaryBuffer buffer;
+  for ( size_t i = 0; i < copies; ++i ) {
+    BOOST_REQUIRE( cache_->readObject( DuplicateId( i ), buffer ) );
+    BOOST_REQUIRE( buffer == buffers_[0] );
+    BOOST_REQUIRE( cache_->readObjectRange( DuplicateId( i ), 1, 3, buffer ) );
+    BOOST_REQUIRE( buffer == BinaryBuffer( buffers_[0].begin() + 1, buffers_[0].begin() + 4 ) );
+  }
+
+  BOOST_TEST_MESSAGE( "The links and blobs must survive a restart." );
+  ReopenCache();
+  BOOST_REQUIRE( OsFileExists( OsConcatPath( path_, checkpointFilename ) ) );
+  BOOST_REQUIRE( cache_->getCurrentSize() == currSize_ );
+  ReadObjects();
+
+  BOOST_TEST_MESSAGE( "Erasing the original and rewriting a copy. The others must still read." );
+  BOOST_REQUIRE( cache_->eraseObject( objectIds_[0] ) );
+  BOOST_REQUIRE( cache_->writeObject( DuplicateId( 0 ), buffers_[1] ) );
+  BOOST_REQUIRE( cache_->getCurrentSize() == currSize_ );
+  BOOST_REQUIRE( cache_->readObject( DuplicateId( 0 ), buffer ) );
+  BOOST_REQUIRE( buffer == buffers_[1] );
+  for ( size_t i = 1; i < copies; ++i ) {
+    BOOST_REQUIRE( cache_->readObject( DuplicateId( i ), buffer ) );
+    BOOST_REQUIRE( buffer == buffers_[0] );
+  }
+
+  BOOST_TEST_MESSAGE( "Erasing the last copies. The blob must go with them." );
+  for ( size_t i = 0; i < copies; ++i ) {
+    BOOST_REQUIRE( cache_->eraseObject( DuplicateId( i ) ) );
+  }
+  BOOST_REQUIRE( cache_->getCurrentSize() == currSize_ - buffers_[0].size() );
+  BOOST_REQUIRE( !OsFileExists( BlobFilename( buffers_[0] ) ) );
+  BOOST_REQUIRE( OsFileExists( BlobFilename( buffers_[1] ) ) );
+
+  BOOST_TEST_MESSAGE( "Pruning everything. Nothing may be left over." );
+  cache_->setMaxSize( 0 );
+  BOOST_REQUIRE( cache_->getCurrentSize() == 0 );
+  BOOST_REQUIRE( !OsFileExists( BlobFilename( buffers_[1] ) ) );
+  ReopenCache();
+  BOOST_REQUIRE( cache_->getCurrentSize() == 0 );
+}
+
+BOOST_FIXTURE_TEST_CASE( TestDedupSegmentCompaction, DedupSegmentCacheFixture )
+{
+  const size_t copies = 10;
+  WriteDuplicates( copies );
+  BOOST_REQUIRE( cache_->getCurrentSize() == currSize_ );
+
+  BOOST_TEST_MESSAGE( "Erasing everything else in the first segment. The compactor must move the blob along." );
+  for ( size_t n = 0; n < objWritten_; ++n ) {
+    BOOST_REQUIRE( cache_->eraseObject( objectIds_[n] ) );
+  }
+  std::ostringstream ss;
+  ss << std::setbase( 16 ) << std::setw( 8 ) << std::setfill( '0' ) << 1 << segmentExtension;
+  const std::string firstSegment( OsConcatPath( path_, ss.str() ) );
+  for ( int i = 0; i < 100 && OsFileExists( firstSegment ); ++i ) {
+    boost::this_thread::sleep( boost::posix_time::milliseconds( 50 ) );
+  }
+  BOOST_REQUIRE( !OsFileExists( firstSegment ) );
+  BOOST_REQUIRE( cache_->getCurrentSize() == buffers_[0].size() );
+
+  BOOST_TEST_MESSAGE( "Every copy must read from where the blob went, also after a restart." );
+  for ( size_t round = 0; round < 2; ++round ) {
+    for ( size_t i = 0; i < copies; ++i ) {
+      BinaryBuffer buffer;
+      BOOST_REQUIRE( cache_->readObject( DuplicateId( i ), buffer ) );
+      BOOST_REQUIRE( buffer == buffers_[0] );
+    }
+    ReopenCache();
+  }
+  BOOST_REQUIRE( cache_->getCurrentSize() == buffers_[0].size() );
+}
+
+BOOST_AUTO_TEST_SUITE_END();
+
+CacheOptions GetTraceOptions()
+{
+  CacheOptions options;
+  options.traceFile = OsConcatPath( traceCachePath, "trace.cct" );
+  return options;
+}
+
+struct TraceCacheFixture : public CacheFixture
+{
+  TraceCacheFixture() : CacheFixture( traceCachePath, GetTraceOptions() ) {}
+};
+
+BOOST_FIXTURE_TEST_SUITE(TraceTestSuite, TraceCacheFixture);
+
+BOOST_AUTO_TEST_CASE( TestTraceCalls )
+{
+  WriteObjects();
+  ReadObjects();
+  BOOST_TEST_MESSAGE( "Missing, erasing and batching objects, and shrinking the cache." );
+  BinaryBuffer buffer;
+  const BinaryBuffer missing( 5, 0 );
+  BOOST_REQUIRE( !cache_->readObject( missing, buffer ) );
+  BOOST_REQUIRE( cache_->eraseObject( objectIds_[0] ) );
+  std::vector< BinaryBuffer > ids;
+  ids.push_back( objectIds_[0] );
+  ids.push_back( objectIds_[1] );
+  std::vector< bool > found;
+  BOOST_REQUIRE( cache_->hasObjects( ids, found ) == 1 );
+  cache_->setMaxSize( reducedMaxSize );
+
+  BOOST_TEST_MESSAGE( "Reading the trace back. Every call must be in it, in order." );
+  delete cache_;
+  cache_ = 0;
+  std::vector< TraceRecord > records;
+  std::time_t started;
+  BOOST_REQUIRE( ReadTrace( options_.traceFile, records, started ) );
+  BOOST_REQUIRE( started <= std::time( 0 ) );
+  // The fixture's setMaxSize, a write and a has per object, a read per
+  // object, and the calls above
+  BOOST_REQUIRE( records.size() == 1 + 3 * objWritten_ + 5 );
+  BOOST_REQUIRE( records[0].operation_ == TraceRecord::SetMaxSize && records[0].size_ == maxSize );
+  for ( size_t n = 0; n < objWritten_; ++n ) {
+    const TraceRecord& write( records[ 1 + 2 * n ] );
+    BOOST_REQUIRE( write.operation_ == TraceRecord::Write && write.ok_ );
+    BOOST_REQUIRE( write.objId_ == Fingerprint( objectIds_[n] ) );
+    BOOST_REQUIRE( write.size_ == buffers_[n].size() );
+    BOOST_REQUIRE( records[ 2 + 2 * n ].operation_ == TraceRecord::Has && records[ 2 + 2 * n ].ok_ );
+    const TraceRecord& read( records[ 1 + 2 * objWritten_ + n ] );
+    BOOST_REQUIRE( read.operation_ == TraceRecord::Read && read.ok_ && read.size_ == buffers_[n].size() );
+  }
+  for ( size_t i = 1; i < records.size(); ++i ) {
+    BOOST_REQUIRE( records[i].time_ >= records[ i - 1 ].time_ );
+  }
+  const TraceRecord* last = &records[ 1 + 3 * objWritten_ ];
+  BOOST_REQUIRE( last[0].operation_ == TraceRecord::Read && !last[0].ok_ && last[0].objId_ == Fingerprint( missing ) );
+  BOOST_REQUIRE( last[1].operation_ == TraceRecord::Erase && last[1].ok_ );
+  BOOST_REQUIRE( last[2].operation_ == TraceRecord::Has && !last[2].ok_ && last[2].objId_ == Fingerprint( objectIds_[0] ) );
+  BOOST_REQUIRE( last[3].operation_ == TraceRecord::Has && last[3].ok_ && last[3].objId_ == Fingerprint( objectIds_[1] ) );
+  BOOST_REQUIRE( last[4].operation_ == TraceRecord::SetMaxSize && last[4].size_ == reducedMaxSize );
+}
+
+BOOST_AUTO_TEST_SUITE_END();
+
+CacheOptions GetStatsOptions()
+{
+  CacheOptions options;
+  // The format of older versions, which is hashed as well as encrypted
+  options.encryption = CacheOptions::Rc4Sha1Encryption;
+  return options;
+}
+
+struct StatsCacheFixture : public CacheFixture
+{
+  StatsCacheFixture() : CacheFixture( statsCachePath, GetStatsOptions() ) {}
+
+  // Every call counted in a histogram must be in exactly one bucket
+  static void CheckHistogram( const LatencyHistogram& histogram, uint64_t count ) {
+    BOOST_REQUIRE( histogram.count == count );
+    uint64_t inBuckets = 0;
+    for ( size_t i = 0; i < LatencyHistogram::noOfBuckets; ++i ) {
+      inBuckets += histogram.buckets[i];
+    }
+    BOOST_REQUIRE( inBuckets == count );
+    BOOST_REQUIRE( count == 0 || histogram.nanoseconds > 0 );
+  }
+};
+
+BOOST_FIXTURE_TEST_SUITE(StatsTestSuite, StatsCacheFixture);
+
+BOOST_AUTO_TEST_CASE( TestStatsCounts )
+{
+  WriteObjects();
+  ReadObjects();
+  BOOST_TEST_MESSAGE( "Missing, damaging and pruning objects." );
+  BinaryBuffer buffer;
+  BOOST_REQUIRE( !cache_->readObject( BinaryBuffer( 5, 0 ), buffer ) );
+  const std::string filename( OsConcatPath( statsCachePath, FileStore::Filename( objectIds_[0] ) ) );
+  BinaryBuffer record;
+  OsReadFile( filename, record );
+  ++ record.back();
+  OsWriteFile( filename, record );
+  BOOST_REQUIRE( !cache_->readObject( objectIds_[0], buffer ) );
+  cache_->setMaxSize( reducedMaxSize );
+
+  CacheStats stats;
+  cache_->getStats( stats );
+  uint64_t written = 0;
+  for ( size_t n = 0; n < objWritten_; ++n ) {
+    written += buffers_[n].size();
+  }
+  BOOST_REQUIRE( stats.hits == objWritten_ );
+  BOOST_REQUIRE( stats.misses == 2 );
+  BOOST_REQUIRE( stats.integrityFailures == 1 );
+  BOOST_REQUIRE( stats.bytesRead == written );
+  BOOST_REQUIRE( stats.bytesWritten == written );
+  BOOST_REQUIRE( stats.prunes > 0 );
+  BOOST_REQUIRE( stats.deleteFailures == 0 );
+
+  // WriteObjects looks every object up too, and only some lookups are timed
+  CheckHistogram( stats.operations[ CacheStats::WriteOperation ], objWritten_ );
+  CheckHistogram( stats.operations[ CacheStats::HasOperation ], ( objWritten_ + timedLookups - 1 ) / timedLookups );
+  CheckHistogram( stats.operations[ CacheStats::ReadOperation ], objWritten_ + 2 );
+  CheckHistogram( stats.operations[ CacheStats::SetMaxSizeOperation ], 2 );
+  CheckHistogram( stats.operations[ CacheStats::EraseOperation ], 0 );
+  CheckHistogram( stats.stages[ CacheStats::FileWriteStage ], objWritten_ );
+  CheckHistogram( stats.stages[ CacheStats::EncryptStage ], objWritten_ );
+  CheckHistogram( stats.stages[ CacheStats::FileReadStage ], objWritten_ + 1 );
+  CheckHistogram( stats.stages[ CacheStats::DecryptStage ], objWritten_ + 1 );
+  CheckHistogram( stats.stages[ CacheStats::HashStage ], 2 * objWritten_ + 1 );
+  CheckHistogram( stats.stages[ CacheStats::DeleteStage ], stats.prunes );
+  CheckHistogram( stats.stages[ CacheStats::CompressStage ], 0 );
+
+  BOOST_TEST_MESSAGE( "Files that can't be deleted must be counted when pruned." );
+  cache_->setMaxSize( maxSize );
+  WriteObjects();
+  const std::string pruned( OsConcatPath( statsCachePath, FileStore::Filename( objectIds_[0] ) ) );
+  OsDeleteFile( pruned );
+  cache_->setMaxSize( 0 );
+  CacheStats after;
+  cache_->getStats( after );
+  BOOST_REQUIRE( after.deleteFailures == 1 );
+  BOOST_REQUIRE( after.prunes > stats.prunes );
+  BOOST_REQUIRE( cache_->getCurrentSize() == 0 );
+}
+
+#ifdef CLIENTCACHE_SPANS
+BOOST_AUTO_TEST_CASE( TestSpans )
+{
+  BOOST_TEST_MESSAGE( "Writing and reading objects with spans enabled, and pruning them all." );
+  BOOST_REQUIRE( enableSpans( true ) );
+  WriteObjects();
+  ReadObjects();
+  cache_->setMaxSize( 0 );
+  BOOST_REQUIRE( enableSpans( false ) );
+  BinaryBuffer buffer;
+  BOOST_REQUIRE( !cache_->readObject( objectIds_[0], buffer ) );
+
+  BOOST_TEST_MESSAGE( "Every call and the stages within must be in the spans written." );
+  const std::string filename( OsConcatPath( statsCachePath, "spans.json" ) );
+  BOOST_REQUIRE( writeSpans( filename ) );
+  BinaryBuffer written;
+  OsReadFile( filename, written );
+  const std::string json( written.begin(), written.end() );
+  BOOST_REQUIRE( json.compare( 0, 16, "{\"traceEvents\":[" ) == 0 );
+  const char* names[] = { "writeObject", "readObject", "setMaxSize", "PruneObjects", "Rc4EncryptDecrypt", "Sha1Hash",
+                          "EncodeFilenameFromBuffer", "OsDirectory::Read" };
+  for ( size_t i = 0; i < sizeof( names ) / sizeof( names[0] ); ++i ) {
+    BOOST_REQUIRE( json.find( "{\"name\":\"" + std::string( names[i] ) + "\"," ) != std::string::npos );
+  }
+  // The read after they were disabled isn't there
+  size_t reads = 0;
+  for ( size_t at = json.find( "\"readObject\"" ); at != std::string::npos; at = json.find( "\"readObject\"", at + 1 ) ) {
+    ++ reads;
+  }
+  BOOST_REQUIRE( reads == objWritten_ );
+}
+#endif
+
+BOOST_AUTO_TEST_SUITE_END();
+
 /*
   BOOST_AUTO_TEST_CASE( TestDestroy )
   {
@@ -393,7 +2232,7 @@ BOOST_AUTO_TEST_SUITE_END();
   std::vector< uint8_t > key;
   key.assign( dummykey.begin(), dummykey.end() );
 
-  cache_s = createCache( "c:\\temp\\cache", key );
+  cache_s = createCache( cachePath, key );
   BOOST_REQUIRE( cache_s );
 
   BOOST_REQUIRE( cache_s->getCurrentSize() == 0 );
@@ -413,7 +2252,7 @@ BOOST_AUTO_TEST_SUITE_END();
   std::vector< uint8_t > key;
   std::copy( dummykey.begin(), dummykey.end(), back_inserter( key ) );
 
-  cache_s = createCache( "c:\\temp\\cache", key );
+  cache_s = createCache( cachePath, key );
   BOOST_REQUIRE( cache_s );
   cache_s->setMaxSize( reducedMaxSize );
 
@@ -431,7 +2270,7 @@ BOOST_AUTO_TEST_SUITE_END();
   BinaryBuffer buffer;
   BOOST_REQUIRE( cache_s->eraseObject( *it ) );
   BOOST_REQUIRE( !cache_s->hasObject( *it ) );
-  BOOST_REQUIRE( !OsFileExists( OsConcatPath( "c:\\temp\\cache", Crypt::EncodeFilenameFromBuffer( *it, ".CDF" ) ) ) );
+  BOOST_REQUIRE( !OsFileExists( OsConcatPath( cachePath, FileStore::Filename( *it ) ) ) );
   }
   BOOST_REQUIRE( cache_s->getCurrentSize() == 0 );
   }
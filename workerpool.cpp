@@ -0,0 +1,51 @@
+#include "stdinc.hpp"
+#include "workerpool.hpp"
+
+WorkerPool::WorkerPool( size_t threads, size_t maxQueued )
+    : maxQueued_( std::max< size_t >( 1, maxQueued ) ), stopping_( false )
+{
+  for ( size_t i = 0; i < std::max< size_t >( 1, threads ); ++i ) {
+    threads_.create_thread( boost::bind( &WorkerPool::Run, this ) );
+  }
+}
+
+WorkerPool::~WorkerPool()
+{
+  {
+    boost::mutex::scoped_lock lock( mutex_ );
+    stopping_ = true;
+  }
+  taskQueued_.notify_all();
+  threads_.join_all();
+}
+
+void WorkerPool::Submit( const Task& task )
+{
+  boost::mutex::scoped_lock lock( mutex_ );
+  while ( tasks_.size() >= maxQueued_ ) {
+    taskTaken_.wait( lock );
+  }
+  tasks_.push_back( task );
+  taskQueued_.notify_one();
+}
+
+void WorkerPool::Run()
+{
+  for ( ;; ) {
+    Task task;
+    {
+      boost::mutex::scoped_lock lock( mutex_ );
+      while ( tasks_.empty() && !stopping_ ) {
+        taskQueued_.wait( lock );
+      }
+      if ( tasks_.empty() ) {
+        return;
+      }
+      task.swap( tasks_.front() );
+      tasks_.pop_front();
+    }
+    taskTaken_.notify_one();
+    // Tasks handle their own errors
+    task();
+  }
+}
@@ -0,0 +1,35 @@
+#ifndef __WORKERPOOL_HPP__
+#define __WORKERPOOL_HPP__
+
+/**
+   A fixed set of threads that run tasks in the order they were
+   submitted. At most maxQueued tasks wait at a time: Submit blocks until
+   there is room, so whoever produces work faster than the threads do it
+   is slowed down instead of queueing without bound.
+*/
+class WorkerPool
+{
+ public:
+  typedef boost::function< void () > Task;
+
+  WorkerPool( size_t threads, size_t maxQueued );
+  // Runs the tasks still queued, then stops the threads
+  ~WorkerPool();
+
+  void Submit( const Task& task );
+
+ private:
+  void Run();
+
+  const size_t maxQueued_;
+  boost::mutex mutex_;
+  boost::condition_variable taskQueued_;
+  boost::condition_variable taskTaken_;
+  std::deque< Task > tasks_;
+  bool stopping_;
+  boost::thread_group threads_;
+  WorkerPool( const WorkerPool& ); // not copyable
+  bool operator=( const WorkerPool& ); // not assignable
+};
+
+#endif // __WORKERPOOL_HPP__